@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
@@ -16,42 +17,797 @@
 #include <sys/sendfile.h>
 #include <time.h>
 #include <errno.h>
+#include <sys/xattr.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #include <limits.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <math.h>
+#include <zlib.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/un.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
 #define MAX_CLIENTS 10
 #define BUFFER_SIZE 1024
 #define MAX_PATH_LEN 1024
 #define MAX_FILES 3
+#define TRANSFER_BUFFER_SIZE (64 * 1024)
+#define CRC32C_POLY 0x82F63B78
+#define CRC_XATTR "user.dfs.crc32c"
+#define USAGE_XATTR "user.dfs.usage"
+#define DIR_CACHE_SIZE 32
+#define LOG_RING_SIZE 4096
+#define LOG_MESSAGE_SIZE 240
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_ROTATE_BYTES (16 * 1024 * 1024)
+#define LOG_ROTATE_KEEP 3
+#define LOG_IDLE_SLEEP_US 2000
+#define DEFAULT_LOG_RATE 10000
+#define METRICS_PORT_OFFSET 1000
+#define HIST_BUCKETS 128
+#define STATS_BUFFER_SIZE (BUFFER_SIZE * 64)
+#define TRACE_RING_SIZE 65536
+#define TRACE_NODE_ID 1
+#define DEFAULT_TRACE_SAMPLE_RATE 100
+#define MAX_BATCH_BYTES (16 * 1024 * 1024)
+#define ENCODING_RAW 0
+#define ENCODING_ZLIB 1
+#define COMPRESS_CHUNK_SIZE (64 * 1024)
+#define COMPRESS_SAMPLE_SIZE 4096
+#define COMPRESS_MAX_ENTROPY 7.5
+#define COMPRESS_TOKEN " compress=zlib"
+#define CACHED_TOKEN " cached="
+#define NOT_MODIFIED_SIZE ((off_t) -3)
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK (64 * 1024)
+#define DELTA_COPY 0
+#define DELTA_LITERAL 1
+#define DELTA_SIGNATURE_BATCH 512
+#define ADMIT_MAX_CHILDREN 128
+#define ADMIT_IP_BUCKETS 256
+#define DEFAULT_PER_IP_LIMIT 16
+#define ADMIT_POLL_US 5000
+#define BUSY_SIZE ((off_t) -2)
+#define NODE_CONNECT_TIMEOUT_MS 1000
+#define NODE_IO_TIMEOUT_MS 5000
+#define NODE_ARCHIVE_TIMEOUT_MS 60000
+#define UNIX_SOCKET_NAME "dfs-%d.sock"
+#define RECORD_MAGIC "DFSREC1\n"
+#define MAX_QUOTAS 32
+#define CHANGE_RING_SIZE 4096
+#define CHANGE_EVENT_BUFFER (64 * 1024)
+#define CHANGE_PENDING_CREATES 64
+#define CHANGE_POLL_MS 50
+#define CHANGE_MAX_WAIT_MS 30000
+#define WALK_MAX_THREADS 16
+#define WALK_BUFFER_SIZE (64 * 1024)
+#define WALK_MAX_OPEN_DIRS 256
+#define WALK_SPIN_LIMIT 64
+#define WALK_IDLE_SLEEP_US 50
+#define WALK_ORDERED 1
+#define WALK_STAT 2
+#define WALK_DIRS 4
+#define WALK_COUNT_ONLY 8
+#define FIND_DEFAULT_LIMIT 1000
+#define FIND_MAX_LIMIT 100000
+#define FIND_BUFFER_SIZE (4 * MAX_PATH_LEN)
+#define BREAKER_FAILURE_THRESHOLD 5
+#define BREAKER_OPEN_MS 5000
+#define HEARTBEAT_SUSPECT_MS 2500
+#define HEARTBEAT_DEAD_MS 6000
+#define NODE_MIN_FREE_BYTES (64UL * 1024 * 1024)
+#define MIGRATE_DEFAULT_RATE (16L * 1024 * 1024)
+#define MIGRATE_DEFAULT_IOPS 200
+#define MIGRATE_YIELD_MS 50
+#define MIGRATE_CATCHUP_ROUNDS 5
+#define MIGRATE_SWITCH_BACKLOG 32
+#define MIGRATE_FREEZE_MAX_MS 10000
+#define MIGRATE_SETTLE_MS 200
+#define MIGRATE_DRAIN_MS 30000
+#define TLS_HANDSHAKE_TIMEOUT_MS 5000
+#define TLS_RECORD_SIZE (16 * 1024)
+#define TLS_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+
+enum command_id { CMD_UPLOADF, CMD_DOWNLF, CMD_REMOVEF, CMD_DOWNLTAR, CMD_DISPFNAMES, CMD_MDOWNLF, CMD_MREMOVEF,
+                  CMD_DELTAF, CMD_FINDF, CMD_COPYF, CMD_MOVEF, CMD_COUNT };
+
+// Commands are admitted per class so a burst of tars cannot starve cheap metadata requests
+enum admit_class { CLASS_LIGHT, CLASS_TRANSFER, CLASS_ARCHIVE, CLASS_COUNT };
+
+// Latency histogram with 4 linear sub-buckets per power of two (HDR-style)
+struct latency_histogram {
+    unsigned long count;
+    unsigned long errors;
+    unsigned long sum_us;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+// Lives in a shared anonymous mapping so every forked child updates the same counters
+struct server_metrics {
+    struct latency_histogram commands[CMD_COUNT];
+    struct latency_histogram forwards[3];
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long wire_raw_bytes;
+    unsigned long wire_sent_bytes;
+    long in_flight;
+    unsigned long rejected[CLASS_COUNT];
+    unsigned long shed_connections;
+    unsigned long not_modified;
+    unsigned long tls_offloaded;
+    unsigned long tls_relayed;
+    unsigned long passed_fds;
+};
+
+enum ticket_state { TICKET_FREE, TICKET_WAITING, TICKET_ADMITTED };
+
+// What a child currently holds; the parent releases it if the child dies without doing so
+struct admit_ticket {
+    int state;
+    int admit_class;
+    int ip_bucket;
+    int writing;
+};
+
+enum breaker_state { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+// Per storage node, shared by all children. After BREAKER_FAILURE_THRESHOLD consecutive failures
+// calls fail fast; once BREAKER_OPEN_MS has passed a single request is let through as a probe.
+struct node_breaker {
+    int state;
+    int failures;
+    unsigned long opened_us;
+};
+
+enum member_state { MEMBER_UNKNOWN, MEMBER_ALIVE, MEMBER_SUSPECT, MEMBER_DEAD };
+
+enum migrate_state { MIGRATE_IDLE, MIGRATE_COPYING, MIGRATE_CATCHING_UP, MIGRATE_SWITCHING, MIGRATE_CLEANING,
+                     MIGRATE_DONE, MIGRATE_FAILED };
+
+// The port that stores each type, shared so that a rebalance's switch reaches every child forked
+// after it, and the progress of the current or last rebalance. frozen holds back writes while
+// a switch is in progress; owner is the child running the rebalance, so the accept loop can
+// release both if that child dies.
+struct placement_table {
+    int ports[3];
+    int frozen;
+    int active;
+    pid_t owner;
+    int state;
+    int node;
+    int target_port;
+    unsigned long rate;
+    unsigned long iops;
+    unsigned long files_total;
+    unsigned long files_done;
+    unsigned long bytes_total;
+    unsigned long bytes_done;
+    unsigned long catchup_files;
+    unsigned long started_us;
+    char message[96];
+};
+
+// A node's files as listed by listf, for planning and verifying a rebalance
+struct migrate_file {
+    char *path;
+    off_t size;
+    unsigned int crc;
+};
+
+struct migrate_list {
+    struct migrate_file *files;
+    size_t count;
+    size_t capacity;
+};
+
+// A rebalance's limits: rate in bytes per second, iops in file operations per second (0 for none)
+struct migrate_budget {
+    unsigned long rate;
+    unsigned long iops;
+    unsigned long next_us;
+};
+
+// Latest heartbeat from a storage node. Fields are stored one by one, so a reader may briefly see
+// a mix of two consecutive heartbeats; last_seen_us is written last.
+struct node_member {
+    unsigned long last_seen_us;
+    long in_flight;
+    unsigned long requests;
+    unsigned long p99_us;
+    unsigned long free_bytes;
+    unsigned long total_bytes;
+    unsigned long files;
+};
+
+// Shared across the accept loop and every forked child
+struct admission_control {
+    long in_flight[CLASS_COUNT];
+    long waiting[CLASS_COUNT];
+    long ip_in_flight[ADMIT_IP_BUCKETS];
+    struct admit_ticket tickets[ADMIT_MAX_CHILDREN];
+};
+
+// Header of one chunk of a zlib-encoded payload; wire_len 0 means the chunk is stored raw
+struct chunk_header {
+    unsigned int raw_len;
+    unsigned int wire_len;
+};
+
+// Signature of one full block of the server's copy, sent to the client for deltaf
+struct block_signature {
+    unsigned int weak;
+    unsigned int strong;
+};
+
+// One deltaf instruction: copy block `value` of the old copy, or take the `value` literal bytes
+// that follow the instruction
+struct delta_op {
+    unsigned int type;
+    unsigned int value;
+};
+
+enum log_level { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_LEVEL_COUNT };
+
+enum trace_stage { STAGE_PARSE, STAGE_LOOKUP, STAGE_CONNECT, STAGE_FIRST_BYTE, STAGE_TRANSFER, STAGE_CLOSE, STAGE_COUNT };
+
+// Fixed-size binary span record; seq is published last so readers can skip torn slots
+struct trace_span {
+    unsigned long seq;
+    unsigned long trace_id;
+    unsigned long start_us;
+    unsigned int duration_us;
+    unsigned short stage;
+    unsigned char command;
+    unsigned char reserved;
+    int pid;
+};
+
+struct trace_ring {
+    unsigned long next;
+    struct trace_span spans[TRACE_RING_SIZE];
+};
+
+enum record_status { RECORD_OK, RECORD_ERROR, RECORD_BUSY };
+
+// One request in the workload recording (-W), followed by args_len bytes of its arguments. The
+// file starts with RECORD_MAGIC; payloads are never recorded, only their sizes.
+struct workload_record {
+    unsigned long start_us;     // wall clock when the command line was read
+    unsigned int duration_us;   // until the reply was sent, or until rejected
+    unsigned char command;      // command_id
+    unsigned char status;       // record_status
+    unsigned short args_len;
+    unsigned long bytes_in;     // payload bytes received from the client
+    unsigned long bytes_out;    // payload bytes sent to it
+};
+
+// One log record; sequence hands the slot between the handler that fills it and the writer
+struct log_slot {
+    unsigned long sequence;
+    unsigned long timestamp_us;
+    int pid;
+    int level;
+    char message[LOG_MESSAGE_SIZE];
+};
+
+// Shared by every forked handler and drained by the log writer process
+struct log_ring {
+    unsigned long enqueue_pos;
+    char pad[56];
+    unsigned long dropped_full;
+    unsigned long dropped_rate;
+    unsigned long rate_window;
+    unsigned long rate_count;
+    struct log_slot slots[LOG_RING_SIZE];
+};
+
+// Record returned by getdents64, which glibc does not declare
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// File or directory found by walk_tree; path is relative to the walk's root. size and mtime
+// are only filled in for regular files under WALK_STAT.
+struct walk_entry {
+    char *path;
+    unsigned char type;
+    off_t size;
+    time_t mtime;
+};
+
+// Directory waiting to be read, with an fd opened from its parent when one could be kept
+struct walk_item {
+    char *path;
+    int fd;
+    int depth;
+};
+
+// The directories one walker thread has queued: items[head..tail)
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_item *items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+};
+
+struct walk_worker {
+    struct walk *walk;
+    int id;
+    struct walk_deque deque;
+    struct walk_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+typedef int (*walk_match_fn)(const char *path, const char *name, const struct stat *st, void *arg);
+
+// Shared state of one walk_tree call
+struct walk {
+    int root_fd;
+    int flags;
+    int max_depth;
+    int threads;
+    walk_match_fn match;
+    void *arg;
+    long pending;
+    long open_dirs;
+    int stop;
+    struct walk_worker *workers;
+};
+
+// A parsed findf query; unset sizes are -1 and unset times 0. S1 sets cancelled to end its
+// local search early.
+struct find_query {
+    char path[MAX_PATH_LEN];
+    char pattern[MAX_PATH_LEN];
+    int use_regex;
+    regex_t regex;
+    off_t min_size;
+    off_t max_size;
+    time_t newer_than;
+    time_t older_than;
+    long limit;
+    int cancelled;
+};
+
+// State shared by the walker threads of one findf search
+struct find_search {
+    struct find_query *query;
+    int root_fd;
+    int out_fd;
+    const char *ext;
+    char prefix[MAX_PATH_LEN + 8];
+    pthread_mutex_t lock;
+    long found;
+    int stop;
+};
+
+// One stream of findf results being relayed: S1's own search or a storage node's
+struct find_source {
+    int fd;
+    int complete;
+    size_t len;
+    char buffer[FIND_BUFFER_SIZE];
+};
+
+// Arguments of the thread that searches S1's own tree
+struct find_local {
+    struct find_query *query;
+    int dir_fd;
+    int out_fd;
+};
+
+// Value of the CRC_XATTR: the checksum with the size and modification time the file had when it
+// was taken, so a file edited in place outside the server is checksummed again
+struct crc_tag {
+    unsigned int crc;
+    off_t size;
+    struct timespec mtime;
+};
+
+// Bytes and files stored below a directory, kept in its USAGE_XATTR and rolled up to every
+// ancestor as files are written and removed
+struct dir_usage {
+    long bytes;
+    long files;
+};
+
+// Limit on everything stored below prefix (relative to ~S1, "" for all of it) across all nodes;
+// max_files 0 means no file limit
+struct quota {
+    char prefix[MAX_PATH_LEN];
+    long max_bytes;
+    long max_files;
+};
+
+// One change below the storage root; seq is published last so readers can skip slots the
+// watcher is rewriting
+struct change_record {
+    unsigned long seq;
+    unsigned long time_us;
+    char type;
+    char path[MAX_PATH_LEN];
+};
+
+// Filled by the watcher process and read by every handler. epoch is the watcher's start time,
+// so cursors from before a restart are recognised, and resync_seq is the marker record written
+// after events were lost. incomplete is set once a directory could not be watched.
+struct change_feed {
+    unsigned long epoch;
+    unsigned long next;
+    unsigned long resync_seq;
+    int incomplete;
+    struct change_record records[CHANGE_RING_SIZE];
+};
+
+// Open directory below the storage root, kept per process and evicted least recently used
+struct dir_cache_entry {
+    char path[MAX_PATH_LEN];
+    int fd;
+    unsigned long last_used;
+};
+
+const char *command_names[CMD_COUNT] = { "uploadf", "downlf", "removef", "downltar", "dispfnames", "mdownlf", "mremovef",
+                                         "deltaf", "findf", "copyf", "movef" };
+const char *node_names[3] = { "S2", "S3", "S4" };
+const char *member_names[4] = { "unknown", "alive", "suspect", "dead" };
+const char *breaker_names[3] = { "closed", "open", "half_open" };
+const char *migrate_state_names[7] = { "idle", "copying", "catching_up", "switching", "cleaning", "done", "failed" };
+const char *class_names[CLASS_COUNT] = { "light", "transfer", "archive" };
+const int class_limits[CLASS_COUNT] = { 32, 16, 2 };
+const int class_queue_limits[CLASS_COUNT] = { 32, 32, 4 };
+const int class_deadline_ms[CLASS_COUNT] = { 500, 2000, 5000 };
+const char *stage_names[STAGE_COUNT] = { "parse", "local_lookup", "connect", "remote_first_byte", "transfer", "close" };
 
 int main_port = 4307;
 int s2_port = 4308;
 int s3_port = 4309;
 int s4_port = 4310;
+int metrics_port = 0;
+struct server_metrics *metrics;
+int trace_sample_rate = DEFAULT_TRACE_SAMPLE_RATE;
+struct trace_ring *traces;
+unsigned long current_trace_id = 0;
+int current_command = -1;
+unsigned int crc32c_table[8][256];
+int root_fd = -1;
+struct dir_cache_entry dir_cache[DIR_CACHE_SIZE];
+unsigned long dir_cache_clock = 0;
+const char *log_level_names[LOG_LEVEL_COUNT] = { "debug", "info", "warn", "error" };
+struct log_ring *log_ring = NULL;
+struct change_feed *changes = NULL;
+struct quota quotas[MAX_QUOTAS];
+int quota_count = 0;
+char **watch_paths = NULL;
+int watch_capacity = 0;
+int walk_threads = 1;
+int log_min_level = LOG_INFO;
+int log_rate_limit = DEFAULT_LOG_RATE;
+volatile sig_atomic_t log_writer_stopping = 0;
+int session_compress = 0;
+long cached_crc = -1;
+off_t cached_size = -1;
+int node_compress = 0;
+struct admission_control *admission;
+int per_ip_limit = DEFAULT_PER_IP_LIMIT;
+int admit_slot = -1;
+struct node_breaker *breakers;
+struct node_member *members;
+struct placement_table *placement;
+SSL_CTX *tls_ctx = NULL;
+int client_bucket = 0;
+char *unix_socket_dir = NULL;
+int record_fd = -1;
+char record_args[BUFFER_SIZE];
+unsigned long request_bytes_in = 0;
+unsigned long request_bytes_out = 0;
 
 void process_client_request(int client_conn);
 int handle_upload(int client_conn, char *filename, char *dest_path);
 int handle_download(int client_conn, char *filename);
+int send_open_file(int client_conn, int fd, const char *name);
+int recv_fd(int sockfd, void *buf, size_t len, int *fd);
 int handle_remove(int client_conn, char *filename);
 int handle_tar_download(int client_conn, char *filetype);
 int display_files(int client_conn, char *pathname);
-int forward_to_server(int target_port, char *file_path, char *dest_path);
+int handle_find(int client_conn, char *args);
+int handle_copy(int client_conn, int cmd_id, char *src, char *dst);
+int move_directory(int client_conn, char *src, char *dst);
+int owner_node(const char *path);
+int pull_from_node(int port, char *src, char *dst);
+int handle_rebalance(int client_conn, char *args);
+int run_rebalance(int node, int port, struct migrate_budget *budget, struct migrate_list *source, char *cursor);
+int migrate_switch(int node, int old_port, int port, const char *ext, char *cursor, struct migrate_list *source);
+long migrate_verify(int old_port, int port, struct migrate_list *source, struct migrate_budget *budget);
+long migrate_apply_changes(int old_port, int port, const char *ext, char *cursor, struct migrate_budget *budget);
+int migrate_cursor(int port, char *cursor);
+int migrate_push(int old_port, const char *path, int port, unsigned long rate);
+int migrate_list_node(int port, struct migrate_list *list);
+void migrate_list_free(struct migrate_list *list);
+int compare_migrate_files(const void *a, const void *b);
+void migrate_throttle(struct migrate_budget *budget);
+int writes_in_progress(void);
+void enter_placement(int cmd_id);
+void sync_placement(void);
+void set_rebalance_state(int state, const char *message);
+int format_rebalance(char *out, size_t len);
+void *find_local_main(void *arg);
+int handle_batch(int client_conn, int cmd_id);
+int start_node_batch(int port, int cmd_id, char *list, size_t len);
+int write_batch_failure(int client_conn, int cmd_id, char *path, const char *reason);
+char *read_batch_list(int fd);
+int write_batch_record(int out_fd, char *path, int fd);
+int connect_to_node(int port, int io_timeout_ms);
+int connect_unix(int port);
+int connect_tcp(int port);
+void set_nodelay(int sockfd);
+int node_index(int port);
+int breaker_allow(int port);
+void breaker_report(int port, int healthy);
+int member_state(int node);
+int node_can_accept(int port, off_t size, char *reason, size_t len);
+void run_heartbeat_listener(int port);
+int format_nodes(char *out, size_t len);
+int forward_to_server(int target_port, int dir_fd, char *filename, char *target_name, char *dest_path);
+int handle_delta_upload(int client_conn, char *filename, char *dest_path);
+int relay_delta(int client_conn, int target_port, char *name, char *dest_path, off_t new_size);
+int send_node_command(int port, char *command);
+int read_node_response(int sockfd, int port, char *response, unsigned long forward_start);
 int send_command_to_server(int port, char *command, char *response);
 int create_directory_structure(char *path);
+void open_root_dir(void);
+const char *relative_path(const char *path);
+int resolve_dir(const char *dir, int create);
+int resolve_parent(const char *path, int create, const char **leaf);
+int write_all(int fd, const void *buf, size_t len);
+int read_all(int fd, void *buf, size_t len);
+off_t transfer_data(int out_fd, int in_fd, off_t count);
+off_t transfer_checksummed(int out_fd, int in_fd, off_t count, unsigned int *crc);
+void crc32c_init(void);
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len);
+unsigned int file_crc32c(int fd);
+int stored_crc32c(int fd, unsigned int *crc);
+void store_crc32c(int fd, unsigned int crc);
+double sample_entropy(const unsigned char *buf, size_t len);
+int choose_encoding(int fd, const char *name);
+off_t send_payload(int out_fd, int in_fd, off_t size, int framed, const char *name, unsigned int *crc);
+off_t send_zlib_chunks(int out_fd, int in_fd, off_t size, unsigned int *crc);
+off_t receive_payload(int out_fd, int in_fd, off_t size, int framed, unsigned int *crc);
+void pack_chunk(struct chunk_header *header, const unsigned char *raw, size_t len, unsigned char *packed, int level);
+ssize_t read_chunk(int in_fd, int encoding, unsigned char *raw, unsigned char *packed, off_t remaining);
+unsigned int weak_checksum(const unsigned char *buf, size_t len);
+unsigned int delta_block_size(off_t size);
+int send_signatures(int out_fd, int old_fd, off_t block_count, unsigned int block_size);
+off_t apply_delta(int out_fd, int in_fd, off_t delta_len, int old_fd, off_t block_count,
+                  unsigned int block_size, unsigned int *crc);
+int receive_delta(int conn, int dir_fd, const char *name, int old_fd, off_t new_size);
+off_t relay_payload(int out_fd, int in_fd, off_t size);
+off_t forward_payload(int out_fd, int out_framed, int in_fd, int in_framed, off_t size, const char *name);
 void handle_error(const char *msg);
+unsigned long now_us(void);
+int latency_bucket(unsigned long us);
+unsigned long bucket_upper_bound(int idx);
+void record_latency(struct latency_histogram *hist, unsigned long start_us, int failed);
+void record_forward(int port, unsigned long start_us, int failed);
+void add_bytes(unsigned long *counter, long n);
+unsigned long histogram_percentile(struct latency_histogram *hist, double pct);
+int format_histogram_line(char *out, size_t len, const char *name, struct latency_histogram *hist);
+int format_stats(char *out, size_t len);
+int format_prometheus_histogram(char *out, size_t len, const char *metric, const char *label,
+                                const char *value, struct latency_histogram *hist);
+int format_prometheus(char *out, size_t len);
+void run_metrics_endpoint(int port);
+unsigned long trace_clock(void);
+void trace_begin(int command);
+unsigned long trace_start(void);
+void trace_span(int stage, unsigned long start_us);
+void append_trace(char *command, size_t len);
+int dump_traces(int fd);
+void start_log_writer(const char *path);
+void log_message(int level, const char *fmt, ...);
+void run_log_writer(const char *path);
+void stop_log_writer(int sig);
+unsigned long wall_clock_us(void);
+struct dir_usage file_usage(int dir_fd, const char *name);
+void update_usage(const char *path, struct dir_usage delta);
+void account_usage(int dir_fd, const char *dir, const char *name, struct dir_usage before);
+int unlink_counted(int dir_fd, const char *name, const char *path);
+int read_usage(int dir_fd, int rescan, struct dir_usage *usage);
+int copy_entry(const char *src, const char *dst);
+int move_entry(const char *src, const char *dst);
+void forget_dirs(const char *dir);
+void start_change_watcher(void);
+void run_change_watcher(int inotify_fd);
+int watch_tree(int inotify_fd, int dir_fd, const char *path, int announce);
+void unwatch_tree(int inotify_fd, const char *path);
+void record_change(char type, const char *path);
+void mark_resync(void);
+int serve_changes(int conn, const char *cursor, int wait_ms);
+ssize_t walk_tree(int root_fd, int flags, int max_depth, walk_match_fn match, void *arg,
+                  struct walk_entry **entries);
+void walk_free(struct walk_entry *entries, ssize_t count);
+int compare_walk_entries(const void *a, const void *b);
+void *walk_worker_main(void *arg);
+int is_temp_name(const char *name);
+void walk_read_dir(struct walk_worker *worker, struct walk_item *item, char *buffer);
+int walk_push(struct walk_deque *deque, struct walk_item item);
+int walk_pop(struct walk_deque *deque, struct walk_item *item);
+int walk_steal(struct walk_deque *deque, struct walk_item *item);
+int match_extension(const char *path, const char *name, const struct stat *st, void *arg);
+int parse_find_query(char *args, struct find_query *query, char *error, size_t len);
+void free_find_query(struct find_query *query);
+long parse_age(const char *text);
+int find_match(const char *path, const char *name, const struct stat *st, void *arg);
+long run_find(int dir_fd, struct find_query *query, int out_fd, const char *ext);
+int open_log_file(const char *path);
+int open_record_file(const char *path);
+void record_request(int cmd_id, int status, unsigned long start_us);
+void rotate_log_files(const char *path);
+int format_log_line(char *out, size_t len, unsigned long timestamp_us, int level, int pid, const char *message);
+int parse_log_level(const char *name);
+int handle_trace_dump(int client_conn);
+int relay_changes(int client_conn, const char *filetype, const char *cursor, int wait_ms);
+int handle_du(int client_conn, const char *path, int rescan);
+int node_usage(int port, const char *path, int rescan, struct dir_usage *usage);
+int collect_usage(const char *path, int rescan, struct dir_usage usage[4]);
+void load_quotas(const char *path);
+long parse_size(const char *text);
+int check_quota(const char *dest_path, struct dir_usage incoming, const char *moved_from, char *reason, size_t len);
+int quota_covers(const char *prefix, const char *path);
+int source_usage(int owner, const char *src, struct dir_usage *usage);
+int command_class(int cmd_id);
+int client_ip_bucket(int client_conn);
+SSL_CTX *tls_server_context(const char *cert_file, const char *key_file);
+int tls_accept(int client_conn);
+int tls_offloaded(SSL *ssl);
+int tls_relay(SSL *ssl, int sockfd);
+void tls_relay_main(SSL *ssl, int sockfd, int local_fd);
+int try_acquire(long *counter, long limit);
+int try_admit(int admit_class, int ip_bucket);
+int admit_request(int admit_class, int ip_bucket);
+void release_ticket(struct admit_ticket *ticket);
+void reject_busy(int client_conn, int cmd_id, int admit_class);
+void reap_children(pid_t *children);
+int free_child_slot(pid_t *children);
 
 int main(int argc, char *argv[]) 
 {
-    if (argc == 5) {
-        main_port = atoi(argv[1]);
-        s2_port = atoi(argv[2]);
-        s3_port = atoi(argv[3]);
-        s4_port = atoi(argv[4]);
+    int opt_char;
+    char *log_path = NULL;
+    char *cert_file = NULL;
+    char *key_file = NULL;
+    while ((opt_char = getopt(argc, argv, "m:t:l:L:R:P:zQ:T:K:U:W:")) != -1) {
+        if (opt_char == 'm') {
+            metrics_port = atoi(optarg);
+        } else if (opt_char == 't') {
+            trace_sample_rate = atoi(optarg);
+        } else if (opt_char == 'l') {
+            log_path = optarg;
+        } else if (opt_char == 'L' && parse_log_level(optarg) >= 0) {
+            log_min_level = parse_log_level(optarg);
+        } else if (opt_char == 'R') {
+            log_rate_limit = atoi(optarg);
+        } else if (opt_char == 'P') {
+            per_ip_limit = atoi(optarg);
+        } else if (opt_char == 'z') {
+            node_compress = 1;
+        } else if (opt_char == 'Q') {
+            load_quotas(optarg);
+        } else if (opt_char == 'T') {
+            cert_file = optarg;
+        } else if (opt_char == 'K') {
+            key_file = optarg;
+        } else if (opt_char == 'U') {
+            unix_socket_dir = optarg;
+        } else if (opt_char == 'W') {
+            record_fd = open_record_file(optarg);
+            if (record_fd < 0) {
+                fprintf(stderr, "Cannot record to %s\n", optarg);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-m metrics_port] [-t trace_1_in_n] [-l log_file] [-L debug|info|warn|error]\n"
+                    "          [-R max_log_lines_per_sec] [-P per_ip_limit] [-z] [-Q quota_file]\n"
+                    "          [-T cert_file [-K key_file]] [-U socket_dir] [-W record_file]\n"
+                    "          [s1_port s2_port s3_port s4_port]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+
+    if (argc - optind == 4) {
+        main_port = atoi(argv[optind]);
+        s2_port = atoi(argv[optind + 1]);
+        s3_port = atoi(argv[optind + 2]);
+        s4_port = atoi(argv[optind + 3]);
+    }
+
+    if (metrics_port == 0) {
+        metrics_port = main_port + METRICS_PORT_OFFSET;
+    }
+    if (cert_file != NULL) {
+        tls_ctx = tls_server_context(cert_file, key_file ? key_file : cert_file);
+        if (tls_ctx == NULL) {
+            fprintf(stderr, "Cannot load TLS certificate %s\n", cert_file);
+            exit(1);
+        }
+    }
+
+    crc32c_init();
+    open_root_dir();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk_threads = (cpus < 1) ? 1 : (cpus > WALK_MAX_THREADS) ? WALK_MAX_THREADS : cpus;
+    
+    metrics = mmap(NULL, sizeof(struct server_metrics), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        handle_error("Metrics allocation failed");
+    }
+    run_metrics_endpoint(metrics_port);
+
+    traces = mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (traces == MAP_FAILED) {
+        handle_error("Trace buffer allocation failed");
+    }
+    start_log_writer(log_path);
+    start_change_watcher();
+
+    admission = mmap(NULL, sizeof(struct admission_control), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (admission == MAP_FAILED) {
+        handle_error("Admission state allocation failed");
+    }
+
+    breakers = mmap(NULL, 3 * sizeof(struct node_breaker), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (breakers == MAP_FAILED) {
+        handle_error("Circuit breaker allocation failed");
+    }
+
+    members = mmap(NULL, 3 * sizeof(struct node_member), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (members == MAP_FAILED) {
+        handle_error("Membership table allocation failed");
+    }
+
+    placement = mmap(NULL, sizeof(struct placement_table), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (placement == MAP_FAILED) {
+        handle_error("Placement table allocation failed");
     }
+    placement->ports[0] = s2_port;
+    placement->ports[1] = s3_port;
+    placement->ports[2] = s4_port;
+    run_heartbeat_listener(main_port);
 
     int server_socket, client_conn;
     socklen_t client_len;
     struct sockaddr_in server_addr, client_addr;
     pid_t child_pid;
+    pid_t children[ADMIT_MAX_CHILDREN] = { 0 };
 
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
@@ -73,13 +829,25 @@ int main(int argc, char *argv[])
     listen(server_socket, MAX_CLIENTS);
     client_len = sizeof(client_addr);
 
-    printf("S1 Server started on port %d\n", main_port);
+    printf("S1 Server started on port %d%s (metrics on 127.0.0.1:%d)\n", main_port, tls_ctx ? " with TLS" : "",
+           metrics_port);
 
     while (1) {
         client_conn = accept(server_socket, (struct sockaddr *) &client_addr, &client_len);
         if (client_conn < 0) {
             handle_error("Client accept failed");
         }
+        set_nodelay(client_conn);
+
+        // Hard cap on forked children: past it the connection is dropped before any work is done
+        reap_children(children);
+        int slot = free_child_slot(children);
+        if (slot < 0) {
+            __atomic_fetch_add(&metrics->shed_connections, 1, __ATOMIC_RELAXED);
+            log_message(LOG_WARN, "event=shed reason=max_children limit=%d", ADMIT_MAX_CHILDREN);
+            close(client_conn);
+            continue;
+        }
 
         child_pid = fork();
         if (child_pid < 0) {
@@ -88,12 +856,18 @@ int main(int argc, char *argv[])
 
         if (child_pid == 0) {
             close(server_socket);
+            admit_slot = slot;
+            client_bucket = client_ip_bucket(client_conn);
+            if (tls_ctx != NULL && (client_conn = tls_accept(client_conn)) < 0) {
+                exit(0);
+            }
             process_client_request(client_conn);
+            release_ticket(&admission->tickets[admit_slot]);
             close(client_conn);
             exit(0);
         } else {
+            children[slot] = child_pid;
             close(client_conn);
-            while (waitpid(-1, NULL, WNOHANG) > 0);
         }
     }
 
@@ -111,8 +885,27 @@ void process_client_request(int client_conn)
     if (n < 0) {
         handle_error("Reading from client failed");
     }
+    unsigned long parse_start = trace_clock();
+    
+    // Clients that can decode compressed payloads say so on the command line
+    char *compress_token = strstr(buffer, COMPRESS_TOKEN);
+    if (compress_token != NULL) {
+        session_compress = 1;
+        *compress_token = '\0';
+    }
+    
+    // ... and downloads offer the CRC32C and size of a cached copy, which is not resent if still current
+    char *cached_token = strstr(buffer, CACHED_TOKEN);
+    if (cached_token != NULL) {
+        char *size_text = NULL;
+        cached_crc = strtoul(cached_token + strlen(CACHED_TOKEN), &size_text, 16);
+        cached_size = (*size_text == ':') ? strtoll(size_text + 1, NULL, 10) : -1;
+        *cached_token = '\0';
+    }
     
-    printf("Received command: %s\n", buffer);
+    log_message(LOG_INFO, "event=request command=\"%s\"", buffer);
+    if (record_fd >= 0) memcpy(record_args, buffer, BUFFER_SIZE);
+    sync_placement();
     
     char *cmd = strtok(buffer, " ");
     if (cmd == NULL) {
@@ -120,110 +913,247 @@ void process_client_request(int client_conn)
         return;
     }
     
-    if (strcmp(cmd, "uploadf") == 0) {
+    if (strcmp(cmd, "stats") == 0) {
+        char *stats = malloc(STATS_BUFFER_SIZE);
+        if (stats != NULL) {
+            int len = format_stats(stats, STATS_BUFFER_SIZE);
+            write(client_conn, stats, len);
+            free(stats);
+        }
+        return;
+    }
+    
+    if (strcmp(cmd, "tracedump") == 0) {
+        handle_trace_dump(client_conn);
+        return;
+    }
+    
+    if (strcmp(cmd, "nodes") == 0) {
+        char table[BUFFER_SIZE * 2];
+        int len = format_nodes(table, sizeof(table));
+        write(client_conn, table, len);
+        return;
+    }
+    
+    if (strcmp(cmd, "du") == 0) {
+        char *path = strtok(NULL, " ");
+        char *rescan = strtok(NULL, " ");
+        handle_du(client_conn, path, rescan != NULL && strcmp(rescan, "rescan") == 0);
+        return;
+    }
+    
+    if (strcmp(cmd, "changes") == 0) {
+        char *filetype = strtok(NULL, " ");
+        char *cursor = strtok(NULL, " ");
+        char *wait_ms = strtok(NULL, " ");
+        relay_changes(client_conn, filetype, cursor, wait_ms ? atoi(wait_ms) : 0);
+        return;
+    }
+    
+    if (strcmp(cmd, "rebalance") == 0) {
+        handle_rebalance(client_conn, strtok(NULL, ""));
+        return;
+    }
+
+    int cmd_id = -1;
+    for (int i = 0; i < CMD_COUNT; i++) {
+        if (strcmp(cmd, command_names[i]) == 0) cmd_id = i;
+    }
+    if (cmd_id < 0) {
+        write(client_conn, "ERROR: Unknown command", 22);
+        return;
+    }
+
+    int admit_class = command_class(cmd_id);
+    if (admit_request(admit_class, client_bucket) < 0) {
+        reject_busy(client_conn, cmd_id, admit_class);
+        record_request(cmd_id, RECORD_BUSY, parse_start);
+        return;
+    }
+    enter_placement(cmd_id);
+
+    trace_begin(cmd_id);
+    trace_span(STAGE_PARSE, parse_start);
+
+    unsigned long start_us = now_us();
+    int result = 0;
+    __atomic_fetch_add(&metrics->in_flight, 1, __ATOMIC_RELAXED);
+
+    if (cmd_id == CMD_UPLOADF) {
         char *filename = strtok(NULL, " ");
         char *dest_path = strtok(NULL, " ");
         if (filename == NULL || dest_path == NULL) {
             write(client_conn, "ERROR: Invalid uploadf format", 29);
-            return;
+            result = -1;
+        } else {
+            result = handle_upload(client_conn, filename, dest_path);
         }
-        handle_upload(client_conn, filename, dest_path);
     } 
-    else if (strcmp(cmd, "downlf") == 0) {
+    else if (cmd_id == CMD_DOWNLF) {
         char *filename = strtok(NULL, " ");
         if (filename == NULL) {
             write(client_conn, "ERROR: Invalid downlf format", 28);
-            return;
+            result = -1;
+        } else {
+            result = handle_download(client_conn, filename);
         }
-        handle_download(client_conn, filename);
     } 
-    else if (strcmp(cmd, "removef") == 0) {
+    else if (cmd_id == CMD_REMOVEF) {
         char *filename = strtok(NULL, " ");
         if (filename == NULL) {
             write(client_conn, "ERROR: Invalid removef format", 29);
-            return;
+            result = -1;
+        } else {
+            result = handle_remove(client_conn, filename);
         }
-        handle_remove(client_conn, filename);
     } 
-    else if (strcmp(cmd, "downltar") == 0) {
+    else if (cmd_id == CMD_DOWNLTAR) {
         char *filetype = strtok(NULL, " ");
         if (filetype == NULL) {
             write(client_conn, "ERROR: Invalid downltar format", 30);
-            return;
+            result = -1;
+        } else {
+            result = handle_tar_download(client_conn, filetype);
         }
-        handle_tar_download(client_conn, filetype);
     } 
-    else if (strcmp(cmd, "dispfnames") == 0) {
+    else if (cmd_id == CMD_DISPFNAMES) {
         char *pathname = strtok(NULL, " ");
         if (pathname == NULL) {
             write(client_conn, "ERROR: Invalid dispfnames format", 32);
-            return;
+            result = -1;
+        } else {
+            result = display_files(client_conn, pathname);
         }
-        display_files(client_conn, pathname);
-    } 
+    }
+    else if (cmd_id == CMD_FINDF) {
+        result = handle_find(client_conn, strtok(NULL, ""));
+    }
+    else if (cmd_id == CMD_COPYF || cmd_id == CMD_MOVEF) {
+        char *src = strtok(NULL, " ");
+        char *dst = strtok(NULL, " ");
+        if (src == NULL || dst == NULL) {
+            dprintf(client_conn, "ERROR: Invalid %s format", command_names[cmd_id]);
+            result = -1;
+        } else {
+            result = handle_copy(client_conn, cmd_id, src, dst);
+        }
+    }
+    else if (cmd_id == CMD_DELTAF) {
+        char *filename = strtok(NULL, " ");
+        char *dest_path = strtok(NULL, " ");
+        if (filename == NULL || dest_path == NULL) {
+            write(client_conn, "ERROR: Invalid deltaf format", 28);
+            result = -1;
+        } else {
+            result = handle_delta_upload(client_conn, filename, dest_path);
+        }
+    }
     else {
-        write(client_conn, "ERROR: Unknown command", 22);
+        result = handle_batch(client_conn, cmd_id);
     }
+
+    __atomic_fetch_sub(&metrics->in_flight, 1, __ATOMIC_RELAXED);
+    release_ticket(&admission->tickets[admit_slot]);
+    record_latency(&metrics->commands[cmd_id], start_us, result < 0);
+    log_message(result < 0 ? LOG_WARN : LOG_INFO, "event=done command=%s status=%s duration_us=%lu",
+                command_names[cmd_id], result < 0 ? "error" : "ok", now_us() - start_us);
+    record_request(cmd_id, result < 0 ? RECORD_ERROR : RECORD_OK, parse_start);
 }
 
 int handle_upload(int client_conn, char *filename, char *dest_path) 
 {
+    char *ext = strrchr(filename, '.');
+    int target_port = 0;
+    if (ext != NULL && strcmp(ext, ".pdf") == 0) target_port = s2_port;
+    else if (ext != NULL && strcmp(ext, ".txt") == 0) target_port = s3_port;
+    else if (ext != NULL && strcmp(ext, ".zip") == 0) target_port = s4_port;
+    
+    // Refuse before the client starts sending if the owning node is known to be down or full
+    char reason[64];
+    if (target_port > 0 && node_can_accept(target_port, 0, reason, sizeof(reason)) < 0) {
+        write(client_conn, reason, strlen(reason));
+        return -1;
+    }
+    
     write(client_conn, "READY", 5);
     
     off_t file_size;
     read(client_conn, &file_size, sizeof(off_t));
     
-    char *ext = strrchr(filename, '.');
     if (ext == NULL) {
         write(client_conn, "ERROR: File has no extension", 28);
         return -1;
     }
     
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), dest_path + 3);
-    create_directory_structure(s1_path);
-    
-    char full_path[MAX_PATH_LEN];
-    snprintf(full_path, MAX_PATH_LEN, "%s/%s", s1_path, basename(filename));
+    // The client sends the file right after its size, so a refused one is read and dropped
+    char quota_reason[BUFFER_SIZE];
+    struct dir_usage incoming = { file_size, 1 };
+    if (check_quota(dest_path, incoming, NULL, quota_reason, sizeof(quota_reason)) < 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        unsigned int client_crc;
+        receive_payload(null_fd, client_conn, file_size, session_compress, NULL);
+        read_all(client_conn, &client_crc, sizeof(client_crc));
+        if (null_fd >= 0) close(null_fd);
+        write(client_conn, quota_reason, strlen(quota_reason));
+        return -1;
+    }
     
-    int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    unsigned long span_start = trace_start();
+    char *name = basename(filename);
+    int dir_fd = resolve_dir(relative_path(dest_path), 1);
+    struct dir_usage before = file_usage(dir_fd, name);
+    int fd = (dir_fd < 0) ? -1 : openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    trace_span(STAGE_LOOKUP, span_start);
     if (fd < 0) {
         write(client_conn, "ERROR: Failed to create file", 28);
         return -1;
     }
+    fremovexattr(fd, CRC_XATTR);
     
-    char buffer[BUFFER_SIZE];
-    off_t remaining = file_size;
-    while (remaining > 0) {
-        int n = read(client_conn, buffer, BUFFER_SIZE);
-        if (n <= 0) {
-            close(fd);
-            write(client_conn, "ERROR: File transfer failed", 27);
-            return -1;
-        }
-        write(fd, buffer, n);
-        remaining -= n;
+    // The client sends the CRC32C of the data after it; ours is computed while receiving
+    span_start = trace_start();
+    unsigned int crc = 0, client_crc;
+    off_t received = receive_payload(fd, client_conn, file_size, session_compress, &crc);
+    trace_span(STAGE_TRANSFER, span_start);
+    add_bytes(&metrics->bytes_in, received);
+    if (received != file_size || read_all(client_conn, &client_crc, sizeof(client_crc)) < 0) {
+        close(fd);
+        account_usage(dir_fd, relative_path(dest_path), name, before);
+        write(client_conn, "ERROR: File transfer failed", 27);
+        return -1;
+    }
+    if (crc != client_crc) {
+        close(fd);
+        unlinkat(dir_fd, name, 0);
+        account_usage(dir_fd, relative_path(dest_path), name, before);
+        write(client_conn, "ERROR: Checksum mismatch", 24);
+        return -1;
     }
+    store_crc32c(fd, crc);
     close(fd);
     
     if (strcmp(ext, ".c") == 0) {
+        account_usage(dir_fd, relative_path(dest_path), name, before);
         write(client_conn, "SUCCESS: File uploaded to S1", 29);
         return 0;
     } else {
-        int target_port = 0;
-        if (strcmp(ext, ".pdf") == 0) target_port = s2_port;
-        else if (strcmp(ext, ".txt") == 0) target_port = s3_port;
-        else if (strcmp(ext, ".zip") == 0) target_port = s4_port;
+        if (target_port > 0 && node_can_accept(target_port, file_size, reason, sizeof(reason)) < 0) {
+            unlinkat(dir_fd, name, 0);
+            write(client_conn, reason, strlen(reason));
+            return -1;
+        }
         
         if (target_port > 0) {
-            if (forward_to_server(target_port, full_path, dest_path) == 0) {
-                unlink(full_path);
+            if (forward_to_server(target_port, dir_fd, name, name, dest_path) == 0) {
+                unlinkat(dir_fd, name, 0);
                 write(client_conn, "SUCCESS: File forwarded to server", 33);
             } else {
                 write(client_conn, "ERROR: Failed to forward file", 29);
+                return -1;
             }
         } else {
             write(client_conn, "ERROR: Unsupported file type", 28);
+            return -1;
         }
     }
     
@@ -232,33 +1162,18 @@ int handle_upload(int client_conn, char *filename, char *dest_path)
 
 int handle_download(int client_conn, char *filename) 
 {
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), filename + 3);
+    unsigned long span_start = trace_start();
+    const char *name;
+    int dir_fd = resolve_parent(filename, 0, &name);
+    int fd = (dir_fd < 0) ? -1 : openat(dir_fd, name, O_RDONLY);
     
     struct stat st;
-    if (stat(s1_path, &st) == 0) {
-        int fd = open(s1_path, O_RDONLY);
-        if (fd < 0) {
-            write(client_conn, "ERROR: Failed to open file", 26);
-            return -1;
-        }
-        
-        write(client_conn, &st.st_size, sizeof(off_t));
-        
-        char buffer[BUFFER_SIZE];
-        off_t remaining = st.st_size;
-        while (remaining > 0) {
-            ssize_t n = read(fd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-            if (n <= 0) {
-                close(fd);
-                return -1;
-            }
-            write(client_conn, buffer, n);
-            remaining -= n;
-        }
-        close(fd);
-        return 0;
+    int found = (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+    trace_span(STAGE_LOOKUP, span_start);
+    if (found) {
+        return send_open_file(client_conn, fd, name);
     }
+    if (fd >= 0) close(fd);
     
     char *ext = strrchr(filename, '.');
     int target_port = 0;
@@ -267,76 +1182,139 @@ int handle_download(int client_conn, char *filename)
     else if (strcmp(ext, ".zip") == 0) target_port = s4_port;
     
     if (target_port > 0) {
-        int sockfd;
-        struct sockaddr_in serv_addr;
-        struct hostent *server;
+        unsigned long forward_start = now_us();
+        span_start = trace_start();
 
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        int sockfd = connect_to_node(target_port, NODE_IO_TIMEOUT_MS);
         if (sockfd < 0) {
+            record_forward(target_port, forward_start, 1);
             off_t error_size = -1;
             write(client_conn, &error_size, sizeof(off_t));
             return -1;
         }
+        trace_span(STAGE_CONNECT, span_start);
 
-        server = gethostbyname("localhost");
-        if (server == NULL) {
-            close(sockfd);
-            off_t error_size = -1;
-            write(client_conn, &error_size, sizeof(off_t));
-            return -1;
-        }
-
-        bzero((char *)&serv_addr, sizeof(serv_addr));
-        serv_addr.sin_family = AF_INET;
-        bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-        serv_addr.sin_port = htons(target_port);
-
-        if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-            close(sockfd);
-            off_t error_size = -1;
-            write(client_conn, &error_size, sizeof(off_t));
-            return -1;
+        char command[BUFFER_SIZE], cached_token[48] = "";
+        if (cached_crc >= 0) {
+            snprintf(cached_token, sizeof(cached_token), "%s%08lx:%ld", CACHED_TOKEN, cached_crc, (long) cached_size);
         }
-
-        char command[BUFFER_SIZE];
-        snprintf(command, BUFFER_SIZE, "downlf %s", filename);
+        // With -U, openf asks a node on this host to pass S1 an open descriptor for the file, which
+        // is then sent to the client from here (sendfile from the node's page cache) without the node
+        // or a second socket in the data path. A node that cannot (over TCP, or for a file it keeps
+        // compressed) answers exactly as to downlf.
+        snprintf(command, BUFFER_SIZE, "%s %s%s%s", unix_socket_dir ? "openf" : "downlf", filename, cached_token,
+                 node_compress ? COMPRESS_TOKEN : "");
+        append_trace(command, BUFFER_SIZE);
+        span_start = trace_start();
         write(sockfd, command, strlen(command));
 
         off_t filesize;
-        if (read(sockfd, &filesize, sizeof(off_t)) == sizeof(off_t)) {
+        unsigned int crc = 0;
+        int failed = 1;
+        int header_ok = (recv_fd(sockfd, &filesize, sizeof(off_t), &fd) == 0);
+        if (header_ok && fd >= 0) {
+            breaker_report(target_port, 1);
+            trace_span(STAGE_FIRST_BYTE, span_start);
+            close(sockfd);
+            record_forward(target_port, forward_start, 0);
+            __atomic_fetch_add(&metrics->passed_fds, 1, __ATOMIC_RELAXED);
+            return send_open_file(client_conn, fd, filename);
+        }
+        header_ok = (header_ok && (filesize < 0 || read_all(sockfd, &crc, sizeof(crc)) == 0));
+        breaker_report(target_port, header_ok);
+        if (header_ok) {
+            trace_span(STAGE_FIRST_BYTE, span_start);
             write(client_conn, &filesize, sizeof(off_t));
+            if (filesize >= 0) write(client_conn, &crc, sizeof(crc));
             
+            off_t sent = 0;
             if (filesize > 0) {
-                char buffer[BUFFER_SIZE];
-                off_t remaining = filesize;
-                while (remaining > 0) {
-                    int bytes = read(sockfd, buffer, 
-                                   (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-                    if (bytes <= 0) break;
-                    write(client_conn, buffer, bytes);
-                    remaining -= bytes;
-                }
+                span_start = trace_start();
+                sent = forward_payload(client_conn, session_compress, sockfd, node_compress, filesize, filename);
+                trace_span(STAGE_TRANSFER, span_start);
+                add_bytes(&metrics->bytes_out, sent);
+            }
+            failed = (filesize < 0 || sent != filesize);
+            if (filesize == NOT_MODIFIED_SIZE) {
+                failed = 0;
+                __atomic_fetch_add(&metrics->not_modified, 1, __ATOMIC_RELAXED);
             }
         } else {
             off_t error_size = -1;
             write(client_conn, &error_size, sizeof(off_t));
         }
 
+        span_start = trace_start();
         close(sockfd);
+        trace_span(STAGE_CLOSE, span_start);
+        record_forward(target_port, forward_start, failed);
+        return failed ? -1 : 0;
     } else {
         off_t error_size = -1;
         write(client_conn, &error_size, sizeof(off_t));
+        return -1;
+    }
+}
+
+// Sends a regular file to the client as downlf does and closes it: size -3 if the client's cached
+// copy is current (same CRC32C and size), else size, CRC32C and the payload
+int send_open_file(int client_conn, int fd, const char *name)
+{
+    struct stat st;
+    fstat(fd, &st);
+    unsigned int crc = file_crc32c(fd);
+    if (cached_crc >= 0 && crc == cached_crc && st.st_size == cached_size) {
+        off_t not_modified = NOT_MODIFIED_SIZE;
+        close(fd);
+        write(client_conn, &not_modified, sizeof(off_t));
+        __atomic_fetch_add(&metrics->not_modified, 1, __ATOMIC_RELAXED);
+        return 0;
     }
+    write(client_conn, &st.st_size, sizeof(off_t));
+    write(client_conn, &crc, sizeof(crc));
     
+    unsigned long span_start = trace_start();
+    off_t sent = send_payload(client_conn, fd, st.st_size, session_compress, name, NULL);
+    close(fd);
+    trace_span(STAGE_TRANSFER, span_start);
+    add_bytes(&metrics->bytes_out, sent);
+    return (sent == st.st_size) ? 0 : -1;
+}
+
+// Reads a len-byte reply and the descriptor that may come with it (-1 if none), which arrives
+// with the first byte
+int recv_fd(int sockfd, void *buf, size_t len, int *fd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+    *fd = -1;
+    ssize_t n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = (n > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (n <= 0 || (n < (ssize_t) len && read_all(sockfd, (char *) buf + n, len - n) < 0)) {
+        if (*fd >= 0) close(*fd);
+        *fd = -1;
+        return -1;
+    }
     return 0;
 }
 
 int handle_remove(int client_conn, char *filename) 
 {
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), filename + 3);
-    
-    if (unlink(s1_path) == 0) {
+    unsigned long span_start = trace_start();
+    const char *name;
+    int dir_fd = resolve_parent(filename, 0, &name);
+    int removed = (dir_fd >= 0 && unlink_counted(dir_fd, name, filename) == 0);
+    trace_span(STAGE_LOOKUP, span_start);
+    if (removed) {
         write(client_conn, "SUCCESS: File deleted from S1", 30);
         return 0;
     }
@@ -361,9 +1339,11 @@ int handle_remove(int client_conn, char *filename)
             write(client_conn, response, strlen(response));
         } else {
             write(client_conn, "ERROR: Failed to contact server", 31);
+            return -1;
         }
     } else {
         write(client_conn, "ERROR: File not found", 21);
+        return -1;
     }
     
     return 0;
@@ -383,11 +1363,14 @@ int handle_tar_download(int client_conn, char *filetype)
 
         struct stat st;
         if (stat("/tmp/cfiles.tar", &st) == 0 && st.st_size > 0) {
+            int fd = open("/tmp/cfiles.tar", O_RDONLY);
+            unsigned int crc = (fd >= 0) ? file_crc32c(fd) : 0;
             write(client_conn, &st.st_size, sizeof(off_t));
+            write(client_conn, &crc, sizeof(crc));
             
-            int fd = open("/tmp/cfiles.tar", O_RDONLY);
             if (fd >= 0) {
-                sendfile(client_conn, fd, NULL, st.st_size);
+                add_bytes(&metrics->bytes_out, send_payload(client_conn, fd, st.st_size, session_compress,
+                                                            "cfiles.tar", NULL));
                 close(fd);
             }
             unlink("/tmp/cfiles.tar");
@@ -395,10 +1378,12 @@ int handle_tar_download(int client_conn, char *filetype)
             // Create empty tar if no files
             system("tar -cf /tmp/cfiles.tar --files-from /dev/null");
             if (stat("/tmp/cfiles.tar", &st) == 0) {
-                write(client_conn, &st.st_size, sizeof(off_t));
                 int fd = open("/tmp/cfiles.tar", O_RDONLY);
+                unsigned int crc = (fd >= 0) ? file_crc32c(fd) : 0;
+                write(client_conn, &st.st_size, sizeof(off_t));
+                write(client_conn, &crc, sizeof(crc));
                 if (fd >= 0) {
-                    sendfile(client_conn, fd, NULL, st.st_size);
+                    send_payload(client_conn, fd, st.st_size, session_compress, "cfiles.tar", NULL);
                     close(fd);
                 }
                 unlink("/tmp/cfiles.tar");
@@ -408,42 +1393,49 @@ int handle_tar_download(int client_conn, char *filetype)
         // Keep existing code for PDF and TXT - DON'T CHANGE THIS PART
         int target_port = (strcmp(filetype, ".pdf") == 0) ? s2_port : s3_port;
         char command[100];
-        snprintf(command, 100, "downltar %s", filetype);
+        snprintf(command, 100, "downltar %s%s", filetype, node_compress ? COMPRESS_TOKEN : "");
+        append_trace(command, sizeof(command));
 
-        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        unsigned long forward_start = now_us();
+        unsigned long span_start = trace_start();
+        int failed = 1;
+        int relayed = 0;
+        // The node archives the whole tree before it answers, so it gets a longer read timeout
+        int sockfd = connect_to_node(target_port, NODE_ARCHIVE_TIMEOUT_MS);
         if (sockfd >= 0) {
-            struct sockaddr_in serv_addr;
-            struct hostent *server = gethostbyname("localhost");
+            trace_span(STAGE_CONNECT, span_start);
+            span_start = trace_start();
+            write(sockfd, command, strlen(command));
             
-            if (server != NULL) {
-                bzero((char *)&serv_addr, sizeof(serv_addr));
-                serv_addr.sin_family = AF_INET;
-                bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-                serv_addr.sin_port = htons(target_port);
+            off_t file_size;
+            unsigned int crc = 0;
+            int header_ok = (read_all(sockfd, &file_size, sizeof(off_t)) == 0 &&
+                             (file_size < 0 || read_all(sockfd, &crc, sizeof(crc)) == 0));
+            breaker_report(target_port, header_ok);
+            if (header_ok) {
+                trace_span(STAGE_FIRST_BYTE, span_start);
+                write(client_conn, &file_size, sizeof(off_t));
+                if (file_size >= 0) write(client_conn, &crc, sizeof(crc));
+                relayed = 1;
                 
-                if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) >= 0) {
-                    write(sockfd, command, strlen(command));
-                    
-                    off_t file_size;
-                    if (read(sockfd, &file_size, sizeof(off_t)) == sizeof(off_t)) {
-                        write(client_conn, &file_size, sizeof(off_t));
-                        
-                        char buffer[BUFFER_SIZE];
-                        off_t remaining = file_size;
-                        while (remaining > 0) {
-                            int bytes = read(sockfd, buffer, 
-                                           (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-                            if (bytes <= 0) break;
-                            write(client_conn, buffer, bytes);
-                            remaining -= bytes;
-                        }
-                    }
-                }
+                span_start = trace_start();
+                off_t sent = (file_size > 0) ? forward_payload(client_conn, session_compress, sockfd, node_compress,
+                                                                file_size, filetype) : 0;
+                trace_span(STAGE_TRANSFER, span_start);
+                add_bytes(&metrics->bytes_out, sent);
+                failed = (file_size < 0 || sent != file_size);
             }
             close(sockfd);
         }
+        if (!relayed) {
+            off_t error_size = -1;
+            write(client_conn, &error_size, sizeof(off_t));
+        }
+        record_forward(target_port, forward_start, failed);
+        return failed ? -1 : 0;
     } else {
         write(client_conn, "ERROR: Unsupported filetype for tar", 35);
+        return -1;
     }
     
     return 0;
@@ -452,155 +1444,4205 @@ int display_files(int client_conn, char *pathname)
 {
     char file_list[BUFFER_SIZE * 4] = {0};
     
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), 
-             (strcmp(pathname, "~S1") == 0) ? "" : (pathname + 3));
-
-    DIR *dir = opendir(s1_path);
-    if (dir) {
-        struct dirent *ent;
-        while ((ent = readdir(dir)) != NULL) {
-            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
-            
-            char *ext = strrchr(ent->d_name, '.');
-            if (ext && strcmp(ext, ".c") == 0) {
-                char output_path[MAX_PATH_LEN];
-                snprintf(output_path, sizeof(output_path), "~S1/%s\n", ent->d_name);
-                strncat(file_list, output_path, BUFFER_SIZE * 4 - strlen(file_list) - 1);
-            }
-        }
-        closedir(dir);
+    unsigned long span_start = trace_start();
+    int dir_fd = resolve_dir(relative_path(pathname), 0);
+    struct walk_entry *entries = NULL;
+    ssize_t count = (dir_fd < 0) ? -1 : walk_tree(dir_fd, WALK_ORDERED, 1, match_extension, ".c", &entries);
+    for (ssize_t i = 0; i < count; i++) {
+        char output_path[MAX_PATH_LEN];
+        snprintf(output_path, sizeof(output_path), "~S1/%s\n", entries[i].path);
+        strncat(file_list, output_path, BUFFER_SIZE * 4 - strlen(file_list) - 1);
     }
+    if (count >= 0) walk_free(entries, count);
+    trace_span(STAGE_LOOKUP, span_start);
 
     char command[MAX_PATH_LEN];
     snprintf(command, MAX_PATH_LEN, "dispfnames %s", pathname);
     char response[BUFFER_SIZE];
 
-    if (send_command_to_server(s2_port, command, response) == 0) {
-        strncat(file_list, response, BUFFER_SIZE * 4 - strlen(file_list) - 1);
-    }
-
-    if (send_command_to_server(s3_port, command, response) == 0) {
-        strncat(file_list, response, BUFFER_SIZE * 4 - strlen(file_list) - 1);
+    // Every node has the request before any reply is read, so a hung node costs one timeout
+    // and its files are replaced by an error line instead of failing the whole listing
+    int node_ports[3] = { s2_port, s3_port, s4_port };
+    int node_socks[3];
+    unsigned long forward_starts[3];
+    for (int i = 0; i < 3; i++) {
+        forward_starts[i] = now_us();
+        node_socks[i] = send_node_command(node_ports[i], command);
     }
 
-    if (send_command_to_server(s4_port, command, response) == 0) {
+    int failures = 0;
+    for (int i = 0; i < 3; i++) {
+        if (node_socks[i] >= 0 &&
+            read_node_response(node_socks[i], node_ports[i], response, forward_starts[i]) == 0) {
+            strncat(file_list, response, BUFFER_SIZE * 4 - strlen(file_list) - 1);
+            continue;
+        }
+        if (node_socks[i] < 0) {
+            record_forward(node_ports[i], forward_starts[i], 1);
+        }
+        const char *cause = (member_state(i) == MEMBER_DEAD) ? "no heartbeat" :
+                            (__atomic_load_n(&breakers[i].state, __ATOMIC_RELAXED) == BREAKER_OPEN) ?
+                            "circuit open" : "no response";
+        snprintf(response, BUFFER_SIZE, "ERROR: %s unavailable (%s), its files are not listed\n",
+                 node_names[i], cause);
         strncat(file_list, response, BUFFER_SIZE * 4 - strlen(file_list) - 1);
+        failures++;
     }
 
     write(client_conn, file_list, strlen(file_list));
-    return 0;
+    add_bytes(&metrics->bytes_out, strlen(file_list));
+    return failures ? -1 : 0;
 }
 
-int forward_to_server(int target_port, char *file_path, char *dest_path) 
+// copyf/movef. A destination naming a file of a supported type is the new path; anything else is
+// a directory the file keeps its name in. Within one server the operation is a local reflink or
+// rename. Across servers the data goes directly between them: S1 forwards or pulls its own side,
+// and between two storage nodes the source pushes to the target itself.
+int handle_copy(int client_conn, int cmd_id, char *src, char *dst)
 {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) return -1;
-    
-    struct sockaddr_in serv_addr;
-    struct hostent *server = gethostbyname("localhost");
-    if (server == NULL) {
-        close(sockfd);
+    int move = (cmd_id == CMD_MOVEF);
+    if (strncmp(src, "~S1/", 4) != 0 || strncmp(dst, "~S1", 3) != 0) {
+        write(client_conn, "ERROR: Paths must start with ~S1/", 33);
         return -1;
     }
     
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(target_port);
+    int src_owner = owner_node(src);
+    if (src_owner < 0) {
+        if (move) return move_directory(client_conn, src, dst);
+        write(client_conn, "ERROR: copyf copies files only", 30);
+        return -1;
+    }
     
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        close(sockfd);
+    char target[MAX_PATH_LEN];
+    if (owner_node(dst) >= 0) {
+        snprintf(target, sizeof(target), "%s", dst);
+    } else {
+        size_t dst_len = strlen(dst);
+        while (dst_len > 3 && dst[dst_len - 1] == '/') dst_len--;
+        snprintf(target, sizeof(target), "%.*s/%s", (int) dst_len, dst, strrchr(src, '/') + 1);
+    }
+    int dst_owner = owner_node(target);
+    if (strcmp(relative_path(src), relative_path(target)) == 0) {
+        write(client_conn, "ERROR: Source and destination are the same", 42);
         return -1;
     }
     
-    char *filename = basename(file_path);
-    char command[MAX_PATH_LEN];
-    snprintf(command, MAX_PATH_LEN, "uploadf %s %s", filename, dest_path);
-    write(sockfd, command, strlen(command));
+    // A copy is charged like an upload of the source; a move only to quotas it enters
+    struct dir_usage incoming;
+    char quota_reason[BUFFER_SIZE];
+    if (quota_count > 0 && source_usage(src_owner, src, &incoming) == 0 &&
+        check_quota(target, incoming, move ? src : NULL, quota_reason, sizeof(quota_reason)) < 0) {
+        write(client_conn, quota_reason, strlen(quota_reason));
+        return -1;
+    }
     
-    char response[10];
-    read(sockfd, response, 5);
+    int node_ports[3] = { s2_port, s3_port, s4_port };
+    char reason[64];
+    if (dst_owner > 0 && node_can_accept(node_ports[dst_owner - 1], 0, reason, sizeof(reason)) < 0) {
+        write(client_conn, reason, strlen(reason));
+        return -1;
+    }
     
-    struct stat st;
-    if (stat(file_path, &st) == 0) {
-        write(sockfd, &st.st_size, sizeof(off_t));
-        
-        int fd = open(file_path, O_RDONLY);
-        if (fd >= 0) {
-            char buffer[BUFFER_SIZE];
-            off_t remaining = st.st_size;
-            while (remaining > 0) {
-                int bytes = read(fd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-                if (bytes <= 0) break;
-                write(sockfd, buffer, bytes);
-                remaining -= bytes;
-            }
-            close(fd);
+    char response[BUFFER_SIZE + 2 * MAX_PATH_LEN];
+    char command[MAX_PATH_LEN * 3];
+    int result;
+    if (src_owner == 0 && dst_owner == 0) {
+        unsigned long span_start = trace_start();
+        result = move ? move_entry(src, target) : copy_entry(src, target);
+        trace_span(STAGE_TRANSFER, span_start);
+        if (result < 0) {
+            snprintf(response, sizeof(response), "ERROR: %s", (errno == ENOENT) ? "File not found in S1" : strerror(errno));
+        }
+    } else if (src_owner == dst_owner) {
+        snprintf(command, sizeof(command), "%s %s %s", command_names[cmd_id], src, target);
+        result = send_command_to_server(node_ports[src_owner - 1], command, response);
+        if (result < 0) snprintf(response, sizeof(response), "ERROR: %s unavailable", node_names[src_owner - 1]);
+        else if (strncmp(response, "SUCCESS", 7) != 0) result = -1;
+    } else if (src_owner == 0) {
+        const char *name;
+        int dir_fd = resolve_parent(src, 0, &name);
+        struct stat st;
+        char target_dir[MAX_PATH_LEN];
+        snprintf(target_dir, sizeof(target_dir), "%.*s", (int) (strrchr(target, '/') - target), target);
+        if (dir_fd < 0 || fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+            snprintf(response, sizeof(response), "ERROR: File not found in S1");
+            result = -1;
+        } else {
+            result = forward_to_server(node_ports[dst_owner - 1], dir_fd, (char *) name, strrchr(target, '/') + 1,
+                                       target_dir);
+            if (result < 0) snprintf(response, sizeof(response), "ERROR: Failed to forward file");
+            else if (move) unlink_counted(dir_fd, name, src);
+        }
+    } else if (dst_owner == 0) {
+        result = pull_from_node(node_ports[src_owner - 1], src, target);
+        if (result < 0) {
+            snprintf(response, sizeof(response), "ERROR: Failed to fetch file from %s", node_names[src_owner - 1]);
+        } else if (move) {
+            snprintf(command, sizeof(command), "removef %s", src);
+            send_command_to_server(node_ports[src_owner - 1], command, response);
         }
+    } else {
+        snprintf(command, sizeof(command), "pushf %s %s %d %d", src, target, node_ports[dst_owner - 1], move);
+        result = send_command_to_server(node_ports[src_owner - 1], command, response);
+        if (result < 0) snprintf(response, sizeof(response), "ERROR: %s unavailable", node_names[src_owner - 1]);
+        else if (strncmp(response, "SUCCESS", 7) != 0) result = -1;
     }
     
-    close(sockfd);
-    return 0;
+    if (result == 0) {
+        snprintf(response, sizeof(response), "SUCCESS: %s %s to %s", src, move ? "moved" : "copied", target);
+    }
+    write(client_conn, response, strlen(response));
+    return result;
 }
 
-int send_command_to_server(int port, char *command, char *response) 
+// A directory is renamed on S1 and on every storage node, each of which holds its own part of
+// the tree. A server without the directory has nothing to move; a failure elsewhere is reported
+// per server, as the servers that succeeded are not rolled back.
+int move_directory(int client_conn, char *src, char *dst)
 {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    char report[BUFFER_SIZE * 2] = "";
+    char response[BUFFER_SIZE];
+    int moved = 0, failures = 0;
+    
+    if (quota_count > 0) {
+        struct dir_usage usage[4], incoming = { 0, 0 };
+        collect_usage(src, 0, usage);
+        for (int t = 0; t < 4; t++) {
+            incoming.bytes += usage[t].bytes;
+            incoming.files += usage[t].files;
+        }
+        if (check_quota(dst, incoming, src, response, sizeof(response)) < 0) {
+            write(client_conn, response, strlen(response));
+            return -1;
+        }
+    }
+    
+    unsigned long span_start = trace_start();
+    if (move_entry(src, dst) == 0) {
+        moved++;
+    } else if (errno != ENOENT) {
+        snprintf(response, sizeof(response), "ERROR: %s in S1\n", strerror(errno));
+        strncat(report, response, sizeof(report) - strlen(report) - 1);
+        failures++;
+    }
+    trace_span(STAGE_LOOKUP, span_start);
+    
+    char command[MAX_PATH_LEN * 3];
+    snprintf(command, sizeof(command), "movef %s %s", src, dst);
+    int node_ports[3] = { s2_port, s3_port, s4_port };
+    for (int i = 0; i < 3; i++) {
+        if (send_command_to_server(node_ports[i], command, response) < 0) {
+            snprintf(response, sizeof(response), "ERROR: %s unavailable", node_names[i]);
+        } else if (strncmp(response, "SUCCESS", 7) == 0) {
+            moved++;
+            continue;
+        } else if (strstr(response, "not found") != NULL) {
+            continue;
+        }
+        strncat(report, response, sizeof(report) - strlen(report) - 2);
+        strcat(report, "\n");
+        failures++;
+    }
+    
+    if (moved == 0 && failures == 0) {
+        snprintf(response, sizeof(response), "ERROR: %s not found", src);
+    } else {
+        snprintf(response, sizeof(response), "%s: %s moved to %s on %d server%s", failures ? "ERROR" : "SUCCESS",
+                 src, dst, moved, (moved == 1) ? "" : "s");
+    }
+    strncat(report, response, sizeof(report) - strlen(report) - 1);
+    write(client_conn, report, strlen(report));
+    return (failures || moved == 0) ? -1 : 0;
+}
+
+// 0 for .c files (kept on S1), 1-3 for the S2, S3 and S4 types, -1 for anything else
+int owner_node(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    if (ext == NULL || strchr(ext, '/') != NULL) return -1;
+    if (strcmp(ext, ".c") == 0) return 0;
+    if (strcmp(ext, ".pdf") == 0) return 1;
+    if (strcmp(ext, ".txt") == 0) return 2;
+    if (strcmp(ext, ".zip") == 0) return 3;
+    return -1;
+}
+
+// Size of the file src on the server that owns it (0 for S1, 1-3 for the storage nodes)
+int source_usage(int owner, const char *src, struct dir_usage *usage)
+{
+    if (owner == 0) {
+        const char *name;
+        int dir_fd = resolve_parent(src, 0, &name);
+        *usage = file_usage(dir_fd, name);
+        return 0;
+    }
+    int node_ports[3] = { s2_port, s3_port, s4_port };
+    return node_usage(node_ports[owner - 1], src, 0, usage);
+}
+
+// Fetches src from a storage node into S1's tree as dst, checking it against the node's CRC32C
+int pull_from_node(int port, char *src, char *dst)
+{
+    unsigned long forward_start = now_us();
+    char command[MAX_PATH_LEN];
+    snprintf(command, sizeof(command), "downlf %s", src);
+    int sockfd = send_node_command(port, command);
+    if (sockfd < 0) {
+        record_forward(port, forward_start, 1);
+        return -1;
+    }
+    
+    const char *name;
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), ".pull.%d", getpid());
+    int dir_fd = resolve_parent(dst, 1, &name);
+    int fd = (dir_fd < 0) ? -1 : openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    unsigned long span_start = trace_start();
+    off_t size = -1;
+    unsigned int node_crc = 0, crc = 0;
+    int header_ok = (read_all(sockfd, &size, sizeof(off_t)) == 0 &&
+                     (size < 0 || read_all(sockfd, &node_crc, sizeof(node_crc)) == 0));
+    int failed = (fd < 0 || !header_ok || size < 0 || receive_payload(fd, sockfd, size, 0, &crc) != size ||
+                  crc != node_crc);
+    trace_span(STAGE_TRANSFER, span_start);
+    breaker_report(port, header_ok);
+    close(sockfd);
+    
+    if (!failed) {
+        struct dir_usage before = file_usage(dir_fd, name);
+        store_crc32c(fd, crc);
+        failed = (renameat(dir_fd, tmp_name, dir_fd, name) < 0);
+        if (!failed) {
+            struct dir_usage after = file_usage(dir_fd, name);
+            struct dir_usage delta = { after.bytes - before.bytes, after.files - before.files };
+            update_usage(relative_path(dst), delta);
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (failed && fd >= 0) unlinkat(dir_fd, tmp_name, 0);
+    add_bytes(&metrics->bytes_in, failed ? 0 : size);
+    record_forward(port, forward_start, failed);
+    return failed ? -1 : 0;
+}
+
+// rebalance <filetype> <port> [rate=N] [iops=N] moves every file of the type from its node to
+// the node on port while the old node keeps serving it, then switches the type over. Without
+// arguments it shows the progress of the current or last rebalance.
+int handle_rebalance(int client_conn, char *args)
+{
+    char *filetype = (args == NULL) ? NULL : strtok(args, " ");
+    if (filetype == NULL) {
+        char status[BUFFER_SIZE];
+        int len = format_rebalance(status, sizeof(status));
+        write(client_conn, status, len);
+        return 0;
+    }
+    
+    char *port_text = strtok(NULL, " ");
+    int node = owner_node(filetype) - 1;
+    int port = (port_text == NULL) ? 0 : atoi(port_text);
+    if (filetype[0] != '.' || node < 0 || port <= 0 || port > 65535) {
+        dprintf(client_conn, "ERROR: Usage: rebalance <.pdf|.txt|.zip> <port> [rate=N] [iops=N]\n");
+        return -1;
+    }
+    struct migrate_budget budget = { MIGRATE_DEFAULT_RATE, MIGRATE_DEFAULT_IOPS, 0 };
+    for (char *token = strtok(NULL, " "); token != NULL; token = strtok(NULL, " ")) {
+        long value;
+        if (strncmp(token, "rate=", 5) == 0 && (value = parse_size(token + 5)) >= 0) {
+            budget.rate = value;
+        } else if (strncmp(token, "iops=", 5) == 0 && (value = parse_size(token + 5)) >= 0) {
+            budget.iops = value;
+        } else {
+            dprintf(client_conn, "ERROR: Invalid rebalance option %s\n", token);
+            return -1;
+        }
+    }
+    if (budget.rate > UINT_MAX) budget.rate = UINT_MAX;
+    if (port == main_port || port == s2_port || port == s3_port || port == s4_port) {
+        dprintf(client_conn, "ERROR: Port %d already belongs to a server\n", port);
+        return -1;
+    }
+    
+    int idle = 0;
+    if (!__atomic_compare_exchange_n(&placement->active, &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        write(client_conn, "ERROR: A rebalance is already running\n", 38);
+        return -1;
+    }
+    __atomic_store_n(&placement->owner, getpid(), __ATOMIC_RELEASE);
+    
+    // The cursor is taken before the listing, so every write the listing misses is in the feed
+    int old_port = placement->ports[node];
+    char cursor[64];
+    struct migrate_list source = { NULL, 0, 0 }, target = { NULL, 0, 0 };
+    const char *error = NULL;
+    if (migrate_list_node(port, &target) < 0) {
+        error = "No storage node answers on that port";
+    } else if (migrate_cursor(old_port, cursor) < 0) {
+        error = "The node's change feed is unavailable or incomplete";
+    } else if (migrate_list_node(old_port, &source) < 0) {
+        error = "Listing the node's files failed";
+    }
+    migrate_list_free(&target);
+    if (error != NULL) {
+        dprintf(client_conn, "ERROR: %s\n", error);
+        migrate_list_free(&source);
+        __atomic_store_n(&placement->owner, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&placement->active, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    
+    unsigned long bytes = 0;
+    for (size_t i = 0; i < source.count; i++) bytes += source.files[i].size;
+    placement->node = node;
+    placement->target_port = port;
+    placement->rate = budget.rate;
+    placement->iops = budget.iops;
+    placement->files_total = source.count;
+    placement->bytes_total = bytes;
+    placement->files_done = placement->bytes_done = placement->catchup_files = 0;
+    placement->started_us = now_us();
+    set_rebalance_state(MIGRATE_COPYING, "");
+    
+    unsigned long seconds = budget.rate ? bytes / budget.rate : 0;
+    if (budget.iops && source.count / budget.iops > seconds) seconds = source.count / budget.iops;
+    dprintf(client_conn, "SUCCESS: Rebalancing %zu %s files (%lu MB) from %s on port %d to port %d, "
+            "about %lu s at the budget\n", source.count, filetype, bytes >> 20, node_names[node], old_port, port,
+            seconds);
+    shutdown(client_conn, SHUT_WR);
+    log_message(LOG_INFO, "event=rebalance_start type=%s from=%d to=%d files=%zu bytes=%lu", filetype, old_port,
+                port, source.count, bytes);
+    
+    int result = run_rebalance(node, port, &budget, &source, cursor);
+    migrate_list_free(&source);
+    __atomic_store_n(&placement->owner, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&placement->active, 0, __ATOMIC_RELEASE);
+    return result;
+}
+
+// Copies the listed files, catches up on the writes made meanwhile and switches over. A lost
+// change feed (the node restarted or its ring overflowed) is replaced by a new cursor and a
+// rescan of both nodes that copies only the files that differ. Once switched, the old copies
+// are removed after the requests still reading them have had MIGRATE_DRAIN_MS to finish.
+int run_rebalance(int node, int port, struct migrate_budget *budget, struct migrate_list *source, char *cursor)
+{
+    const char *extensions[3] = { ".pdf", ".txt", ".zip" };
+    const char *ext = extensions[node];
+    int old_port = placement->ports[node];
+    
+    for (size_t i = 0; i < source->count; i++) {
+        migrate_throttle(budget);
+        if (migrate_push(old_port, source->files[i].path, port, budget->rate) < 0) {
+            log_message(LOG_WARN, "event=rebalance_copy_failed path=%s", source->files[i].path);
+        }
+        __atomic_fetch_add(&placement->files_done, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&placement->bytes_done, source->files[i].size, __ATOMIC_RELAXED);
+    }
+    
+    int switched = -2;
+    while (switched == -2) {
+        // Keep applying the feed until what is left is small enough to apply with writes held
+        set_rebalance_state(MIGRATE_CATCHING_UP, "");
+        long applied = 0;
+        for (int round = 0; round < MIGRATE_CATCHUP_ROUNDS; round++) {
+            applied = migrate_apply_changes(old_port, port, ext, cursor, budget);
+            if (applied <= MIGRATE_SWITCH_BACKLOG) break;
+        }
+        if (applied == -2) {
+            set_rebalance_state(MIGRATE_FAILED, "the old node could not watch all of its directories");
+            break;
+        }
+        switched = (applied < 0) ? -2 : migrate_switch(node, old_port, port, ext, cursor, source);
+        if (switched != -2) break;
+        
+        // The cursor is taken first, so whatever changes during the rescan is in the feed
+        log_message(LOG_WARN, "event=rebalance_rescan type=%s reason=change_feed_lost", ext);
+        set_rebalance_state(MIGRATE_COPYING, "rescanning after the change feed was lost");
+        if (migrate_cursor(old_port, cursor) < 0) {
+            set_rebalance_state(MIGRATE_FAILED, "the old node's change feed is unavailable or incomplete");
+            switched = -1;
+        } else if (migrate_verify(old_port, port, source, budget) < 0) {
+            set_rebalance_state(MIGRATE_FAILED, "the rescan could not list both nodes");
+            switched = -1;
+        }
+    }
+    if (switched < 0) {
+        if (placement->state != MIGRATE_FAILED) set_rebalance_state(MIGRATE_FAILED, "the copy could not be completed");
+        log_message(LOG_ERROR, "event=rebalance_failed type=%s reason=\"%s\"", ext, placement->message);
+        return -1;
+    }
+    
+    set_rebalance_state(MIGRATE_CLEANING, "");
+    usleep(MIGRATE_DRAIN_MS * 1000);
+    char command[MAX_PATH_LEN + 16];
+    char response[BUFFER_SIZE];
+    for (size_t i = 0; i < source->count; i++) {
+        migrate_throttle(budget);
+        snprintf(command, sizeof(command), "removef %s", source->files[i].path);
+        send_command_to_server(old_port, command, response);
+    }
+    set_rebalance_state(MIGRATE_DONE, "");
+    log_message(LOG_INFO, "event=rebalance_done type=%s port=%d files=%zu", ext, port, source->count);
+    return 0;
+}
+
+// Holds back new writes, waits for those in progress, applies the last changes and compares
+// both trees; the placement changes only if they match. Reads carry on throughout. Returns -2
+// if the change feed was lost, so the copy has to start over.
+int migrate_switch(int node, int old_port, int port, const char *ext, char *cursor, struct migrate_list *source)
+{
+    set_rebalance_state(MIGRATE_SWITCHING, "");
+    __atomic_store_n(&placement->frozen, 1, __ATOMIC_SEQ_CST);
+    
+    const char *error = NULL;
+    int result = -1;
+    unsigned long deadline = now_us() + MIGRATE_FREEZE_MAX_MS * 1000UL;
+    while (writes_in_progress() > 0 && now_us() < deadline) {
+        usleep(ADMIT_POLL_US);
+    }
+    if (writes_in_progress() > 0) {
+        error = "writes in progress did not finish";
+    } else {
+        // The old node's watcher records a write shortly after it completes
+        usleep(MIGRATE_SETTLE_MS * 1000);
+        long applied = migrate_apply_changes(old_port, port, ext, cursor, NULL);
+        if (applied == -2) {
+            error = "the old node could not watch all of its directories";
+        } else if (applied < 0) {
+            error = "the change feed was lost";
+            result = -2;
+        } else {
+            long differences = migrate_verify(old_port, port, source, NULL);
+            if (differences > 0) differences = migrate_verify(old_port, port, source, NULL);
+            if (differences != 0) error = "the new node's files do not match";
+        }
+    }
+    
+    if (error == NULL) {
+        __atomic_store_n(&placement->ports[node], port, __ATOMIC_RELEASE);
+        __atomic_store_n(&members[node].last_seen_us, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&breakers[node].failures, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&breakers[node].state, BREAKER_CLOSED, __ATOMIC_RELEASE);
+        log_message(LOG_INFO, "event=placement_switched type=%s from=%d to=%d", ext, old_port, port);
+    }
+    __atomic_store_n(&placement->frozen, 0, __ATOMIC_SEQ_CST);
+    if (error != NULL) {
+        set_rebalance_state(MIGRATE_FAILED, error);
+        log_message(LOG_WARN, "event=rebalance_switch_failed type=%s reason=\"%s\"", ext, error);
+        return result;
+    }
+    return 0;
+}
+
+// Lists both nodes and makes the new one match the old: files that are missing or differ in
+// size or CRC32C are copied again and files the old node no longer has are removed, paced by
+// budget unless it is NULL. Returns the number of differences found (source is replaced by the
+// new listing), or -1 if a listing failed.
+long migrate_verify(int old_port, int port, struct migrate_list *source, struct migrate_budget *budget)
+{
+    struct migrate_list current = { NULL, 0, 0 }, target = { NULL, 0, 0 };
+    if (migrate_list_node(old_port, &current) < 0 || migrate_list_node(port, &target) < 0) {
+        migrate_list_free(&current);
+        migrate_list_free(&target);
+        return -1;
+    }
+    qsort(current.files, current.count, sizeof(struct migrate_file), compare_migrate_files);
+    qsort(target.files, target.count, sizeof(struct migrate_file), compare_migrate_files);
+    
+    long differences = 0;
+    size_t i = 0, j = 0;
+    char command[MAX_PATH_LEN + 16];
+    char response[BUFFER_SIZE];
+    while (i < current.count || j < target.count) {
+        int order = (i == current.count) ? 1 : (j == target.count) ? -1
+                  : strcmp(current.files[i].path, target.files[j].path);
+        if (order == 0 && current.files[i].size == target.files[j].size &&
+            current.files[i].crc == target.files[j].crc) {
+            i++;
+            j++;
+            continue;
+        }
+        differences++;
+        if (budget != NULL) migrate_throttle(budget);
+        if (order <= 0) {
+            migrate_push(old_port, current.files[i].path, port, budget ? budget->rate : 0);
+            i++;
+            if (order == 0) j++;
+        } else {
+            snprintf(command, sizeof(command), "removef %s", target.files[j].path);
+            send_command_to_server(port, command, response);
+            j++;
+        }
+    }
+    
+    migrate_list_free(source);
+    *source = current;
+    migrate_list_free(&target);
+    return differences;
+}
+
+// Applies the old node's change records after cursor to the node on port: created and modified
+// files are copied again, deleted ones removed. Renamed directories and other records are left
+// to migrate_verify. Returns the number of records applied, -1 if the feed has to be resynced,
+// or -2 if the node reports directories it could not watch, whose changes no rescan would
+// catch; cursor is advanced either way.
+long migrate_apply_changes(int old_port, int port, const char *ext, char *cursor, struct migrate_budget *budget)
+{
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "changes %s 0", cursor[0] ? cursor : "-");
+    int sockfd = connect_to_node(old_port, NODE_IO_TIMEOUT_MS);
+    FILE *in = (sockfd < 0) ? NULL : fdopen(sockfd, "r");
+    if (in == NULL) {
+        if (sockfd >= 0) close(sockfd);
+        return -1;
+    }
+    write_all(sockfd, command, strlen(command));
+    
+    char *line = NULL;
+    size_t line_size = 0;
+    char header[16], position[48];
+    int resync = 1, incomplete = 0;
+    if (getline(&line, &line_size, in) > 0 && sscanf(line, "%15s %47s", header, position) == 2 &&
+        (strcmp(header, "cursor") == 0 || strcmp(header, "resync") == 0)) {
+        resync = (strcmp(header, "resync") == 0);
+        incomplete = (strstr(line, " incomplete") != NULL);
+        snprintf(cursor, 64, "%s", position);
+    }
+    
+    long applied = 0;
+    size_t ext_len = strlen(ext);
+    char response[BUFFER_SIZE];
+    while (!resync && !incomplete && getline(&line, &line_size, in) > 0) {
+        unsigned long seq;
+        char type;
+        int offset = 0;
+        if (sscanf(line, "%lu %c %n", &seq, &type, &offset) != 2 || offset == 0) continue;
+        char *path = line + offset;
+        path[strcspn(path, "\n")] = '\0';
+        size_t len = strlen(path);
+        char *slash = strrchr(path, '/');
+        if (len < ext_len || strcmp(path + len - ext_len, ext) != 0 || slash == NULL || slash[1] == '.') continue;
+        
+        if (budget != NULL) migrate_throttle(budget);
+        if (type == 'D') {
+            snprintf(command, sizeof(command), "removef %s", path);
+            send_command_to_server(port, command, response);
+        } else {
+            migrate_push(old_port, path, port, budget ? budget->rate : 0);
+        }
+        applied++;
+        __atomic_fetch_add(&placement->catchup_files, 1, __ATOMIC_RELAXED);
+    }
+    free(line);
+    fclose(in);
+    return incomplete ? -2 : resync ? -1 : applied;
+}
+
+// The old node's current feed position; fails if the feed is incomplete
+int migrate_cursor(int port, char *cursor)
+{
+    cursor[0] = '\0';
+    long result = migrate_apply_changes(port, 0, "", cursor, NULL);
+    return (result != -2 && cursor[0] != '\0') ? 0 : -1;
+}
+
+// Has the old node upload path straight to the node on port, paced to rate bytes per second
+int migrate_push(int old_port, const char *path, int port, unsigned long rate)
+{
+    char command[MAX_PATH_LEN * 2 + 64];
+    snprintf(command, sizeof(command), "pushf %s %s %d 0 %lu", path, path, port, rate);
+    int sockfd = connect_to_node(old_port, NODE_ARCHIVE_TIMEOUT_MS);
+    if (sockfd < 0) return -1;
+    
+    char response[BUFFER_SIZE];
+    bzero(response, BUFFER_SIZE);
+    int answered = (write_all(sockfd, command, strlen(command)) == 0 &&
+                    read(sockfd, response, BUFFER_SIZE - 1) > 0);
+    breaker_report(old_port, answered);
+    close(sockfd);
+    return (strncmp(response, "SUCCESS", 7) == 0) ? 0 : -1;
+}
+
+// Every file of the node's type with its size and CRC32C, read from the node's listf stream as
+// it arrives. The listing has no limit, however many files the node holds.
+int migrate_list_node(int port, struct migrate_list *list)
+{
+    int sockfd = connect_to_node(port, NODE_ARCHIVE_TIMEOUT_MS);
+    FILE *in = (sockfd < 0) ? NULL : fdopen(sockfd, "r");
+    if (in == NULL) {
+        if (sockfd >= 0) close(sockfd);
+        return -1;
+    }
+    write_all(sockfd, "listf", 5);
+    
+    char *line = NULL;
+    size_t line_size = 0;
+    long count = -1;
+    while (count < 0 && getline(&line, &line_size, in) > 0) {
+        long long size;
+        unsigned int crc;
+        int offset = 0;
+        if (sscanf(line, "END %ld", &count) == 1) break;
+        if (strncmp(line, "ERROR", 5) == 0) break;
+        if (sscanf(line, "%lld %x %n", &size, &crc, &offset) != 2 || offset == 0) continue;
+        
+        line[strcspn(line, "\n")] = '\0';
+        if (list->count == list->capacity) {
+            size_t capacity = list->capacity ? list->capacity * 2 : 256;
+            struct migrate_file *files = realloc(list->files, capacity * sizeof(struct migrate_file));
+            if (files == NULL) break;
+            list->files = files;
+            list->capacity = capacity;
+        }
+        list->files[list->count].path = strdup(line + offset);
+        list->files[list->count].size = size;
+        list->files[list->count].crc = crc;
+        list->count++;
+    }
+    free(line);
+    fclose(in);
+    
+    // A listing cut off early would leave files behind
+    return (count < 0 || (size_t) count != list->count) ? -1 : 0;
+}
+
+void migrate_list_free(struct migrate_list *list)
+{
+    for (size_t i = 0; i < list->count; i++) free(list->files[i].path);
+    free(list->files);
+    list->files = NULL;
+    list->count = list->capacity = 0;
+}
+
+int compare_migrate_files(const void *a, const void *b)
+{
+    return strcmp(((const struct migrate_file *) a)->path, ((const struct migrate_file *) b)->path);
+}
+
+// Spaces file operations 1/iops seconds apart and waits while any foreground request is queued
+// for admission, so a rebalance only uses capacity nobody else is asking for. Bandwidth is
+// paced by the sending node (SO_MAX_PACING_RATE).
+void migrate_throttle(struct migrate_budget *budget)
+{
+    for (int queued = 1; queued; ) {
+        queued = 0;
+        for (int i = 0; i < CLASS_COUNT; i++) {
+            queued += __atomic_load_n(&admission->waiting[i], __ATOMIC_RELAXED) > 0;
+        }
+        if (queued) usleep(MIGRATE_YIELD_MS * 1000);
+    }
+    
+    unsigned long now = now_us();
+    if (budget->next_us > now) {
+        usleep(budget->next_us - now);
+        now = budget->next_us;
+    }
+    budget->next_us = now + (budget->iops ? 1000000UL / budget->iops : 0);
+}
+
+// Requests that may write to a node; a switch waits for these to finish
+int writes_in_progress(void)
+{
+    int writing = 0;
+    for (int i = 0; i < ADMIT_MAX_CHILDREN; i++) {
+        writing += __atomic_load_n(&admission->tickets[i].writing, __ATOMIC_SEQ_CST);
+    }
+    return writing;
+}
+
+// Called by each request once admitted. Writes are marked on the ticket and wait while a
+// switch is holding them back; every request then picks up the current placement.
+void enter_placement(int cmd_id)
+{
+    int writes = (cmd_id == CMD_UPLOADF || cmd_id == CMD_REMOVEF || cmd_id == CMD_MREMOVEF || cmd_id == CMD_DELTAF ||
+                  cmd_id == CMD_COPYF || cmd_id == CMD_MOVEF);
+    struct admit_ticket *ticket = &admission->tickets[admit_slot];
+    while (writes) {
+        __atomic_store_n(&ticket->writing, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&placement->frozen, __ATOMIC_SEQ_CST)) break;
+        __atomic_store_n(&ticket->writing, 0, __ATOMIC_SEQ_CST);
+        usleep(ADMIT_POLL_US);
+    }
+    sync_placement();
+}
+
+void sync_placement(void)
+{
+    s2_port = __atomic_load_n(&placement->ports[0], __ATOMIC_ACQUIRE);
+    s3_port = __atomic_load_n(&placement->ports[1], __ATOMIC_ACQUIRE);
+    s4_port = __atomic_load_n(&placement->ports[2], __ATOMIC_ACQUIRE);
+}
+
+void set_rebalance_state(int state, const char *message)
+{
+    snprintf(placement->message, sizeof(placement->message), "%s", message);
+    __atomic_store_n(&placement->state, state, __ATOMIC_RELEASE);
+}
+
+int format_rebalance(char *out, size_t len)
+{
+    int state = __atomic_load_n(&placement->state, __ATOMIC_ACQUIRE);
+    if (state == MIGRATE_IDLE) return snprintf(out, len, "No rebalance has run\n");
+    
+    const char *extensions[3] = { ".pdf", ".txt", ".zip" };
+    int node = placement->node;
+    int written = snprintf(out, len, "rebalance %s (%s) to port %d: %s%s%s\n"
+                           "copied %lu/%lu files, %lu/%lu MB; %lu changes applied; %lu s elapsed\n"
+                           "budget %lu KB/s, %lu files/s\n",
+                           extensions[node], node_names[node], placement->target_port, migrate_state_names[state],
+                           placement->message[0] ? ", " : "", placement->message,
+                           __atomic_load_n(&placement->files_done, __ATOMIC_RELAXED), placement->files_total,
+                           __atomic_load_n(&placement->bytes_done, __ATOMIC_RELAXED) >> 20,
+                           placement->bytes_total >> 20,
+                           __atomic_load_n(&placement->catchup_files, __ATOMIC_RELAXED),
+                           (now_us() - placement->started_us) / 1000000, placement->rate >> 10, placement->iops);
+    return (written < (int) len) ? written : (int) len - 1;
+}
+
+// findf runs the query on S1's tree (in a thread) and on every storage node at once, and relays
+// the matching files to the client as they arrive from any of them. Each search ends its stream
+// with "END <count>". Once limit files are sent the remaining searches are cancelled by closing
+// their connections.
+int handle_find(int client_conn, char *args)
+{
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "findf %s", args ? args : "");
+    
+    struct find_query query;
+    char error[MAX_PATH_LEN];
+    if (parse_find_query(args, &query, error, sizeof(error)) < 0) {
+        dprintf(client_conn, "ERROR: %s\n", error);
+        return -1;
+    }
+    
+    // sources[0] is the local search, sources[1..3] are S2, S3 and S4
+    struct find_source *sources = calloc(4, sizeof(struct find_source));
+    if (sources == NULL) {
+        free_find_query(&query);
+        return -1;
+    }
+    
+    int node_ports[3] = { s2_port, s3_port, s4_port };
+    unsigned long forward_starts[3];
+    for (int i = 0; i < 3; i++) {
+        forward_starts[i] = now_us();
+        sources[i + 1].fd = send_node_command(node_ports[i], command);
+    }
+    
+    // The dir fd cache is not thread safe, so the local directory is resolved here
+    int pair[2];
+    pthread_t local_thread;
+    struct find_local local = { &query, resolve_dir(relative_path(query.path), 0), -1 };
+    int local_started = 0;
+    sources[0].fd = -1;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0) {
+        local.out_fd = pair[1];
+        local_started = (pthread_create(&local_thread, NULL, find_local_main, &local) == 0);
+        if (local_started) {
+            sources[0].fd = pair[0];
+        } else {
+            close(pair[0]);
+            close(pair[1]);
+        }
+    }
+    
+    unsigned long span_start = trace_start();
+    long found = 0;
+    char *out = malloc(FIND_BUFFER_SIZE);
+    struct pollfd fds[4];
+    while (out != NULL && found < query.limit) {
+        int active = 0;
+        for (int i = 0; i < 4; i++) {
+            fds[i].fd = sources[i].fd;
+            fds[i].events = POLLIN;
+            if (fds[i].fd >= 0) active++;
+        }
+        if (active == 0) break;
+        
+        // A node that finds nothing for this long is treated as hung
+        int ready = poll(fds, 4, NODE_ARCHIVE_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) break;
+        
+        for (int i = 0; i < 4 && found < query.limit; i++) {
+            struct find_source *source = &sources[i];
+            if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+            
+            ssize_t n = read(source->fd, source->buffer + source->len, FIND_BUFFER_SIZE - source->len);
+            if (n <= 0) {
+                close(source->fd);
+                source->fd = -1;
+                continue;
+            }
+            source->len += n;
+            
+            // Only whole lines are relayed, so results from different sources never interleave
+            size_t out_len = 0;
+            char *line = source->buffer;
+            char *end = source->buffer + source->len;
+            char *newline;
+            while (found < query.limit && (newline = memchr(line, '\n', end - line)) != NULL) {
+                if (strncmp(line, "END ", 4) == 0) {
+                    source->complete = 1;
+                    close(source->fd);
+                    source->fd = -1;
+                    line = end;
+                    break;
+                }
+                memcpy(out + out_len, line, newline - line + 1);
+                out_len += newline - line + 1;
+                if (strncmp(line, "ERROR", 5) != 0) found++;
+                line = newline + 1;
+            }
+            source->len = end - line;
+            memmove(source->buffer, line, source->len);
+            if (source->len == FIND_BUFFER_SIZE) source->len = 0;   // no line is this long
+            
+            if (out_len > 0 && write_all(client_conn, out, out_len) < 0) {
+                found = query.limit;
+            }
+            add_bytes(&metrics->bytes_out, out_len);
+        }
+    }
+    trace_span(STAGE_TRANSFER, span_start);
+    free(out);
+    
+    int truncated = (found >= query.limit);
+    int failures = 0;
+    for (int i = 0; i < 4; i++) {
+        if (sources[i].fd >= 0) close(sources[i].fd);
+        if (i > 0 && !truncated) {
+            record_forward(node_ports[i - 1], forward_starts[i - 1], !sources[i].complete);
+            breaker_report(node_ports[i - 1], sources[i].complete);
+        }
+        if (!sources[i].complete && !truncated) {
+            dprintf(client_conn, "ERROR: %s unavailable, its files are not searched\n",
+                    (i == 0) ? "S1" : node_names[i - 1]);
+            failures++;
+        }
+    }
+    
+    __atomic_store_n(&query.cancelled, 1, __ATOMIC_RELAXED);
+    if (local_started) pthread_join(local_thread, NULL);
+    free_find_query(&query);
+    free(sources);
+    
+    dprintf(client_conn, "%ld file%s found%s\n", found, (found == 1) ? "" : "s", truncated ? " (limit reached)" : "");
+    return failures ? -1 : 0;
+}
+
+// Searches S1's own .c files for handle_find, writing to a socket pair like a storage node would
+void *find_local_main(void *arg)
+{
+    struct find_local *local = arg;
+    long found = (local->dir_fd < 0) ? 0 : run_find(local->dir_fd, local->query, local->out_fd, ".c");
+    
+    char end[64];
+    int len = snprintf(end, sizeof(end), "END %ld\n", found);
+    send(local->out_fd, end, len, MSG_NOSIGNAL);
+    close(local->out_fd);
+    return NULL;
+}
+
+// Batched downlf/removef. After READY the client sends an off_t length and newline-separated
+// paths. .c files are handled locally; the rest are grouped into one request per storage node,
+// and every node has its list before S1 reads any reply, so the nodes work in parallel.
+// Results are streamed back per file (records for mdownlf, status lines for mremovef) until EOF.
+int handle_batch(int client_conn, int cmd_id)
+{
+    write(client_conn, "READY", 5);
+    
+    char *list = read_batch_list(client_conn);
+    if (list == NULL) {
+        return -1;
+    }
+    
+    // groups[0] holds the local .c paths, groups[1..3] the paths owned by S2, S3 and S4
+    size_t list_len = strlen(list);
+    char *groups[4];
+    size_t group_lens[4] = {0};
+    for (int g = 0; g < 4; g++) {
+        groups[g] = malloc(list_len + 1);
+        if (groups[g] == NULL) {
+            for (int i = 0; i < g; i++) free(groups[i]);
+            free(list);
+            return -1;
+        }
+        groups[g][0] = '\0';
+    }
+    
+    int failures = 0;
+    char *saveptr;
+    for (char *path = strtok_r(list, "\n", &saveptr); path != NULL; path = strtok_r(NULL, "\n", &saveptr)) {
+        char *ext = strrchr(path, '.');
+        int group = -1;
+        if (strncmp(path, "~S1/", 4) != 0 || strstr(path, "..") != NULL) {
+            write_batch_failure(client_conn, cmd_id, path, "invalid path");
+            failures++;
+            continue;
+        }
+        if (ext == NULL) group = -1;
+        else if (strcmp(ext, ".c") == 0) group = 0;
+        else if (strcmp(ext, ".pdf") == 0) group = 1;
+        else if (strcmp(ext, ".txt") == 0) group = 2;
+        else if (strcmp(ext, ".zip") == 0) group = 3;
+        
+        if (group < 0) {
+            write_batch_failure(client_conn, cmd_id, path, "unsupported file type");
+            failures++;
+            continue;
+        }
+        group_lens[group] += sprintf(groups[group] + group_lens[group], "%s\n", path);
+    }
+    free(list);
+    
+    int node_ports[3] = { s2_port, s3_port, s4_port };
+    int node_socks[3] = { -1, -1, -1 };
+    unsigned long forward_starts[3];
+    for (int i = 0; i < 3; i++) {
+        if (group_lens[i + 1] > 0) {
+            forward_starts[i] = now_us();
+            node_socks[i] = start_node_batch(node_ports[i], cmd_id, groups[i + 1], group_lens[i + 1]);
+        }
+    }
+    
+    // Local files are served while the storage nodes work on their lists
+    unsigned long span_start = trace_start();
+    for (char *path = strtok_r(groups[0], "\n", &saveptr); path != NULL; path = strtok_r(NULL, "\n", &saveptr)) {
+        const char *name;
+        int dir_fd = resolve_parent(path, 0, &name);
+        
+        if (cmd_id == CMD_MDOWNLF) {
+            int fd = (dir_fd < 0) ? -1 : openat(dir_fd, name, O_RDONLY);
+            if (write_batch_record(client_conn, path, fd) < 0) failures++;
+            if (fd >= 0) close(fd);
+        } else if (dir_fd >= 0 && unlink_counted(dir_fd, name, path) == 0) {
+            char status[MAX_PATH_LEN + 64];
+            int len = snprintf(status, sizeof(status), "SUCCESS: %s deleted from S1\n", path);
+            write_all(client_conn, status, len);
+        } else {
+            write_batch_failure(client_conn, cmd_id, path, "not found in S1");
+            failures++;
+        }
+    }
+    trace_span(STAGE_LOOKUP, span_start);
+    
+    for (int i = 0; i < 3; i++) {
+        if (group_lens[i + 1] == 0) continue;
+        
+        if (node_socks[i] < 0) {
+            char reason[64];
+            snprintf(reason, sizeof(reason), "%s unavailable", node_names[i]);
+            for (char *path = strtok_r(groups[i + 1], "\n", &saveptr); path != NULL;
+                 path = strtok_r(NULL, "\n", &saveptr)) {
+                write_batch_failure(client_conn, cmd_id, path, reason);
+                failures++;
+            }
+            record_forward(node_ports[i], forward_starts[i], 1);
+            continue;
+        }
+        
+        // The node closes the connection after its last entry
+        span_start = trace_start();
+        off_t sent = transfer_data(client_conn, node_socks[i], LONG_MAX);
+        trace_span(STAGE_TRANSFER, span_start);
+        add_bytes(&metrics->bytes_out, sent);
+        close(node_socks[i]);
+        record_forward(node_ports[i], forward_starts[i], 0);
+    }
+    
+    for (int g = 0; g < 4; g++) free(groups[g]);
+    return failures ? -1 : 0;
+}
+
+// Sends a batched command and its path list to a storage node; returns the connected socket
+int start_node_batch(int port, int cmd_id, char *list, size_t len)
+{
+    unsigned long span_start = trace_start();
+    int sockfd = connect_to_node(port, NODE_IO_TIMEOUT_MS);
+    if (sockfd < 0) return -1;
+    trace_span(STAGE_CONNECT, span_start);
+    
+    // The node's record stream is relayed to the client untouched, so it is framed exactly when
+    // the client's session is
+    char command[MAX_PATH_LEN];
+    snprintf(command, MAX_PATH_LEN, "%s%s", command_names[cmd_id], session_compress ? COMPRESS_TOKEN : "");
+    append_trace(command, MAX_PATH_LEN);
+    write(sockfd, command, strlen(command));
+    
+    char response[10];
+    off_t list_len = len;
+    int ready = (read_all(sockfd, response, 5) == 0 && strncmp(response, "READY", 5) == 0);
+    breaker_report(port, ready);
+    if (!ready || write_all(sockfd, &list_len, sizeof(off_t)) < 0 || write_all(sockfd, list, len) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Reports a per-file failure in the format of the batch: a -1 record or an ERROR line
+int write_batch_failure(int client_conn, int cmd_id, char *path, const char *reason)
+{
+    if (cmd_id == CMD_MDOWNLF) {
+        return write_batch_record(client_conn, path, -1);
+    }
+    
+    char status[MAX_PATH_LEN + 64];
+    int len = snprintf(status, sizeof(status), "ERROR: %s %s\n", path, reason);
+    return write_all(client_conn, status, len);
+}
+
+// Reads an off_t-prefixed path list; returns a NUL-terminated buffer the caller frees
+char *read_batch_list(int fd)
+{
+    off_t len;
+    if (read_all(fd, &len, sizeof(off_t)) < 0 || len < 0 || len > MAX_BATCH_BYTES) {
+        return NULL;
+    }
+    
+    char *list = malloc(len + 1);
+    if (list == NULL) {
+        return NULL;
+    }
+    if (read_all(fd, list, len) < 0) {
+        free(list);
+        return NULL;
+    }
+    list[len] = '\0';
+    return list;
+}
+
+// One mdownlf entry: off_t name length and name, then the usual download header (off_t size,
+// -1 if fd is invalid, and CRC32C) followed by the file data
+int write_batch_record(int out_fd, char *path, int fd)
+{
+    struct stat st;
+    off_t name_len = strlen(path);
+    off_t size = (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : -1;
+    
+    if (write_all(out_fd, &name_len, sizeof(off_t)) < 0 || write_all(out_fd, path, name_len) < 0 ||
+        write_all(out_fd, &size, sizeof(off_t)) < 0 || size < 0) {
+        return -1;
+    }
+    
+    unsigned int crc = file_crc32c(fd);
+    if (write_all(out_fd, &crc, sizeof(crc)) < 0) {
+        return -1;
+    }
+    
+    off_t sent = send_payload(out_fd, fd, size, session_compress, path, NULL);
+    add_bytes(&metrics->bytes_out, sent);
+    return (sent == size) ? 0 : -1;
+}
+
+// Non-blocking connect bounded by NODE_CONNECT_TIMEOUT_MS. The socket is handed back in blocking
+// mode with io_timeout_ms applied to every read and write, so a hung node surfaces as a short
+// read instead of stalling the handler. Fails immediately while the node's breaker is open or
+// its heartbeats have stopped.
+int connect_to_node(int port, int io_timeout_ms)
+{
+    if (member_state(node_index(port)) == MEMBER_DEAD || breaker_allow(port) < 0) return -1;
+    
+    // Nodes on this host are reached through their Unix socket when both sides have -U
+    int sockfd = connect_unix(port);
+    if (sockfd < 0) sockfd = connect_tcp(port);
+    if (sockfd < 0) {
+        breaker_report(port, 0);
+        return -1;
+    }
+    
+    struct timeval timeout = { .tv_sec = io_timeout_ms / 1000, .tv_usec = (io_timeout_ms % 1000) * 1000 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return sockfd;
+}
+
+// Returns -1 without -U or when no node on this host listens for port. A Unix connect never
+// waits for the peer; a full backlog fails with EAGAIN and the call falls back to TCP.
+int connect_unix(int port)
+{
+    if (unix_socket_dir == NULL) return -1;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/" UNIX_SOCKET_NAME, unix_socket_dir, port);
+    if (n < 0 || (size_t) n >= sizeof(addr.sun_path)) return -1;
+    
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) return -1;
+    if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+    return sockfd;
+}
+
+int connect_tcp(int port)
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+    
+    struct sockaddr_in serv_addr;
+    struct hostent *server = gethostbyname("localhost");
+    if (server == NULL) {
+        close(sockfd);
+        return -1;
+    }
+    
+    bzero((char *)&serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
+    serv_addr.sin_port = htons(port);
+    
+    int flags = fcntl(sockfd, F_GETFL);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    int result = connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+    if (result < 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        result = (poll(&pfd, 1, NODE_CONNECT_TIMEOUT_MS) == 1 &&
+                  getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0) ? 0 : -1;
+    }
+    if (result < 0) {
+        close(sockfd);
+        return -1;
+    }
+    fcntl(sockfd, F_SETFL, flags);
+    set_nodelay(sockfd);
+    return sockfd;
+}
+
+// Headers, payloads and trailers go out as separate writes; with Nagle the second one waits
+// for the peer's delayed ACK (about 40 ms) before it is sent
+void set_nodelay(int sockfd)
+{
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int node_index(int port)
+{
+    return (port == s2_port) ? 0 : (port == s3_port) ? 1 : (port == s4_port) ? 2 : -1;
+}
+
+// Returns -1 while the node's breaker is open. The first caller after BREAKER_OPEN_MS claims the
+// probe by advancing opened_us; if that probe never reports, another is allowed one period later.
+int breaker_allow(int port)
+{
+    int node = node_index(port);
+    if (node < 0) return 0;
+    
+    struct node_breaker *breaker = &breakers[node];
+    if (__atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE) == BREAKER_CLOSED) return 0;
+    
+    unsigned long now = now_us();
+    unsigned long opened = __atomic_load_n(&breaker->opened_us, __ATOMIC_RELAXED);
+    if (now - opened >= BREAKER_OPEN_MS * 1000UL &&
+        __atomic_compare_exchange_n(&breaker->opened_us, &opened, now, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&breaker->state, BREAKER_HALF_OPEN, __ATOMIC_RELEASE);
+        log_message(LOG_INFO, "event=breaker_probe node=%s", node_names[node]);
+        return 0;
+    }
+    return -1;
+}
+
+// A node that has never sent a heartbeat is UNKNOWN and treated as usable, so nodes started
+// without heartbeats keep working
+int member_state(int node)
+{
+    if (node < 0) return MEMBER_UNKNOWN;
+    unsigned long last_seen = __atomic_load_n(&members[node].last_seen_us, __ATOMIC_ACQUIRE);
+    if (last_seen == 0) return MEMBER_UNKNOWN;
+    
+    unsigned long age = now_us() - last_seen;
+    if (age <= HEARTBEAT_SUSPECT_MS * 1000UL) return MEMBER_ALIVE;
+    if (age <= HEARTBEAT_DEAD_MS * 1000UL) return MEMBER_SUSPECT;
+    return MEMBER_DEAD;
+}
+
+// Checks the membership table before sending a node size bytes; fills reason with the error
+// line for the client when the node is down or would be left with less than NODE_MIN_FREE_BYTES
+int node_can_accept(int port, off_t size, char *reason, size_t len)
+{
+    int node = node_index(port);
+    int state = member_state(node);
+    if (state == MEMBER_DEAD) {
+        snprintf(reason, len, "ERROR: %s is down", node_names[node]);
+        return -1;
+    }
+    if (state == MEMBER_UNKNOWN) return 0;
+    
+    unsigned long free_bytes = __atomic_load_n(&members[node].free_bytes, __ATOMIC_RELAXED);
+    if (free_bytes < (unsigned long) size + NODE_MIN_FREE_BYTES) {
+        snprintf(reason, len, "ERROR: %s is low on disk space", node_names[node]);
+        return -1;
+    }
+    return 0;
+}
+
+// Receives storage-node heartbeats as UDP datagrams on the S1 port from a dedicated child. The
+// nodes are reached at localhost, so the socket is bound there, and a datagram counts only when
+// it comes from the port of the node it names; anything else is dropped unread.
+void run_heartbeat_listener(int port)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        handle_error("Heartbeat socket creation failed");
+    }
+    struct hostent *server = gethostbyname("localhost");
+    if (server == NULL) {
+        handle_error("Heartbeat address lookup failed");
+    }
+
+    struct sockaddr_in addr;
+    bzero((char *) &addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    bcopy((char *) server->h_addr, (char *) &addr.sin_addr.s_addr, server->h_length);
+    addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        handle_error("Heartbeat binding failed");
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        handle_error("Fork failed");
+    }
+    if (pid > 0) {
+        close(sockfd);
+        return;
+    }
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    char message[BUFFER_SIZE];
+    while (1) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(sockfd, message, sizeof(message) - 1, 0, (struct sockaddr *) &from, &from_len);
+        if (n <= 0 || from.sin_addr.s_addr != addr.sin_addr.s_addr) continue;
+        message[n] = '\0';
+
+        int node_port;
+        struct node_member beat;
+        if (sscanf(message, "heartbeat port=%d in_flight=%ld requests=%lu p99_us=%lu free_bytes=%lu "
+                   "total_bytes=%lu files=%lu", &node_port, &beat.in_flight, &beat.requests, &beat.p99_us,
+                   &beat.free_bytes, &beat.total_bytes, &beat.files) != 7) {
+            continue;
+        }
+        sync_placement();
+        int node = node_index(node_port);
+        if (node < 0 || ntohs(from.sin_port) != node_port) continue;
+
+        int previous = member_state(node);
+        struct node_member *member = &members[node];
+        __atomic_store_n(&member->in_flight, beat.in_flight, __ATOMIC_RELAXED);
+        __atomic_store_n(&member->requests, beat.requests, __ATOMIC_RELAXED);
+        __atomic_store_n(&member->p99_us, beat.p99_us, __ATOMIC_RELAXED);
+        __atomic_store_n(&member->free_bytes, beat.free_bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&member->total_bytes, beat.total_bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&member->files, beat.files, __ATOMIC_RELAXED);
+        __atomic_store_n(&member->last_seen_us, now_us(), __ATOMIC_RELEASE);
+        if (previous == MEMBER_UNKNOWN || previous == MEMBER_DEAD) {
+            log_message(LOG_INFO, "event=node_joined node=%s", node_names[node]);
+        }
+    }
+}
+
+// Membership table for the nodes command; requests and p99 cover the node's last heartbeat interval
+int format_nodes(char *out, size_t len)
+{
+    size_t used = 0;
+    used += snprintf(out + used, len - used, "%-5s %6s %-8s %8s %9s %9s %8s %9s %9s %8s %-9s\n",
+                     "node", "port", "state", "last_ms", "in_flight", "req_per_s", "p99_us",
+                     "free_mb", "total_mb", "files", "breaker");
+    int ports[3] = { s2_port, s3_port, s4_port };
+    for (int i = 0; i < 3 && used < len; i++) {
+        struct node_member *member = &members[i];
+        unsigned long last_seen = __atomic_load_n(&member->last_seen_us, __ATOMIC_ACQUIRE);
+        long age_ms = last_seen ? (long) ((now_us() - last_seen) / 1000) : -1;
+        used += snprintf(out + used, len - used, "%-5s %6d %-8s %8ld %9ld %9lu %8lu %9lu %9lu %8lu %-9s\n",
+                         node_names[i], ports[i], member_names[member_state(i)], age_ms,
+                         __atomic_load_n(&member->in_flight, __ATOMIC_RELAXED),
+                         __atomic_load_n(&member->requests, __ATOMIC_RELAXED),
+                         __atomic_load_n(&member->p99_us, __ATOMIC_RELAXED),
+                         __atomic_load_n(&member->free_bytes, __ATOMIC_RELAXED) >> 20,
+                         __atomic_load_n(&member->total_bytes, __ATOMIC_RELAXED) >> 20,
+                         __atomic_load_n(&member->files, __ATOMIC_RELAXED),
+                         breaker_names[__atomic_load_n(&breakers[i].state, __ATOMIC_RELAXED)]);
+    }
+    return (used < len) ? (int) used : (int) len - 1;
+}
+
+// healthy means the node answered in time, whatever the answer was
+void breaker_report(int port, int healthy)
+{
+    int node = node_index(port);
+    if (node < 0) return;
+    
+    struct node_breaker *breaker = &breakers[node];
+    if (healthy) {
+        __atomic_store_n(&breaker->failures, 0, __ATOMIC_RELAXED);
+        if (__atomic_exchange_n(&breaker->state, BREAKER_CLOSED, __ATOMIC_ACQ_REL) != BREAKER_CLOSED) {
+            log_message(LOG_INFO, "event=breaker_closed node=%s", node_names[node]);
+        }
+        return;
+    }
+    
+    int failures = __atomic_add_fetch(&breaker->failures, 1, __ATOMIC_RELAXED);
+    int state = __atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE);
+    if (state == BREAKER_HALF_OPEN || (state == BREAKER_CLOSED && failures >= BREAKER_FAILURE_THRESHOLD)) {
+        __atomic_store_n(&breaker->opened_us, now_us(), __ATOMIC_RELAXED);
+        __atomic_store_n(&breaker->state, BREAKER_OPEN, __ATOMIC_RELEASE);
+        log_message(LOG_WARN, "event=breaker_open node=%s failures=%d", node_names[node], failures);
+    }
+}
+
+int forward_to_server(int target_port, int dir_fd, char *filename, char *target_name, char *dest_path) 
+{
+    unsigned long forward_start = now_us();
+    unsigned long span_start = trace_start();
+    int sockfd = connect_to_node(target_port, NODE_IO_TIMEOUT_MS);
+    if (sockfd < 0) {
+        record_forward(target_port, forward_start, 1);
+        return -1;
+    }
+    trace_span(STAGE_CONNECT, span_start);
+    
+    char command[MAX_PATH_LEN];
+    snprintf(command, MAX_PATH_LEN, "uploadf %s %s%s", target_name, dest_path, node_compress ? COMPRESS_TOKEN : "");
+    append_trace(command, MAX_PATH_LEN);
+    write(sockfd, command, strlen(command));
+    
+    char response[10];
+    read(sockfd, response, 5);
+    
+    int failed = 1;
+    struct stat st;
+    int fd = openat(dir_fd, filename, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        write(sockfd, &st.st_size, sizeof(off_t));
+        
+        span_start = trace_start();
+        off_t sent = send_payload(sockfd, fd, st.st_size, node_compress, filename, NULL);
+        trace_span(STAGE_TRANSFER, span_start);
+        unsigned int crc = file_crc32c(fd);
+        if (sent == st.st_size && write_all(sockfd, &crc, sizeof(crc)) == 0) {
+            // Wait for the storage node to confirm the file is fully written
+            char result[BUFFER_SIZE];
+            bzero(result, BUFFER_SIZE);
+            span_start = trace_start();
+            breaker_report(target_port, read(sockfd, result, BUFFER_SIZE - 1) > 0);
+            trace_span(STAGE_FIRST_BYTE, span_start);
+            failed = (strncmp(result, "SUCCESS", 7) != 0);
+        }
+    }
+    if (fd >= 0) close(fd);
+    
+    span_start = trace_start();
+    close(sockfd);
+    trace_span(STAGE_CLOSE, span_start);
+    record_forward(target_port, forward_start, failed);
+    return failed ? -1 : 0;
+}
+
+// deltaf: .c files are rebuilt here, other types by the owning node, which runs the same
+// exchange (receive_delta) with S1 relaying it
+int handle_delta_upload(int client_conn, char *filename, char *dest_path)
+{
+    char *ext = strrchr(filename, '.');
+    int target_port = 0;
+    if (ext != NULL && strcmp(ext, ".pdf") == 0) target_port = s2_port;
+    else if (ext != NULL && strcmp(ext, ".txt") == 0) target_port = s3_port;
+    else if (ext != NULL && strcmp(ext, ".zip") == 0) target_port = s4_port;
+    
+    char reason[64];
+    if (target_port == 0 && (ext == NULL || strcmp(ext, ".c") != 0)) {
+        write(client_conn, "ERROR: Unsupported file type", 28);
+        return -1;
+    }
+    if (target_port > 0 && node_can_accept(target_port, 0, reason, sizeof(reason)) < 0) {
+        write(client_conn, reason, strlen(reason));
+        return -1;
+    }
+    
+    write(client_conn, "READY", 5);
+    off_t new_size, error_count = -1;
+    if (read_all(client_conn, &new_size, sizeof(off_t)) < 0 || new_size < 0) {
+        return -1;
+    }
+    
+    // The rebuilt file is charged like an upload of it, before any signatures are sent
+    char quota_reason[BUFFER_SIZE];
+    struct dir_usage incoming = { new_size, 1 };
+    if (check_quota(dest_path, incoming, NULL, quota_reason, sizeof(quota_reason)) < 0) {
+        write(client_conn, &error_count, sizeof(off_t));
+        write(client_conn, quota_reason, strlen(quota_reason));
+        return -1;
+    }
+    
+    char *name = basename(filename);
+    if (target_port > 0) {
+        return relay_delta(client_conn, target_port, name, dest_path, new_size);
+    }
+    
+    unsigned long span_start = trace_start();
+    int dir_fd = resolve_dir(relative_path(dest_path), 1);
+    int old_fd = (dir_fd < 0) ? -1 : openat(dir_fd, name, O_RDONLY);
+    trace_span(STAGE_LOOKUP, span_start);
+    struct dir_usage before = file_usage(dir_fd, name);
+    int result = receive_delta(client_conn, dir_fd, name, old_fd, new_size);
+    if (old_fd >= 0) close(old_fd);
+    account_usage(dir_fd, relative_path(dest_path), name, before);
+    return result;
+}
+
+// Passes a deltaf exchange between the client and a storage node, once the client has sent
+// new_size. Only the lengths are interpreted; a block count of -1 from the node, or from us when
+// the node cannot be used, is followed by a status line instead of signatures.
+int relay_delta(int client_conn, int target_port, char *name, char *dest_path, off_t new_size)
+{
+    off_t error_count = -1;
+    char reason[64];
+    if (node_can_accept(target_port, new_size, reason, sizeof(reason)) < 0) {
+        write(client_conn, &error_count, sizeof(off_t));
+        write(client_conn, reason, strlen(reason));
+        return -1;
+    }
+    
+    unsigned long forward_start = now_us();
+    char command[MAX_PATH_LEN];
+    snprintf(command, MAX_PATH_LEN, "deltaf %s %s", name, dest_path);
+    int sockfd = send_node_command(target_port, command);
+    
+    char ready[6] = {0};
+    off_t block_count = -1;
+    int header_ok = (sockfd >= 0 && read_all(sockfd, ready, 5) == 0 && strcmp(ready, "READY") == 0 &&
+                     write_all(sockfd, &new_size, sizeof(off_t)) == 0 &&
+                     read_all(sockfd, &block_count, sizeof(off_t)) == 0);
+    if (!header_ok) {
+        if (sockfd >= 0) {
+            close(sockfd);
+            breaker_report(target_port, 0);
+        }
+        record_forward(target_port, forward_start, 1);
+        write(client_conn, &error_count, sizeof(off_t));
+        write(client_conn, "ERROR: Failed to forward file", 29);
+        return -1;
+    }
+    
+    write_all(client_conn, &block_count, sizeof(off_t));
+    unsigned int block_size, crc;
+    off_t delta_len = -1;
+    off_t signatures_len = block_count * sizeof(struct block_signature);
+    if (block_count >= 0 && read_all(sockfd, &block_size, sizeof(block_size)) == 0 &&
+        write_all(client_conn, &block_size, sizeof(block_size)) == 0 &&
+        transfer_data(client_conn, sockfd, signatures_len) == signatures_len &&
+        read_all(client_conn, &delta_len, sizeof(off_t)) == 0 && write_all(sockfd, &delta_len, sizeof(off_t)) == 0) {
+        unsigned long span_start = trace_start();
+        off_t relayed = transfer_data(sockfd, client_conn, delta_len);
+        trace_span(STAGE_TRANSFER, span_start);
+        add_bytes(&metrics->bytes_in, relayed);
+        if (relayed == delta_len && read_all(client_conn, &crc, sizeof(crc)) == 0) {
+            write_all(sockfd, &crc, sizeof(crc));
+        }
+    }
+    
+    char response[BUFFER_SIZE];
+    if (read_node_response(sockfd, target_port, response, forward_start) < 0) {
+        strcpy(response, "ERROR: Failed to forward file");
+    }
+    write(client_conn, response, strlen(response));
+    return (strncmp(response, "SUCCESS", 7) == 0) ? 0 : -1;
+}
+
+// Connects to a storage node and sends a traced command; returns the socket or -1
+int send_node_command(int port, char *command)
+{
+    unsigned long span_start = trace_start();
+    int sockfd = connect_to_node(port, NODE_IO_TIMEOUT_MS);
+    if (sockfd < 0) return -1;
+    trace_span(STAGE_CONNECT, span_start);
+    
+    char traced_command[MAX_PATH_LEN];
+    snprintf(traced_command, MAX_PATH_LEN, "%s", command);
+    append_trace(traced_command, MAX_PATH_LEN);
+    if (write_all(sockfd, traced_command, strlen(traced_command)) < 0) {
+        close(sockfd);
+        breaker_report(port, 0);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Reads a node's text reply (an empty reply is valid, e.g. an empty listing) and closes the
+// socket. Returns -1 if the read timed out or failed.
+int read_node_response(int sockfd, int port, char *response, unsigned long forward_start)
+{
+    unsigned long span_start = trace_start();
+    bzero(response, BUFFER_SIZE);
+    int n = read(sockfd, response, BUFFER_SIZE - 1);
+    trace_span(STAGE_FIRST_BYTE, span_start);
+    
+    span_start = trace_start();
+    close(sockfd);
+    trace_span(STAGE_CLOSE, span_start);
+    breaker_report(port, n >= 0);
+    record_forward(port, forward_start, n < 0);
+    return (n >= 0) ? 0 : -1;
+}
+
+int send_command_to_server(int port, char *command, char *response) 
+{
+    unsigned long forward_start = now_us();
+    int sockfd = send_node_command(port, command);
+    if (sockfd < 0) {
+        record_forward(port, forward_start, 1);
+        return -1;
+    }
+    return read_node_response(sockfd, port, response, forward_start);
+}
+
+int create_directory_structure(char *path) 
+{
+    char *temp_path = strdup(path);
+    char *token = strtok(temp_path, "/");
+    char current_path[MAX_PATH_LEN] = "";
+    
+    if (path[0] == '/') {
+        strcpy(current_path, "/");
+    }
+    
+    while (token != NULL) {
+        if (strlen(current_path) > 1) {
+            strcat(current_path, "/");
+        }
+        strcat(current_path, token);
+        
+        if (mkdir(current_path, 0755) && errno != EEXIST) {
+            free(temp_path);
+            return -1;
+        }
+        
+        token = strtok(NULL, "/");
+    }
+    
+    free(temp_path);
+    return 0;
+}
+
+// Opens the storage root once at startup; every path below it is resolved with *at() calls
+void open_root_dir(void)
+{
+    char root_path[MAX_PATH_LEN];
+    snprintf(root_path, MAX_PATH_LEN, "%s/S1", getenv("HOME"));
+    create_directory_structure(root_path);
+    
+    root_fd = open(root_path, O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0) {
+        handle_error("Opening storage root failed");
+    }
+}
+
+// Strips the ~S1 prefix and leading slashes, leaving a path relative to the storage root
+const char *relative_path(const char *path)
+{
+    if (strncmp(path, "~S1", 3) == 0) path += 3;
+    while (*path == '/') path++;
+    return path;
+}
+
+// Returns an fd for dir (relative to the root, "" for the root itself) from a small LRU of
+// open directories, creating missing components if asked. ".." components are rejected so a
+// lookup cannot leave the root. The fd belongs to the cache; callers must not close it.
+int resolve_dir(const char *dir, int create)
+{
+    if (dir[0] == '\0') return root_fd;
+    if (strlen(dir) >= MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (const char *p = dir; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == dir || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            errno = EACCES;
+            return -1;
+        }
+    }
+    
+    int victim = 0;
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].path[0] != '\0' && strcmp(dir_cache[i].path, dir) == 0) {
+            dir_cache[i].last_used = ++dir_cache_clock;
+            return dir_cache[i].fd;
+        }
+        if (dir_cache[i].last_used < dir_cache[victim].last_used) victim = i;
+    }
+    
+    // A single openat covers the usual case of an existing directory; only when it is
+    // missing are the components created one by one with mkdirat
+    int fd = openat(root_fd, dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 && errno == ENOENT && create) {
+        char components[MAX_PATH_LEN];
+        strcpy(components, dir);
+        
+        int parent = root_fd;
+        char *saveptr;
+        for (char *name = strtok_r(components, "/", &saveptr); name != NULL; name = strtok_r(NULL, "/", &saveptr)) {
+            if (mkdirat(parent, name, 0755) < 0 && errno != EEXIST) {
+                fd = -1;
+            } else {
+                fd = openat(parent, name, O_RDONLY | O_DIRECTORY);
+            }
+            if (parent != root_fd) close(parent);
+            if (fd < 0) break;
+            parent = fd;
+        }
+    }
+    if (fd < 0) return -1;
+    
+    if (dir_cache[victim].path[0] != '\0') close(dir_cache[victim].fd);
+    strcpy(dir_cache[victim].path, dir);
+    dir_cache[victim].fd = fd;
+    dir_cache[victim].last_used = ++dir_cache_clock;
+    return fd;
+}
+
+// Splits a client path into the (cached) fd of its directory and its final component
+int resolve_parent(const char *path, int create, const char **leaf)
+{
+    const char *rel = relative_path(path);
+    const char *slash = strrchr(rel, '/');
+    int dir_fd;
+    
+    if (slash == NULL) {
+        *leaf = rel;
+        dir_fd = root_fd;
+    } else {
+        char dir[MAX_PATH_LEN];
+        if (slash - rel >= MAX_PATH_LEN) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(dir, rel, slash - rel);
+        dir[slash - rel] = '\0';
+        *leaf = slash + 1;
+        dir_fd = resolve_dir(dir, create);
+    }
+    
+    if (**leaf == '\0' || strcmp(*leaf, ".") == 0 || strcmp(*leaf, "..") == 0) {
+        errno = EACCES;
+        return -1;
+    }
+    return dir_fd;
+}
+
+unsigned long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+int latency_bucket(unsigned long us)
+{
+    if (us < 4) return (int) us;
+
+    int msb = 63 - __builtin_clzl(us);
+    int idx = (msb - 1) * 4 + (int) ((us >> (msb - 2)) & 3);
+    return (idx < HIST_BUCKETS) ? idx : HIST_BUCKETS - 1;
+}
+
+// Exclusive upper bound in microseconds of a histogram bucket
+unsigned long bucket_upper_bound(int idx)
+{
+    if (idx < 4) return idx + 1;
+    return (5UL + idx % 4) << (idx / 4 - 1);
+}
+
+void record_latency(struct latency_histogram *hist, unsigned long start_us, int failed)
+{
+    unsigned long elapsed = now_us() - start_us;
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum_us, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->buckets[latency_bucket(elapsed)], 1, __ATOMIC_RELAXED);
+    if (failed) {
+        __atomic_fetch_add(&hist->errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void record_forward(int port, unsigned long start_us, int failed)
+{
+    int node = node_index(port);
+    if (node >= 0) {
+        record_latency(&metrics->forwards[node], start_us, failed);
+    }
+    if (failed) {
+        log_message(LOG_WARN, "event=forward_failed node=%s port=%d", (node >= 0) ? node_names[node] : "?", port);
+    }
+}
+
+void add_bytes(unsigned long *counter, long n)
+{
+    if (n > 0) {
+        __atomic_fetch_add(counter, (unsigned long) n, __ATOMIC_RELAXED);
+        // Each request has its own child, so these are that request's totals for record_request
+        if (counter == &metrics->bytes_in) request_bytes_in += n;
+        if (counter == &metrics->bytes_out) request_bytes_out += n;
+    }
+}
+
+unsigned long histogram_percentile(struct latency_histogram *hist, double pct)
+{
+    unsigned long total = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    if (total == 0) return 0;
+
+    unsigned long target = (unsigned long) (total * pct / 100.0);
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if (seen > target) return bucket_upper_bound(i);
+    }
+    return bucket_upper_bound(HIST_BUCKETS - 1);
+}
+
+int format_histogram_line(char *out, size_t len, const char *name, struct latency_histogram *hist)
+{
+    unsigned long count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    unsigned long sum = __atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED);
+    return snprintf(out, len, "%-12s %10lu %8lu %10lu %10lu %10lu %10lu %10lu\n", name, count,
+                    __atomic_load_n(&hist->errors, __ATOMIC_RELAXED),
+                    count ? sum / count : 0,
+                    histogram_percentile(hist, 50), histogram_percentile(hist, 95),
+                    histogram_percentile(hist, 99), histogram_percentile(hist, 99.9));
+}
+
+int format_stats(char *out, size_t len)
+{
+    size_t used = 0;
+    used += snprintf(out + used, len - used, "%-12s %10s %8s %10s %10s %10s %10s %10s\n",
+                     "command", "requests", "errors", "mean_us", "p50_us", "p95_us", "p99_us", "p999_us");
+    for (int i = 0; i < CMD_COUNT && used < len; i++) {
+        used += format_histogram_line(out + used, len - used, command_names[i], &metrics->commands[i]);
+    }
+    for (int i = 0; i < 3 && used < len; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "forward_%s", node_names[i]);
+        used += format_histogram_line(out + used, len - used, name, &metrics->forwards[i]);
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used, "bytes_in %lu\nbytes_out %lu\nin_flight %ld\n",
+                         __atomic_load_n(&metrics->bytes_in, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->bytes_out, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->in_flight, __ATOMIC_RELAXED));
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used, "compressed_payload_bytes %lu\ncompressed_wire_bytes %lu\n",
+                         __atomic_load_n(&metrics->wire_raw_bytes, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->wire_sent_bytes, __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < CLASS_COUNT && used < len; i++) {
+        used += snprintf(out + used, len - used, "admit_%s in_flight=%ld/%d waiting=%ld/%d rejected=%lu\n",
+                         class_names[i], __atomic_load_n(&admission->in_flight[i], __ATOMIC_RELAXED),
+                         class_limits[i], __atomic_load_n(&admission->waiting[i], __ATOMIC_RELAXED),
+                         class_queue_limits[i], __atomic_load_n(&metrics->rejected[i], __ATOMIC_RELAXED));
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used, "shed_connections %lu\nnot_modified %lu\npassed_fds %lu\n",
+                         __atomic_load_n(&metrics->shed_connections, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->not_modified, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->passed_fds, __ATOMIC_RELAXED));
+    }
+    if (tls_ctx != NULL && used < len) {
+        used += snprintf(out + used, len - used, "tls ktls=%lu relayed=%lu\n",
+                         __atomic_load_n(&metrics->tls_offloaded, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->tls_relayed, __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < 3 && used < len; i++) {
+        used += snprintf(out + used, len - used, "breaker_%s %s failures=%d\n", node_names[i],
+                         breaker_names[__atomic_load_n(&breakers[i].state, __ATOMIC_RELAXED)],
+                         __atomic_load_n(&breakers[i].failures, __ATOMIC_RELAXED));
+    }
+    return (used < len) ? (int) used : (int) len - 1;
+}
+
+// Emits cumulative buckets at power-of-two boundaries to keep the exposition compact
+int format_prometheus_histogram(char *out, size_t len, const char *metric, const char *label,
+                                const char *value, struct latency_histogram *hist)
+{
+    size_t used = 0;
+    unsigned long cumulative = 0;
+    for (int i = 0; i < HIST_BUCKETS && used < len; i++) {
+        cumulative += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if (i % 4 == 3) {
+            used += snprintf(out + used, len - used, "%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n",
+                             metric, label, value, bucket_upper_bound(i) / 1e6, cumulative);
+        }
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used,
+                         "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n"
+                         "%s_sum{%s=\"%s\"} %g\n%s_count{%s=\"%s\"} %lu\n",
+                         metric, label, value, cumulative,
+                         metric, label, value, __atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED) / 1e6,
+                         metric, label, value, __atomic_load_n(&hist->count, __ATOMIC_RELAXED));
+    }
+    return (used < len) ? (int) used : (int) len;
+}
+
+int format_prometheus(char *out, size_t len)
+{
+    size_t used = 0;
+    used += snprintf(out + used, len - used,
+                     "# TYPE dfs_request_duration_seconds histogram\n");
+    for (int i = 0; i < CMD_COUNT && used < len; i++) {
+        used += format_prometheus_histogram(out + used, len - used, "dfs_request_duration_seconds",
+                                            "command", command_names[i], &metrics->commands[i]);
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used, "# TYPE dfs_request_errors_total counter\n");
+    }
+    for (int i = 0; i < CMD_COUNT && used < len; i++) {
+        used += snprintf(out + used, len - used, "dfs_request_errors_total{command=\"%s\"} %lu\n",
+                         command_names[i], __atomic_load_n(&metrics->commands[i].errors, __ATOMIC_RELAXED));
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used,
+                         "# TYPE dfs_forward_duration_seconds histogram\n");
+    }
+    for (int i = 0; i < 3 && used < len; i++) {
+        used += format_prometheus_histogram(out + used, len - used, "dfs_forward_duration_seconds",
+                                            "node", node_names[i], &metrics->forwards[i]);
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used,
+                         "# TYPE dfs_bytes_in_total counter\ndfs_bytes_in_total %lu\n"
+                         "# TYPE dfs_bytes_out_total counter\ndfs_bytes_out_total %lu\n"
+                         "# TYPE dfs_in_flight_requests gauge\ndfs_in_flight_requests %ld\n",
+                         __atomic_load_n(&metrics->bytes_in, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->bytes_out, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->in_flight, __ATOMIC_RELAXED));
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used, "# TYPE dfs_admission_rejected_total counter\n");
+    }
+    for (int i = 0; i < CLASS_COUNT && used < len; i++) {
+        used += snprintf(out + used, len - used, "dfs_admission_rejected_total{class=\"%s\"} %lu\n",
+                         class_names[i], __atomic_load_n(&metrics->rejected[i], __ATOMIC_RELAXED));
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used,
+                         "# TYPE dfs_shed_connections_total counter\ndfs_shed_connections_total %lu\n"
+                         "# TYPE dfs_tls_connections_total counter\n"
+                         "dfs_tls_connections_total{mode=\"ktls\"} %lu\ndfs_tls_connections_total{mode=\"relay\"} %lu\n"
+                         "# TYPE dfs_node_breaker_state gauge\n",
+                         __atomic_load_n(&metrics->shed_connections, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->tls_offloaded, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->tls_relayed, __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < 3 && used < len; i++) {
+        used += snprintf(out + used, len - used, "dfs_node_breaker_state{node=\"%s\"} %d\n",
+                         node_names[i], __atomic_load_n(&breakers[i].state, __ATOMIC_RELAXED));
+    }
+    return (used < len) ? (int) used : (int) len - 1;
+}
+
+// Size and count of one .c file, zero if there is none. Other types only pass through ~S1 on
+// their way to a node, and upload temporaries are not files yet, so neither counts.
+struct dir_usage file_usage(int dir_fd, const char *name)
+{
+    struct dir_usage usage = { 0, 0 };
+    struct stat st;
+    const char *ext = strrchr(name, '.');
+    if (dir_fd >= 0 && !is_temp_name(name) && ext != NULL && strcmp(ext, ".c") == 0 &&
+        fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+        usage.bytes = st.st_size;
+        usage.files = 1;
+    }
+    return usage;
+}
+
+// Adds delta to the aggregate of every directory above path (relative to the root), innermost
+// first. Directories without an aggregate are skipped; read_usage builds theirs by a scan.
+void update_usage(const char *path, struct dir_usage delta)
+{
+    if (delta.bytes == 0 && delta.files == 0) return;
+    
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    do {
+        char *slash = strrchr(dir, '/');
+        if (slash != NULL) *slash = '\0';
+        else dir[0] = '\0';
+        
+        // flock needs an open file of its own; root_fd is shared by every handler
+        int dir_fd = resolve_dir(dir, 0);
+        int lock_fd = (dir_fd < 0) ? -1 : openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+        if (lock_fd < 0) continue;
+        
+        struct dir_usage usage;
+        flock(lock_fd, LOCK_EX);
+        if (fgetxattr(lock_fd, USAGE_XATTR, &usage, sizeof(usage)) == sizeof(usage)) {
+            usage.bytes += delta.bytes;
+            usage.files += delta.files;
+            fsetxattr(lock_fd, USAGE_XATTR, &usage, sizeof(usage), 0);
+        }
+        flock(lock_fd, LOCK_UN);
+        close(lock_fd);
+    } while (dir[0] != '\0');
+}
+
+// Rolls up the change a write made to name in dir, given the file's usage beforehand
+void account_usage(int dir_fd, const char *dir, const char *name, struct dir_usage before)
+{
+    struct dir_usage after = file_usage(dir_fd, name);
+    struct dir_usage delta = { after.bytes - before.bytes, after.files - before.files };
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    update_usage(path, delta);
+}
+
+// unlinkat for stored files that also takes the file out of the aggregates above it
+int unlink_counted(int dir_fd, const char *name, const char *path)
+{
+    struct dir_usage before = file_usage(dir_fd, name);
+    if (unlinkat(dir_fd, name, 0) < 0) return -1;
+    
+    struct dir_usage delta = { -before.bytes, -before.files };
+    update_usage(relative_path(path), delta);
+    return 0;
+}
+
+// Usage below dir_fd from its aggregate. Without one, or with rescan, the subtree is walked,
+// and every directory on the way gets a fresh aggregate, so later queries are a single read.
+int read_usage(int dir_fd, int rescan, struct dir_usage *usage)
+{
+    if (!rescan && fgetxattr(dir_fd, USAGE_XATTR, usage, sizeof(*usage)) == sizeof(*usage)) {
+        return 0;
+    }
+    
+    int list_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = (list_fd < 0) ? NULL : fdopendir(list_fd);
+    if (dir == NULL) {
+        if (list_fd >= 0) close(list_fd);
+        return -1;
+    }
+    
+    usage->bytes = 0;
+    usage->files = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || is_temp_name(ent->d_name)) {
+            continue;
+        }
+        
+        unsigned char type = ent->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        struct dir_usage sub = { 0, 0 };
+        if (type == DT_DIR) {
+            int sub_fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub_fd >= 0) {
+                read_usage(sub_fd, rescan, &sub);
+                close(sub_fd);
+            }
+        } else if (type == DT_REG) {
+            sub = file_usage(dirfd(dir), ent->d_name);
+        }
+        usage->bytes += sub.bytes;
+        usage->files += sub.files;
+    }
+    closedir(dir);
+    
+    fsetxattr(dir_fd, USAGE_XATTR, usage, sizeof(*usage), 0);
+    return 0;
+}
+
+// Copies src to dst (~S1 paths on this server) without the data leaving the kernel: a reflink
+// where the filesystem has them, else copy_file_range, else sendfile. The copy keeps the stored
+// form and CRC32C of the source and is renamed into place once complete.
+int copy_entry(const char *src, const char *dst)
+{
+    const char *src_name, *dst_name;
+    int src_dir_fd = resolve_parent(src, 0, &src_name);
+    int in_fd = (src_dir_fd < 0) ? -1 : openat(src_dir_fd, src_name, O_RDONLY | O_NOFOLLOW);
+    struct stat st;
+    if (in_fd < 0 || fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (in_fd >= 0) close(in_fd);
+        errno = ENOENT;
+        return -1;
+    }
+    
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), ".copy.%d", getpid());
+    int dst_dir_fd = resolve_parent(dst, 1, &dst_name);
+    int out_fd = (dst_dir_fd < 0) ? -1 : openat(dst_dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        close(in_fd);
+        return -1;
+    }
+    
+    off_t copied = 0;
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        copied = st.st_size;
+    } else {
+        // copy_file_range advances both offsets, so the fallback carries on from where it stopped
+        ssize_t n;
+        while (copied < st.st_size &&
+               (n = syscall(SYS_copy_file_range, in_fd, NULL, out_fd, NULL, st.st_size - copied, 0)) > 0) {
+            copied += n;
+        }
+        off_t rest = (copied < st.st_size) ? transfer_data(out_fd, in_fd, st.st_size - copied) : 0;
+        if (rest > 0) copied += rest;
+    }
+    unsigned int crc;
+    if (copied == st.st_size && stored_crc32c(in_fd, &crc) == 0) {
+        store_crc32c(out_fd, crc);
+    }
+    close(in_fd);
+    close(out_fd);
+    
+    struct dir_usage before = file_usage(dst_dir_fd, dst_name);
+    if (copied != st.st_size || renameat(dst_dir_fd, tmp_name, dst_dir_fd, dst_name) < 0) {
+        int saved_errno = (copied != st.st_size) ? EIO : errno;
+        unlinkat(dst_dir_fd, tmp_name, 0);
+        errno = saved_errno;
+        return -1;
+    }
+    struct dir_usage after = file_usage(dst_dir_fd, dst_name);
+    struct dir_usage delta = { after.bytes - before.bytes, after.files - before.files };
+    update_usage(relative_path(dst), delta);
+    return 0;
+}
+
+// Renames src to dst on this server with one renameat; src may be a file or a whole directory,
+// whose totals move with it and are taken off its old ancestors and added to its new ones
+int move_entry(const char *src, const char *dst)
+{
+    const char *src_name, *dst_name;
+    int src_dir_fd = resolve_parent(src, 0, &src_name);
+    struct stat st;
+    if (src_dir_fd < 0 || fstatat(src_dir_fd, src_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    
+    struct dir_usage moved = { 0, 0 }, replaced = { 0, 0 };
+    int is_dir = S_ISDIR(st.st_mode);
+    if (is_dir) {
+        int dir_fd = resolve_dir(relative_path(src), 0);
+        if (dir_fd < 0 || read_usage(dir_fd, 0, &moved) < 0) return -1;
+    } else {
+        moved = file_usage(src_dir_fd, src_name);
+    }
+    
+    int dst_dir_fd = resolve_parent(dst, 1, &dst_name);
+    if (dst_dir_fd < 0) return -1;
+    if (!is_dir) replaced = file_usage(dst_dir_fd, dst_name);
+    if (renameat(src_dir_fd, src_name, dst_dir_fd, dst_name) < 0) return -1;
+    if (is_dir) forget_dirs(relative_path(src));
+    
+    struct dir_usage removed = { -moved.bytes, -moved.files };
+    struct dir_usage added = { moved.bytes - replaced.bytes, moved.files - replaced.files };
+    update_usage(relative_path(src), removed);
+    update_usage(relative_path(dst), added);
+    return 0;
+}
+
+// Drops the cached fds of dir and everything below it once the directory has been renamed
+void forget_dirs(const char *dir)
+{
+    size_t len = strlen(dir);
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].path[0] != '\0' && strncmp(dir_cache[i].path, dir, len) == 0 &&
+            (dir_cache[i].path[len] == '\0' || dir_cache[i].path[len] == '/')) {
+            close(dir_cache[i].fd);
+            dir_cache[i].path[0] = '\0';
+            dir_cache[i].last_used = 0;
+        }
+    }
+}
+
+// Walks the tree below root_fd with a pool of threads and returns the regular files whose
+// name match accepts (all of them when match is NULL); with WALK_DIRS directories are listed
+// too. max_depth 1 reads root_fd only, 0 means no limit. Upload temporaries (is_temp_name) are
+// skipped. With entries NULL the matches are only counted. Otherwise *entries gets an array
+// the caller releases with walk_free, sorted by path under WALK_ORDERED and in discovery order
+// otherwise. match gets the file's lstat under WALK_STAT (NULL otherwise); a match function
+// returning a negative value ends the walk early. root_fd stays open.
+ssize_t walk_tree(int root_fd, int flags, int max_depth, walk_match_fn match, void *arg,
+                  struct walk_entry **entries)
+{
+    struct walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.root_fd = root_fd;
+    walk.flags = flags | ((entries == NULL) ? WALK_COUNT_ONLY : 0);
+    walk.max_depth = max_depth;
+    walk.match = match;
+    walk.arg = arg;
+    // A single directory gains nothing from more threads
+    walk.threads = (max_depth == 1) ? 1 : walk_threads;
+    walk.workers = calloc(walk.threads, sizeof(struct walk_worker));
+    if (walk.workers == NULL) return -1;
+    
+    for (int i = 0; i < walk.threads; i++) {
+        walk.workers[i].walk = &walk;
+        walk.workers[i].id = i;
+        pthread_mutex_init(&walk.workers[i].deque.lock, NULL);
+    }
+    
+    struct walk_item root = { strdup(""), -1, 0 };
+    walk.pending = 1;
+    if (root.path == NULL || walk_push(&walk.workers[0].deque, root) < 0) {
+        free(root.path);
+        walk.pending = 0;
+    }
+    
+    // The calling thread is worker 0; if threads cannot be started the others just do more
+    pthread_t tids[WALK_MAX_THREADS];
+    int started = 1;
+    while (started < walk.threads &&
+           pthread_create(&tids[started], NULL, walk_worker_main, &walk.workers[started]) == 0) {
+        started++;
+    }
+    walk_worker_main(&walk.workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    
+    ssize_t total = 0;
+    for (int i = 0; i < walk.threads; i++) {
+        total += walk.workers[i].count;
+    }
+    struct walk_entry *all = NULL;
+    if (entries != NULL) {
+        all = malloc((total > 0 ? total : 1) * sizeof(struct walk_entry));
+        size_t filled = 0;
+        for (int i = 0; i < walk.threads; i++) {
+            if (all != NULL) {
+                memcpy(all + filled, walk.workers[i].entries, walk.workers[i].count * sizeof(struct walk_entry));
+            } else {
+                walk_free(walk.workers[i].entries, walk.workers[i].count);
+            }
+            filled += walk.workers[i].count;
+        }
+        if (all != NULL && (flags & WALK_ORDERED)) {
+            qsort(all, total, sizeof(struct walk_entry), compare_walk_entries);
+        }
+        *entries = all;
+    }
+    for (int i = 0; i < walk.threads; i++) {
+        free(walk.workers[i].entries);
+        free(walk.workers[i].deque.items);
+        pthread_mutex_destroy(&walk.workers[i].deque.lock);
+    }
+    free(walk.workers);
+    return (entries != NULL && all == NULL) ? -1 : total;
+}
+
+void walk_free(struct walk_entry *entries, ssize_t count)
+{
+    for (ssize_t i = 0; i < count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+int compare_walk_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct walk_entry *) a)->path, ((const struct walk_entry *) b)->path);
+}
+
+// Takes directories from its own deque first, then steals from the others. pending counts the
+// directories queued or being read, so the walk is over once it drops to zero.
+void *walk_worker_main(void *arg)
+{
+    struct walk_worker *worker = arg;
+    struct walk *walk = worker->walk;
+    char *buffer = malloc(WALK_BUFFER_SIZE);
+    if (buffer == NULL) return NULL;
+    
+    int idle = 0;
+    while (1) {
+        struct walk_item item;
+        int found = (walk_pop(&worker->deque, &item) == 0);
+        for (int i = 1; !found && i < walk->threads; i++) {
+            found = (walk_steal(&walk->workers[(worker->id + i) % walk->threads].deque, &item) == 0);
+        }
+        
+        if (found) {
+            walk_read_dir(worker, &item, buffer);
+            __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+            idle = 0;
+        } else if (__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else if (++idle < WALK_SPIN_LIMIT) {
+            sched_yield();
+        } else {
+            usleep(WALK_IDLE_SLEEP_US);
+        }
+    }
+    
+    free(buffer);
+    return NULL;
+}
+
+// Names the servers give files while writing them (.copy.<pid>, .plain.<pid>, .pull.<pid>,
+// .<name>.<pid>.delta); they are never listed, archived or counted
+int is_temp_name(const char *name)
+{
+    const char *prefixes[] = { ".copy.", ".plain.", ".pull." };
+    for (int i = 0; i < 3; i++) {
+        size_t len = strlen(prefixes[i]);
+        if (strncmp(name, prefixes[i], len) == 0 && name[len] != '\0' &&
+            strspn(name + len, "0123456789") == strlen(name + len)) {
+            return 1;
+        }
+    }
+    size_t len = strlen(name);
+    if (name[0] != '.' || len < 9 || strcmp(name + len - 6, ".delta") != 0) return 0;
+    size_t digits = len - 6;
+    while (digits > 0 && name[digits - 1] >= '0' && name[digits - 1] <= '9') digits--;
+    return digits < len - 6 && digits > 1 && name[digits - 1] == '.';
+}
+
+// Reads one directory with getdents64, queueing its subdirectories on this worker's deque.
+// Subdirectories are opened relative to their parent while fewer than WALK_MAX_OPEN_DIRS are
+// held; past that they are reopened by path from the root when their turn comes.
+void walk_read_dir(struct walk_worker *worker, struct walk_item *item, char *buffer)
+{
+    struct walk *walk = worker->walk;
+    int fd = item->fd;
+    if (fd >= 0) {
+        __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+    } else if (!__atomic_load_n(&walk->stop, __ATOMIC_RELAXED)) {
+        fd = openat(walk->root_fd, item->path[0] ? item->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    if (fd < 0) {
+        free(item->path);
+        return;
+    }
+    
+    long n;
+    // Once the walk is stopped the directories still queued are only closed
+    while (!__atomic_load_n(&walk->stop, __ATOMIC_RELAXED) &&
+           (n = syscall(SYS_getdents64, fd, buffer, WALK_BUFFER_SIZE)) > 0) {
+        for (long offset = 0; offset < n; ) {
+            struct linux_dirent64 *ent = (struct linux_dirent64 *) (buffer + offset);
+            offset += ent->d_reclen;
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || is_temp_name(ent->d_name)) {
+                continue;
+            }
+            
+            unsigned char type = ent->d_type;
+            struct stat st;
+            int have_stat = 0;
+            if (type == DT_UNKNOWN || (type == DT_REG && (walk->flags & WALK_STAT))) {
+                if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                have_stat = 1;
+            }
+            if (type != DT_DIR && type != DT_REG) continue;
+            if (type == DT_REG && walk->match == NULL && (walk->flags & WALK_COUNT_ONLY)) {
+                // Plain counting never needs the file's path
+                worker->count++;
+                continue;
+            }
+            
+            char path[MAX_PATH_LEN];
+            if (snprintf(path, sizeof(path), "%s%s%s", item->path, item->path[0] ? "/" : "",
+                         ent->d_name) >= (int) sizeof(path)) {
+                continue;
+            }
+            
+            if (type == DT_DIR && (walk->max_depth == 0 || item->depth + 1 < walk->max_depth)) {
+                struct walk_item child = { strdup(path), -1, item->depth + 1 };
+                if (__atomic_add_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED) <= WALK_MAX_OPEN_DIRS) {
+                    child.fd = openat(fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                }
+                if (child.fd < 0) __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+                
+                __atomic_add_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+                if (child.path == NULL || walk_push(&worker->deque, child) < 0) {
+                    // Out of memory: the subtree is left out rather than the walk failing
+                    __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+                    if (child.fd >= 0) {
+                        close(child.fd);
+                        __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+                    }
+                    free(child.path);
+                }
+            }
+            
+            if (type == DT_DIR && !(walk->flags & WALK_DIRS)) continue;
+            int keep = (walk->match == NULL) ? 1 : walk->match(path, ent->d_name, have_stat ? &st : NULL, walk->arg);
+            if (keep < 0) {
+                __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (!keep) continue;
+            if (walk->flags & WALK_COUNT_ONLY) {
+                worker->count++;
+                continue;
+            }
+            if (worker->count == worker->capacity) {
+                size_t capacity = worker->capacity ? worker->capacity * 2 : 256;
+                struct walk_entry *grown = realloc(worker->entries, capacity * sizeof(struct walk_entry));
+                if (grown == NULL) continue;
+                worker->entries = grown;
+                worker->capacity = capacity;
+            }
+            struct walk_entry *entry = &worker->entries[worker->count];
+            entry->path = strdup(path);
+            entry->type = type;
+            entry->size = 0;
+            entry->mtime = 0;
+            if ((walk->flags & WALK_STAT) && type == DT_REG && have_stat) {
+                entry->size = st.st_size;
+                entry->mtime = st.st_mtime;
+            }
+            if (entry->path != NULL) worker->count++;
+        }
+    }
+    
+    close(fd);
+    free(item->path);
+}
+
+int walk_push(struct walk_deque *deque, struct walk_item item)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(item));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            struct walk_item *grown = realloc(deque->items, capacity * sizeof(item));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->items = grown;
+            deque->capacity = capacity;
+        }
+    }
+    deque->items[deque->tail++] = item;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// The owner works depth first from the bottom of its deque...
+int walk_pop(struct walk_deque *deque, struct walk_item *item)
+{
+    int result = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[--deque->tail];
+        result = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return result;
+}
+
+// ... while thieves take from the top, where the directories nearest the root and so the
+// largest remaining subtrees are
+int walk_steal(struct walk_deque *deque, struct walk_item *item)
+{
+    if (__atomic_load_n(&deque->tail, __ATOMIC_RELAXED) == __atomic_load_n(&deque->head, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    int result = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[deque->head++];
+        result = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return result;
+}
+
+// walk_match_fn for files with the extension given as arg
+int match_extension(const char *path, const char *name, const struct stat *st, void *arg)
+{
+    (void) path;
+    (void) st;
+    const char *ext = strrchr(name, '.');
+    return ext != NULL && strcmp(ext, (const char *) arg) == 0;
+}
+
+// Parses "<~S1 path> <glob|/regex/> [size>N] [size<N] [mtime<AGE] [mtime>AGE] [limit=N]". N takes
+// a K/M/G suffix and AGE an s/m/h/d one; mtime<2h means modified in the last two hours. The
+// pattern is matched against file names only. args is modified; on success the caller releases
+// the query with free_find_query.
+int parse_find_query(char *args, struct find_query *query, char *error, size_t len)
+{
+    memset(query, 0, sizeof(*query));
+    query->min_size = -1;
+    query->max_size = -1;
+    query->limit = FIND_DEFAULT_LIMIT;
+    
+    char *saveptr = NULL;
+    char *path = (args == NULL) ? NULL : strtok_r(args, " ", &saveptr);
+    char *pattern = (path == NULL) ? NULL : strtok_r(NULL, " ", &saveptr);
+    if (pattern == NULL || strncmp(path, "~S1", 3) != 0) {
+        snprintf(error, len, "Invalid findf format");
+        return -1;
+    }
+    snprintf(query->path, sizeof(query->path), "%s", path);
+    
+    size_t pattern_len = strlen(pattern);
+    if (pattern_len > 2 && pattern[0] == '/' && pattern[pattern_len - 1] == '/') {
+        pattern[pattern_len - 1] = '\0';
+        if (regcomp(&query->regex, pattern + 1, REG_EXTENDED | REG_NOSUB) != 0) {
+            snprintf(error, len, "Invalid regular expression %s/", pattern);
+            return -1;
+        }
+        query->use_regex = 1;
+    } else {
+        snprintf(query->pattern, sizeof(query->pattern), "%s", pattern);
+    }
+    
+    time_t now = time(NULL);
+    char *token;
+    while ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+        long value = -1;
+        if (strncmp(token, "size>", 5) == 0 && (value = parse_size(token + 5)) >= 0) {
+            query->min_size = value;
+        } else if (strncmp(token, "size<", 5) == 0 && (value = parse_size(token + 5)) >= 0) {
+            query->max_size = value;
+        } else if (strncmp(token, "mtime<", 6) == 0 && (value = parse_age(token + 6)) >= 0) {
+            query->newer_than = now - value;
+        } else if (strncmp(token, "mtime>", 6) == 0 && (value = parse_age(token + 6)) >= 0) {
+            query->older_than = now - value;
+        } else if (strncmp(token, "limit=", 6) == 0 && (value = atol(token + 6)) > 0 && value <= FIND_MAX_LIMIT) {
+            query->limit = value;
+        } else {
+            snprintf(error, len, "Invalid findf predicate %s", token);
+            free_find_query(query);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void free_find_query(struct find_query *query)
+{
+    if (query->use_regex) {
+        regfree(&query->regex);
+        query->use_regex = 0;
+    }
+}
+
+// Seconds in "<n>[s|m|h|d]", or -1
+long parse_age(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value < 0) return -1;
+    if (*end == 'm') value *= 60;
+    else if (*end == 'h') value *= 3600;
+    else if (*end == 'd') value *= 86400;
+    else if (*end != 's' && *end != '\0') return -1;
+    return value;
+}
+
+// walk_match_fn for findf: writes each file that satisfies the query to out_fd as soon as it is
+// found, and ends the walk at the limit, on cancellation or once out_fd is closed
+int find_match(const char *path, const char *name, const struct stat *st, void *arg)
+{
+    struct find_search *search = arg;
+    struct find_query *query = search->query;
+    if (__atomic_load_n(&search->stop, __ATOMIC_RELAXED) || __atomic_load_n(&query->cancelled, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    if (st == NULL || !match_extension(path, name, st, (void *) search->ext)) return 0;
+    if (query->use_regex ? regexec(&query->regex, name, 0, NULL, 0) != 0 : fnmatch(query->pattern, name, 0) != 0) {
+        return 0;
+    }
+    
+    off_t size = st->st_size;
+    if ((query->min_size >= 0 && size <= query->min_size) || (query->max_size >= 0 && size >= query->max_size) ||
+        (query->newer_than && st->st_mtime < query->newer_than) ||
+        (query->older_than && st->st_mtime > query->older_than)) {
+        return 0;
+    }
+    
+    char modified[32];
+    struct tm tm;
+    strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", localtime_r(&st->st_mtime, &tm));
+    char line[MAX_PATH_LEN * 2];
+    int len = snprintf(line, sizeof(line), "%10lld  %s  %s%s\n", (long long) size, modified, search->prefix, path);
+    if (len >= (int) sizeof(line)) return 0;
+    
+    // Lines from the walker threads must not interleave; MSG_NOSIGNAL turns a closed peer into EPIPE
+    int result = 0;
+    pthread_mutex_lock(&search->lock);
+    if (search->stop || send(search->out_fd, line, len, MSG_NOSIGNAL) != len || ++search->found >= query->limit) {
+        __atomic_store_n(&search->stop, 1, __ATOMIC_RELAXED);
+        result = -1;
+    }
+    pthread_mutex_unlock(&search->lock);
+    return result;
+}
+
+// Streams the ext files below dir_fd that match query to out_fd; returns how many were sent
+long run_find(int dir_fd, struct find_query *query, int out_fd, const char *ext)
+{
+    struct find_search search;
+    memset(&search, 0, sizeof(search));
+    search.query = query;
+    search.root_fd = dir_fd;
+    search.out_fd = out_fd;
+    search.ext = ext;
+    // Results carry their full path, ~S1/<dir>/<path below it>
+    const char *relative = relative_path(query->path);
+    int relative_len = strlen(relative);
+    while (relative_len > 0 && relative[relative_len - 1] == '/') relative_len--;
+    snprintf(search.prefix, sizeof(search.prefix), "~S1/%.*s%s", relative_len, relative, relative_len ? "/" : "");
+    pthread_mutex_init(&search.lock, NULL);
+    
+    walk_tree(dir_fd, WALK_STAT, 0, find_match, &search, NULL);
+    
+    pthread_mutex_destroy(&search.lock);
+    return search.found;
+}
+
+// Maps the change feed and forks the watcher that fills it from inotify. The storage tree is
+// watched before the fork, and like the log ring this runs before the accept loop, so every
+// handler can read the feed and nothing written once the server accepts is missed.
+void start_change_watcher(void)
+{
+    changes = mmap(NULL, sizeof(struct change_feed), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (changes == MAP_FAILED) {
+        handle_error("Change feed allocation failed");
+    }
+
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        log_message(LOG_WARN, "event=change_feed_disabled errno=%d", errno);
+        return;
+    }
+    changes->epoch = wall_clock_us();
+    changes->next = 1;
+    watch_tree(inotify_fd, root_fd, "", 0);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        handle_error("Fork failed");
+    }
+    if (pid > 0) {
+        close(inotify_fd);
+        for (int wd = 0; wd < watch_capacity; wd++) {
+            free(watch_paths[wd]);
+        }
+        free(watch_paths);
+        watch_paths = NULL;
+        watch_capacity = 0;
+        return;
+    }
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    run_change_watcher(inotify_fd);
+    exit(0);
+}
+
+// Turns inotify events into feed records. A new file is announced once its writer closes it,
+// so consumers never see a create for a half-written upload.
+void run_change_watcher(int inotify_fd)
+{
+    char *events = malloc(CHANGE_EVENT_BUFFER);
+    char pending[CHANGE_PENDING_CREATES][MAX_PATH_LEN];
+    int pending_count = 0;
+    if (events == NULL) {
+        exit(1);
+    }
+
+    while (1) {
+        ssize_t len = read(inotify_fd, events, CHANGE_EVENT_BUFFER);
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) continue;
+            exit(1);
+        }
+
+        for (char *ptr = events; ptr < events + len; ) {
+            struct inotify_event *ev = (struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                log_message(LOG_WARN, "event=change_feed_overflow seq=%lu", changes->next);
+                mark_resync();
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= watch_capacity || watch_paths[ev->wd] == NULL) continue;
+            if (ev->mask & IN_IGNORED) {
+                free(watch_paths[ev->wd]);
+                watch_paths[ev->wd] = NULL;
+                continue;
+            }
+            // Upload and delta temporaries are renamed into place; only the final name is a change
+            if (ev->len == 0 || is_temp_name(ev->name)) continue;
+
+            char path[MAX_PATH_LEN];
+            const char *dir = watch_paths[ev->wd];
+            snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] ? "/" : "", ev->name);
+
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    // Files can land in a new directory before its watch exists, so it is
+                    // scanned and whatever it already holds is announced
+                    int dir_fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                    if (dir_fd >= 0) {
+                        watch_tree(inotify_fd, dir_fd, path, 1);
+                        close(dir_fd);
+                    }
+                } else if (ev->mask & IN_MOVED_FROM) {
+                    // The files under it are not listed; a trailing slash deletes the subtree
+                    unwatch_tree(inotify_fd, path);
+                    strncat(path, "/", sizeof(path) - strlen(path) - 1);
+                    record_change('D', path);
+                }
+                continue;
+            }
+
+            int slot = -1;
+            for (int i = 0; i < pending_count; i++) {
+                if (strcmp(pending[i], path) == 0) slot = i;
+            }
+            if (slot >= 0 && (ev->mask & (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM))) {
+                memmove(pending[slot], pending[slot + 1], (pending_count - slot - 1) * MAX_PATH_LEN);
+                pending_count--;
+            }
+
+            if (ev->mask & IN_CREATE) {
+                if (pending_count == CHANGE_PENDING_CREATES) {
+                    // Created but never written, such as a link; announce the oldest anyway
+                    record_change('C', pending[0]);
+                    memmove(pending[0], pending[1], (pending_count - 1) * MAX_PATH_LEN);
+                    pending_count--;
+                }
+                snprintf(pending[pending_count++], MAX_PATH_LEN, "%s", path);
+            } else if (ev->mask & IN_CLOSE_WRITE) {
+                record_change(slot >= 0 ? 'C' : 'M', path);
+            } else if (ev->mask & IN_MOVED_TO) {
+                record_change('C', path);
+            } else if ((ev->mask & (IN_DELETE | IN_MOVED_FROM)) && slot < 0) {
+                record_change('D', path);
+            }
+        }
+    }
+}
+
+// Watches dir_fd (at path below the root) and every directory under it. With announce set,
+// the regular files found are recorded as created.
+int watch_tree(int inotify_fd, int dir_fd, const char *path, int announce)
+{
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", dir_fd);
+    int wd = inotify_add_watch(inotify_fd, proc_path, IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM |
+                               IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK);
+    if (wd < 0) {
+        // Typically fs.inotify.max_user_watches; changes below here would go unseen
+        log_message(LOG_WARN, "event=change_watch_failed path=\"%s\" errno=%d", path, errno);
+        __atomic_store_n(&changes->incomplete, 1, __ATOMIC_RELEASE);
+        mark_resync();
+        return -1;
+    }
+    if (wd >= watch_capacity) {
+        int capacity = (wd + 1) * 2;
+        char **grown = realloc(watch_paths, capacity * sizeof(char *));
+        if (grown == NULL) return -1;
+        memset(grown + watch_capacity, 0, (capacity - watch_capacity) * sizeof(char *));
+        watch_paths = grown;
+        watch_capacity = capacity;
+    }
+    free(watch_paths[wd]);
+    watch_paths[wd] = strdup(path);
+
+    int list_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = (list_fd < 0) ? NULL : fdopendir(list_fd);
+    if (dir == NULL) {
+        if (list_fd >= 0) close(list_fd);
+        return -1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || is_temp_name(ent->d_name)) {
+            continue;
+        }
+
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s%s%s", path, path[0] ? "/" : "", ent->d_name);
+        unsigned char type = ent->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            int sub_fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub_fd >= 0) {
+                watch_tree(inotify_fd, sub_fd, child, announce);
+                close(sub_fd);
+            }
+        } else if (type == DT_REG && announce) {
+            record_change('C', child);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Drops the watches on path and below it after the directory was moved away
+void unwatch_tree(int inotify_fd, const char *path)
+{
+    size_t len = strlen(path);
+    for (int wd = 0; wd < watch_capacity; wd++) {
+        if (watch_paths[wd] != NULL && strncmp(watch_paths[wd], path, len) == 0 &&
+            (watch_paths[wd][len] == '\0' || watch_paths[wd][len] == '/')) {
+            inotify_rm_watch(inotify_fd, wd);
+            free(watch_paths[wd]);
+            watch_paths[wd] = NULL;
+        }
+    }
+}
+
+// Appends a record for a .c file or a subtree; only the watcher writes, so next needs no
+// atomic increment
+void record_change(char type, const char *path)
+{
+    // Other types pass through ~S1 only while they are forwarded to their node
+    const char *ext = strrchr(path, '.');
+    if (path[strlen(path) - 1] != '/' && (ext == NULL || strcmp(ext, ".c") != 0)) return;
+    
+    unsigned long seq = changes->next;
+    struct change_record *record = &changes->records[seq % CHANGE_RING_SIZE];
+
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    record->time_us = wall_clock_us();
+    record->type = type;
+    snprintf(record->path, sizeof(record->path), "%s", path);
+    __atomic_store_n(&record->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&changes->next, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Events were lost. Every cursor before the marker record appended here has to rescan; the
+// marker is never listed, and cursors handed out from now on are at or past it.
+void mark_resync(void)
+{
+    __atomic_store_n(&changes->resync_seq, changes->next, __ATOMIC_RELEASE);
+    record_change('R', "");
+}
+
+// Answers "changes [cursor] [wait_ms]". The cursor is "<epoch>:<seq>" as returned by the last
+// call. The reply is a "cursor <epoch>:<seq>" line followed by one "<seq> <C|M|D> ~S1/<path>"
+// line per record after the given one. It starts with "resync" instead, and has no records,
+// when the consumer has no cursor, the server restarted, or records it needs were overwritten
+// or lost; the consumer then lists the tree again and continues from the new cursor. The
+// header ends in " incomplete" once some directory could not be watched, since changes below
+// it are never recorded. With nothing new, the call waits up to wait_ms for the first record.
+int serve_changes(int conn, const char *cursor, int wait_ms)
+{
+    if (changes == NULL || changes->epoch == 0) {
+        write(conn, "ERROR: Change feed unavailable\n", 31);
+        return -1;
+    }
+
+    unsigned long epoch = 0, since = 0;
+    int have_cursor = (cursor != NULL && sscanf(cursor, "%lx:%lu", &epoch, &since) == 2 &&
+                       epoch == changes->epoch);
+    if (wait_ms > CHANGE_MAX_WAIT_MS) wait_ms = CHANGE_MAX_WAIT_MS;
+
+    unsigned long next = __atomic_load_n(&changes->next, __ATOMIC_ACQUIRE);
+    for (int waited = 0; have_cursor && next <= since + 1 && waited < wait_ms; waited += CHANGE_POLL_MS) {
+        usleep(CHANGE_POLL_MS * 1000);
+        next = __atomic_load_n(&changes->next, __ATOMIC_ACQUIRE);
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (out == NULL) {
+        write(conn, "ERROR: Out of memory\n", 21);
+        return -1;
+    }
+
+    int resync = (!have_cursor || since >= next || since < __atomic_load_n(&changes->resync_seq, __ATOMIC_ACQUIRE) ||
+                  next - since - 1 > CHANGE_RING_SIZE);
+    unsigned long last = since;
+    for (unsigned long seq = since + 1; !resync && seq < next; seq++) {
+        struct change_record record;
+        struct change_record *slot = &changes->records[seq % CHANGE_RING_SIZE];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) break;
+        memcpy(&record, slot, sizeof(record));
+        // Overwritten while copying; the next call from last will be told to resync
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) break;
+
+        if (record.type != 'R') fprintf(out, "%lu %c ~S1/%s\n", seq, record.type, record.path);
+        last = seq;
+    }
+    fclose(out);
+
+    char header[96];
+    int header_len = snprintf(header, sizeof(header), "%s %lx:%lu%s\n", resync ? "resync" : "cursor",
+                              changes->epoch, resync ? next - 1 : last,
+                              __atomic_load_n(&changes->incomplete, __ATOMIC_ACQUIRE) ? " incomplete" : "");
+    int result = (write_all(conn, header, header_len) == 0 && write_all(conn, body, body_len) == 0) ? 0 : -1;
+    free(body);
+    return result;
+}
+
+// Serves the Prometheus text format over HTTP from a dedicated child bound to loopback
+void run_metrics_endpoint(int port)
+{
+    int metrics_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_socket < 0) {
+        handle_error("Metrics socket creation failed");
+    }
+
+    int opt = 1;
+    setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    bzero((char *) &addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(metrics_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        handle_error("Metrics binding failed");
+    }
+    listen(metrics_socket, MAX_CLIENTS);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        handle_error("Fork failed");
+    }
+    if (pid > 0) {
+        close(metrics_socket);
+        return;
+    }
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    char *body = malloc(STATS_BUFFER_SIZE);
+    if (body == NULL) {
+        exit(1);
+    }
+    while (1) {
+        int conn = accept(metrics_socket, NULL, NULL);
+        if (conn < 0) continue;
+
+        char request[BUFFER_SIZE];
+        read(conn, request, sizeof(request));
+
+        int body_len = format_prometheus(body, STATS_BUFFER_SIZE);
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %d\r\n\r\n", body_len);
+        write(conn, header, header_len);
+        write(conn, body, body_len);
+        close(conn);
+    }
+}
+
+int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Moves count bytes between descriptors: sendfile when the source is a regular file,
+// otherwise a TRANSFER_BUFFER_SIZE read/write loop (the fastest options in xferbench).
+// Returns the number of bytes moved, which is short of count on error or EOF.
+off_t transfer_data(int out_fd, int in_fd, off_t count)
+{
+    struct stat st;
+    off_t done = 0;
+
+    if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        while (done < count) {
+            ssize_t sent = sendfile(out_fd, in_fd, NULL, count - done);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) break;
+            done += sent;
+        }
+        return done;
+    }
+
+    return transfer_checksummed(out_fd, in_fd, count, NULL);
+}
+
+// Read/write loop that also folds the bytes into *crc (if not NULL), so a payload is
+// checksummed while it streams instead of in a second pass
+off_t transfer_checksummed(int out_fd, int in_fd, off_t count, unsigned int *crc)
+{
+    char buffer[TRANSFER_BUFFER_SIZE];
+    off_t done = 0;
+    while (done < count) {
+        size_t chunk = (count - done < TRANSFER_BUFFER_SIZE) ? (size_t) (count - done) : TRANSFER_BUFFER_SIZE;
+        ssize_t n = read(in_fd, buffer, chunk);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || write_all(out_fd, buffer, n) < 0) break;
+        if (crc != NULL) *crc = crc32c_update(*crc, buffer, n);
+        done += n;
+    }
+    return done;
+}
+
+// Shannon entropy of a sample in bits per byte; already-compressed data comes out close to 8
+double sample_entropy(const unsigned char *buf, size_t len)
+{
+    unsigned int counts[256] = {0};
+    for (size_t i = 0; i < len; i++) {
+        counts[buf[i]]++;
+    }
+    
+    double entropy = 0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] == 0) continue;
+        double p = (double) counts[i] / len;
+        entropy -= p * log2(p);
+    }
+    return entropy;
+}
+
+// Zip archives are always sent raw. Regular files are sampled at the start and the middle, since
+// formats like PDF have a plain-text header in front of compressed streams; sockets cannot be
+// sampled up front and rely on the per-chunk check in send_zlib_chunks.
+int choose_encoding(int fd, const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (ext != NULL && strcmp(ext, ".zip") == 0) return ENCODING_RAW;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return ENCODING_ZLIB;
+    
+    unsigned char sample[COMPRESS_SAMPLE_SIZE];
+    off_t offsets[2] = { 0, st.st_size / 2 };
+    for (int i = 0; i < 2; i++) {
+        ssize_t n = pread(fd, sample, sizeof(sample), offsets[i]);
+        if (n > 0 && sample_entropy(sample, n) > COMPRESS_MAX_ENTROPY) return ENCODING_RAW;
+    }
+    return ENCODING_ZLIB;
+}
+
+// Sends size bytes from in_fd. Unframed sessions get the bytes as they are; framed sessions
+// (the command carried COMPRESS_TOKEN) get a one-byte encoding first, then either the raw
+// bytes or a sequence of chunks; empty payloads have no encoding byte. *crc, if not NULL, is
+// updated over the uncompressed data.
+off_t send_payload(int out_fd, int in_fd, off_t size, int framed, const char *name, unsigned int *crc)
+{
+    if (size == 0) return 0;
+    unsigned char encoding = framed ? choose_encoding(in_fd, name) : ENCODING_RAW;
+    if (framed && write_all(out_fd, &encoding, 1) < 0) return -1;
+    
+    if (encoding == ENCODING_ZLIB) return send_zlib_chunks(out_fd, in_fd, size, crc);
+    return (crc != NULL) ? transfer_checksummed(out_fd, in_fd, size, crc) : transfer_data(out_fd, in_fd, size);
+}
+
+// Each chunk is a chunk_header and either wire_len bytes of zlib data or, when wire_len is 0,
+// raw_len stored bytes. Chunks that look random or do not shrink are stored.
+off_t send_zlib_chunks(int out_fd, int in_fd, off_t size, unsigned int *crc)
+{
+    unsigned char *raw = malloc(COMPRESS_CHUNK_SIZE);
+    unsigned char *packed = malloc(compressBound(COMPRESS_CHUNK_SIZE));
+    off_t sent = 0;
+    
+    while (raw != NULL && packed != NULL && sent < size) {
+        size_t want = (size - sent < COMPRESS_CHUNK_SIZE) ? (size_t) (size - sent) : COMPRESS_CHUNK_SIZE;
+        if (read_all(in_fd, raw, want) < 0) break;
+        if (crc != NULL) *crc = crc32c_update(*crc, raw, want);
+        
+        struct chunk_header header;
+        pack_chunk(&header, raw, want, packed, Z_BEST_SPEED);
+        
+        const unsigned char *wire = header.wire_len ? packed : raw;
+        size_t wire_len = header.wire_len ? header.wire_len : want;
+        if (write_all(out_fd, &header, sizeof(header)) < 0 || write_all(out_fd, wire, wire_len) < 0) break;
+        add_bytes(&metrics->wire_raw_bytes, want);
+        add_bytes(&metrics->wire_sent_bytes, wire_len);
+        sent += want;
+    }
+    
+    free(raw);
+    free(packed);
+    return sent;
+}
+
+// Counterpart of send_payload: writes the decoded payload to out_fd and returns its length
+off_t receive_payload(int out_fd, int in_fd, off_t size, int framed, unsigned int *crc)
+{
+    unsigned char encoding = ENCODING_RAW;
+    if (size == 0) return 0;
+    if (framed && read_all(in_fd, &encoding, 1) < 0) return -1;
+    if (encoding == ENCODING_RAW) return transfer_checksummed(out_fd, in_fd, size, crc);
+    if (encoding != ENCODING_ZLIB) return -1;
+    
+    unsigned char *raw = malloc(COMPRESS_CHUNK_SIZE);
+    unsigned char *packed = malloc(compressBound(COMPRESS_CHUNK_SIZE));
+    off_t received = 0;
+    
+    while (raw != NULL && packed != NULL && received < size) {
+        ssize_t n = read_chunk(in_fd, encoding, raw, packed, size - received);
+        if (n < 0) break;
+        if (crc != NULL) *crc = crc32c_update(*crc, raw, n);
+        if (write_all(out_fd, raw, n) < 0) break;
+        received += n;
+    }
+    
+    free(raw);
+    free(packed);
+    return received;
+}
+
+// Compresses one chunk into packed (compressBound(COMPRESS_CHUNK_SIZE) bytes) and fills in its
+// header; wire_len stays 0, storing the chunk raw, when the data looks random or does not shrink
+void pack_chunk(struct chunk_header *header, const unsigned char *raw, size_t len, unsigned char *packed, int level)
+{
+    uLongf packed_len = compressBound(COMPRESS_CHUNK_SIZE);
+    size_t sample_len = (len < COMPRESS_SAMPLE_SIZE) ? len : COMPRESS_SAMPLE_SIZE;
+    
+    header->raw_len = len;
+    header->wire_len = 0;
+    if (sample_entropy(raw, sample_len) <= COMPRESS_MAX_ENTROPY &&
+        compress2(packed, &packed_len, raw, len, level) == Z_OK && packed_len < len) {
+        header->wire_len = packed_len;
+    }
+}
+
+// Reads the next chunk (at most remaining bytes) of a payload with the given encoding into raw,
+// decoding it if needed; returns its length, or -1 on a read error or a malformed chunk
+ssize_t read_chunk(int in_fd, int encoding, unsigned char *raw, unsigned char *packed, off_t remaining)
+{
+    if (encoding == ENCODING_RAW) {
+        size_t want = (remaining < COMPRESS_CHUNK_SIZE) ? (size_t) remaining : COMPRESS_CHUNK_SIZE;
+        return (read_all(in_fd, raw, want) < 0) ? -1 : (ssize_t) want;
+    }
+    
+    struct chunk_header header;
+    if (read_all(in_fd, &header, sizeof(header)) < 0 || header.raw_len == 0 ||
+        header.raw_len > COMPRESS_CHUNK_SIZE || header.wire_len > compressBound(COMPRESS_CHUNK_SIZE) ||
+        header.raw_len > remaining) {
+        return -1;
+    }
+    
+    uLongf raw_len = header.raw_len;
+    if (header.wire_len == 0) {
+        if (read_all(in_fd, raw, header.raw_len) < 0) return -1;
+    } else if (read_all(in_fd, packed, header.wire_len) < 0 ||
+               uncompress(raw, &raw_len, packed, header.wire_len) != Z_OK || raw_len != header.raw_len) {
+        return -1;
+    }
+    return raw_len;
+}
+
+// Copies a framed payload between two framed sessions without decoding it
+off_t relay_payload(int out_fd, int in_fd, off_t size)
+{
+    unsigned char encoding;
+    if (size == 0) return 0;
+    if (read_all(in_fd, &encoding, 1) < 0 || write_all(out_fd, &encoding, 1) < 0) return -1;
+    if (encoding != ENCODING_ZLIB) return transfer_data(out_fd, in_fd, size);
+    
+    off_t relayed = 0;
+    while (relayed < size) {
+        struct chunk_header header;
+        if (read_all(in_fd, &header, sizeof(header)) < 0 || header.raw_len == 0 ||
+            header.raw_len > size - relayed || write_all(out_fd, &header, sizeof(header)) < 0) {
+            break;
+        }
+        off_t wire_len = header.wire_len ? header.wire_len : header.raw_len;
+        if (transfer_data(out_fd, in_fd, wire_len) != wire_len) break;
+        relayed += header.raw_len;
+    }
+    return relayed;
+}
+
+// Moves a payload from a storage node to the client, decoding or encoding only when the two
+// sessions disagree about framing
+off_t forward_payload(int out_fd, int out_framed, int in_fd, int in_framed, off_t size, const char *name)
+{
+    if (in_framed && out_framed) return relay_payload(out_fd, in_fd, size);
+    if (in_framed) return receive_payload(out_fd, in_fd, size, 1, NULL);
+    return send_payload(out_fd, in_fd, size, out_framed, name, NULL);
+}
+
+// rsync's rolling checksum of a block: a is the byte sum and b the sum of the running values of
+// a, both kept to 16 bits in the result
+unsigned int weak_checksum(const unsigned char *buf, size_t len)
+{
+    unsigned int a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += buf[i];
+        b += a;
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Blocks of about sqrt(size) bytes keep both the signature list and the per-block overhead small
+unsigned int delta_block_size(off_t size)
+{
+    unsigned int block_size = DELTA_MIN_BLOCK;
+    while ((off_t) block_size * block_size < size && block_size < DELTA_MAX_BLOCK) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+// Writes the block count, block size and one block_signature per full block of old_fd
+int send_signatures(int out_fd, int old_fd, off_t block_count, unsigned int block_size)
+{
+    if (write_all(out_fd, &block_count, sizeof(off_t)) < 0 ||
+        write_all(out_fd, &block_size, sizeof(block_size)) < 0) {
+        return -1;
+    }
+    
+    unsigned char *block = malloc(block_size);
+    struct block_signature batch[DELTA_SIGNATURE_BATCH];
+    int queued = 0, result = (block == NULL) ? -1 : 0;
+    for (off_t i = 0; i < block_count && result == 0; i++) {
+        if (pread(old_fd, block, block_size, i * block_size) != (ssize_t) block_size) {
+            result = -1;
+            break;
+        }
+        batch[queued].weak = weak_checksum(block, block_size);
+        batch[queued].strong = crc32c_update(0, block, block_size);
+        if (++queued == DELTA_SIGNATURE_BATCH || i == block_count - 1) {
+            result = write_all(out_fd, batch, queued * sizeof(batch[0]));
+            queued = 0;
+        }
+    }
+    free(block);
+    return result;
+}
+
+// Rebuilds a file into out_fd from delta_len bytes of delta_op instructions read from in_fd,
+// copying blocks from old_fd. Returns the number of bytes written, or -1 on a bad instruction.
+off_t apply_delta(int out_fd, int in_fd, off_t delta_len, int old_fd, off_t block_count,
+                  unsigned int block_size, unsigned int *crc)
+{
+    unsigned char *buffer = malloc(DELTA_MAX_BLOCK);
+    off_t consumed = 0, written = 0;
+    
+    while (buffer != NULL && consumed < delta_len) {
+        struct delta_op op;
+        if (delta_len - consumed < (off_t) sizeof(op) || read_all(in_fd, &op, sizeof(op)) < 0) break;
+        consumed += sizeof(op);
+        
+        size_t len = op.value;
+        if (op.type == DELTA_COPY && op.value < block_count) {
+            len = block_size;
+            if (pread(old_fd, buffer, len, (off_t) op.value * block_size) != (ssize_t) len) break;
+        } else if (op.type == DELTA_LITERAL && len <= DELTA_MAX_BLOCK && (off_t) len <= delta_len - consumed) {
+            if (read_all(in_fd, buffer, len) < 0) break;
+            consumed += len;
+        } else {
+            break;
+        }
+        
+        *crc = crc32c_update(*crc, buffer, len);
+        if (write_all(out_fd, buffer, len) < 0) break;
+        written += len;
+    }
+    
+    free(buffer);
+    return (consumed == delta_len) ? written : -1;
+}
+
+// Server side of deltaf once the client has sent the new size: sends the signatures of old_fd
+// (-1 if there is no current copy), rebuilds the file in a temporary file next to it and renames
+// it over name once its CRC32C matches the client's. Replies with a status line.
+int receive_delta(int conn, int dir_fd, const char *name, int old_fd, off_t new_size)
+{
+    char tmp_name[MAX_PATH_LEN];
+    snprintf(tmp_name, sizeof(tmp_name), ".%s.%d.delta", name, getpid());
+    int fd = openat(dir_fd, tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        off_t error_count = -1;
+        write(conn, &error_count, sizeof(off_t));
+        write(conn, "ERROR: Failed to create file", 28);
+        return -1;
+    }
+    
+    struct stat st;
+    off_t old_size = (old_fd >= 0 && fstat(old_fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0;
+    unsigned int block_size = delta_block_size(old_size);
+    off_t block_count = old_size / block_size;
+    
+    unsigned long span_start = trace_start();
+    off_t delta_len = -1, written = -1;
+    unsigned int crc = 0, client_crc = 0;
+    if (send_signatures(conn, old_fd, block_count, block_size) == 0 &&
+        read_all(conn, &delta_len, sizeof(off_t)) == 0 && delta_len >= 0) {
+        written = apply_delta(fd, conn, delta_len, old_fd, block_count, block_size, &crc);
+    }
+    trace_span(STAGE_TRANSFER, span_start);
+    add_bytes(&metrics->bytes_in, delta_len);
+    
+    int result = -1;
+    if (written != new_size || read_all(conn, &client_crc, sizeof(client_crc)) < 0) {
+        write(conn, "ERROR: Delta transfer failed", 28);
+    } else if (crc != client_crc) {
+        write(conn, "ERROR: Checksum mismatch", 24);
+    } else {
+        store_crc32c(fd, crc);
+        result = 0;
+    }
+    // Closed before the rename, so the change feed sees the finished file appear once
+    close(fd);
+    if (result == 0) {
+        result = renameat(dir_fd, tmp_name, dir_fd, name);
+        if (result < 0) write(conn, "ERROR: Failed to replace file", 29);
+    }
+    
+    if (result < 0) {
+        unlinkat(dir_fd, tmp_name, 0);
+        return -1;
+    }
+    char status[MAX_PATH_LEN];
+    int len = snprintf(status, sizeof(status), "SUCCESS: %s rebuilt from a %ld byte delta (%ld bytes)",
+                       name, (long) delta_len, (long) new_size);
+    write(conn, status, len);
+    return 0;
+}
+
+void crc32c_init(void)
+{
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            unsigned int prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len)
+{
+    unsigned long c = crc;
+    while (len > 0 && ((unsigned long) p & 7) != 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        unsigned long word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    return c;
+}
+#endif
+
+// Continues a running CRC32C (Castagnoli, as in iSCSI/ext4); start from 0. Uses the SSE4.2
+// crc32 instruction when the CPU has it and slicing-by-8 tables otherwise.
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_sse42(crc, p, len);
+    }
+#endif
+    while (len >= 8) {
+        unsigned int lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24);
+        unsigned int hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int) p[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+// Stored CRC32C of an open file (user.dfs.crc32c xattr). Files without one, or whose size or
+// mtime no longer match it, are checksummed in a single pass and the result is stored for the
+// next download.
+unsigned int file_crc32c(int fd)
+{
+    unsigned int crc = 0;
+    if (stored_crc32c(fd, &crc) == 0) {
+        return crc;
+    }
+    
+    char buffer[TRANSFER_BUFFER_SIZE];
+    off_t offset = 0;
+    ssize_t n;
+    crc = 0;
+    while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+        crc = crc32c_update(crc, buffer, n);
+        offset += n;
+    }
+    store_crc32c(fd, crc);
+    return crc;
+}
+
+// Reads the stored CRC32C into crc; -1 if there is none or the file changed since it was taken
+int stored_crc32c(int fd, unsigned int *crc)
+{
+    struct crc_tag tag;
+    struct stat st;
+    if (fgetxattr(fd, CRC_XATTR, &tag, sizeof(tag)) != sizeof(tag) || fstat(fd, &st) != 0 ||
+        tag.size != st.st_size || tag.mtime.tv_sec != st.st_mtim.tv_sec ||
+        tag.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        return -1;
+    }
+    *crc = tag.crc;
+    return 0;
+}
+
+// Stores crc for the file as it is now; called once its data is complete
+void store_crc32c(int fd, unsigned int crc)
+{
+    struct crc_tag tag = { .crc = crc };
+    struct stat st;
+    if (fstat(fd, &st) != 0) return;
+    tag.size = st.st_size;
+    tag.mtime = st.st_mtim;
+    fsetxattr(fd, CRC_XATTR, &tag, sizeof(tag), 0);
+}
+
+unsigned long trace_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+// Samples one request in trace_sample_rate; each forked child handles one request
+void trace_begin(int command)
+{
+    current_command = command;
+    if (trace_sample_rate <= 0) return;
+
+    // splitmix64 over pid and clock, since every child inherits the same PRNG state
+    unsigned long x = ((unsigned long) getpid() << 32) ^ trace_clock() ^ 0x9e3779b97f4a7c15UL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+    x ^= x >> 31;
+    if (x % trace_sample_rate == 0) {
+        current_trace_id = x | 1;
+    }
+}
+
+// Returns a span start timestamp, or 0 when the current request is not sampled
+unsigned long trace_start(void)
+{
+    return current_trace_id ? trace_clock() : 0;
+}
+
+void trace_span(int stage, unsigned long start_us)
+{
+    if (current_trace_id == 0 || traces == NULL) return;
+
+    unsigned long idx = __atomic_fetch_add(&traces->next, 1, __ATOMIC_RELAXED);
+    struct trace_span *span = &traces->spans[idx % TRACE_RING_SIZE];
+
+    __atomic_store_n(&span->seq, 0, __ATOMIC_RELAXED);
+    span->trace_id = current_trace_id;
+    span->start_us = start_us;
+    span->duration_us = (unsigned int) (trace_clock() - start_us);
+    span->stage = (unsigned short) stage;
+    span->command = (unsigned char) current_command;
+    span->pid = getpid();
+    __atomic_store_n(&span->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+// Propagates the trace id on a forwarded command so storage nodes record matching spans
+void append_trace(char *command, size_t len)
+{
+    size_t used = strlen(command);
+    if (current_trace_id != 0 && used < len) {
+        snprintf(command + used, len - used, " trace=%016lx", current_trace_id);
+    }
+}
+
+// Writes the ring as Chrome trace events, each prefixed with a comma
+int dump_traces(int fd)
+{
+    int count = 0;
+    for (unsigned long i = 0; i < TRACE_RING_SIZE; i++) {
+        struct trace_span span;
+        struct trace_span *slot = &traces->spans[i];
+        unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0) continue;
+        memcpy(&span, slot, sizeof(span));
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) continue;
+
+        dprintf(fd, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%u,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"trace_id\":\"%016lx\"}}",
+                stage_names[span.stage], (span.command < CMD_COUNT) ? command_names[span.command] : "other",
+                span.start_us, span.duration_us, TRACE_NODE_ID, span.pid, span.trace_id);
+        count++;
+    }
+    return count;
+}
+
+// Answers "du <path> [rescan]" with the bytes and files below path for each type and in total.
+// A node that cannot be reached gets an error row and is left out of the total.
+int handle_du(int client_conn, const char *path, int rescan)
+{
+    if (path == NULL || strncmp(path, "~S1", 3) != 0) {
+        write(client_conn, "ERROR: Invalid du format\n", 25);
+        return -1;
+    }
+    
+    const char *types[4] = { ".c", ".pdf", ".txt", ".zip" };
+    struct dir_usage usage[4], total = { 0, 0 };
+    int failed = collect_usage(path, rescan, usage);
+    
+    char table[BUFFER_SIZE];
+    int len = snprintf(table, sizeof(table), "%-6s %10s %14s\n", "type", "files", "bytes");
+    for (int i = 0; i < 4; i++) {
+        if (failed & (1 << i)) {
+            len += snprintf(table + len, sizeof(table) - len, "%-6s ERROR: %s unavailable\n", types[i],
+                            i == 0 ? "S1" : node_names[i - 1]);
+            continue;
+        }
+        len += snprintf(table + len, sizeof(table) - len, "%-6s %10ld %14ld\n", types[i], usage[i].files,
+                        usage[i].bytes);
+        total.bytes += usage[i].bytes;
+        total.files += usage[i].files;
+    }
+    len += snprintf(table + len, sizeof(table) - len, "%-6s %10ld %14ld\n", "total", total.files, total.bytes);
+    write(client_conn, table, len);
+    return failed ? -1 : 0;
+}
+
+// Fills usage[] for .c (local) and the S2, S3 and S4 trees; returns a bit mask of the entries
+// that could not be read
+int collect_usage(const char *path, int rescan, struct dir_usage usage[4])
+{
+    int failed = 0;
+    memset(usage, 0, 4 * sizeof(struct dir_usage));
+    
+    int dir_fd = resolve_dir(relative_path(path), 0);
+    if (dir_fd >= 0 && read_usage(dir_fd, rescan, &usage[0]) < 0) failed |= 1;
+    
+    int ports[3] = { s2_port, s3_port, s4_port };
+    for (int i = 0; i < 3; i++) {
+        if (node_usage(ports[i], path, rescan, &usage[i + 1]) < 0) failed |= 1 << (i + 1);
+    }
+    return failed;
+}
+
+// Asks one node for its "usage" line; a rescan walks the node's tree, so it may take longer
+int node_usage(int port, const char *path, int rescan, struct dir_usage *usage)
+{
+    int sockfd = connect_to_node(port, rescan ? NODE_ARCHIVE_TIMEOUT_MS : NODE_IO_TIMEOUT_MS);
     if (sockfd < 0) return -1;
     
-    struct sockaddr_in serv_addr;
-    struct hostent *server = gethostbyname("localhost");
-    if (server == NULL) {
-        close(sockfd);
-        return -1;
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "usage %s%s", path, rescan ? " rescan" : "");
+    write(sockfd, command, strlen(command));
+    
+    char reply[128];
+    int len = 0, n;
+    while (len < (int) sizeof(reply) - 1 && (n = read(sockfd, reply + len, sizeof(reply) - 1 - len)) > 0) {
+        len += n;
     }
+    reply[len] = '\0';
+    close(sockfd);
     
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(port);
+    int ok = (sscanf(reply, "%ld %ld", &usage->bytes, &usage->files) == 2);
+    breaker_report(port, ok);
+    return ok ? 0 : -1;
+}
+
+// Quota file lines are "<~S1 prefix> <max_bytes>[K|M|G] [max_files]"; # starts a comment
+void load_quotas(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        handle_error("Opening quota file failed");
+    }
     
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+    char line[MAX_PATH_LEN + 64];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char prefix[MAX_PATH_LEN], max_bytes[32];
+        long max_files = 0;
+        if (line[0] == '#' || sscanf(line, "%1023s %31s %ld", prefix, max_bytes, &max_files) < 2) continue;
+        if (quota_count == MAX_QUOTAS || strncmp(prefix, "~S1", 3) != 0 || parse_size(max_bytes) < 0) {
+            fprintf(stderr, "Ignoring quota line: %s", line);
+            continue;
+        }
+        
+        struct quota *quota = &quotas[quota_count++];
+        snprintf(quota->prefix, sizeof(quota->prefix), "%s", relative_path(prefix));
+        size_t len = strlen(quota->prefix);
+        while (len > 0 && quota->prefix[len - 1] == '/') quota->prefix[--len] = '\0';
+        quota->max_bytes = parse_size(max_bytes);
+        quota->max_files = max_files;
+    }
+    fclose(file);
+}
+
+// "512", "64K", "10M" or "2G"; -1 if malformed
+long parse_size(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value < 0) return -1;
+    if (*end == 'K') value <<= 10;
+    else if (*end == 'M') value <<= 20;
+    else if (*end == 'G') value <<= 30;
+    else if (*end != '\0') return -1;
+    return value;
+}
+
+// Checks incoming bytes and files written to dest_path (an upload, copy or move) against every
+// quota on it or an ancestor. Usage comes from the aggregates, so this costs a round trip per
+// node rather than a scan. An overwrite is charged its full size. A move from moved_from is not
+// charged to quotas that already hold it. A node that cannot be reached counts as empty, so an
+// outage does not block writes to the other nodes.
+int check_quota(const char *dest_path, struct dir_usage incoming, const char *moved_from, char *reason, size_t len)
+{
+    const char *dest = relative_path(dest_path);
+    for (int i = 0; i < quota_count; i++) {
+        if (!quota_covers(quotas[i].prefix, dest)) continue;
+        if (moved_from != NULL && quota_covers(quotas[i].prefix, relative_path(moved_from))) continue;
+        
+        char path[MAX_PATH_LEN + 8];
+        snprintf(path, sizeof(path), "~S1/%.*s", MAX_PATH_LEN, quotas[i].prefix);
+        struct dir_usage usage[4];
+        long bytes = 0, files = 0;
+        int failed = collect_usage(path, 0, usage);
+        for (int t = 0; t < 4; t++) {
+            if (failed & (1 << t)) continue;
+            bytes += usage[t].bytes;
+            files += usage[t].files;
+        }
+        if (failed) {
+            log_message(LOG_WARN, "event=quota_partial prefix=\"%s\" unreachable_mask=%d", path, failed);
+        }
+        
+        if (bytes + incoming.bytes > quotas[i].max_bytes ||
+            (quotas[i].max_files > 0 && files + incoming.files > quotas[i].max_files)) {
+            int n = snprintf(reason, len, "ERROR: Quota exceeded for %s (%ld of %ld bytes, %ld", path, bytes,
+                             quotas[i].max_bytes, files);
+            if (quotas[i].max_files > 0) n += snprintf(reason + n, len - n, " of %ld", quotas[i].max_files);
+            snprintf(reason + n, len - n, " files used)");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Whether path (relative to the root) is a quota's prefix or below it
+int quota_covers(const char *prefix, const char *path)
+{
+    size_t prefix_len = strlen(prefix);
+    return prefix_len == 0 ||
+           (strncmp(path, prefix, prefix_len) == 0 && (path[prefix_len] == '\0' || path[prefix_len] == '/'));
+}
+
+// Serves the .c feed from this server and relays the others from the node that stores the type
+int relay_changes(int client_conn, const char *filetype, const char *cursor, int wait_ms)
+{
+    int port = 0;
+    if (filetype != NULL && strcmp(filetype, ".c") == 0) {
+        return serve_changes(client_conn, cursor, wait_ms);
+    }
+    if (filetype != NULL && strcmp(filetype, ".pdf") == 0) port = s2_port;
+    else if (filetype != NULL && strcmp(filetype, ".txt") == 0) port = s3_port;
+    else if (filetype != NULL && strcmp(filetype, ".zip") == 0) port = s4_port;
+    if (port == 0) {
+        write(client_conn, "ERROR: Unsupported filetype for changes\n", 40);
+        return -1;
+    }
+    if (wait_ms > CHANGE_MAX_WAIT_MS) wait_ms = CHANGE_MAX_WAIT_MS;
+
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "changes %s %d", cursor ? cursor : "-", wait_ms);
+    int sockfd = connect_to_node(port, NODE_IO_TIMEOUT_MS + wait_ms);
+    if (sockfd < 0) {
+        dprintf(client_conn, "ERROR: %s unavailable\n", node_names[node_index(port)]);
+        return -1;
+    }
+    write(sockfd, command, strlen(command));
+
+    char response[TRANSFER_BUFFER_SIZE];
+    ssize_t bytes;
+    off_t relayed = 0;
+    while ((bytes = read(sockfd, response, sizeof(response))) > 0) {
+        write_all(client_conn, response, bytes);
+        relayed += bytes;
+    }
+    breaker_report(port, relayed > 0);
+    close(sockfd);
+    return (relayed > 0) ? 0 : -1;
+}
+
+// Merges S1's spans with every storage node's into one Chrome trace file
+int handle_trace_dump(int client_conn)
+{
+    // mkstemps creates a new file (O_EXCL, mode 0600), so a file or symlink already at a
+    // guessable name in /tmp is never opened or truncated
+    char path[MAX_PATH_LEN];
+    snprintf(path, MAX_PATH_LEN, "/tmp/dfs_trace_%ld_XXXXXX.json", (long) time(NULL));
+
+    int fd = mkstemps(path, 5);
+    if (fd < 0) {
+        write(client_conn, "ERROR: Failed to create trace file", 34);
+        return -1;
+    }
+
+    dprintf(fd, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"S1\"}}");
+    for (int i = 0; i < 3; i++) {
+        dprintf(fd, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+                i + 2, node_names[i]);
+    }
+    int count = dump_traces(fd);
+
+    int ports[3] = { s2_port, s3_port, s4_port };
+    for (int i = 0; i < 3; i++) {
+        int sockfd = connect_to_node(ports[i], NODE_IO_TIMEOUT_MS);
+        if (sockfd < 0) continue;
+
+        write(sockfd, "tracedump", 9);
+        transfer_data(fd, sockfd, LONG_MAX);
         close(sockfd);
+    }
+    dprintf(fd, "\n]}\n");
+    close(fd);
+
+    char response[BUFFER_SIZE];
+    int len = snprintf(response, BUFFER_SIZE, "SUCCESS: %d S1 spans written to %s\n", count, path);
+    write(client_conn, response, len);
+    return 0;
+}
+
+// downltar builds an archive in /tmp and is by far the most expensive request
+int command_class(int cmd_id)
+{
+    if (cmd_id == CMD_DOWNLTAR || cmd_id == CMD_FINDF) return CLASS_ARCHIVE;
+    if (cmd_id == CMD_UPLOADF || cmd_id == CMD_DOWNLF || cmd_id == CMD_MDOWNLF || cmd_id == CMD_DELTAF ||
+        cmd_id == CMD_COPYF || cmd_id == CMD_MOVEF) {
+        return CLASS_TRANSFER;
+    }
+    return CLASS_LIGHT;
+}
+
+// Clients are limited by address; colliding addresses share a bucket, which only makes the limit stricter
+int client_ip_bucket(int client_conn)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(client_conn, (struct sockaddr *) &addr, &len) < 0 || addr.sin_family != AF_INET) {
+        return 0;
+    }
+    unsigned int ip = ntohl(addr.sin_addr.s_addr);
+    return (ip * 2654435761U) >> 24;
+}
+
+// TLS for client connections (-T). OpenSSL 3.0 hands both directions to kernel TLS only for
+// TLS 1.2 with AES-GCM, so the context is limited to those; renegotiation and session tickets,
+// which would arrive as records the kernel cannot pass to read(), are disabled.
+SSL_CTX *tls_server_context(const char *cert_file, const char *key_file)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) return NULL;
+    
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_TICKET |
+                        SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    if (SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS) != 1 ||
+        SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// Runs the handshake on a new client connection and returns the fd the request is served on.
+// With kernel TLS in both directions that is the socket itself, so read/write, sendfile and
+// splice keep working on it unchanged and the kernel encrypts; otherwise it is one end of a
+// socketpair whose other end a relay process (tls_relay) bridges to the TLS connection.
+int tls_accept(int client_conn)
+{
+    struct timeval timeout = { .tv_sec = TLS_HANDSHAKE_TIMEOUT_MS / 1000,
+                               .tv_usec = (TLS_HANDSHAKE_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(client_conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    unsigned long span_start = now_us();
+    SSL *ssl = SSL_new(tls_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, client_conn) != 1 || SSL_accept(ssl) != 1) {
+        log_message(LOG_WARN, "event=tls_handshake_failed error=\"%s\"",
+                    ERR_reason_error_string(ERR_peek_last_error()));
+        SSL_free(ssl);
+        close(client_conn);
         return -1;
     }
+    struct timeval none = { 0, 0 };
+    setsockopt(client_conn, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    setsockopt(client_conn, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
     
-    write(sockfd, command, strlen(command));
+    int offloaded = tls_offloaded(ssl);
+    __atomic_fetch_add(offloaded ? &metrics->tls_offloaded : &metrics->tls_relayed, 1, __ATOMIC_RELAXED);
+    log_message(LOG_DEBUG, "event=tls_handshake cipher=%s ktls=%d duration_us=%lu", SSL_get_cipher_name(ssl),
+                offloaded, now_us() - span_start);
+    if (offloaded) {
+        SSL_free(ssl);
+        return client_conn;
+    }
+    return tls_relay(ssl, client_conn);
+}
+
+// Both directions are in the kernel and OpenSSL holds no decrypted bytes of its own
+int tls_offloaded(SSL *ssl)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) && SSL_pending(ssl) == 0;
+}
+
+// Without kernel TLS: forks a relay that encrypts and decrypts between sockfd and a socketpair,
+// and returns the other end of the pair. The relay is double-forked so nobody has to reap it,
+// and outlives the caller until the last bytes written to the pair have been sent.
+int tls_relay(SSL *ssl, int sockfd)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        SSL_free(ssl);
+        close(sockfd);
+        return -1;
+    }
     
-    bzero(response, BUFFER_SIZE);
-    read(sockfd, response, BUFFER_SIZE - 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pair[0]);
+        if (fork() == 0) {
+            tls_relay_main(ssl, sockfd, pair[1]);
+        }
+        _exit(0);
+    }
+    SSL_free(ssl);
+    close(sockfd);
+    close(pair[1]);
+    if (pid < 0) {
+        close(pair[0]);
+        return -1;
+    }
+    waitpid(pid, NULL, 0);
+    return pair[0];
+}
+
+void tls_relay_main(SSL *ssl, int sockfd, int local_fd)
+{
+    char buffer[TLS_RECORD_SIZE];
+    struct pollfd fds[2] = { { .fd = sockfd, .events = POLLIN }, { .fd = local_fd, .events = POLLIN } };
     
+    while (1) {
+        fds[0].revents = fds[1].revents = 0;
+        // Records OpenSSL has already read do not show up in poll
+        if (SSL_pending(ssl) == 0 && poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (SSL_pending(ssl) > 0 || (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            int n = SSL_read(ssl, buffer, sizeof(buffer));
+            if (n <= 0 || write_all(local_fd, buffer, n) < 0) break;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(local_fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                // The request is finished; close_notify tells the peer nothing was cut off
+                SSL_shutdown(ssl);
+                break;
+            }
+            if (SSL_write(ssl, buffer, n) <= 0) break;
+        }
+    }
+    SSL_free(ssl);
     close(sockfd);
+    close(local_fd);
+    _exit(0);
+}
+
+// Increments counter unless it has already reached limit
+int try_acquire(long *counter, long limit)
+{
+    long current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (current < limit) {
+        if (__atomic_compare_exchange_n(counter, &current, current + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int try_admit(int admit_class, int ip_bucket)
+{
+    if (try_acquire(&admission->in_flight[admit_class], class_limits[admit_class]) < 0) return -1;
+    if (try_acquire(&admission->ip_in_flight[ip_bucket], per_ip_limit) < 0) {
+        __atomic_fetch_sub(&admission->in_flight[admit_class], 1, __ATOMIC_RELAXED);
+        return -1;
+    }
     return 0;
 }
 
-int create_directory_structure(char *path) 
+// Takes an in-flight slot for the class and client, waiting in the class's bounded queue until the
+// class deadline if both are saturated. Returns -1 when the queue is full or the deadline passes.
+int admit_request(int admit_class, int ip_bucket)
 {
-    char *temp_path = strdup(path);
-    char *token = strtok(temp_path, "/");
-    char current_path[MAX_PATH_LEN] = "";
+    struct admit_ticket *ticket = &admission->tickets[admit_slot];
+    ticket->admit_class = admit_class;
+    ticket->ip_bucket = ip_bucket;
     
-    if (path[0] == '/') {
-        strcpy(current_path, "/");
+    if (try_admit(admit_class, ip_bucket) == 0) {
+        __atomic_store_n(&ticket->state, TICKET_ADMITTED, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if (try_acquire(&admission->waiting[admit_class], class_queue_limits[admit_class]) < 0) {
+        return -1;
     }
+    __atomic_store_n(&ticket->state, TICKET_WAITING, __ATOMIC_RELEASE);
     
-    while (token != NULL) {
-        if (strlen(current_path) > 1) {
-            strcat(current_path, "/");
+    unsigned long deadline = now_us() + class_deadline_ms[admit_class] * 1000UL;
+    int admitted = -1;
+    while (admitted < 0 && now_us() < deadline) {
+        usleep(ADMIT_POLL_US);
+        admitted = try_admit(admit_class, ip_bucket);
+    }
+    
+    release_ticket(ticket);
+    if (admitted == 0) {
+        __atomic_store_n(&ticket->state, TICKET_ADMITTED, __ATOMIC_RELEASE);
+    }
+    return admitted;
+}
+
+// Safe to call from both the child and the parent reaping it; only one of them sees the old state
+void release_ticket(struct admit_ticket *ticket)
+{
+    int state = __atomic_exchange_n(&ticket->state, TICKET_FREE, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&ticket->writing, 0, __ATOMIC_RELEASE);
+    if (state == TICKET_WAITING) {
+        __atomic_fetch_sub(&admission->waiting[ticket->admit_class], 1, __ATOMIC_RELAXED);
+    } else if (state == TICKET_ADMITTED) {
+        __atomic_fetch_sub(&admission->in_flight[ticket->admit_class], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&admission->ip_in_flight[ticket->ip_bucket], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Answers in the framing the client expects for the command: downloads get the BUSY_SIZE sentinel
+// followed by the retry delay, everything else a text line
+void reject_busy(int client_conn, int cmd_id, int admit_class)
+{
+    unsigned int retry_after_ms = class_deadline_ms[admit_class];
+    __atomic_fetch_add(&metrics->rejected[admit_class], 1, __ATOMIC_RELAXED);
+    log_message(LOG_WARN, "event=busy command=%s class=%s", command_names[cmd_id], class_names[admit_class]);
+    
+    if (cmd_id == CMD_DOWNLF || cmd_id == CMD_DOWNLTAR) {
+        off_t busy = BUSY_SIZE;
+        write_all(client_conn, &busy, sizeof(off_t));
+        write_all(client_conn, &retry_after_ms, sizeof(retry_after_ms));
+    } else {
+        char response[64];
+        int len = snprintf(response, sizeof(response), "BUSY: retry after %u ms", retry_after_ms);
+        write_all(client_conn, response, len);
+    }
+}
+
+// Reaps finished children and returns anything they still held to the admission counters. A
+// child that dies while running a rebalance would otherwise leave writes frozen for good.
+void reap_children(pid_t *children)
+{
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        pid_t owner = pid;
+        if (__atomic_compare_exchange_n(&placement->owner, &owner, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&placement->frozen, 0, __ATOMIC_SEQ_CST);
+            set_rebalance_state(MIGRATE_FAILED, "the rebalance process exited");
+            __atomic_store_n(&placement->active, 0, __ATOMIC_RELEASE);
+            log_message(LOG_ERROR, "event=rebalance_failed reason=owner_exited pid=%d", (int) pid);
+        }
+        for (int i = 0; i < ADMIT_MAX_CHILDREN; i++) {
+            if (children[i] == pid) {
+                release_ticket(&admission->tickets[i]);
+                children[i] = 0;
+                break;
+            }
+        }
+    }
+}
+
+int free_child_slot(pid_t *children)
+{
+    for (int i = 0; i < ADMIT_MAX_CHILDREN; i++) {
+        if (children[i] == 0) return i;
+    }
+    return -1;
+}
+
+// Maps the shared log ring and forks the writer that drains it. Called before the accept
+// loop so every forked handler inherits the mapping.
+void start_log_writer(const char *path)
+{
+    log_ring = mmap(NULL, sizeof(struct log_ring), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (log_ring == MAP_FAILED) {
+        handle_error("Log ring allocation failed");
+    }
+    for (unsigned long i = 0; i < LOG_RING_SIZE; i++) {
+        log_ring->slots[i].sequence = i;
+    }
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        handle_error("Log writer fork failed");
+    }
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        run_log_writer(path);
+        exit(0);
+    }
+}
+
+// Formats a record straight into a ring slot. Never blocks: when the ring is full or the
+// per-second budget for debug/info lines is spent the record is dropped and counted.
+void log_message(int level, const char *fmt, ...)
+{
+    if (log_ring == NULL || level < log_min_level) return;
+    
+    if (level < LOG_WARN && log_rate_limit > 0) {
+        unsigned long second = now_us() / 1000000;
+        unsigned long window = __atomic_load_n(&log_ring->rate_window, __ATOMIC_RELAXED);
+        if (window != second &&
+            __atomic_compare_exchange_n(&log_ring->rate_window, &window, second, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&log_ring->rate_count, 0, __ATOMIC_RELAXED);
+        }
+        if (__atomic_fetch_add(&log_ring->rate_count, 1, __ATOMIC_RELAXED) >= (unsigned long) log_rate_limit) {
+            __atomic_fetch_add(&log_ring->dropped_rate, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    
+    // Bounded MPMC queue (Vyukov): a slot is free for position pos when its sequence == pos
+    struct log_slot *slot;
+    unsigned long pos = __atomic_load_n(&log_ring->enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &log_ring->slots[pos & (LOG_RING_SIZE - 1)];
+        long diff = (long) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (long) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_ring->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&log_ring->dropped_full, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log_ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    
+    slot->timestamp_us = wall_clock_us();
+    slot->pid = getpid();
+    slot->level = level;
+    
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(slot->message, LOG_MESSAGE_SIZE, fmt, args);
+    va_end(args);
+    
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Writer process: drains the ring in order, batching lines into one write, and rotates the
+// file at LOG_ROTATE_BYTES. Logs to stdout when no file was given.
+void run_log_writer(const char *path)
+{
+    signal(SIGTERM, stop_log_writer);
+    
+    int fd = (path != NULL) ? open_log_file(path) : STDOUT_FILENO;
+    off_t written = (fd >= 0) ? lseek(fd, 0, SEEK_END) : 0;
+    if (written < 0) written = 0;
+    
+    char *batch = malloc(LOG_BATCH_SIZE);
+    if (batch == NULL) exit(1);
+    unsigned long pos = 0;
+    unsigned long reported_full = 0, reported_rate = 0;
+    
+    while (1) {
+        size_t used = 0;
+        while (used + LOG_MESSAGE_SIZE + 128 < LOG_BATCH_SIZE) {
+            struct log_slot *slot = &log_ring->slots[pos & (LOG_RING_SIZE - 1)];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) break;
+            used += format_log_line(batch + used, LOG_BATCH_SIZE - used, slot->timestamp_us,
+                                    slot->level, slot->pid, slot->message);
+            __atomic_store_n(&slot->sequence, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+            pos++;
         }
-        strcat(current_path, token);
         
-        if (mkdir(current_path, 0755) && errno != EEXIST) {
-            free(temp_path);
-            return -1;
+        unsigned long dropped_full = __atomic_load_n(&log_ring->dropped_full, __ATOMIC_RELAXED);
+        unsigned long dropped_rate = __atomic_load_n(&log_ring->dropped_rate, __ATOMIC_RELAXED);
+        if (dropped_full != reported_full || dropped_rate != reported_rate) {
+            char message[LOG_MESSAGE_SIZE];
+            snprintf(message, sizeof(message), "event=log_dropped ring_full=%lu rate_limited=%lu",
+                     dropped_full, dropped_rate);
+            used += format_log_line(batch + used, LOG_BATCH_SIZE - used, wall_clock_us(), LOG_WARN, getpid(), message);
+            reported_full = dropped_full;
+            reported_rate = dropped_rate;
         }
         
-        token = strtok(NULL, "/");
+        if (used == 0) {
+            if (log_writer_stopping) break;
+            usleep(LOG_IDLE_SLEEP_US);
+            continue;
+        }
+        
+        if (fd >= 0 && write_all(fd, batch, used) == 0) {
+            written += used;
+        }
+        if (path != NULL && written >= LOG_ROTATE_BYTES) {
+            close(fd);
+            rotate_log_files(path);
+            fd = open_log_file(path);
+            written = 0;
+        }
     }
     
-    free(temp_path);
-    return 0;
+    free(batch);
+}
+
+// Log timestamps are wall-clock; now_us() is monotonic and only used for durations
+unsigned long wall_clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void stop_log_writer(int sig)
+{
+    (void) sig;
+    log_writer_stopping = 1;
+}
+
+int open_log_file(const char *path)
+{
+    return open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+// Opens a workload recording for appending; a new file gets the magic, an existing one must have it
+int open_record_file(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return -1;
+    
+    char magic[sizeof(RECORD_MAGIC) - 1];
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (st.st_size == 0 && write_all(fd, RECORD_MAGIC, sizeof(magic)) < 0) ||
+        (st.st_size > 0 && (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+                            memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Appends one record for the finished request. A single O_APPEND write keeps records from
+// concurrent children whole without any locking.
+void record_request(int cmd_id, int status, unsigned long start_us)
+{
+    if (record_fd < 0) return;
+    
+    char entry[sizeof(struct workload_record) + BUFFER_SIZE] __attribute__((aligned(8)));
+    struct workload_record *record = (struct workload_record *) entry;
+    const char *args = strchr(record_args, ' ');
+    args = (args != NULL) ? args + 1 : "";
+    memset(record, 0, sizeof(*record));
+    record->start_us = start_us;
+    record->duration_us = (unsigned int) (trace_clock() - start_us);
+    record->command = cmd_id;
+    record->status = status;
+    record->args_len = strlen(args);
+    record->bytes_in = request_bytes_in;
+    record->bytes_out = request_bytes_out;
+    memcpy(entry + sizeof(*record), args, record->args_len);
+    write(record_fd, entry, sizeof(*record) + record->args_len);
+}
+
+// file -> file.1 -> ... -> file.LOG_ROTATE_KEEP (the oldest is overwritten)
+void rotate_log_files(const char *path)
+{
+    char from[MAX_PATH_LEN], to[MAX_PATH_LEN];
+    for (int i = LOG_ROTATE_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", path, i);
+        snprintf(to, sizeof(to), "%s.%d", path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", path);
+    rename(path, to);
+}
+
+// One key=value line: ts=... level=... node=... pid=... followed by the record's own fields
+int format_log_line(char *out, size_t len, unsigned long timestamp_us, int level, int pid, const char *message)
+{
+    time_t seconds = timestamp_us / 1000000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    int n = snprintf(out, len, "ts=%s.%06luZ level=%s node=S1 pid=%d %s\n", stamp, timestamp_us % 1000000,
+                     log_level_names[level], pid, message);
+    return (n < 0 || (size_t) n >= len) ? 0 : n;
+}
+
+// Accepts a level name (debug, info, warn, error) and returns its index, or -1
+int parse_log_level(const char *name)
+{
+    for (int i = 0; i < LOG_LEVEL_COUNT; i++) {
+        if (strcmp(name, log_level_names[i]) == 0) return i;
+    }
+    return -1;
 }
 
 void handle_error(const char *msg) 
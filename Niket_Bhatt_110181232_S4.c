@@ -1,4 +1,5 @@
 // Distributed File System - S4 Server Implementation by Niket
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
@@ -16,31 +18,490 @@
 #include <sys/sendfile.h>
 #include <time.h>
 #include <errno.h>
+#include <sys/xattr.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #include <limits.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <math.h>
+#include <zlib.h>
+#include <sys/statvfs.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <poll.h>
+#include <sys/un.h>
 
 #define MAX_CLIENTS 10
 #define BUFFER_SIZE 1024
 #define MAX_PATH_LEN 1024
+#define TRANSFER_BUFFER_SIZE (64 * 1024)
+#define CRC32C_POLY 0x82F63B78
+#define CRC_XATTR "user.dfs.crc32c"
+#define USAGE_XATTR "user.dfs.usage"
+#define DIR_CACHE_SIZE 32
+#define LOG_RING_SIZE 4096
+#define LOG_MESSAGE_SIZE 240
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_ROTATE_BYTES (16 * 1024 * 1024)
+#define LOG_ROTATE_KEEP 3
+#define LOG_IDLE_SLEEP_US 2000
+#define DEFAULT_LOG_RATE 10000
+#define METRICS_PORT_OFFSET 1000
+#define HIST_BUCKETS 128
+#define STATS_BUFFER_SIZE (BUFFER_SIZE * 32)
+#define TRACE_RING_SIZE 65536
+#define MAX_BATCH_BYTES (16 * 1024 * 1024)
+#define ENCODING_RAW 0
+#define ENCODING_ZLIB 1
+#define COMPRESS_CHUNK_SIZE (64 * 1024)
+#define COMPRESS_SAMPLE_SIZE 4096
+#define COMPRESS_MAX_ENTROPY 7.5
+#define COMPRESS_TOKEN " compress=zlib"
+#define CACHED_TOKEN " cached="
+#define NOT_MODIFIED_SIZE ((off_t) -3)
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK (64 * 1024)
+#define DELTA_COPY 0
+#define DELTA_LITERAL 1
+#define DELTA_SIGNATURE_BATCH 512
+#define DEFAULT_S1_PORT 4307
+#define HEARTBEAT_INTERVAL_MS 1000
+#define HEARTBEAT_FILE_COUNT_EVERY 10
+#define PEER_IO_TIMEOUT_MS 5000
+#define UNIX_SOCKET_NAME "dfs-%d.sock"
+#define CHANGE_RING_SIZE 4096
+#define CHANGE_EVENT_BUFFER (64 * 1024)
+#define CHANGE_PENDING_CREATES 64
+#define CHANGE_POLL_MS 50
+#define CHANGE_MAX_WAIT_MS 30000
+#define WALK_MAX_THREADS 16
+#define WALK_BUFFER_SIZE (64 * 1024)
+#define WALK_MAX_OPEN_DIRS 256
+#define WALK_SPIN_LIMIT 64
+#define WALK_IDLE_SLEEP_US 50
+#define WALK_ORDERED 1
+#define WALK_STAT 2
+#define WALK_DIRS 4
+#define WALK_COUNT_ONLY 8
+#define FIND_DEFAULT_LIMIT 1000
+#define FIND_MAX_LIMIT 100000
+#define TRACE_NODE_ID 4
+
+enum command_id { CMD_UPLOADF, CMD_DOWNLF, CMD_REMOVEF, CMD_DOWNLTAR, CMD_DISPFNAMES, CMD_MDOWNLF, CMD_MREMOVEF,
+                  CMD_DELTAF, CMD_FINDF, CMD_COPYF, CMD_MOVEF, CMD_COUNT };
+
+// Latency histogram with 4 linear sub-buckets per power of two (HDR-style)
+struct latency_histogram {
+    unsigned long count;
+    unsigned long errors;
+    unsigned long sum_us;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+// Lives in a shared anonymous mapping so every forked child updates the same counters
+struct server_metrics {
+    struct latency_histogram commands[CMD_COUNT];
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long wire_raw_bytes;
+    unsigned long wire_sent_bytes;
+    long in_flight;
+};
+
+// Header of one chunk of a zlib-encoded payload; wire_len 0 means the chunk is stored raw
+struct chunk_header {
+    unsigned int raw_len;
+    unsigned int wire_len;
+};
+
+// Signature of one full block of the server's copy, sent to the client for deltaf
+struct block_signature {
+    unsigned int weak;
+    unsigned int strong;
+};
+
+// One deltaf instruction: copy block `value` of the old copy, or take the `value` literal bytes
+// that follow the instruction
+struct delta_op {
+    unsigned int type;
+    unsigned int value;
+};
+
+enum log_level { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_LEVEL_COUNT };
+
+enum trace_stage { STAGE_PARSE, STAGE_LOOKUP, STAGE_CONNECT, STAGE_FIRST_BYTE, STAGE_TRANSFER, STAGE_CLOSE, STAGE_COUNT };
+
+// Fixed-size binary span record; seq is published last so readers can skip torn slots
+struct trace_span {
+    unsigned long seq;
+    unsigned long trace_id;
+    unsigned long start_us;
+    unsigned int duration_us;
+    unsigned short stage;
+    unsigned char command;
+    unsigned char reserved;
+    int pid;
+};
+
+struct trace_ring {
+    unsigned long next;
+    struct trace_span spans[TRACE_RING_SIZE];
+};
+
+// One log record; sequence hands the slot between the handler that fills it and the writer
+struct log_slot {
+    unsigned long sequence;
+    unsigned long timestamp_us;
+    int pid;
+    int level;
+    char message[LOG_MESSAGE_SIZE];
+};
+
+// Shared by every forked handler and drained by the log writer process
+struct log_ring {
+    unsigned long enqueue_pos;
+    char pad[56];
+    unsigned long dropped_full;
+    unsigned long dropped_rate;
+    unsigned long rate_window;
+    unsigned long rate_count;
+    struct log_slot slots[LOG_RING_SIZE];
+};
+
+// Record returned by getdents64, which glibc does not declare
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// File or directory found by walk_tree; path is relative to the walk's root. size and mtime
+// are only filled in for regular files under WALK_STAT.
+struct walk_entry {
+    char *path;
+    unsigned char type;
+    off_t size;
+    time_t mtime;
+};
+
+// Directory waiting to be read, with an fd opened from its parent when one could be kept
+struct walk_item {
+    char *path;
+    int fd;
+    int depth;
+};
+
+// The directories one walker thread has queued: items[head..tail)
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_item *items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+};
+
+struct walk_worker {
+    struct walk *walk;
+    int id;
+    struct walk_deque deque;
+    struct walk_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+typedef int (*walk_match_fn)(const char *path, const char *name, const struct stat *st, void *arg);
+
+// Shared state of one walk_tree call
+struct walk {
+    int root_fd;
+    int flags;
+    int max_depth;
+    int threads;
+    walk_match_fn match;
+    void *arg;
+    long pending;
+    long open_dirs;
+    int stop;
+    struct walk_worker *workers;
+};
+
+// A parsed findf query; unset sizes are -1 and unset times 0. S1 sets cancelled to end its
+// local search early.
+struct find_query {
+    char path[MAX_PATH_LEN];
+    char pattern[MAX_PATH_LEN];
+    int use_regex;
+    regex_t regex;
+    off_t min_size;
+    off_t max_size;
+    time_t newer_than;
+    time_t older_than;
+    long limit;
+    int cancelled;
+};
+
+// State shared by the walker threads of one findf search
+struct find_search {
+    struct find_query *query;
+    int root_fd;
+    int out_fd;
+    const char *ext;
+    char prefix[MAX_PATH_LEN + 8];
+    pthread_mutex_t lock;
+    long found;
+    int stop;
+    int checksums;
+};
+
+// Value of the CRC_XATTR: the checksum with the size and modification time the file had when it
+// was taken, so a file edited in place outside the server is checksummed again
+struct crc_tag {
+    unsigned int crc;
+    off_t size;
+    struct timespec mtime;
+};
+
+// Bytes and files stored below a directory, kept in its USAGE_XATTR and rolled up to every
+// ancestor as files are written and removed
+struct dir_usage {
+    long bytes;
+    long files;
+};
+
+// One change below the storage root; seq is published last so readers can skip slots the
+// watcher is rewriting
+struct change_record {
+    unsigned long seq;
+    unsigned long time_us;
+    char type;
+    char path[MAX_PATH_LEN];
+};
+
+// Filled by the watcher process and read by every handler. epoch is the watcher's start time,
+// so cursors from before a restart are recognised, and resync_seq is the marker record written
+// after events were lost. incomplete is set once a directory could not be watched.
+struct change_feed {
+    unsigned long epoch;
+    unsigned long next;
+    unsigned long resync_seq;
+    int incomplete;
+    struct change_record records[CHANGE_RING_SIZE];
+};
+
+// Open directory below the storage root, kept per process and evicted least recently used
+struct dir_cache_entry {
+    char path[MAX_PATH_LEN];
+    int fd;
+    unsigned long last_used;
+};
+
+const char *command_names[CMD_COUNT] = { "uploadf", "downlf", "removef", "downltar", "dispfnames", "mdownlf", "mremovef",
+                                         "deltaf", "findf", "copyf", "movef" };
+const char *stage_names[STAGE_COUNT] = { "parse", "local_lookup", "connect", "remote_first_byte", "transfer", "close" };
+
+struct server_metrics *metrics;
+struct trace_ring *traces;
+unsigned long current_trace_id = 0;
+int current_command = -1;
+unsigned int crc32c_table[8][256];
+int root_fd = -1;
+struct dir_cache_entry dir_cache[DIR_CACHE_SIZE];
+unsigned long dir_cache_clock = 0;
+const char *log_level_names[LOG_LEVEL_COUNT] = { "debug", "info", "warn", "error" };
+struct log_ring *log_ring = NULL;
+struct change_feed *changes = NULL;
+char **watch_paths = NULL;
+int watch_capacity = 0;
+int walk_threads = 1;
+int log_min_level = LOG_INFO;
+int log_rate_limit = DEFAULT_LOG_RATE;
+volatile sig_atomic_t log_writer_stopping = 0;
+int session_compress = 0;
+long cached_crc = -1;
+off_t cached_size = -1;
+char *unix_socket_dir = NULL;
 
 void process_s1_request(int s1_conn);
 int handle_zip_upload(int s1_conn, char *file_path, char *dest_path);
 int handle_zip_download(int s1_conn, char *file_path);
 int handle_zip_removal(int s1_conn, char *file_path);
 int display_zip_files(int s1_conn, char *pathname);
+int find_zip_files(int s1_conn, char *args);
+int list_zip_files(int s1_conn);
+int handle_zip_copy(int s1_conn, char *src, char *dst, int move);
+int handle_zip_push(int s1_conn, char *src, char *dst, int port, int move, unsigned int rate);
+int push_file(int port, int fd, const char *dst, unsigned int rate);
+int connect_to_peer(int port, int allow_unix);
+void set_nodelay(int sockfd);
+int unix_socket_path(char *out, size_t len, int port);
+int listen_unix(int port);
+int connect_unix(int port);
+int handle_zip_open(int s1_conn, char *file_path);
+int send_fd(int sockfd, const void *buf, size_t len, int fd);
+int handle_zip_batch(int s1_conn, int cmd_id);
+int handle_zip_delta(int s1_conn, char *file_path, char *dest_path);
+char *read_batch_list(int fd);
+int write_batch_record(int out_fd, char *path, int fd);
 int create_directory_structure(char *path);
+void open_root_dir(void);
+const char *relative_path(const char *path);
+int resolve_dir(const char *dir, int create);
+int resolve_parent(const char *path, int create, const char **leaf);
+int write_all(int fd, const void *buf, size_t len);
+int read_all(int fd, void *buf, size_t len);
+off_t transfer_data(int out_fd, int in_fd, off_t count);
+off_t transfer_checksummed(int out_fd, int in_fd, off_t count, unsigned int *crc);
+void crc32c_init(void);
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len);
+unsigned int file_crc32c(int fd);
+int stored_crc32c(int fd, unsigned int *crc);
+int path_crc32c(int dir_fd, const char *path, const struct stat *st, unsigned int *crc);
+ssize_t path_xattr(int dir_fd, const char *path, const char *name, void *value, size_t size);
+void store_crc32c(int fd, unsigned int crc);
+double sample_entropy(const unsigned char *buf, size_t len);
+int choose_encoding(int fd, const char *name);
+off_t send_payload(int out_fd, int in_fd, off_t size, int framed, const char *name, unsigned int *crc);
+off_t send_zlib_chunks(int out_fd, int in_fd, off_t size, unsigned int *crc);
+off_t receive_payload(int out_fd, int in_fd, off_t size, int framed, unsigned int *crc);
+void pack_chunk(struct chunk_header *header, const unsigned char *raw, size_t len, unsigned char *packed, int level);
+ssize_t read_chunk(int in_fd, int encoding, unsigned char *raw, unsigned char *packed, off_t remaining);
+unsigned int weak_checksum(const unsigned char *buf, size_t len);
+unsigned int delta_block_size(off_t size);
+int send_signatures(int out_fd, int old_fd, off_t block_count, unsigned int block_size);
+off_t apply_delta(int out_fd, int in_fd, off_t delta_len, int old_fd, off_t block_count,
+                  unsigned int block_size, unsigned int *crc);
+int receive_delta(int conn, int dir_fd, const char *name, int old_fd);
 void handle_error(const char *msg);
+unsigned long now_us(void);
+int latency_bucket(unsigned long us);
+unsigned long bucket_upper_bound(int idx);
+void record_latency(struct latency_histogram *hist, unsigned long start_us, int failed);
+void add_bytes(unsigned long *counter, long n);
+unsigned long histogram_percentile(struct latency_histogram *hist, double pct);
+int format_stats(char *out, size_t len);
+int format_prometheus(char *out, size_t len);
+void run_metrics_endpoint(int port);
+void run_heartbeat_sender(int port, int s1_port);
+int format_heartbeat(char *out, size_t len, int port, struct latency_histogram *previous, unsigned long files);
+unsigned long count_files(int dir_fd);
+unsigned long trace_clock(void);
+unsigned long trace_start(void);
+void trace_span(int stage, unsigned long start_us);
+int dump_traces(int fd);
+void start_log_writer(const char *path);
+void log_message(int level, const char *fmt, ...);
+void run_log_writer(const char *path);
+void stop_log_writer(int sig);
+unsigned long wall_clock_us(void);
+struct dir_usage file_usage(int dir_fd, const char *name);
+void update_usage(const char *path, struct dir_usage delta);
+void account_usage(int dir_fd, const char *dir, const char *name, struct dir_usage before);
+int unlink_counted(int dir_fd, const char *name, const char *path);
+int read_usage(int dir_fd, int rescan, struct dir_usage *usage);
+int copy_entry(const char *src, const char *dst);
+int move_entry(const char *src, const char *dst);
+void forget_dirs(const char *dir);
+void start_change_watcher(void);
+void run_change_watcher(int inotify_fd);
+int watch_tree(int inotify_fd, int dir_fd, const char *path, int announce);
+void unwatch_tree(int inotify_fd, const char *path);
+void record_change(char type, const char *path);
+void mark_resync(void);
+int serve_changes(int conn, const char *cursor, int wait_ms);
+ssize_t walk_tree(int root_fd, int flags, int max_depth, walk_match_fn match, void *arg,
+                  struct walk_entry **entries);
+void walk_free(struct walk_entry *entries, ssize_t count);
+int compare_walk_entries(const void *a, const void *b);
+void *walk_worker_main(void *arg);
+int is_temp_name(const char *name);
+void walk_read_dir(struct walk_worker *worker, struct walk_item *item, char *buffer);
+int walk_push(struct walk_deque *deque, struct walk_item item);
+int walk_pop(struct walk_deque *deque, struct walk_item *item);
+int walk_steal(struct walk_deque *deque, struct walk_item *item);
+int match_extension(const char *path, const char *name, const struct stat *st, void *arg);
+int parse_find_query(char *args, struct find_query *query, char *error, size_t len);
+void free_find_query(struct find_query *query);
+long parse_age(const char *text);
+long parse_size(const char *text);
+int find_match(const char *path, const char *name, const struct stat *st, void *arg);
+long run_find(int dir_fd, struct find_query *query, int out_fd, const char *ext, int checksums);
+int open_log_file(const char *path);
+void rotate_log_files(const char *path);
+int format_log_line(char *out, size_t len, unsigned long timestamp_us, int level, int pid, const char *message);
+int parse_log_level(const char *name);
 
 int main(int argc, char *argv[]) 
 {
     int port = 4310;
+    int metrics_port = 0;
+    int s1_port = DEFAULT_S1_PORT;
+    int opt_char;
+    char *log_path = NULL;
+    
+    while ((opt_char = getopt(argc, argv, "m:l:L:R:H:U:")) != -1) {
+        if (opt_char == 'm') {
+            metrics_port = atoi(optarg);
+        } else if (opt_char == 'H') {
+            s1_port = atoi(optarg);
+        } else if (opt_char == 'l') {
+            log_path = optarg;
+        } else if (opt_char == 'L' && parse_log_level(optarg) >= 0) {
+            log_min_level = parse_log_level(optarg);
+        } else if (opt_char == 'R') {
+            log_rate_limit = atoi(optarg);
+        } else if (opt_char == 'U') {
+            unix_socket_dir = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-m metrics_port] [-l log_file] [-L debug|info|warn|error]\n"
+                    "          [-R max_log_lines_per_sec] [-H s1_heartbeat_port] [-U socket_dir] [port]\n", argv[0]);
+            exit(1);
+        }
+    }
     
-    if (argc == 2) {
-        port = atoi(argv[1]);
+    if (argc - optind == 1) {
+        port = atoi(argv[optind]);
     }
+    
+    if (metrics_port == 0) {
+        metrics_port = port + METRICS_PORT_OFFSET;
+    }
+    
+    crc32c_init();
+    open_root_dir();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk_threads = (cpus < 1) ? 1 : (cpus > WALK_MAX_THREADS) ? WALK_MAX_THREADS : cpus;
+    
+    metrics = mmap(NULL, sizeof(struct server_metrics), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        handle_error("Metrics allocation failed");
+    }
+    run_metrics_endpoint(metrics_port);
+    
+    traces = mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (traces == MAP_FAILED) {
+        handle_error("Trace buffer allocation failed");
+    }
+    start_log_writer(log_path);
+    start_change_watcher();
+    run_heartbeat_sender(port, s1_port);
 
     int server_socket, s1_conn;
-    socklen_t client_len;
-    struct sockaddr_in server_addr, client_addr;
+    struct sockaddr_in server_addr;
     pid_t child_pid;
 
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -61,15 +522,27 @@ int main(int argc, char *argv[])
     }
 
     listen(server_socket, MAX_CLIENTS);
-    client_len = sizeof(client_addr);
 
-    printf("S4 ZIP Server started on port %d\n", port);
+    // Same-host peers can also connect through <dir>/dfs-<port>.sock, skipping the TCP/IP stack
+    int unix_socket = -1;
+    if (unix_socket_dir != NULL && (unix_socket = listen_unix(port)) < 0) {
+        handle_error("Unix socket setup failed");
+    }
+    struct pollfd listeners[2] = { { .fd = server_socket, .events = POLLIN }, { .fd = unix_socket, .events = POLLIN } };
+
+    printf("S4 ZIP Server started on port %d (metrics on 127.0.0.1:%d)\n", port, metrics_port);
 
     while (1) {
-        s1_conn = accept(server_socket, (struct sockaddr *) &client_addr, &client_len);
+        // A negative fd makes poll skip the Unix listener when there is none
+        if (poll(listeners, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            handle_error("Poll failed");
+        }
+        s1_conn = accept((listeners[0].revents & POLLIN) ? server_socket : unix_socket, NULL, NULL);
         if (s1_conn < 0) {
             handle_error("Accept failed");
         }
+        if (listeners[0].revents & POLLIN) set_nodelay(s1_conn);
 
         child_pid = fork();
         if (child_pid < 0) {
@@ -78,6 +551,7 @@ int main(int argc, char *argv[])
 
         if (child_pid == 0) {
             close(server_socket);
+            if (unix_socket >= 0) close(unix_socket);
             process_s1_request(s1_conn);
             close(s1_conn);
             exit(0);
@@ -101,8 +575,32 @@ void process_s1_request(int s1_conn)
     if (n < 0) {
         handle_error("Reading from S1 failed");
     }
+    unsigned long parse_start = trace_clock();
+    
+    // S1 appends a trace id to the commands it samples
+    char *trace_token = strstr(buffer, " trace=");
+    if (trace_token != NULL) {
+        current_trace_id = strtoul(trace_token + 7, NULL, 16);
+        *trace_token = '\0';
+    }
+    
+    // ... and a compression token when the payloads of this session are framed
+    char *compress_token = strstr(buffer, COMPRESS_TOKEN);
+    if (compress_token != NULL) {
+        session_compress = 1;
+        *compress_token = '\0';
+    }
+    
+    // ... and a cached copy's CRC32C and size on downloads the client may already have
+    char *cached_token = strstr(buffer, CACHED_TOKEN);
+    if (cached_token != NULL) {
+        char *size_text = NULL;
+        cached_crc = strtoul(cached_token + strlen(CACHED_TOKEN), &size_text, 16);
+        cached_size = (*size_text == ':') ? strtoll(size_text + 1, NULL, 10) : -1;
+        *cached_token = '\0';
+    }
     
-    printf("S4 received: %s\n", buffer);
+    log_message(LOG_INFO, "event=request command=\"%s\"", buffer);
     
     char *cmd = strtok(buffer, " ");
     if (cmd == NULL) {
@@ -110,41 +608,160 @@ void process_s1_request(int s1_conn)
         return;
     }
     
+    if (strcmp(cmd, "stats") == 0) {
+        char *stats = malloc(STATS_BUFFER_SIZE);
+        if (stats != NULL) {
+            int len = format_stats(stats, STATS_BUFFER_SIZE);
+            write(s1_conn, stats, len);
+            free(stats);
+        }
+        return;
+    }
+    
+    if (strcmp(cmd, "tracedump") == 0) {
+        dump_traces(s1_conn);
+        return;
+    }
+    
+    if (strcmp(cmd, "usage") == 0) {
+        char *path = strtok(NULL, " ");
+        char *rescan = strtok(NULL, " ");
+        struct dir_usage usage = { 0, 0 };
+        int dir_fd = (path == NULL) ? -1 : resolve_dir(relative_path(path), 0);
+        if (dir_fd >= 0) {
+            read_usage(dir_fd, rescan != NULL && strcmp(rescan, "rescan") == 0, &usage);
+        } else if (path != NULL) {
+            // A file's usage is its own size, which S1 charges a copy or move against quotas
+            const char *name;
+            int parent_fd = resolve_parent(path, 0, &name);
+            usage = file_usage(parent_fd, name);
+        }
+        dprintf(s1_conn, "%ld %ld\n", usage.bytes, usage.files);
+        return;
+    }
+    
+    if (strcmp(cmd, "listf") == 0) {
+        list_zip_files(s1_conn);
+        return;
+    }
+    
+    if (strcmp(cmd, "changes") == 0) {
+        char *cursor = strtok(NULL, " ");
+        char *wait_ms = strtok(NULL, " ");
+        serve_changes(s1_conn, cursor, wait_ms ? atoi(wait_ms) : 0);
+        return;
+    }
+
+    int cmd_id = -1;
+    for (int i = 0; i < CMD_COUNT; i++) {
+        if (strcmp(cmd, command_names[i]) == 0) cmd_id = i;
+    }
+    current_command = cmd_id;
+    trace_span(STAGE_PARSE, parse_start);
+
+    unsigned long start_us = now_us();
+    int result = 0;
+    __atomic_fetch_add(&metrics->in_flight, 1, __ATOMIC_RELAXED);
+
     if (strcmp(cmd, "uploadf") == 0) {
         char *file_path = strtok(NULL, " ");
         char *dest_path = strtok(NULL, " ");
         if (file_path == NULL || dest_path == NULL) {
             write(s1_conn, "ERROR: Missing parameters", 25);
-            return;
+            result = -1;
+        } else {
+            result = handle_zip_upload(s1_conn, file_path, dest_path);
         }
-        handle_zip_upload(s1_conn, file_path, dest_path);
     } 
     else if (strcmp(cmd, "downlf") == 0) {
         char *file_path = strtok(NULL, " ");
         if (file_path == NULL) {
             write(s1_conn, "ERROR: Missing filename", 23);
-            return;
+            result = -1;
+        } else {
+            result = handle_zip_download(s1_conn, file_path);
         }
-        handle_zip_download(s1_conn, file_path);
     } 
     else if (strcmp(cmd, "removef") == 0) {
         char *file_path = strtok(NULL, " ");
         if (file_path == NULL) {
             write(s1_conn, "ERROR: Missing filename", 23);
-            return;
+            result = -1;
+        } else {
+            result = handle_zip_removal(s1_conn, file_path);
         }
-        handle_zip_removal(s1_conn, file_path);
     } 
     else if (strcmp(cmd, "dispfnames") == 0) {
         char *pathname = strtok(NULL, " ");
         if (pathname == NULL) {
             write(s1_conn, "ERROR: Missing pathname", 23);
-            return;
+            result = -1;
+        } else {
+            result = display_zip_files(s1_conn, pathname);
+        }
+    } 
+    else if (strcmp(cmd, "deltaf") == 0) {
+        char *file_path = strtok(NULL, " ");
+        char *dest_path = strtok(NULL, " ");
+        if (file_path == NULL || dest_path == NULL) {
+            write(s1_conn, "ERROR: Missing parameters", 25);
+            result = -1;
+        } else {
+            result = handle_zip_delta(s1_conn, file_path, dest_path);
+        }
+    } 
+    else if (strcmp(cmd, "findf") == 0) {
+        result = find_zip_files(s1_conn, strtok(NULL, ""));
+    } 
+    else if (strcmp(cmd, "copyf") == 0 || strcmp(cmd, "movef") == 0) {
+        char *src = strtok(NULL, " ");
+        char *dst = strtok(NULL, " ");
+        if (src == NULL || dst == NULL) {
+            write(s1_conn, "ERROR: Missing parameters", 25);
+            result = -1;
+        } else {
+            result = handle_zip_copy(s1_conn, src, dst, cmd_id == CMD_MOVEF);
+        }
+    } 
+    else if (strcmp(cmd, "pushf") == 0) {
+        char *src = strtok(NULL, " ");
+        char *dst = strtok(NULL, " ");
+        char *port = strtok(NULL, " ");
+        char *move = strtok(NULL, " ");
+        char *rate = strtok(NULL, " ");
+        if (src == NULL || dst == NULL || port == NULL || move == NULL) {
+            write(s1_conn, "ERROR: Missing parameters", 25);
+            result = -1;
+        } else {
+            // The node-to-node half of a copyf, movef or rebalance, counted as a copyf or movef
+            cmd_id = current_command = (atoi(move) ? CMD_MOVEF : CMD_COPYF);
+            result = handle_zip_push(s1_conn, src, dst, atoi(port), atoi(move), rate ? strtoul(rate, NULL, 10) : 0);
+        }
+    } 
+    else if (strcmp(cmd, "openf") == 0) {
+        char *file_path = strtok(NULL, " ");
+        if (file_path == NULL) {
+            write(s1_conn, "ERROR: Missing filename", 23);
+            result = -1;
+        } else {
+            // S1's same-host downlf, counted as one
+            cmd_id = current_command = CMD_DOWNLF;
+            result = handle_zip_open(s1_conn, file_path);
         }
-        display_zip_files(s1_conn, pathname);
+    } 
+    else if (strcmp(cmd, "mdownlf") == 0 || strcmp(cmd, "mremovef") == 0) {
+        result = handle_zip_batch(s1_conn, cmd_id);
     } 
     else {
         write(s1_conn, "ERROR: Unknown command", 22);
+        result = -1;
+    }
+
+    __atomic_fetch_sub(&metrics->in_flight, 1, __ATOMIC_RELAXED);
+    if (cmd_id >= 0) {
+        record_latency(&metrics->commands[cmd_id], start_us, result < 0);
+        log_message(result < 0 ? LOG_WARN : LOG_INFO, "event=done command=%s status=%s duration_us=%lu",
+                    command_names[cmd_id], result < 0 ? "error" : "ok", now_us() - start_us);
     }
 }
 
@@ -158,32 +775,39 @@ int handle_zip_upload(int s1_conn, char *file_path, char *dest_path)
         return -1;
     }
     
-    char s4_path[MAX_PATH_LEN];
-    snprintf(s4_path, MAX_PATH_LEN, "%s/S4%s", getenv("HOME"), dest_path + 3);
-    create_directory_structure(s4_path);
-    
-    char full_dest_path[MAX_PATH_LEN];
-    snprintf(full_dest_path, MAX_PATH_LEN, "%s/%s", s4_path, file_path);
-    
-    int fd = open(full_dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    unsigned long span_start = trace_start();
+    int dir_fd = resolve_dir(relative_path(dest_path), 1);
+    struct dir_usage before = file_usage(dir_fd, file_path);
+    int fd = (dir_fd < 0) ? -1 : openat(dir_fd, file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    trace_span(STAGE_LOOKUP, span_start);
     if (fd < 0) {
         write(s1_conn, "ERROR: Failed to create file", 28);
         return -1;
     }
+    fremovexattr(fd, CRC_XATTR);
     
-    char buffer[BUFFER_SIZE];
-    off_t remaining = file_size;
-    while (remaining > 0) {
-        int bytes = read(s1_conn, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-        if (bytes <= 0) {
-            close(fd);
-            write(s1_conn, "ERROR: Transfer failed", 22);
-            return -1;
-        }
-        write(fd, buffer, bytes);
-        remaining -= bytes;
+    // S1 sends the CRC32C of the data after it; ours is computed while receiving
+    span_start = trace_start();
+    unsigned int crc = 0, s1_crc;
+    off_t received = receive_payload(fd, s1_conn, file_size, session_compress, &crc);
+    trace_span(STAGE_TRANSFER, span_start);
+    add_bytes(&metrics->bytes_in, received);
+    if (received != file_size || read_all(s1_conn, &s1_crc, sizeof(s1_crc)) < 0) {
+        close(fd);
+        account_usage(dir_fd, relative_path(dest_path), file_path, before);
+        write(s1_conn, "ERROR: Transfer failed", 22);
+        return -1;
     }
+    if (crc != s1_crc) {
+        close(fd);
+        unlinkat(dir_fd, file_path, 0);
+        account_usage(dir_fd, relative_path(dest_path), file_path, before);
+        write(s1_conn, "ERROR: Checksum mismatch", 24);
+        return -1;
+    }
+    store_crc32c(fd, crc);
     close(fd);
+    account_usage(dir_fd, relative_path(dest_path), file_path, before);
     
     write(s1_conn, "SUCCESS: ZIP stored in S4", 25);
     return 0;
@@ -191,49 +815,50 @@ int handle_zip_upload(int s1_conn, char *file_path, char *dest_path)
 
 int handle_zip_download(int s1_conn, char *file_path) 
 {
-    char s4_path[MAX_PATH_LEN];
-    snprintf(s4_path, MAX_PATH_LEN, "%s/S4%s", getenv("HOME"), file_path + 3);
+    unsigned long span_start = trace_start();
+    const char *name;
+    int dir_fd = resolve_parent(file_path, 0, &name);
+    int fd = (dir_fd < 0) ? -1 : openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+    trace_span(STAGE_LOOKUP, span_start);
     
     struct stat st;
-    if (stat(s4_path, &st) != 0) {
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
         off_t error_size = -1;
         write(s1_conn, &error_size, sizeof(off_t));
         return -1;
     }
     
-    int fd = open(s4_path, O_RDONLY);
-    if (fd < 0) {
-        off_t error_size = -1;
-        write(s1_conn, &error_size, sizeof(off_t));
-        return -1;
+    unsigned int crc = file_crc32c(fd);
+    if (cached_crc >= 0 && crc == cached_crc && st.st_size == cached_size) {
+        off_t not_modified = NOT_MODIFIED_SIZE;
+        close(fd);
+        write(s1_conn, &not_modified, sizeof(off_t));
+        return 0;
     }
-    
     write(s1_conn, &st.st_size, sizeof(off_t));
+    write(s1_conn, &crc, sizeof(crc));
     
-    char buffer[BUFFER_SIZE];
-    off_t remaining = st.st_size;
-    while (remaining > 0) {
-        ssize_t n = read(fd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-        if (n <= 0) {
-            close(fd);
-            return -1;
-        }
-        write(s1_conn, buffer, n);
-        remaining -= n;
-    }
+    span_start = trace_start();
+    off_t sent = send_payload(s1_conn, fd, st.st_size, session_compress, name, NULL);
     close(fd);
-    return 0;
+    trace_span(STAGE_TRANSFER, span_start);
+    add_bytes(&metrics->bytes_out, sent);
+    return (sent == st.st_size) ? 0 : -1;
 }
 
 int handle_zip_removal(int s1_conn, char *file_path) 
 {
-    char s4_path[MAX_PATH_LEN];
-    snprintf(s4_path, MAX_PATH_LEN, "%s/S4%s", getenv("HOME"), file_path + 3);
-    
-    if (unlink(s4_path) == 0) {
+    unsigned long span_start = trace_start();
+    const char *name;
+    int dir_fd = resolve_parent(file_path, 0, &name);
+    int removed = (dir_fd >= 0 && unlink_counted(dir_fd, name, file_path) == 0);
+    trace_span(STAGE_LOOKUP, span_start);
+    if (removed) {
         write(s1_conn, "SUCCESS: ZIP deleted from S4", 28);
     } else {
         write(s1_conn, "ERROR: ZIP not found in S4", 26);
+        return -1;
     }
     
     return 0;
@@ -241,39 +866,373 @@ int handle_zip_removal(int s1_conn, char *file_path)
 
 int display_zip_files(int s1_conn, char *pathname) 
 {
-    char s4_path[MAX_PATH_LEN];
-    snprintf(s4_path, MAX_PATH_LEN, "%s/S4%s", getenv("HOME"), 
-             (strcmp(pathname, "~S1") == 0) ? "" : (pathname + 3));
-    
-    struct stat st;
-    if (stat(s4_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    int dir_fd = resolve_dir(relative_path(pathname), 0);
+    struct walk_entry *entries = NULL;
+    ssize_t count = (dir_fd < 0) ? -1 : walk_tree(dir_fd, WALK_ORDERED, 1, match_extension, ".zip", &entries);
+    if (count < 0) {
         write(s1_conn, "", 0);
         return 0;
     }
     
     char file_list[BUFFER_SIZE * 2] = {0};
-    DIR *dir = opendir(s4_path);
-    if (dir) {
-        struct dirent *ent;
-        while ((ent = readdir(dir)) != NULL) {
-            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
-                continue;
-            }
-            
-            char *ext = strrchr(ent->d_name, '.');
-            if (ext && strcmp(ext, ".zip") == 0) {
-                char output_path[MAX_PATH_LEN];
-                snprintf(output_path, sizeof(output_path), "~S1/%s\n", ent->d_name);
-                strncat(file_list, output_path, BUFFER_SIZE * 2 - strlen(file_list) - 1);
-            }
-        }
-        closedir(dir);
+    for (ssize_t i = 0; i < count; i++) {
+        char output_path[MAX_PATH_LEN];
+        snprintf(output_path, sizeof(output_path), "~S1/%s\n", entries[i].path);
+        strncat(file_list, output_path, BUFFER_SIZE * 2 - strlen(file_list) - 1);
     }
+    walk_free(entries, count);
     
     write(s1_conn, file_list, strlen(file_list));
+    add_bytes(&metrics->bytes_out, strlen(file_list));
     return 0;
 }
 
+// copyf/movef of a file within this node, and movef of a directory (see copy_entry and move_entry)
+int handle_zip_copy(int s1_conn, char *src, char *dst, int move)
+{
+    unsigned long span_start = trace_start();
+    int result = move ? move_entry(src, dst) : copy_entry(src, dst);
+    trace_span(STAGE_TRANSFER, span_start);
+    if (result == 0) {
+        dprintf(s1_conn, "SUCCESS: %s %s to %s", src, move ? "moved" : "copied", dst);
+    } else if (errno == ENOENT) {
+        dprintf(s1_conn, "ERROR: %s not found in S4", src);
+    } else {
+        dprintf(s1_conn, "ERROR: %s in S4", strerror(errno));
+    }
+    return result;
+}
+
+// pushf: a copy or move to another file type, or a rebalance copy to a new node. The file goes
+// straight to the node on port as an uploadf there, so it never passes through S1; a move
+// removes it here once the target has it.
+int handle_zip_push(int s1_conn, char *src, char *dst, int port, int move, unsigned int rate)
+{
+    unsigned long span_start = trace_start();
+    const char *name;
+    int dir_fd = resolve_parent(src, 0, &name);
+    int fd = (dir_fd < 0) ? -1 : openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+    trace_span(STAGE_LOOKUP, span_start);
+    if (fd < 0) {
+        dprintf(s1_conn, "ERROR: %s not found in S4", src);
+        return -1;
+    }
+    
+    span_start = trace_start();
+    int result = push_file(port, fd, dst, rate);
+    close(fd);
+    trace_span(STAGE_TRANSFER, span_start);
+    if (result == 0 && move) unlink_counted(dir_fd, name, src);
+    
+    if (result == 0) {
+        dprintf(s1_conn, "SUCCESS: %s %s to %s", src, move ? "moved" : "copied", dst);
+    } else {
+        dprintf(s1_conn, "ERROR: Transfer of %s to port %d failed", src, port);
+    }
+    return result;
+}
+
+// Uploads the file behind fd to the storage node on port as dst, the way S1 forwards an upload.
+int push_file(int port, int fd, const char *dst, unsigned int rate)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    off_t size = st.st_size;
+    
+    const char *slash = strrchr(dst, '/');
+    if (slash == NULL) return -1;
+    char command[MAX_PATH_LEN * 2];
+    snprintf(command, sizeof(command), "uploadf %s %.*s", slash + 1, (int) (slash - dst), dst);
+    
+    // Rebalance copies are paced by the kernel to rate bytes per second. Only TCP is paced, so
+    // they never take the Unix socket.
+    int sockfd = connect_to_peer(port, rate == 0);
+    if (sockfd < 0) return -1;
+    if (rate > 0) setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+    char ready[5];
+    int failed = (write_all(sockfd, command, strlen(command)) < 0 || read_all(sockfd, ready, 5) < 0 ||
+                  memcmp(ready, "READY", 5) != 0 || write_all(sockfd, &size, sizeof(off_t)) < 0);
+    if (!failed) {
+        unsigned int crc = file_crc32c(fd);
+        failed = (send_payload(sockfd, fd, size, 0, slash + 1, NULL) != size || write_all(sockfd, &crc, sizeof(crc)) < 0);
+    }
+    if (!failed) {
+        // The target replies once the file is fully written
+        char result[BUFFER_SIZE];
+        bzero(result, BUFFER_SIZE);
+        failed = (read(sockfd, result, BUFFER_SIZE - 1) <= 0 || strncmp(result, "SUCCESS", 7) != 0);
+    }
+    close(sockfd);
+    return failed ? -1 : 0;
+}
+
+int connect_to_peer(int port, int allow_unix)
+{
+    int sockfd = allow_unix ? connect_unix(port) : -1;
+    if (sockfd < 0) {
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd < 0) return -1;
+        
+        struct sockaddr_in addr;
+        bzero((char *) &addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            close(sockfd);
+            return -1;
+        }
+        set_nodelay(sockfd);
+    }
+    
+    struct timeval timeout = { .tv_sec = PEER_IO_TIMEOUT_MS / 1000, .tv_usec = (PEER_IO_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return sockfd;
+}
+
+// Headers, payloads and trailers go out as separate writes; with Nagle the second one waits
+// for the peer's delayed ACK (about 40 ms) before it is sent
+void set_nodelay(int sockfd)
+{
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// <socket_dir>/dfs-<port>.sock, or -1 if that does not fit in sun_path
+int unix_socket_path(char *out, size_t len, int port)
+{
+    int n = snprintf(out, len, "%s/" UNIX_SOCKET_NAME, unix_socket_dir, port);
+    return (n < 0 || (size_t) n >= len) ? -1 : 0;
+}
+
+int listen_unix(int port)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (unix_socket_path(addr.sun_path, sizeof(addr.sun_path), port) < 0) return -1;
+    
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+    // A socket file left by an earlier run would make bind fail
+    unlink(addr.sun_path);
+    // Peers on the socket can be handed open files (openf), so only this user may connect. The
+    // umask has bind create the socket file as 0600; a chmod after it would leave a window.
+    mode_t old_mask = umask(077);
+    int bound = bind(sockfd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(sockfd, MAX_CLIENTS) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Returns -1 without -U or when no node on this host listens for port, so callers fall back to TCP
+int connect_unix(int port)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (unix_socket_dir == NULL || unix_socket_path(addr.sun_path, sizeof(addr.sun_path), port) < 0) return -1;
+    
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+    if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// openf: downlf for S1 on the same host. Over the Unix socket, which only this user can connect
+// to, S1 gets the file size and an open descriptor (SCM_RIGHTS) instead of the data and sends the
+// file to the client itself. Over TCP or for a missing file the reply is the usual downlf one.
+int handle_zip_open(int s1_conn, char *file_path)
+{
+    struct sockaddr_un local;
+    socklen_t local_len = sizeof(local);
+    struct ucred peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getsockname(s1_conn, (struct sockaddr *) &local, &local_len) != 0 || local.sun_family != AF_UNIX ||
+        getsockopt(s1_conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 || peer.uid != getuid()) {
+        return handle_zip_download(s1_conn, file_path);
+    }
+    
+    unsigned long span_start = trace_start();
+    const char *name;
+    int dir_fd = resolve_parent(file_path, 0, &name);
+    int fd = (dir_fd < 0) ? -1 : openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+    struct stat st;
+    int passable = (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+    trace_span(STAGE_LOOKUP, span_start);
+    if (!passable) {
+        if (fd >= 0) close(fd);
+        return handle_zip_download(s1_conn, file_path);
+    }
+    
+    int sent = send_fd(s1_conn, &st.st_size, sizeof(off_t), fd);
+    close(fd);
+    return sent;
+}
+
+// Sends len bytes with fd attached as SCM_RIGHTS
+int send_fd(int sockfd, const void *buf, size_t len, int fd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return (sendmsg(sockfd, &msg, MSG_NOSIGNAL) == (ssize_t) len) ? 0 : -1;
+}
+
+// findf: streams the .zip files below the path that match the query, then "END <count>". A
+// directory this node does not have simply has no matches.
+int find_zip_files(int s1_conn, char *args)
+{
+    struct find_query query;
+    char error[MAX_PATH_LEN];
+    if (parse_find_query(args, &query, error, sizeof(error)) < 0) {
+        dprintf(s1_conn, "ERROR: %s\n", error);
+        return -1;
+    }
+    
+    int dir_fd = resolve_dir(relative_path(query.path), 0);
+    long found = (dir_fd < 0) ? 0 : run_find(dir_fd, &query, s1_conn, ".zip", 0);
+    free_find_query(&query);
+    
+    char end[64];
+    int len = snprintf(end, sizeof(end), "END %ld\n", found);
+    return (send(s1_conn, end, len, MSG_NOSIGNAL) == len) ? 0 : -1;
+}
+
+// listf: every .zip file on the node as "<size> <crc32c> <path>", then "END <count>". Unlike
+// findf there is no limit, since a rebalance plans and verifies its copy from this listing.
+int list_zip_files(int s1_conn)
+{
+    struct find_query query;
+    char error[MAX_PATH_LEN];
+    char args[] = "~S1 *";
+    if (parse_find_query(args, &query, error, sizeof(error)) < 0) {
+        dprintf(s1_conn, "ERROR: %s\n", error);
+        return -1;
+    }
+    query.limit = LONG_MAX;
+    
+    long found = run_find(root_fd, &query, s1_conn, ".zip", 1);
+    free_find_query(&query);
+    
+    char end[64];
+    int len = snprintf(end, sizeof(end), "END %ld\n", found);
+    return (send(s1_conn, end, len, MSG_NOSIGNAL) == len) ? 0 : -1;
+}
+
+// Batched downlf/removef for one node: after READY, S1 sends an off_t length and a list of
+// newline-separated paths. Downloads answer with one record per path, removals with one
+// status line per path; the connection is closed after the last entry.
+int handle_zip_batch(int s1_conn, int cmd_id)
+{
+    write(s1_conn, "READY", 5);
+    
+    char *list = read_batch_list(s1_conn);
+    if (list == NULL) {
+        return -1;
+    }
+    
+    int failures = 0;
+    char *saveptr;
+    for (char *file_path = strtok_r(list, "\n", &saveptr); file_path != NULL;
+         file_path = strtok_r(NULL, "\n", &saveptr)) {
+        const char *name;
+        int dir_fd = resolve_parent(file_path, 0, &name);
+        
+        if (cmd_id == CMD_MDOWNLF) {
+            int fd = (dir_fd < 0) ? -1 : openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+            if (write_batch_record(s1_conn, file_path, fd) < 0) failures++;
+            if (fd >= 0) close(fd);
+        } else {
+            char status[MAX_PATH_LEN + 64];
+            int len;
+            if (dir_fd >= 0 && unlink_counted(dir_fd, name, file_path) == 0) {
+                len = snprintf(status, sizeof(status), "SUCCESS: %s deleted from S4\n", file_path);
+            } else {
+                len = snprintf(status, sizeof(status), "ERROR: %s not found in S4\n", file_path);
+                failures++;
+            }
+            write_all(s1_conn, status, len);
+        }
+    }
+    
+    free(list);
+    return failures ? -1 : 0;
+}
+
+// Delta upload (see receive_delta); the reply to the READY is the new file's size
+int handle_zip_delta(int s1_conn, char *file_path, char *dest_path)
+{
+    write(s1_conn, "READY", 5);
+    
+    unsigned long span_start = trace_start();
+    int dir_fd = resolve_dir(relative_path(dest_path), 1);
+    int old_fd = (dir_fd < 0) ? -1 : openat(dir_fd, file_path, O_RDONLY);
+    trace_span(STAGE_LOOKUP, span_start);
+    
+    struct dir_usage before = file_usage(dir_fd, file_path);
+    int result = receive_delta(s1_conn, dir_fd, file_path, old_fd);
+    if (old_fd >= 0) close(old_fd);
+    account_usage(dir_fd, relative_path(dest_path), file_path, before);
+    return result;
+}
+
+// Reads an off_t-prefixed path list; returns a NUL-terminated buffer the caller frees
+char *read_batch_list(int fd)
+{
+    off_t len;
+    if (read_all(fd, &len, sizeof(off_t)) < 0 || len < 0 || len > MAX_BATCH_BYTES) {
+        return NULL;
+    }
+    
+    char *list = malloc(len + 1);
+    if (list == NULL) {
+        return NULL;
+    }
+    if (read_all(fd, list, len) < 0) {
+        free(list);
+        return NULL;
+    }
+    list[len] = '\0';
+    return list;
+}
+
+// One mdownlf entry: off_t name length and name, then the usual download header (off_t size,
+// -1 if fd is invalid, and CRC32C) followed by the file data
+int write_batch_record(int out_fd, char *path, int fd)
+{
+    struct stat st;
+    off_t name_len = strlen(path);
+    off_t size = (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : -1;
+    
+    if (write_all(out_fd, &name_len, sizeof(off_t)) < 0 || write_all(out_fd, path, name_len) < 0 ||
+        write_all(out_fd, &size, sizeof(off_t)) < 0 || size < 0) {
+        return -1;
+    }
+    
+    unsigned int crc = file_crc32c(fd);
+    if (write_all(out_fd, &crc, sizeof(crc)) < 0) {
+        return -1;
+    }
+    
+    off_t sent = send_payload(out_fd, fd, size, session_compress, path, NULL);
+    add_bytes(&metrics->bytes_out, sent);
+    return (sent == size) ? 0 : -1;
+}
+
 int create_directory_structure(char *path) 
 {
     char *temp_path = strdup(path);
@@ -302,6 +1261,2068 @@ int create_directory_structure(char *path)
     return 0;
 }
 
+// Opens the storage root once at startup; every path below it is resolved with *at() calls
+void open_root_dir(void)
+{
+    char root_path[MAX_PATH_LEN];
+    snprintf(root_path, MAX_PATH_LEN, "%s/S4", getenv("HOME"));
+    create_directory_structure(root_path);
+    
+    root_fd = open(root_path, O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0) {
+        handle_error("Opening storage root failed");
+    }
+}
+
+// Strips the ~S1 prefix and leading slashes, leaving a path relative to the storage root
+const char *relative_path(const char *path)
+{
+    if (strncmp(path, "~S1", 3) == 0) path += 3;
+    while (*path == '/') path++;
+    return path;
+}
+
+// Returns an fd for dir (relative to the root, "" for the root itself) from a small LRU of
+// open directories, creating missing components if asked. ".." components are rejected so a
+// lookup cannot leave the root. The fd belongs to the cache; callers must not close it.
+int resolve_dir(const char *dir, int create)
+{
+    if (dir[0] == '\0') return root_fd;
+    if (strlen(dir) >= MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (const char *p = dir; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == dir || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            errno = EACCES;
+            return -1;
+        }
+    }
+    
+    int victim = 0;
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].path[0] != '\0' && strcmp(dir_cache[i].path, dir) == 0) {
+            dir_cache[i].last_used = ++dir_cache_clock;
+            return dir_cache[i].fd;
+        }
+        if (dir_cache[i].last_used < dir_cache[victim].last_used) victim = i;
+    }
+    
+    // A single openat covers the usual case of an existing directory; only when it is
+    // missing are the components created one by one with mkdirat
+    int fd = openat(root_fd, dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 && errno == ENOENT && create) {
+        char components[MAX_PATH_LEN];
+        strcpy(components, dir);
+        
+        int parent = root_fd;
+        char *saveptr;
+        for (char *name = strtok_r(components, "/", &saveptr); name != NULL; name = strtok_r(NULL, "/", &saveptr)) {
+            if (mkdirat(parent, name, 0755) < 0 && errno != EEXIST) {
+                fd = -1;
+            } else {
+                fd = openat(parent, name, O_RDONLY | O_DIRECTORY);
+            }
+            if (parent != root_fd) close(parent);
+            if (fd < 0) break;
+            parent = fd;
+        }
+    }
+    if (fd < 0) return -1;
+    
+    if (dir_cache[victim].path[0] != '\0') close(dir_cache[victim].fd);
+    strcpy(dir_cache[victim].path, dir);
+    dir_cache[victim].fd = fd;
+    dir_cache[victim].last_used = ++dir_cache_clock;
+    return fd;
+}
+
+// Splits a client path into the (cached) fd of its directory and its final component
+int resolve_parent(const char *path, int create, const char **leaf)
+{
+    const char *rel = relative_path(path);
+    const char *slash = strrchr(rel, '/');
+    int dir_fd;
+    
+    if (slash == NULL) {
+        *leaf = rel;
+        dir_fd = root_fd;
+    } else {
+        char dir[MAX_PATH_LEN];
+        if (slash - rel >= MAX_PATH_LEN) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(dir, rel, slash - rel);
+        dir[slash - rel] = '\0';
+        *leaf = slash + 1;
+        dir_fd = resolve_dir(dir, create);
+    }
+    
+    if (**leaf == '\0' || strcmp(*leaf, ".") == 0 || strcmp(*leaf, "..") == 0) {
+        errno = EACCES;
+        return -1;
+    }
+    return dir_fd;
+}
+
+unsigned long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+int latency_bucket(unsigned long us)
+{
+    if (us < 4) return (int) us;
+
+    int msb = 63 - __builtin_clzl(us);
+    int idx = (msb - 1) * 4 + (int) ((us >> (msb - 2)) & 3);
+    return (idx < HIST_BUCKETS) ? idx : HIST_BUCKETS - 1;
+}
+
+// Exclusive upper bound in microseconds of a histogram bucket
+unsigned long bucket_upper_bound(int idx)
+{
+    if (idx < 4) return idx + 1;
+    return (5UL + idx % 4) << (idx / 4 - 1);
+}
+
+void record_latency(struct latency_histogram *hist, unsigned long start_us, int failed)
+{
+    unsigned long elapsed = now_us() - start_us;
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum_us, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->buckets[latency_bucket(elapsed)], 1, __ATOMIC_RELAXED);
+    if (failed) {
+        __atomic_fetch_add(&hist->errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void add_bytes(unsigned long *counter, long n)
+{
+    if (n > 0) {
+        __atomic_fetch_add(counter, (unsigned long) n, __ATOMIC_RELAXED);
+    }
+}
+
+unsigned long histogram_percentile(struct latency_histogram *hist, double pct)
+{
+    unsigned long total = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    if (total == 0) return 0;
+
+    unsigned long target = (unsigned long) (total * pct / 100.0);
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if (seen > target) return bucket_upper_bound(i);
+    }
+    return bucket_upper_bound(HIST_BUCKETS - 1);
+}
+
+int format_stats(char *out, size_t len)
+{
+    size_t used = 0;
+    used += snprintf(out + used, len - used, "%-12s %10s %8s %10s %10s %10s %10s %10s\n",
+                     "command", "requests", "errors", "mean_us", "p50_us", "p95_us", "p99_us", "p999_us");
+    for (int i = 0; i < CMD_COUNT && used < len; i++) {
+        struct latency_histogram *hist = &metrics->commands[i];
+        unsigned long count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+        unsigned long sum = __atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED);
+        used += snprintf(out + used, len - used, "%-12s %10lu %8lu %10lu %10lu %10lu %10lu %10lu\n",
+                         command_names[i], count, __atomic_load_n(&hist->errors, __ATOMIC_RELAXED),
+                         count ? sum / count : 0,
+                         histogram_percentile(hist, 50), histogram_percentile(hist, 95),
+                         histogram_percentile(hist, 99), histogram_percentile(hist, 99.9));
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used, "bytes_in %lu\nbytes_out %lu\nin_flight %ld\n",
+                         __atomic_load_n(&metrics->bytes_in, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->bytes_out, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->in_flight, __ATOMIC_RELAXED));
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used, "compressed_payload_bytes %lu\ncompressed_wire_bytes %lu\n",
+                         __atomic_load_n(&metrics->wire_raw_bytes, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->wire_sent_bytes, __ATOMIC_RELAXED));
+    }
+    return (used < len) ? (int) used : (int) len - 1;
+}
+
+// Emits cumulative buckets at power-of-two boundaries to keep the exposition compact
+int format_prometheus(char *out, size_t len)
+{
+    size_t used = 0;
+    used += snprintf(out + used, len - used, "# TYPE dfs_request_duration_seconds histogram\n");
+    for (int i = 0; i < CMD_COUNT && used < len; i++) {
+        struct latency_histogram *hist = &metrics->commands[i];
+        unsigned long cumulative = 0;
+        for (int b = 0; b < HIST_BUCKETS && used < len; b++) {
+            cumulative += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+            if (b % 4 == 3) {
+                used += snprintf(out + used, len - used,
+                                 "dfs_request_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %lu\n",
+                                 command_names[i], bucket_upper_bound(b) / 1e6, cumulative);
+            }
+        }
+        if (used < len) {
+            used += snprintf(out + used, len - used,
+                             "dfs_request_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %lu\n"
+                             "dfs_request_duration_seconds_sum{command=\"%s\"} %g\n"
+                             "dfs_request_duration_seconds_count{command=\"%s\"} %lu\n"
+                             "dfs_request_errors_total{command=\"%s\"} %lu\n",
+                             command_names[i], cumulative,
+                             command_names[i], __atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED) / 1e6,
+                             command_names[i], __atomic_load_n(&hist->count, __ATOMIC_RELAXED),
+                             command_names[i], __atomic_load_n(&hist->errors, __ATOMIC_RELAXED));
+        }
+    }
+    if (used < len) {
+        used += snprintf(out + used, len - used,
+                         "# TYPE dfs_bytes_in_total counter\ndfs_bytes_in_total %lu\n"
+                         "# TYPE dfs_bytes_out_total counter\ndfs_bytes_out_total %lu\n"
+                         "# TYPE dfs_in_flight_requests gauge\ndfs_in_flight_requests %ld\n",
+                         __atomic_load_n(&metrics->bytes_in, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->bytes_out, __ATOMIC_RELAXED),
+                         __atomic_load_n(&metrics->in_flight, __ATOMIC_RELAXED));
+    }
+    return (used < len) ? (int) used : (int) len - 1;
+}
+
+// Sends this node's load and capacity to S1 as a UDP datagram every HEARTBEAT_INTERVAL_MS from a
+// dedicated child. The file count walks the whole tree, so it is only refreshed every
+// HEARTBEAT_FILE_COUNT_EVERY heartbeats. A port of 0 disables heartbeats.
+void run_heartbeat_sender(int port, int s1_port)
+{
+    if (s1_port <= 0) return;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        handle_error("Fork failed");
+    }
+    if (pid > 0) return;
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct hostent *server = gethostbyname("localhost");
+    if (sockfd < 0 || server == NULL) {
+        exit(1);
+    }
+
+    struct sockaddr_in s1_addr;
+    bzero((char *) &s1_addr, sizeof(s1_addr));
+    s1_addr.sin_family = AF_INET;
+    bcopy((char *)server->h_addr, (char *)&s1_addr.sin_addr.s_addr, server->h_length);
+    s1_addr.sin_port = htons(s1_port);
+
+    // Sent from this node's own port on the same host, which S1 checks each heartbeat against
+    struct sockaddr_in own_addr = s1_addr;
+    own_addr.sin_port = htons(port);
+    if (bind(sockfd, (struct sockaddr *) &own_addr, sizeof(own_addr)) < 0) {
+        handle_error("Heartbeat binding failed");
+    }
+
+    struct latency_histogram previous;
+    memset(&previous, 0, sizeof(previous));
+    unsigned long files = 0;
+    char message[BUFFER_SIZE];
+    for (unsigned long beat = 0; ; beat++) {
+        if (beat % HEARTBEAT_FILE_COUNT_EVERY == 0) {
+            files = count_files(root_fd);
+        }
+        int len = format_heartbeat(message, sizeof(message), port, &previous, files);
+        sendto(sockfd, message, len, 0, (struct sockaddr *) &s1_addr, sizeof(s1_addr));
+        usleep(HEARTBEAT_INTERVAL_MS * 1000);
+    }
+}
+
+// One heartbeat line. previous holds the command histograms summed at the last heartbeat, so
+// requests and p99_us describe only the interval since then.
+int format_heartbeat(char *out, size_t len, int port, struct latency_histogram *previous, unsigned long files)
+{
+    struct latency_histogram total, window;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < CMD_COUNT; i++) {
+        total.count += __atomic_load_n(&metrics->commands[i].count, __ATOMIC_RELAXED);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            total.buckets[b] += __atomic_load_n(&metrics->commands[i].buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+    window.count = total.count - previous->count;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        window.buckets[b] = total.buckets[b] - previous->buckets[b];
+    }
+    *previous = total;
+
+    struct statvfs fs;
+    unsigned long free_bytes = 0, total_bytes = 0;
+    if (fstatvfs(root_fd, &fs) == 0) {
+        free_bytes = (unsigned long) fs.f_bavail * fs.f_frsize;
+        total_bytes = (unsigned long) fs.f_blocks * fs.f_frsize;
+    }
+
+    return snprintf(out, len, "heartbeat port=%d in_flight=%ld requests=%lu p99_us=%lu free_bytes=%lu "
+                    "total_bytes=%lu files=%lu", port, __atomic_load_n(&metrics->in_flight, __ATOMIC_RELAXED),
+                    window.count, histogram_percentile(&window, 99), free_bytes, total_bytes, files);
+}
+
+// Counts regular files below dir_fd, which stays open
+unsigned long count_files(int dir_fd)
+{
+    ssize_t count = walk_tree(dir_fd, 0, 0, NULL, NULL, NULL);
+    return (count < 0) ? 0 : count;
+}
+
+// Size and count of one stored file, zero if there is none. Upload temporaries never count.
+struct dir_usage file_usage(int dir_fd, const char *name)
+{
+    struct dir_usage usage = { 0, 0 };
+    struct stat st;
+    if (dir_fd >= 0 && !is_temp_name(name) && fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        S_ISREG(st.st_mode)) {
+        usage.bytes = st.st_size;
+        usage.files = 1;
+    }
+    return usage;
+}
+
+// Adds delta to the aggregate of every directory above path (relative to the root), innermost
+// first. Directories without an aggregate are skipped; read_usage builds theirs by a scan.
+void update_usage(const char *path, struct dir_usage delta)
+{
+    if (delta.bytes == 0 && delta.files == 0) return;
+    
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    do {
+        char *slash = strrchr(dir, '/');
+        if (slash != NULL) *slash = '\0';
+        else dir[0] = '\0';
+        
+        // flock needs an open file of its own; root_fd is shared by every handler
+        int dir_fd = resolve_dir(dir, 0);
+        int lock_fd = (dir_fd < 0) ? -1 : openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+        if (lock_fd < 0) continue;
+        
+        struct dir_usage usage;
+        flock(lock_fd, LOCK_EX);
+        if (fgetxattr(lock_fd, USAGE_XATTR, &usage, sizeof(usage)) == sizeof(usage)) {
+            usage.bytes += delta.bytes;
+            usage.files += delta.files;
+            fsetxattr(lock_fd, USAGE_XATTR, &usage, sizeof(usage), 0);
+        }
+        flock(lock_fd, LOCK_UN);
+        close(lock_fd);
+    } while (dir[0] != '\0');
+}
+
+// Rolls up the change a write made to name in dir, given the file's usage beforehand
+void account_usage(int dir_fd, const char *dir, const char *name, struct dir_usage before)
+{
+    struct dir_usage after = file_usage(dir_fd, name);
+    struct dir_usage delta = { after.bytes - before.bytes, after.files - before.files };
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    update_usage(path, delta);
+}
+
+// unlinkat for stored files that also takes the file out of the aggregates above it
+int unlink_counted(int dir_fd, const char *name, const char *path)
+{
+    struct dir_usage before = file_usage(dir_fd, name);
+    if (unlinkat(dir_fd, name, 0) < 0) return -1;
+    
+    struct dir_usage delta = { -before.bytes, -before.files };
+    update_usage(relative_path(path), delta);
+    return 0;
+}
+
+// Usage below dir_fd from its aggregate. Without one, or with rescan, the subtree is walked,
+// and every directory on the way gets a fresh aggregate, so later queries are a single read.
+int read_usage(int dir_fd, int rescan, struct dir_usage *usage)
+{
+    if (!rescan && fgetxattr(dir_fd, USAGE_XATTR, usage, sizeof(*usage)) == sizeof(*usage)) {
+        return 0;
+    }
+    
+    int list_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = (list_fd < 0) ? NULL : fdopendir(list_fd);
+    if (dir == NULL) {
+        if (list_fd >= 0) close(list_fd);
+        return -1;
+    }
+    
+    usage->bytes = 0;
+    usage->files = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || is_temp_name(ent->d_name)) {
+            continue;
+        }
+        
+        unsigned char type = ent->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        struct dir_usage sub = { 0, 0 };
+        if (type == DT_DIR) {
+            int sub_fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub_fd >= 0) {
+                read_usage(sub_fd, rescan, &sub);
+                close(sub_fd);
+            }
+        } else if (type == DT_REG) {
+            sub = file_usage(dirfd(dir), ent->d_name);
+        }
+        usage->bytes += sub.bytes;
+        usage->files += sub.files;
+    }
+    closedir(dir);
+    
+    fsetxattr(dir_fd, USAGE_XATTR, usage, sizeof(*usage), 0);
+    return 0;
+}
+
+// Copies src to dst (~S1 paths on this server) without the data leaving the kernel: a reflink
+// where the filesystem has them, else copy_file_range, else sendfile. The copy keeps the stored
+// form and CRC32C of the source and is renamed into place once complete.
+int copy_entry(const char *src, const char *dst)
+{
+    const char *src_name, *dst_name;
+    int src_dir_fd = resolve_parent(src, 0, &src_name);
+    int in_fd = (src_dir_fd < 0) ? -1 : openat(src_dir_fd, src_name, O_RDONLY | O_NOFOLLOW);
+    struct stat st;
+    if (in_fd < 0 || fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (in_fd >= 0) close(in_fd);
+        errno = ENOENT;
+        return -1;
+    }
+    
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), ".copy.%d", getpid());
+    int dst_dir_fd = resolve_parent(dst, 1, &dst_name);
+    int out_fd = (dst_dir_fd < 0) ? -1 : openat(dst_dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        close(in_fd);
+        return -1;
+    }
+    
+    off_t copied = 0;
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        copied = st.st_size;
+    } else {
+        // copy_file_range advances both offsets, so the fallback carries on from where it stopped
+        ssize_t n;
+        while (copied < st.st_size &&
+               (n = syscall(SYS_copy_file_range, in_fd, NULL, out_fd, NULL, st.st_size - copied, 0)) > 0) {
+            copied += n;
+        }
+        off_t rest = (copied < st.st_size) ? transfer_data(out_fd, in_fd, st.st_size - copied) : 0;
+        if (rest > 0) copied += rest;
+    }
+    unsigned int crc;
+    if (copied == st.st_size && stored_crc32c(in_fd, &crc) == 0) {
+        store_crc32c(out_fd, crc);
+    }
+    close(in_fd);
+    close(out_fd);
+    
+    struct dir_usage before = file_usage(dst_dir_fd, dst_name);
+    if (copied != st.st_size || renameat(dst_dir_fd, tmp_name, dst_dir_fd, dst_name) < 0) {
+        int saved_errno = (copied != st.st_size) ? EIO : errno;
+        unlinkat(dst_dir_fd, tmp_name, 0);
+        errno = saved_errno;
+        return -1;
+    }
+    struct dir_usage after = file_usage(dst_dir_fd, dst_name);
+    struct dir_usage delta = { after.bytes - before.bytes, after.files - before.files };
+    update_usage(relative_path(dst), delta);
+    return 0;
+}
+
+// Renames src to dst on this server with one renameat; src may be a file or a whole directory,
+// whose totals move with it and are taken off its old ancestors and added to its new ones
+int move_entry(const char *src, const char *dst)
+{
+    const char *src_name, *dst_name;
+    int src_dir_fd = resolve_parent(src, 0, &src_name);
+    struct stat st;
+    if (src_dir_fd < 0 || fstatat(src_dir_fd, src_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    
+    struct dir_usage moved = { 0, 0 }, replaced = { 0, 0 };
+    int is_dir = S_ISDIR(st.st_mode);
+    if (is_dir) {
+        int dir_fd = resolve_dir(relative_path(src), 0);
+        if (dir_fd < 0 || read_usage(dir_fd, 0, &moved) < 0) return -1;
+    } else {
+        moved = file_usage(src_dir_fd, src_name);
+    }
+    
+    int dst_dir_fd = resolve_parent(dst, 1, &dst_name);
+    if (dst_dir_fd < 0) return -1;
+    if (!is_dir) replaced = file_usage(dst_dir_fd, dst_name);
+    if (renameat(src_dir_fd, src_name, dst_dir_fd, dst_name) < 0) return -1;
+    if (is_dir) forget_dirs(relative_path(src));
+    
+    struct dir_usage removed = { -moved.bytes, -moved.files };
+    struct dir_usage added = { moved.bytes - replaced.bytes, moved.files - replaced.files };
+    update_usage(relative_path(src), removed);
+    update_usage(relative_path(dst), added);
+    return 0;
+}
+
+// Drops the cached fds of dir and everything below it once the directory has been renamed
+void forget_dirs(const char *dir)
+{
+    size_t len = strlen(dir);
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].path[0] != '\0' && strncmp(dir_cache[i].path, dir, len) == 0 &&
+            (dir_cache[i].path[len] == '\0' || dir_cache[i].path[len] == '/')) {
+            close(dir_cache[i].fd);
+            dir_cache[i].path[0] = '\0';
+            dir_cache[i].last_used = 0;
+        }
+    }
+}
+
+// Walks the tree below root_fd with a pool of threads and returns the regular files whose
+// name match accepts (all of them when match is NULL); with WALK_DIRS directories are listed
+// too. max_depth 1 reads root_fd only, 0 means no limit. Upload temporaries (is_temp_name) are
+// skipped. With entries NULL the matches are only counted. Otherwise *entries gets an array
+// the caller releases with walk_free, sorted by path under WALK_ORDERED and in discovery order
+// otherwise. match gets the file's lstat under WALK_STAT (NULL otherwise); a match function
+// returning a negative value ends the walk early. root_fd stays open.
+ssize_t walk_tree(int root_fd, int flags, int max_depth, walk_match_fn match, void *arg,
+                  struct walk_entry **entries)
+{
+    struct walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.root_fd = root_fd;
+    walk.flags = flags | ((entries == NULL) ? WALK_COUNT_ONLY : 0);
+    walk.max_depth = max_depth;
+    walk.match = match;
+    walk.arg = arg;
+    // A single directory gains nothing from more threads
+    walk.threads = (max_depth == 1) ? 1 : walk_threads;
+    walk.workers = calloc(walk.threads, sizeof(struct walk_worker));
+    if (walk.workers == NULL) return -1;
+    
+    for (int i = 0; i < walk.threads; i++) {
+        walk.workers[i].walk = &walk;
+        walk.workers[i].id = i;
+        pthread_mutex_init(&walk.workers[i].deque.lock, NULL);
+    }
+    
+    struct walk_item root = { strdup(""), -1, 0 };
+    walk.pending = 1;
+    if (root.path == NULL || walk_push(&walk.workers[0].deque, root) < 0) {
+        free(root.path);
+        walk.pending = 0;
+    }
+    
+    // The calling thread is worker 0; if threads cannot be started the others just do more
+    pthread_t tids[WALK_MAX_THREADS];
+    int started = 1;
+    while (started < walk.threads &&
+           pthread_create(&tids[started], NULL, walk_worker_main, &walk.workers[started]) == 0) {
+        started++;
+    }
+    walk_worker_main(&walk.workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    
+    ssize_t total = 0;
+    for (int i = 0; i < walk.threads; i++) {
+        total += walk.workers[i].count;
+    }
+    struct walk_entry *all = NULL;
+    if (entries != NULL) {
+        all = malloc((total > 0 ? total : 1) * sizeof(struct walk_entry));
+        size_t filled = 0;
+        for (int i = 0; i < walk.threads; i++) {
+            if (all != NULL) {
+                memcpy(all + filled, walk.workers[i].entries, walk.workers[i].count * sizeof(struct walk_entry));
+            } else {
+                walk_free(walk.workers[i].entries, walk.workers[i].count);
+            }
+            filled += walk.workers[i].count;
+        }
+        if (all != NULL && (flags & WALK_ORDERED)) {
+            qsort(all, total, sizeof(struct walk_entry), compare_walk_entries);
+        }
+        *entries = all;
+    }
+    for (int i = 0; i < walk.threads; i++) {
+        free(walk.workers[i].entries);
+        free(walk.workers[i].deque.items);
+        pthread_mutex_destroy(&walk.workers[i].deque.lock);
+    }
+    free(walk.workers);
+    return (entries != NULL && all == NULL) ? -1 : total;
+}
+
+void walk_free(struct walk_entry *entries, ssize_t count)
+{
+    for (ssize_t i = 0; i < count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+int compare_walk_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct walk_entry *) a)->path, ((const struct walk_entry *) b)->path);
+}
+
+// Takes directories from its own deque first, then steals from the others. pending counts the
+// directories queued or being read, so the walk is over once it drops to zero.
+void *walk_worker_main(void *arg)
+{
+    struct walk_worker *worker = arg;
+    struct walk *walk = worker->walk;
+    char *buffer = malloc(WALK_BUFFER_SIZE);
+    if (buffer == NULL) return NULL;
+    
+    int idle = 0;
+    while (1) {
+        struct walk_item item;
+        int found = (walk_pop(&worker->deque, &item) == 0);
+        for (int i = 1; !found && i < walk->threads; i++) {
+            found = (walk_steal(&walk->workers[(worker->id + i) % walk->threads].deque, &item) == 0);
+        }
+        
+        if (found) {
+            walk_read_dir(worker, &item, buffer);
+            __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+            idle = 0;
+        } else if (__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else if (++idle < WALK_SPIN_LIMIT) {
+            sched_yield();
+        } else {
+            usleep(WALK_IDLE_SLEEP_US);
+        }
+    }
+    
+    free(buffer);
+    return NULL;
+}
+
+// Names the servers give files while writing them (.copy.<pid>, .plain.<pid>, .pull.<pid>,
+// .<name>.<pid>.delta); they are never listed, archived or counted
+int is_temp_name(const char *name)
+{
+    const char *prefixes[] = { ".copy.", ".plain.", ".pull." };
+    for (int i = 0; i < 3; i++) {
+        size_t len = strlen(prefixes[i]);
+        if (strncmp(name, prefixes[i], len) == 0 && name[len] != '\0' &&
+            strspn(name + len, "0123456789") == strlen(name + len)) {
+            return 1;
+        }
+    }
+    size_t len = strlen(name);
+    if (name[0] != '.' || len < 9 || strcmp(name + len - 6, ".delta") != 0) return 0;
+    size_t digits = len - 6;
+    while (digits > 0 && name[digits - 1] >= '0' && name[digits - 1] <= '9') digits--;
+    return digits < len - 6 && digits > 1 && name[digits - 1] == '.';
+}
+
+// Reads one directory with getdents64, queueing its subdirectories on this worker's deque.
+// Subdirectories are opened relative to their parent while fewer than WALK_MAX_OPEN_DIRS are
+// held; past that they are reopened by path from the root when their turn comes.
+void walk_read_dir(struct walk_worker *worker, struct walk_item *item, char *buffer)
+{
+    struct walk *walk = worker->walk;
+    int fd = item->fd;
+    if (fd >= 0) {
+        __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+    } else if (!__atomic_load_n(&walk->stop, __ATOMIC_RELAXED)) {
+        fd = openat(walk->root_fd, item->path[0] ? item->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    if (fd < 0) {
+        free(item->path);
+        return;
+    }
+    
+    long n;
+    // Once the walk is stopped the directories still queued are only closed
+    while (!__atomic_load_n(&walk->stop, __ATOMIC_RELAXED) &&
+           (n = syscall(SYS_getdents64, fd, buffer, WALK_BUFFER_SIZE)) > 0) {
+        for (long offset = 0; offset < n; ) {
+            struct linux_dirent64 *ent = (struct linux_dirent64 *) (buffer + offset);
+            offset += ent->d_reclen;
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || is_temp_name(ent->d_name)) {
+                continue;
+            }
+            
+            unsigned char type = ent->d_type;
+            struct stat st;
+            int have_stat = 0;
+            if (type == DT_UNKNOWN || (type == DT_REG && (walk->flags & WALK_STAT))) {
+                if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                have_stat = 1;
+            }
+            if (type != DT_DIR && type != DT_REG) continue;
+            if (type == DT_REG && walk->match == NULL && (walk->flags & WALK_COUNT_ONLY)) {
+                // Plain counting never needs the file's path
+                worker->count++;
+                continue;
+            }
+            
+            char path[MAX_PATH_LEN];
+            if (snprintf(path, sizeof(path), "%s%s%s", item->path, item->path[0] ? "/" : "",
+                         ent->d_name) >= (int) sizeof(path)) {
+                continue;
+            }
+            
+            if (type == DT_DIR && (walk->max_depth == 0 || item->depth + 1 < walk->max_depth)) {
+                struct walk_item child = { strdup(path), -1, item->depth + 1 };
+                if (__atomic_add_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED) <= WALK_MAX_OPEN_DIRS) {
+                    child.fd = openat(fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                }
+                if (child.fd < 0) __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+                
+                __atomic_add_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+                if (child.path == NULL || walk_push(&worker->deque, child) < 0) {
+                    // Out of memory: the subtree is left out rather than the walk failing
+                    __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+                    if (child.fd >= 0) {
+                        close(child.fd);
+                        __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+                    }
+                    free(child.path);
+                }
+            }
+            
+            if (type == DT_DIR && !(walk->flags & WALK_DIRS)) continue;
+            int keep = (walk->match == NULL) ? 1 : walk->match(path, ent->d_name, have_stat ? &st : NULL, walk->arg);
+            if (keep < 0) {
+                __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (!keep) continue;
+            if (walk->flags & WALK_COUNT_ONLY) {
+                worker->count++;
+                continue;
+            }
+            if (worker->count == worker->capacity) {
+                size_t capacity = worker->capacity ? worker->capacity * 2 : 256;
+                struct walk_entry *grown = realloc(worker->entries, capacity * sizeof(struct walk_entry));
+                if (grown == NULL) continue;
+                worker->entries = grown;
+                worker->capacity = capacity;
+            }
+            struct walk_entry *entry = &worker->entries[worker->count];
+            entry->path = strdup(path);
+            entry->type = type;
+            entry->size = 0;
+            entry->mtime = 0;
+            if ((walk->flags & WALK_STAT) && type == DT_REG && have_stat) {
+                entry->size = st.st_size;
+                entry->mtime = st.st_mtime;
+            }
+            if (entry->path != NULL) worker->count++;
+        }
+    }
+    
+    close(fd);
+    free(item->path);
+}
+
+int walk_push(struct walk_deque *deque, struct walk_item item)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(item));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            struct walk_item *grown = realloc(deque->items, capacity * sizeof(item));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->items = grown;
+            deque->capacity = capacity;
+        }
+    }
+    deque->items[deque->tail++] = item;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// The owner works depth first from the bottom of its deque...
+int walk_pop(struct walk_deque *deque, struct walk_item *item)
+{
+    int result = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[--deque->tail];
+        result = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return result;
+}
+
+// ... while thieves take from the top, where the directories nearest the root and so the
+// largest remaining subtrees are
+int walk_steal(struct walk_deque *deque, struct walk_item *item)
+{
+    if (__atomic_load_n(&deque->tail, __ATOMIC_RELAXED) == __atomic_load_n(&deque->head, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    int result = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[deque->head++];
+        result = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return result;
+}
+
+// walk_match_fn for files with the extension given as arg
+int match_extension(const char *path, const char *name, const struct stat *st, void *arg)
+{
+    (void) path;
+    (void) st;
+    const char *ext = strrchr(name, '.');
+    return ext != NULL && strcmp(ext, (const char *) arg) == 0;
+}
+
+// Parses "<~S1 path> <glob|/regex/> [size>N] [size<N] [mtime<AGE] [mtime>AGE] [limit=N]". N takes
+// a K/M/G suffix and AGE an s/m/h/d one; mtime<2h means modified in the last two hours. The
+// pattern is matched against file names only. args is modified; on success the caller releases
+// the query with free_find_query.
+int parse_find_query(char *args, struct find_query *query, char *error, size_t len)
+{
+    memset(query, 0, sizeof(*query));
+    query->min_size = -1;
+    query->max_size = -1;
+    query->limit = FIND_DEFAULT_LIMIT;
+    
+    char *saveptr = NULL;
+    char *path = (args == NULL) ? NULL : strtok_r(args, " ", &saveptr);
+    char *pattern = (path == NULL) ? NULL : strtok_r(NULL, " ", &saveptr);
+    if (pattern == NULL || strncmp(path, "~S1", 3) != 0) {
+        snprintf(error, len, "Invalid findf format");
+        return -1;
+    }
+    snprintf(query->path, sizeof(query->path), "%s", path);
+    
+    size_t pattern_len = strlen(pattern);
+    if (pattern_len > 2 && pattern[0] == '/' && pattern[pattern_len - 1] == '/') {
+        pattern[pattern_len - 1] = '\0';
+        if (regcomp(&query->regex, pattern + 1, REG_EXTENDED | REG_NOSUB) != 0) {
+            snprintf(error, len, "Invalid regular expression %s/", pattern);
+            return -1;
+        }
+        query->use_regex = 1;
+    } else {
+        snprintf(query->pattern, sizeof(query->pattern), "%s", pattern);
+    }
+    
+    time_t now = time(NULL);
+    char *token;
+    while ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+        long value = -1;
+        if (strncmp(token, "size>", 5) == 0 && (value = parse_size(token + 5)) >= 0) {
+            query->min_size = value;
+        } else if (strncmp(token, "size<", 5) == 0 && (value = parse_size(token + 5)) >= 0) {
+            query->max_size = value;
+        } else if (strncmp(token, "mtime<", 6) == 0 && (value = parse_age(token + 6)) >= 0) {
+            query->newer_than = now - value;
+        } else if (strncmp(token, "mtime>", 6) == 0 && (value = parse_age(token + 6)) >= 0) {
+            query->older_than = now - value;
+        } else if (strncmp(token, "limit=", 6) == 0 && (value = atol(token + 6)) > 0 && value <= FIND_MAX_LIMIT) {
+            query->limit = value;
+        } else {
+            snprintf(error, len, "Invalid findf predicate %s", token);
+            free_find_query(query);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void free_find_query(struct find_query *query)
+{
+    if (query->use_regex) {
+        regfree(&query->regex);
+        query->use_regex = 0;
+    }
+}
+
+// "512", "64K", "10M" or "2G"; -1 if malformed
+long parse_size(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value < 0) return -1;
+    if (*end == 'K') value <<= 10;
+    else if (*end == 'M') value <<= 20;
+    else if (*end == 'G') value <<= 30;
+    else if (*end != '\0') return -1;
+    return value;
+}
+
+// Seconds in "<n>[s|m|h|d]", or -1
+long parse_age(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value < 0) return -1;
+    if (*end == 'm') value *= 60;
+    else if (*end == 'h') value *= 3600;
+    else if (*end == 'd') value *= 86400;
+    else if (*end != 's' && *end != '\0') return -1;
+    return value;
+}
+
+// walk_match_fn for findf: writes each file that satisfies the query to out_fd as soon as it is
+// found, and ends the walk at the limit, on cancellation or once out_fd is closed
+int find_match(const char *path, const char *name, const struct stat *st, void *arg)
+{
+    struct find_search *search = arg;
+    struct find_query *query = search->query;
+    if (__atomic_load_n(&search->stop, __ATOMIC_RELAXED) || __atomic_load_n(&query->cancelled, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    if (st == NULL || !match_extension(path, name, st, (void *) search->ext)) return 0;
+    if (query->use_regex ? regexec(&query->regex, name, 0, NULL, 0) != 0 : fnmatch(query->pattern, name, 0) != 0) {
+        return 0;
+    }
+    
+    off_t size = st->st_size;
+    if ((query->min_size >= 0 && size <= query->min_size) || (query->max_size >= 0 && size >= query->max_size) ||
+        (query->newer_than && st->st_mtime < query->newer_than) ||
+        (query->older_than && st->st_mtime > query->older_than)) {
+        return 0;
+    }
+    
+    char modified[32];
+    struct tm tm;
+    strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", localtime_r(&st->st_mtime, &tm));
+    char line[MAX_PATH_LEN * 2];
+    int len = snprintf(line, sizeof(line), "%10lld  %s  %s%s\n", (long long) size, modified, search->prefix, path);
+    if (search->checksums) {
+        unsigned int crc;
+        if (path_crc32c(search->root_fd, path, st, &crc) < 0) return 0;
+        len = snprintf(line, sizeof(line), "%lld %08x %s%s\n", (long long) size, crc, search->prefix, path);
+    }
+    if (len >= (int) sizeof(line)) return 0;
+    
+    // Lines from the walker threads must not interleave; MSG_NOSIGNAL turns a closed peer into EPIPE
+    int result = 0;
+    pthread_mutex_lock(&search->lock);
+    if (search->stop || send(search->out_fd, line, len, MSG_NOSIGNAL) != len || ++search->found >= query->limit) {
+        __atomic_store_n(&search->stop, 1, __ATOMIC_RELAXED);
+        result = -1;
+    }
+    pthread_mutex_unlock(&search->lock);
+    return result;
+}
+
+// Streams the ext files below dir_fd that match query to out_fd; returns how many were sent.
+// With checksums, each line is "<size> <crc32c> <path>" instead of the findf listing.
+long run_find(int dir_fd, struct find_query *query, int out_fd, const char *ext, int checksums)
+{
+    struct find_search search;
+    memset(&search, 0, sizeof(search));
+    search.query = query;
+    search.root_fd = dir_fd;
+    search.out_fd = out_fd;
+    search.ext = ext;
+    search.checksums = checksums;
+    // Results carry their full path, ~S1/<dir>/<path below it>
+    const char *relative = relative_path(query->path);
+    int relative_len = strlen(relative);
+    while (relative_len > 0 && relative[relative_len - 1] == '/') relative_len--;
+    snprintf(search.prefix, sizeof(search.prefix), "~S1/%.*s%s", relative_len, relative, relative_len ? "/" : "");
+    pthread_mutex_init(&search.lock, NULL);
+    
+    walk_tree(dir_fd, WALK_STAT, 0, find_match, &search, NULL);
+    
+    pthread_mutex_destroy(&search.lock);
+    return search.found;
+}
+
+// Maps the change feed and forks the watcher that fills it from inotify. The storage tree is
+// watched before the fork, and like the log ring this runs before the accept loop, so every
+// handler can read the feed and nothing written once the server accepts is missed.
+void start_change_watcher(void)
+{
+    changes = mmap(NULL, sizeof(struct change_feed), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (changes == MAP_FAILED) {
+        handle_error("Change feed allocation failed");
+    }
+
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        log_message(LOG_WARN, "event=change_feed_disabled errno=%d", errno);
+        return;
+    }
+    changes->epoch = wall_clock_us();
+    changes->next = 1;
+    watch_tree(inotify_fd, root_fd, "", 0);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        handle_error("Fork failed");
+    }
+    if (pid > 0) {
+        close(inotify_fd);
+        for (int wd = 0; wd < watch_capacity; wd++) {
+            free(watch_paths[wd]);
+        }
+        free(watch_paths);
+        watch_paths = NULL;
+        watch_capacity = 0;
+        return;
+    }
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    run_change_watcher(inotify_fd);
+    exit(0);
+}
+
+// Turns inotify events into feed records. A new file is announced once its writer closes it,
+// so consumers never see a create for a half-written upload.
+void run_change_watcher(int inotify_fd)
+{
+    char *events = malloc(CHANGE_EVENT_BUFFER);
+    char pending[CHANGE_PENDING_CREATES][MAX_PATH_LEN];
+    int pending_count = 0;
+    if (events == NULL) {
+        exit(1);
+    }
+
+    while (1) {
+        ssize_t len = read(inotify_fd, events, CHANGE_EVENT_BUFFER);
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) continue;
+            exit(1);
+        }
+
+        for (char *ptr = events; ptr < events + len; ) {
+            struct inotify_event *ev = (struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                log_message(LOG_WARN, "event=change_feed_overflow seq=%lu", changes->next);
+                mark_resync();
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= watch_capacity || watch_paths[ev->wd] == NULL) continue;
+            if (ev->mask & IN_IGNORED) {
+                free(watch_paths[ev->wd]);
+                watch_paths[ev->wd] = NULL;
+                continue;
+            }
+            // Upload and delta temporaries are renamed into place; only the final name is a change
+            if (ev->len == 0 || is_temp_name(ev->name)) continue;
+
+            char path[MAX_PATH_LEN];
+            const char *dir = watch_paths[ev->wd];
+            snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] ? "/" : "", ev->name);
+
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    // Files can land in a new directory before its watch exists, so it is
+                    // scanned and whatever it already holds is announced
+                    int dir_fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                    if (dir_fd >= 0) {
+                        watch_tree(inotify_fd, dir_fd, path, 1);
+                        close(dir_fd);
+                    }
+                } else if (ev->mask & IN_MOVED_FROM) {
+                    // The files under it are not listed; a trailing slash deletes the subtree
+                    unwatch_tree(inotify_fd, path);
+                    strncat(path, "/", sizeof(path) - strlen(path) - 1);
+                    record_change('D', path);
+                }
+                continue;
+            }
+
+            int slot = -1;
+            for (int i = 0; i < pending_count; i++) {
+                if (strcmp(pending[i], path) == 0) slot = i;
+            }
+            if (slot >= 0 && (ev->mask & (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM))) {
+                memmove(pending[slot], pending[slot + 1], (pending_count - slot - 1) * MAX_PATH_LEN);
+                pending_count--;
+            }
+
+            if (ev->mask & IN_CREATE) {
+                if (pending_count == CHANGE_PENDING_CREATES) {
+                    // Created but never written, such as a link; announce the oldest anyway
+                    record_change('C', pending[0]);
+                    memmove(pending[0], pending[1], (pending_count - 1) * MAX_PATH_LEN);
+                    pending_count--;
+                }
+                snprintf(pending[pending_count++], MAX_PATH_LEN, "%s", path);
+            } else if (ev->mask & IN_CLOSE_WRITE) {
+                record_change(slot >= 0 ? 'C' : 'M', path);
+            } else if (ev->mask & IN_MOVED_TO) {
+                record_change('C', path);
+            } else if ((ev->mask & (IN_DELETE | IN_MOVED_FROM)) && slot < 0) {
+                record_change('D', path);
+            }
+        }
+    }
+}
+
+// Watches dir_fd (at path below the root) and every directory under it. With announce set,
+// the regular files found are recorded as created.
+int watch_tree(int inotify_fd, int dir_fd, const char *path, int announce)
+{
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", dir_fd);
+    int wd = inotify_add_watch(inotify_fd, proc_path, IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM |
+                               IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK);
+    if (wd < 0) {
+        // Typically fs.inotify.max_user_watches; changes below here would go unseen
+        log_message(LOG_WARN, "event=change_watch_failed path=\"%s\" errno=%d", path, errno);
+        __atomic_store_n(&changes->incomplete, 1, __ATOMIC_RELEASE);
+        mark_resync();
+        return -1;
+    }
+    if (wd >= watch_capacity) {
+        int capacity = (wd + 1) * 2;
+        char **grown = realloc(watch_paths, capacity * sizeof(char *));
+        if (grown == NULL) return -1;
+        memset(grown + watch_capacity, 0, (capacity - watch_capacity) * sizeof(char *));
+        watch_paths = grown;
+        watch_capacity = capacity;
+    }
+    free(watch_paths[wd]);
+    watch_paths[wd] = strdup(path);
+
+    int list_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = (list_fd < 0) ? NULL : fdopendir(list_fd);
+    if (dir == NULL) {
+        if (list_fd >= 0) close(list_fd);
+        return -1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || is_temp_name(ent->d_name)) {
+            continue;
+        }
+
+        char child[MAX_PATH_LEN];
+        snprintf(child, sizeof(child), "%s%s%s", path, path[0] ? "/" : "", ent->d_name);
+        unsigned char type = ent->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            int sub_fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub_fd >= 0) {
+                watch_tree(inotify_fd, sub_fd, child, announce);
+                close(sub_fd);
+            }
+        } else if (type == DT_REG && announce) {
+            record_change('C', child);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Drops the watches on path and below it after the directory was moved away
+void unwatch_tree(int inotify_fd, const char *path)
+{
+    size_t len = strlen(path);
+    for (int wd = 0; wd < watch_capacity; wd++) {
+        if (watch_paths[wd] != NULL && strncmp(watch_paths[wd], path, len) == 0 &&
+            (watch_paths[wd][len] == '\0' || watch_paths[wd][len] == '/')) {
+            inotify_rm_watch(inotify_fd, wd);
+            free(watch_paths[wd]);
+            watch_paths[wd] = NULL;
+        }
+    }
+}
+
+// Appends a record; only the watcher writes, so next needs no atomic increment
+void record_change(char type, const char *path)
+{
+    unsigned long seq = changes->next;
+    struct change_record *record = &changes->records[seq % CHANGE_RING_SIZE];
+
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    record->time_us = wall_clock_us();
+    record->type = type;
+    snprintf(record->path, sizeof(record->path), "%s", path);
+    __atomic_store_n(&record->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&changes->next, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Events were lost. Every cursor before the marker record appended here has to rescan; the
+// marker is never listed, and cursors handed out from now on are at or past it.
+void mark_resync(void)
+{
+    __atomic_store_n(&changes->resync_seq, changes->next, __ATOMIC_RELEASE);
+    record_change('R', "");
+}
+
+// Answers "changes [cursor] [wait_ms]". The cursor is "<epoch>:<seq>" as returned by the last
+// call. The reply is a "cursor <epoch>:<seq>" line followed by one "<seq> <C|M|D> ~S1/<path>"
+// line per record after the given one. It starts with "resync" instead, and has no records,
+// when the consumer has no cursor, the server restarted, or records it needs were overwritten
+// or lost; the consumer then lists the tree again and continues from the new cursor. The
+// header ends in " incomplete" once some directory could not be watched, since changes below
+// it are never recorded. With nothing new, the call waits up to wait_ms for the first record.
+int serve_changes(int conn, const char *cursor, int wait_ms)
+{
+    if (changes == NULL || changes->epoch == 0) {
+        write(conn, "ERROR: Change feed unavailable\n", 31);
+        return -1;
+    }
+
+    unsigned long epoch = 0, since = 0;
+    int have_cursor = (cursor != NULL && sscanf(cursor, "%lx:%lu", &epoch, &since) == 2 &&
+                       epoch == changes->epoch);
+    if (wait_ms > CHANGE_MAX_WAIT_MS) wait_ms = CHANGE_MAX_WAIT_MS;
+
+    unsigned long next = __atomic_load_n(&changes->next, __ATOMIC_ACQUIRE);
+    for (int waited = 0; have_cursor && next <= since + 1 && waited < wait_ms; waited += CHANGE_POLL_MS) {
+        usleep(CHANGE_POLL_MS * 1000);
+        next = __atomic_load_n(&changes->next, __ATOMIC_ACQUIRE);
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (out == NULL) {
+        write(conn, "ERROR: Out of memory\n", 21);
+        return -1;
+    }
+
+    int resync = (!have_cursor || since >= next || since < __atomic_load_n(&changes->resync_seq, __ATOMIC_ACQUIRE) ||
+                  next - since - 1 > CHANGE_RING_SIZE);
+    unsigned long last = since;
+    for (unsigned long seq = since + 1; !resync && seq < next; seq++) {
+        struct change_record record;
+        struct change_record *slot = &changes->records[seq % CHANGE_RING_SIZE];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) break;
+        memcpy(&record, slot, sizeof(record));
+        // Overwritten while copying; the next call from last will be told to resync
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) break;
+
+        if (record.type != 'R') fprintf(out, "%lu %c ~S1/%s\n", seq, record.type, record.path);
+        last = seq;
+    }
+    fclose(out);
+
+    char header[96];
+    int header_len = snprintf(header, sizeof(header), "%s %lx:%lu%s\n", resync ? "resync" : "cursor",
+                              changes->epoch, resync ? next - 1 : last,
+                              __atomic_load_n(&changes->incomplete, __ATOMIC_ACQUIRE) ? " incomplete" : "");
+    int result = (write_all(conn, header, header_len) == 0 && write_all(conn, body, body_len) == 0) ? 0 : -1;
+    free(body);
+    return result;
+}
+
+// Serves the Prometheus text format over HTTP from a dedicated child bound to loopback
+void run_metrics_endpoint(int port)
+{
+    int metrics_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_socket < 0) {
+        handle_error("Metrics socket creation failed");
+    }
+
+    int opt = 1;
+    setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    bzero((char *) &addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(metrics_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        handle_error("Metrics binding failed");
+    }
+    listen(metrics_socket, MAX_CLIENTS);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        handle_error("Fork failed");
+    }
+    if (pid > 0) {
+        close(metrics_socket);
+        return;
+    }
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    char *body = malloc(STATS_BUFFER_SIZE);
+    if (body == NULL) {
+        exit(1);
+    }
+    while (1) {
+        int conn = accept(metrics_socket, NULL, NULL);
+        if (conn < 0) continue;
+
+        char request[BUFFER_SIZE];
+        read(conn, request, sizeof(request));
+
+        int body_len = format_prometheus(body, STATS_BUFFER_SIZE);
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %d\r\n\r\n", body_len);
+        write(conn, header, header_len);
+        write(conn, body, body_len);
+        close(conn);
+    }
+}
+
+int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Moves count bytes between descriptors: sendfile when the source is a regular file,
+// otherwise a TRANSFER_BUFFER_SIZE read/write loop (the fastest options in xferbench).
+// Returns the number of bytes moved, which is short of count on error or EOF.
+off_t transfer_data(int out_fd, int in_fd, off_t count)
+{
+    struct stat st;
+    off_t done = 0;
+
+    if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        while (done < count) {
+            ssize_t sent = sendfile(out_fd, in_fd, NULL, count - done);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) break;
+            done += sent;
+        }
+        return done;
+    }
+
+    return transfer_checksummed(out_fd, in_fd, count, NULL);
+}
+
+// Read/write loop that also folds the bytes into *crc (if not NULL), so a payload is
+// checksummed while it streams instead of in a second pass
+off_t transfer_checksummed(int out_fd, int in_fd, off_t count, unsigned int *crc)
+{
+    char buffer[TRANSFER_BUFFER_SIZE];
+    off_t done = 0;
+    while (done < count) {
+        size_t chunk = (count - done < TRANSFER_BUFFER_SIZE) ? (size_t) (count - done) : TRANSFER_BUFFER_SIZE;
+        ssize_t n = read(in_fd, buffer, chunk);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || write_all(out_fd, buffer, n) < 0) break;
+        if (crc != NULL) *crc = crc32c_update(*crc, buffer, n);
+        done += n;
+    }
+    return done;
+}
+
+// Shannon entropy of a sample in bits per byte; already-compressed data comes out close to 8
+double sample_entropy(const unsigned char *buf, size_t len)
+{
+    unsigned int counts[256] = {0};
+    for (size_t i = 0; i < len; i++) {
+        counts[buf[i]]++;
+    }
+    
+    double entropy = 0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] == 0) continue;
+        double p = (double) counts[i] / len;
+        entropy -= p * log2(p);
+    }
+    return entropy;
+}
+
+// Zip archives are always sent raw. Regular files are sampled at the start and the middle, since
+// formats like PDF have a plain-text header in front of compressed streams; sockets cannot be
+// sampled up front and rely on the per-chunk check in send_zlib_chunks.
+int choose_encoding(int fd, const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (ext != NULL && strcmp(ext, ".zip") == 0) return ENCODING_RAW;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return ENCODING_ZLIB;
+    
+    unsigned char sample[COMPRESS_SAMPLE_SIZE];
+    off_t offsets[2] = { 0, st.st_size / 2 };
+    for (int i = 0; i < 2; i++) {
+        ssize_t n = pread(fd, sample, sizeof(sample), offsets[i]);
+        if (n > 0 && sample_entropy(sample, n) > COMPRESS_MAX_ENTROPY) return ENCODING_RAW;
+    }
+    return ENCODING_ZLIB;
+}
+
+// Sends size bytes from in_fd. Unframed sessions get the bytes as they are; framed sessions
+// (the command carried COMPRESS_TOKEN) get a one-byte encoding first, then either the raw
+// bytes or a sequence of chunks; empty payloads have no encoding byte. *crc, if not NULL, is
+// updated over the uncompressed data.
+off_t send_payload(int out_fd, int in_fd, off_t size, int framed, const char *name, unsigned int *crc)
+{
+    if (size == 0) return 0;
+    unsigned char encoding = framed ? choose_encoding(in_fd, name) : ENCODING_RAW;
+    if (framed && write_all(out_fd, &encoding, 1) < 0) return -1;
+    
+    if (encoding == ENCODING_ZLIB) return send_zlib_chunks(out_fd, in_fd, size, crc);
+    return (crc != NULL) ? transfer_checksummed(out_fd, in_fd, size, crc) : transfer_data(out_fd, in_fd, size);
+}
+
+// Each chunk is a chunk_header and either wire_len bytes of zlib data or, when wire_len is 0,
+// raw_len stored bytes. Chunks that look random or do not shrink are stored.
+off_t send_zlib_chunks(int out_fd, int in_fd, off_t size, unsigned int *crc)
+{
+    unsigned char *raw = malloc(COMPRESS_CHUNK_SIZE);
+    unsigned char *packed = malloc(compressBound(COMPRESS_CHUNK_SIZE));
+    off_t sent = 0;
+    
+    while (raw != NULL && packed != NULL && sent < size) {
+        size_t want = (size - sent < COMPRESS_CHUNK_SIZE) ? (size_t) (size - sent) : COMPRESS_CHUNK_SIZE;
+        if (read_all(in_fd, raw, want) < 0) break;
+        if (crc != NULL) *crc = crc32c_update(*crc, raw, want);
+        
+        struct chunk_header header;
+        pack_chunk(&header, raw, want, packed, Z_BEST_SPEED);
+        
+        const unsigned char *wire = header.wire_len ? packed : raw;
+        size_t wire_len = header.wire_len ? header.wire_len : want;
+        if (write_all(out_fd, &header, sizeof(header)) < 0 || write_all(out_fd, wire, wire_len) < 0) break;
+        add_bytes(&metrics->wire_raw_bytes, want);
+        add_bytes(&metrics->wire_sent_bytes, wire_len);
+        sent += want;
+    }
+    
+    free(raw);
+    free(packed);
+    return sent;
+}
+
+// Counterpart of send_payload: writes the decoded payload to out_fd and returns its length
+off_t receive_payload(int out_fd, int in_fd, off_t size, int framed, unsigned int *crc)
+{
+    unsigned char encoding = ENCODING_RAW;
+    if (size == 0) return 0;
+    if (framed && read_all(in_fd, &encoding, 1) < 0) return -1;
+    if (encoding == ENCODING_RAW) return transfer_checksummed(out_fd, in_fd, size, crc);
+    if (encoding != ENCODING_ZLIB) return -1;
+    
+    unsigned char *raw = malloc(COMPRESS_CHUNK_SIZE);
+    unsigned char *packed = malloc(compressBound(COMPRESS_CHUNK_SIZE));
+    off_t received = 0;
+    
+    while (raw != NULL && packed != NULL && received < size) {
+        ssize_t n = read_chunk(in_fd, encoding, raw, packed, size - received);
+        if (n < 0) break;
+        if (crc != NULL) *crc = crc32c_update(*crc, raw, n);
+        if (write_all(out_fd, raw, n) < 0) break;
+        received += n;
+    }
+    
+    free(raw);
+    free(packed);
+    return received;
+}
+
+// Compresses one chunk into packed (compressBound(COMPRESS_CHUNK_SIZE) bytes) and fills in its
+// header; wire_len stays 0, storing the chunk raw, when the data looks random or does not shrink
+void pack_chunk(struct chunk_header *header, const unsigned char *raw, size_t len, unsigned char *packed, int level)
+{
+    uLongf packed_len = compressBound(COMPRESS_CHUNK_SIZE);
+    size_t sample_len = (len < COMPRESS_SAMPLE_SIZE) ? len : COMPRESS_SAMPLE_SIZE;
+    
+    header->raw_len = len;
+    header->wire_len = 0;
+    if (sample_entropy(raw, sample_len) <= COMPRESS_MAX_ENTROPY &&
+        compress2(packed, &packed_len, raw, len, level) == Z_OK && packed_len < len) {
+        header->wire_len = packed_len;
+    }
+}
+
+// Reads the next chunk (at most remaining bytes) of a payload with the given encoding into raw,
+// decoding it if needed; returns its length, or -1 on a read error or a malformed chunk
+ssize_t read_chunk(int in_fd, int encoding, unsigned char *raw, unsigned char *packed, off_t remaining)
+{
+    if (encoding == ENCODING_RAW) {
+        size_t want = (remaining < COMPRESS_CHUNK_SIZE) ? (size_t) remaining : COMPRESS_CHUNK_SIZE;
+        return (read_all(in_fd, raw, want) < 0) ? -1 : (ssize_t) want;
+    }
+    
+    struct chunk_header header;
+    if (read_all(in_fd, &header, sizeof(header)) < 0 || header.raw_len == 0 ||
+        header.raw_len > COMPRESS_CHUNK_SIZE || header.wire_len > compressBound(COMPRESS_CHUNK_SIZE) ||
+        header.raw_len > remaining) {
+        return -1;
+    }
+    
+    uLongf raw_len = header.raw_len;
+    if (header.wire_len == 0) {
+        if (read_all(in_fd, raw, header.raw_len) < 0) return -1;
+    } else if (read_all(in_fd, packed, header.wire_len) < 0 ||
+               uncompress(raw, &raw_len, packed, header.wire_len) != Z_OK || raw_len != header.raw_len) {
+        return -1;
+    }
+    return raw_len;
+}
+
+// rsync's rolling checksum of a block: a is the byte sum and b the sum of the running values of
+// a, both kept to 16 bits in the result
+unsigned int weak_checksum(const unsigned char *buf, size_t len)
+{
+    unsigned int a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += buf[i];
+        b += a;
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Blocks of about sqrt(size) bytes keep both the signature list and the per-block overhead small
+unsigned int delta_block_size(off_t size)
+{
+    unsigned int block_size = DELTA_MIN_BLOCK;
+    while ((off_t) block_size * block_size < size && block_size < DELTA_MAX_BLOCK) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+// Writes the block count, block size and one block_signature per full block of old_fd
+int send_signatures(int out_fd, int old_fd, off_t block_count, unsigned int block_size)
+{
+    if (write_all(out_fd, &block_count, sizeof(off_t)) < 0 ||
+        write_all(out_fd, &block_size, sizeof(block_size)) < 0) {
+        return -1;
+    }
+    
+    unsigned char *block = malloc(block_size);
+    struct block_signature batch[DELTA_SIGNATURE_BATCH];
+    int queued = 0, result = (block == NULL) ? -1 : 0;
+    for (off_t i = 0; i < block_count && result == 0; i++) {
+        if (pread(old_fd, block, block_size, i * block_size) != (ssize_t) block_size) {
+            result = -1;
+            break;
+        }
+        batch[queued].weak = weak_checksum(block, block_size);
+        batch[queued].strong = crc32c_update(0, block, block_size);
+        if (++queued == DELTA_SIGNATURE_BATCH || i == block_count - 1) {
+            result = write_all(out_fd, batch, queued * sizeof(batch[0]));
+            queued = 0;
+        }
+    }
+    free(block);
+    return result;
+}
+
+// Rebuilds a file into out_fd from delta_len bytes of delta_op instructions read from in_fd,
+// copying blocks from old_fd. Returns the number of bytes written, or -1 on a bad instruction.
+off_t apply_delta(int out_fd, int in_fd, off_t delta_len, int old_fd, off_t block_count,
+                  unsigned int block_size, unsigned int *crc)
+{
+    unsigned char *buffer = malloc(DELTA_MAX_BLOCK);
+    off_t consumed = 0, written = 0;
+    
+    while (buffer != NULL && consumed < delta_len) {
+        struct delta_op op;
+        if (delta_len - consumed < (off_t) sizeof(op) || read_all(in_fd, &op, sizeof(op)) < 0) break;
+        consumed += sizeof(op);
+        
+        size_t len = op.value;
+        if (op.type == DELTA_COPY && op.value < block_count) {
+            len = block_size;
+            if (pread(old_fd, buffer, len, (off_t) op.value * block_size) != (ssize_t) len) break;
+        } else if (op.type == DELTA_LITERAL && len <= DELTA_MAX_BLOCK && (off_t) len <= delta_len - consumed) {
+            if (read_all(in_fd, buffer, len) < 0) break;
+            consumed += len;
+        } else {
+            break;
+        }
+        
+        *crc = crc32c_update(*crc, buffer, len);
+        if (write_all(out_fd, buffer, len) < 0) break;
+        written += len;
+    }
+    
+    free(buffer);
+    return (consumed == delta_len) ? written : -1;
+}
+
+// Server side of deltaf after READY: reads the new size, sends the signatures of old_fd (-1 if
+// there is no current copy), rebuilds the file in a temporary file next to it and renames it
+// over name once its CRC32C matches the client's. Replies with a status line.
+int receive_delta(int conn, int dir_fd, const char *name, int old_fd)
+{
+    off_t new_size;
+    if (read_all(conn, &new_size, sizeof(off_t)) < 0 || new_size < 0) {
+        return -1;
+    }
+    
+    char tmp_name[MAX_PATH_LEN];
+    snprintf(tmp_name, sizeof(tmp_name), ".%s.%d.delta", name, getpid());
+    int fd = openat(dir_fd, tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        off_t error_count = -1;
+        write(conn, &error_count, sizeof(off_t));
+        write(conn, "ERROR: Failed to create file", 28);
+        return -1;
+    }
+    
+    struct stat st;
+    off_t old_size = (old_fd >= 0 && fstat(old_fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0;
+    unsigned int block_size = delta_block_size(old_size);
+    off_t block_count = old_size / block_size;
+    
+    unsigned long span_start = trace_start();
+    off_t delta_len = -1, written = -1;
+    unsigned int crc = 0, client_crc = 0;
+    if (send_signatures(conn, old_fd, block_count, block_size) == 0 &&
+        read_all(conn, &delta_len, sizeof(off_t)) == 0 && delta_len >= 0) {
+        written = apply_delta(fd, conn, delta_len, old_fd, block_count, block_size, &crc);
+    }
+    trace_span(STAGE_TRANSFER, span_start);
+    add_bytes(&metrics->bytes_in, delta_len);
+    
+    int result = -1;
+    if (written != new_size || read_all(conn, &client_crc, sizeof(client_crc)) < 0) {
+        write(conn, "ERROR: Delta transfer failed", 28);
+    } else if (crc != client_crc) {
+        write(conn, "ERROR: Checksum mismatch", 24);
+    } else {
+        store_crc32c(fd, crc);
+        result = 0;
+    }
+    // Closed before the rename, so the change feed sees the finished file appear once
+    close(fd);
+    if (result == 0) {
+        result = renameat(dir_fd, tmp_name, dir_fd, name);
+        if (result < 0) write(conn, "ERROR: Failed to replace file", 29);
+    }
+    
+    if (result < 0) {
+        unlinkat(dir_fd, tmp_name, 0);
+        return -1;
+    }
+    char status[MAX_PATH_LEN];
+    int len = snprintf(status, sizeof(status), "SUCCESS: %s rebuilt from a %ld byte delta (%ld bytes)",
+                       name, (long) delta_len, (long) new_size);
+    write(conn, status, len);
+    return 0;
+}
+
+void crc32c_init(void)
+{
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            unsigned int prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len)
+{
+    unsigned long c = crc;
+    while (len > 0 && ((unsigned long) p & 7) != 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        unsigned long word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    return c;
+}
+#endif
+
+// Continues a running CRC32C (Castagnoli, as in iSCSI/ext4); start from 0. Uses the SSE4.2
+// crc32 instruction when the CPU has it and slicing-by-8 tables otherwise.
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_sse42(crc, p, len);
+    }
+#endif
+    while (len >= 8) {
+        unsigned int lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24);
+        unsigned int hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int) p[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+// Stored CRC32C of an open file (user.dfs.crc32c xattr). Files without one, or whose size or
+// mtime no longer match it, are checksummed in a single pass and the result is stored for the
+// next download.
+unsigned int file_crc32c(int fd)
+{
+    unsigned int crc = 0;
+    if (stored_crc32c(fd, &crc) == 0) {
+        return crc;
+    }
+    
+    char buffer[TRANSFER_BUFFER_SIZE];
+    off_t offset = 0;
+    ssize_t n;
+    crc = 0;
+    while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+        crc = crc32c_update(crc, buffer, n);
+        offset += n;
+    }
+    store_crc32c(fd, crc);
+    return crc;
+}
+
+// Reads the stored CRC32C into crc; -1 if there is none or the file changed since it was taken
+int stored_crc32c(int fd, unsigned int *crc)
+{
+    struct crc_tag tag;
+    struct stat st;
+    if (fgetxattr(fd, CRC_XATTR, &tag, sizeof(tag)) != sizeof(tag) || fstat(fd, &st) != 0 ||
+        tag.size != st.st_size || tag.mtime.tv_sec != st.st_mtim.tv_sec ||
+        tag.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        return -1;
+    }
+    *crc = tag.crc;
+    return 0;
+}
+
+// CRC32C of the file at path below dir_fd, given its lstat. A stored CRC32C that still matches st
+// is read without opening the file; otherwise it is opened and checksummed as by file_crc32c.
+int path_crc32c(int dir_fd, const char *path, const struct stat *st, unsigned int *crc)
+{
+    struct crc_tag tag;
+    if (path_xattr(dir_fd, path, CRC_XATTR, &tag, sizeof(tag)) == sizeof(tag) && tag.size == st->st_size &&
+        tag.mtime.tv_sec == st->st_mtim.tv_sec && tag.mtime.tv_nsec == st->st_mtim.tv_nsec) {
+        *crc = tag.crc;
+        return 0;
+    }
+    int fd = openat(dir_fd, path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return -1;
+    *crc = file_crc32c(fd);
+    close(fd);
+    return 0;
+}
+
+// lgetxattr on the file at path below dir_fd, reached through the directory's /proc/self/fd entry
+// since there is no *at form of it
+ssize_t path_xattr(int dir_fd, const char *path, const char *name, void *value, size_t size)
+{
+    char proc_path[MAX_PATH_LEN + 32];
+    if (snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d/%s", dir_fd, path) >= (int) sizeof(proc_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return lgetxattr(proc_path, name, value, size);
+}
+
+// Stores crc for the file as it is now; called once its data is complete
+void store_crc32c(int fd, unsigned int crc)
+{
+    struct crc_tag tag = { .crc = crc };
+    struct stat st;
+    if (fstat(fd, &st) != 0) return;
+    tag.size = st.st_size;
+    tag.mtime = st.st_mtim;
+    fsetxattr(fd, CRC_XATTR, &tag, sizeof(tag), 0);
+}
+
+unsigned long trace_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+// Returns a span start timestamp, or 0 when the current request is not sampled
+unsigned long trace_start(void)
+{
+    return current_trace_id ? trace_clock() : 0;
+}
+
+void trace_span(int stage, unsigned long start_us)
+{
+    if (current_trace_id == 0 || traces == NULL) return;
+
+    unsigned long idx = __atomic_fetch_add(&traces->next, 1, __ATOMIC_RELAXED);
+    struct trace_span *span = &traces->spans[idx % TRACE_RING_SIZE];
+
+    __atomic_store_n(&span->seq, 0, __ATOMIC_RELAXED);
+    span->trace_id = current_trace_id;
+    span->start_us = start_us;
+    span->duration_us = (unsigned int) (trace_clock() - start_us);
+    span->stage = (unsigned short) stage;
+    span->command = (unsigned char) current_command;
+    span->pid = getpid();
+    __atomic_store_n(&span->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+// Writes the ring as Chrome trace events, each prefixed with a comma
+int dump_traces(int fd)
+{
+    int count = 0;
+    for (unsigned long i = 0; i < TRACE_RING_SIZE; i++) {
+        struct trace_span span;
+        struct trace_span *slot = &traces->spans[i];
+        unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0) continue;
+        memcpy(&span, slot, sizeof(span));
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) continue;
+
+        dprintf(fd, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%u,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"trace_id\":\"%016lx\"}}",
+                stage_names[span.stage], (span.command < CMD_COUNT) ? command_names[span.command] : "other",
+                span.start_us, span.duration_us, TRACE_NODE_ID, span.pid, span.trace_id);
+        count++;
+    }
+    return count;
+}
+
+// Maps the shared log ring and forks the writer that drains it. Called before the accept
+// loop so every forked handler inherits the mapping.
+void start_log_writer(const char *path)
+{
+    log_ring = mmap(NULL, sizeof(struct log_ring), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (log_ring == MAP_FAILED) {
+        handle_error("Log ring allocation failed");
+    }
+    for (unsigned long i = 0; i < LOG_RING_SIZE; i++) {
+        log_ring->slots[i].sequence = i;
+    }
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        handle_error("Log writer fork failed");
+    }
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        run_log_writer(path);
+        exit(0);
+    }
+}
+
+// Formats a record straight into a ring slot. Never blocks: when the ring is full or the
+// per-second budget for debug/info lines is spent the record is dropped and counted.
+void log_message(int level, const char *fmt, ...)
+{
+    if (log_ring == NULL || level < log_min_level) return;
+    
+    if (level < LOG_WARN && log_rate_limit > 0) {
+        unsigned long second = now_us() / 1000000;
+        unsigned long window = __atomic_load_n(&log_ring->rate_window, __ATOMIC_RELAXED);
+        if (window != second &&
+            __atomic_compare_exchange_n(&log_ring->rate_window, &window, second, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&log_ring->rate_count, 0, __ATOMIC_RELAXED);
+        }
+        if (__atomic_fetch_add(&log_ring->rate_count, 1, __ATOMIC_RELAXED) >= (unsigned long) log_rate_limit) {
+            __atomic_fetch_add(&log_ring->dropped_rate, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    
+    // Bounded MPMC queue (Vyukov): a slot is free for position pos when its sequence == pos
+    struct log_slot *slot;
+    unsigned long pos = __atomic_load_n(&log_ring->enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &log_ring->slots[pos & (LOG_RING_SIZE - 1)];
+        long diff = (long) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (long) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_ring->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&log_ring->dropped_full, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log_ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    
+    slot->timestamp_us = wall_clock_us();
+    slot->pid = getpid();
+    slot->level = level;
+    
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(slot->message, LOG_MESSAGE_SIZE, fmt, args);
+    va_end(args);
+    
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Writer process: drains the ring in order, batching lines into one write, and rotates the
+// file at LOG_ROTATE_BYTES. Logs to stdout when no file was given.
+void run_log_writer(const char *path)
+{
+    signal(SIGTERM, stop_log_writer);
+    
+    int fd = (path != NULL) ? open_log_file(path) : STDOUT_FILENO;
+    off_t written = (fd >= 0) ? lseek(fd, 0, SEEK_END) : 0;
+    if (written < 0) written = 0;
+    
+    char *batch = malloc(LOG_BATCH_SIZE);
+    if (batch == NULL) exit(1);
+    unsigned long pos = 0;
+    unsigned long reported_full = 0, reported_rate = 0;
+    
+    while (1) {
+        size_t used = 0;
+        while (used + LOG_MESSAGE_SIZE + 128 < LOG_BATCH_SIZE) {
+            struct log_slot *slot = &log_ring->slots[pos & (LOG_RING_SIZE - 1)];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) break;
+            used += format_log_line(batch + used, LOG_BATCH_SIZE - used, slot->timestamp_us,
+                                    slot->level, slot->pid, slot->message);
+            __atomic_store_n(&slot->sequence, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+            pos++;
+        }
+        
+        unsigned long dropped_full = __atomic_load_n(&log_ring->dropped_full, __ATOMIC_RELAXED);
+        unsigned long dropped_rate = __atomic_load_n(&log_ring->dropped_rate, __ATOMIC_RELAXED);
+        if (dropped_full != reported_full || dropped_rate != reported_rate) {
+            char message[LOG_MESSAGE_SIZE];
+            snprintf(message, sizeof(message), "event=log_dropped ring_full=%lu rate_limited=%lu",
+                     dropped_full, dropped_rate);
+            used += format_log_line(batch + used, LOG_BATCH_SIZE - used, wall_clock_us(), LOG_WARN, getpid(), message);
+            reported_full = dropped_full;
+            reported_rate = dropped_rate;
+        }
+        
+        if (used == 0) {
+            if (log_writer_stopping) break;
+            usleep(LOG_IDLE_SLEEP_US);
+            continue;
+        }
+        
+        if (fd >= 0 && write_all(fd, batch, used) == 0) {
+            written += used;
+        }
+        if (path != NULL && written >= LOG_ROTATE_BYTES) {
+            close(fd);
+            rotate_log_files(path);
+            fd = open_log_file(path);
+            written = 0;
+        }
+    }
+    
+    free(batch);
+}
+
+// Log timestamps are wall-clock; now_us() is monotonic and only used for durations
+unsigned long wall_clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void stop_log_writer(int sig)
+{
+    (void) sig;
+    log_writer_stopping = 1;
+}
+
+int open_log_file(const char *path)
+{
+    return open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+// file -> file.1 -> ... -> file.LOG_ROTATE_KEEP (the oldest is overwritten)
+void rotate_log_files(const char *path)
+{
+    char from[MAX_PATH_LEN], to[MAX_PATH_LEN];
+    for (int i = LOG_ROTATE_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", path, i);
+        snprintf(to, sizeof(to), "%s.%d", path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", path);
+    rename(path, to);
+}
+
+// One key=value line: ts=... level=... node=... pid=... followed by the record's own fields
+int format_log_line(char *out, size_t len, unsigned long timestamp_us, int level, int pid, const char *message)
+{
+    time_t seconds = timestamp_us / 1000000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    int n = snprintf(out, len, "ts=%s.%06luZ level=%s node=S4 pid=%d %s\n", stamp, timestamp_us % 1000000,
+                     log_level_names[level], pid, message);
+    return (n < 0 || (size_t) n >= len) ? 0 : n;
+}
+
+// Accepts a level name (debug, info, warn, error) and returns its index, or -1
+int parse_log_level(const char *name)
+{
+    for (int i = 0; i < LOG_LEVEL_COUNT; i++) {
+        if (strcmp(name, log_level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
 void handle_error(const char *msg) 
 {
     perror(msg);
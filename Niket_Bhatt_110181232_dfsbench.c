@@ -0,0 +1,1108 @@
+// DFS Benchmark - load generator for the S1-S4 cluster
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define BUFFER_SIZE 1024
+#define MAX_MIX 16
+#define MAX_TRACKED_FILES 256
+#define MAX_FILE_PATH 256
+#define CRC32C_POLY 0x82F63B78
+#define BUSY_SIZE ((off_t) -2)
+#define RECORD_MAGIC "DFSREC1\n"
+#define REPLAY_SEED_SIZE 1024
+
+enum op_id { OP_UPLOADF, OP_DOWNLF, OP_REMOVEF, OP_DISPFNAMES, OP_DOWNLTAR, OP_COUNT };
+
+const char *op_names[OP_COUNT] = { "uploadf", "downlf", "removef", "dispfnames", "downltar" };
+
+// Command ids as S1 records them, in S1's command_id order
+enum replay_command { RC_UPLOADF, RC_DOWNLF, RC_REMOVEF, RC_DOWNLTAR, RC_DISPFNAMES, RC_MDOWNLF, RC_MREMOVEF,
+                      RC_DELTAF, RC_FINDF, RC_COPYF, RC_MOVEF, RC_COUNT };
+
+const char *replay_names[RC_COUNT] = { "uploadf", "downlf", "removef", "downltar", "dispfnames", "mdownlf",
+                                       "mremovef", "deltaf", "findf", "copyf", "movef" };
+
+enum record_status { RECORD_OK, RECORD_ERROR, RECORD_BUSY };
+
+// Must match S1's struct workload_record
+struct workload_record {
+    unsigned long start_us;
+    unsigned int duration_us;
+    unsigned char command;
+    unsigned char status;
+    unsigned short args_len;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+};
+
+struct replay_op {
+    struct workload_record record;
+    char *args;
+    double at;          // seconds after the first recorded request
+    double latency_us;
+    double lag_us;      // how late it was issued against its schedule
+    int status;
+    int skipped;
+};
+
+struct weighted_size {
+    off_t size;
+    int weight;
+    unsigned int crc;
+};
+
+struct latency_samples {
+    double *values;
+    size_t count;
+    size_t capacity;
+    unsigned long errors;
+    unsigned long bytes;
+};
+
+struct client_state {
+    int id;
+    unsigned int seed;
+    pthread_t thread;
+    struct latency_samples samples[OP_COUNT];
+    char files[MAX_TRACKED_FILES][MAX_FILE_PATH];
+    off_t file_sizes[MAX_TRACKED_FILES];
+    int file_count;
+    unsigned long sequence;
+};
+
+char host[256] = "localhost";
+int s1_port = 4307;
+int client_count = 4;
+int duration_sec = 10;
+long requests_per_client = 0;
+int op_weights[OP_COUNT] = { 40, 40, 5, 10, 5 };
+struct weighted_size sizes[MAX_MIX];
+int size_count = 0;
+const char *file_types[] = { ".c", ".pdf", ".txt", ".zip" };
+char dest_dir[128] = "~S1/dfsbench";
+char *payload;
+off_t payload_size;
+volatile int stop_requested = 0;
+double max_p99_ms = 0;
+struct replay_op *replay_ops = NULL;
+size_t replay_count = 0;
+size_t replay_next = 0;
+double replay_speed = 1;
+double replay_start;
+unsigned int crc32c_table[8][256];
+
+int connect_to_server();
+void set_nodelay(int sockfd);
+int write_all(int fd, const void *buf, size_t len);
+double now_sec(void);
+off_t parse_size(const char *text);
+int parse_size_mix(char *spec);
+int parse_op_mix(char *spec);
+int pick_op(struct client_state *state);
+off_t pick_size(struct client_state *state);
+unsigned int payload_crc(off_t size);
+void crc32c_init(void);
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len);
+int upload_payload(const char *name, const char *dir, off_t size);
+int do_upload(struct client_state *state, unsigned long *bytes);
+int drain_sized_response(int sockfd, unsigned long *bytes);
+int do_download(struct client_state *state, unsigned long *bytes);
+int do_remove(struct client_state *state);
+int do_dispfnames(unsigned long *bytes);
+int do_downltar(struct client_state *state, unsigned long *bytes);
+void add_sample(struct latency_samples *samples, double usec, int failed, unsigned long bytes);
+void *client_main(void *arg);
+pid_t launch_server(const char *bin_dir, const char *name, char *const args[]);
+void launch_cluster(const char *bin_dir, const char *work_dir, pid_t *pids);
+int compare_double(const void *a, const void *b);
+double percentile(struct latency_samples *samples, double pct);
+int report(struct client_state *clients, double elapsed, const char *json_path);
+int load_replay(const char *path);
+int compare_replay(const void *a, const void *b);
+void seed_replay(void);
+int replay_request(struct replay_op *op, unsigned long *bytes);
+void *replay_main(void *arg);
+int replay_report(double elapsed, const char *json_path);
+void stop_cluster(pid_t *pids);
+unsigned long fnv1a(const char *text);
+int remember_path(unsigned long *set, size_t mask, const char *path);
+void usage(const char *prog);
+
+int main(int argc, char *argv[])
+{
+    const char *json_path = NULL;
+    const char *bin_dir = NULL;
+    const char *work_dir = "/tmp/dfsbench";
+    const char *replay_path = NULL;
+    char size_spec[256] = "1K:50,64K:40,1M:10";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:d:n:m:s:j:l:w:x:D:r:S:h")) != -1) {
+        switch (opt) {
+            case 'H': snprintf(host, sizeof(host), "%s", optarg); break;
+            case 'p': s1_port = atoi(optarg); break;
+            case 'c': client_count = atoi(optarg); break;
+            case 'd': duration_sec = atoi(optarg); break;
+            case 'n': requests_per_client = atol(optarg); break;
+            case 'm':
+                if (parse_op_mix(optarg) < 0) usage(argv[0]);
+                break;
+            case 's': snprintf(size_spec, sizeof(size_spec), "%s", optarg); break;
+            case 'j': json_path = optarg; break;
+            case 'l': bin_dir = optarg; break;
+            case 'w': work_dir = optarg; break;
+            case 'x': max_p99_ms = atof(optarg); break;
+            case 'D': snprintf(dest_dir, sizeof(dest_dir), "%s", optarg); break;
+            case 'r': replay_path = optarg; break;
+            case 'S': replay_speed = atof(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (client_count <= 0 || replay_speed < 0 || parse_size_mix(size_spec) < 0) {
+        usage(argv[0]);
+    }
+    if (replay_path != NULL && load_replay(replay_path) < 0) {
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t cluster[4] = { 0 };
+    if (bin_dir != NULL) {
+        launch_cluster(bin_dir, work_dir, cluster);
+    }
+
+    // One random payload sized for the largest file, shared read-only by every client
+    payload_size = 0;
+    for (int i = 0; i < size_count; i++) {
+        if (sizes[i].size > payload_size) payload_size = sizes[i].size;
+    }
+    // A replay sends payload bytes only for its uploads and the files it seeds for downloads
+    if (replay_count > 0 && payload_size < REPLAY_SEED_SIZE) payload_size = REPLAY_SEED_SIZE;
+    for (size_t i = 0; i < replay_count; i++) {
+        struct workload_record *record = &replay_ops[i].record;
+        off_t size = 0;
+        if (record->command == RC_UPLOADF) size = record->bytes_in;
+        else if (record->command == RC_DOWNLF && record->status == RECORD_OK) size = record->bytes_out;
+        if (size > payload_size) payload_size = size;
+    }
+    payload = malloc(payload_size > 0 ? payload_size : 1);
+    if (payload == NULL) {
+        perror("Payload allocation failed");
+        exit(1);
+    }
+    unsigned int seed = 12345;
+    for (off_t i = 0; i < payload_size; i++) {
+        payload[i] = (char) rand_r(&seed);
+    }
+    crc32c_init();
+    for (int i = 0; i < size_count; i++) {
+        sizes[i].crc = crc32c_update(0, payload, sizes[i].size);
+    }
+
+    if (replay_path != NULL) {
+        seed_replay();
+        printf("dfsbench: replaying %zu requests from %s against %s:%d at %gx with %d workers\n",
+               replay_count, replay_path, host, s1_port, replay_speed, client_count);
+
+        pthread_t *workers = calloc(client_count, sizeof(pthread_t));
+        if (workers == NULL) {
+            perror("Worker allocation failed");
+            exit(1);
+        }
+        replay_start = now_sec();
+        for (int i = 0; i < client_count; i++) {
+            pthread_create(&workers[i], NULL, replay_main, NULL);
+        }
+        for (int i = 0; i < client_count; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        int status = replay_report(now_sec() - replay_start, json_path);
+        stop_cluster(cluster);
+        return status;
+    }
+
+    struct client_state *clients = calloc(client_count, sizeof(struct client_state));
+    if (clients == NULL) {
+        perror("Client allocation failed");
+        exit(1);
+    }
+
+    if (requests_per_client > 0) {
+        printf("dfsbench: %d clients against %s:%d, %ld requests each\n",
+               client_count, host, s1_port, requests_per_client);
+    } else {
+        printf("dfsbench: %d clients against %s:%d for %d seconds\n",
+               client_count, host, s1_port, duration_sec);
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < client_count; i++) {
+        clients[i].id = i;
+        clients[i].seed = 1000 + i;
+        pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+    }
+
+    if (requests_per_client == 0) {
+        sleep(duration_sec);
+        stop_requested = 1;
+    }
+    for (int i = 0; i < client_count; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    int status = report(clients, elapsed, json_path);
+    stop_cluster(cluster);
+    return status;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -H host        S1 host (default localhost)\n"
+            "  -p port        S1 port (default 4307)\n"
+            "  -c clients     concurrent clients (default 4)\n"
+            "  -d seconds     run duration (default 10)\n"
+            "  -n requests    requests per client instead of a duration\n"
+            "  -m mix         op weights, e.g. uploadf:40,downlf:40,removef:5,dispfnames:10,downltar:5\n"
+            "  -s sizes       file size weights, e.g. 1K:50,64K:40,1M:10\n"
+            "  -D dir         destination directory (default ~S1/dfsbench)\n"
+            "  -j file        write JSON results to file ('-' for stdout)\n"
+            "  -l bindir      launch S1-S4 from bindir on port..port+3\n"
+            "  -w workdir     HOME for a launched cluster (default /tmp/dfsbench)\n"
+            "  -x ms          exit with status 2 if any op p99 exceeds ms\n"
+            "  -r file        replay a workload recorded by S1 -W instead of a synthetic mix\n"
+            "  -S speed       replay speed: 1 as recorded, N times faster, 0 as fast as possible\n", prog);
+    exit(1);
+}
+
+int connect_to_server()
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+
+    struct addrinfo hints, *res;
+    bzero((char *) &hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    struct sockaddr_in serv_addr;
+    memcpy(&serv_addr, res->ai_addr, sizeof(serv_addr));
+    serv_addr.sin_port = htons(s1_port);
+    freeaddrinfo(res);
+
+    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    set_nodelay(sockfd);
+    return sockfd;
+}
+
+// Headers, payloads and trailers go out as separate writes; with Nagle the second one waits
+// for the server's delayed ACK (about 40 ms) before it is sent
+void set_nodelay(int sockfd)
+{
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+off_t parse_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return -1;
+    if (*end == 'K' || *end == 'k') value *= 1024;
+    else if (*end == 'M' || *end == 'm') value *= 1024 * 1024;
+    else if (*end == 'G' || *end == 'g') value *= 1024.0 * 1024 * 1024;
+    return (off_t) value;
+}
+
+int parse_size_mix(char *spec)
+{
+    size_count = 0;
+    for (char *item = strtok(spec, ","); item != NULL && size_count < MAX_MIX; item = strtok(NULL, ",")) {
+        char *colon = strchr(item, ':');
+        sizes[size_count].weight = colon ? atoi(colon + 1) : 1;
+        if (colon) *colon = '\0';
+        sizes[size_count].size = parse_size(item);
+        if (sizes[size_count].size < 0 || sizes[size_count].weight <= 0) return -1;
+        size_count++;
+    }
+    return size_count > 0 ? 0 : -1;
+}
+
+int parse_op_mix(char *spec)
+{
+    int total = 0;
+    memset(op_weights, 0, sizeof(op_weights));
+    for (char *item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *colon = strchr(item, ':');
+        if (colon == NULL) return -1;
+        *colon = '\0';
+        int found = 0;
+        for (int i = 0; i < OP_COUNT; i++) {
+            if (strcmp(item, op_names[i]) == 0) {
+                op_weights[i] = atoi(colon + 1);
+                total += op_weights[i];
+                found = 1;
+            }
+        }
+        if (!found) return -1;
+    }
+    return total > 0 ? 0 : -1;
+}
+
+int pick_op(struct client_state *state)
+{
+    int total = 0;
+    for (int i = 0; i < OP_COUNT; i++) total += op_weights[i];
+
+    int r = rand_r(&state->seed) % total;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (r < op_weights[i]) return i;
+        r -= op_weights[i];
+    }
+    return OP_UPLOADF;
+}
+
+off_t pick_size(struct client_state *state)
+{
+    int total = 0;
+    for (int i = 0; i < size_count; i++) total += sizes[i].weight;
+
+    int r = rand_r(&state->seed) % total;
+    for (int i = 0; i < size_count; i++) {
+        if (r < sizes[i].weight) return sizes[i].size;
+        r -= sizes[i].weight;
+    }
+    return sizes[0].size;
+}
+
+// CRC32C of the payload prefix sent for an upload of this size (precomputed per size class)
+unsigned int payload_crc(off_t size)
+{
+    for (int i = 0; i < size_count; i++) {
+        if (sizes[i].size == size) return sizes[i].crc;
+    }
+    return crc32c_update(0, payload, size);
+}
+
+// Uploads the first size bytes of the payload as dir/name; -2 if S1 answered BUSY
+int upload_payload(const char *name, const char *dir, off_t size)
+{
+    int sockfd = connect_to_server();
+    if (sockfd < 0) return -1;
+
+    char cmd[BUFFER_SIZE];
+    snprintf(cmd, BUFFER_SIZE, "uploadf %s %s", name, dir);
+    write(sockfd, cmd, strlen(cmd));
+
+    char response[BUFFER_SIZE];
+    bzero(response, BUFFER_SIZE);
+    read(sockfd, response, BUFFER_SIZE - 1);
+    if (strcmp(response, "READY") != 0) {
+        close(sockfd);
+        return (strncmp(response, "BUSY", 4) == 0) ? -2 : -1;
+    }
+
+    unsigned int crc = payload_crc(size);
+    if (write_all(sockfd, &size, sizeof(off_t)) < 0 || write_all(sockfd, payload, size) < 0 ||
+        write_all(sockfd, &crc, sizeof(crc)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    bzero(response, BUFFER_SIZE);
+    read(sockfd, response, BUFFER_SIZE - 1);
+    close(sockfd);
+    return (strncmp(response, "SUCCESS", 7) == 0) ? 0 : -1;
+}
+
+int do_upload(struct client_state *state, unsigned long *bytes)
+{
+    char name[128];
+    const char *ext = file_types[state->sequence % 4];
+    snprintf(name, sizeof(name), "bench_%d_%lu%s", state->id, state->sequence++, ext);
+    off_t size = pick_size(state);
+    if (upload_payload(name, dest_dir, size) < 0) return -1;
+
+    *bytes = size;
+    int slot = (state->file_count < MAX_TRACKED_FILES) ? state->file_count++ :
+               (int) (rand_r(&state->seed) % MAX_TRACKED_FILES);
+    snprintf(state->files[slot], sizeof(state->files[slot]), "%s/%s", dest_dir, name);
+    state->file_sizes[slot] = size;
+    return 0;
+}
+
+// Reads a download header (size, CRC32C) and payload and discards them; -2 if S1 answered BUSY
+int drain_sized_response(int sockfd, unsigned long *bytes)
+{
+    off_t size;
+    unsigned int crc;
+    if (read(sockfd, &size, sizeof(off_t)) != sizeof(off_t)) return -1;
+    if (size < 0) return (size == BUSY_SIZE) ? -2 : -1;
+    if (read(sockfd, &crc, sizeof(crc)) != sizeof(crc)) return -1;
+
+    char buffer[BUFFER_SIZE * 64];
+    off_t remaining = size;
+    while (remaining > 0) {
+        ssize_t n = read(sockfd, buffer, (remaining < (off_t) sizeof(buffer)) ? remaining : (off_t) sizeof(buffer));
+        if (n <= 0) return -1;
+        remaining -= n;
+    }
+    *bytes = size;
+    return 0;
+}
+
+int do_download(struct client_state *state, unsigned long *bytes)
+{
+    if (state->file_count == 0) return -1;
+
+    int slot = rand_r(&state->seed) % state->file_count;
+    int sockfd = connect_to_server();
+    if (sockfd < 0) return -1;
+
+    char cmd[BUFFER_SIZE];
+    snprintf(cmd, BUFFER_SIZE, "downlf %s", state->files[slot]);
+    write(sockfd, cmd, strlen(cmd));
+
+    int result = drain_sized_response(sockfd, bytes);
+    close(sockfd);
+    return result;
+}
+
+int do_remove(struct client_state *state)
+{
+    if (state->file_count == 0) return -1;
+
+    int slot = rand_r(&state->seed) % state->file_count;
+    int sockfd = connect_to_server();
+    if (sockfd < 0) return -1;
+
+    char cmd[BUFFER_SIZE];
+    snprintf(cmd, BUFFER_SIZE, "removef %s", state->files[slot]);
+    write(sockfd, cmd, strlen(cmd));
+
+    char response[BUFFER_SIZE];
+    bzero(response, BUFFER_SIZE);
+    read(sockfd, response, BUFFER_SIZE - 1);
+    close(sockfd);
+
+    state->file_count--;
+    memcpy(state->files[slot], state->files[state->file_count], sizeof(state->files[slot]));
+    state->file_sizes[slot] = state->file_sizes[state->file_count];
+    return (strncmp(response, "SUCCESS", 7) == 0) ? 0 : -1;
+}
+
+int do_dispfnames(unsigned long *bytes)
+{
+    int sockfd = connect_to_server();
+    if (sockfd < 0) return -1;
+
+    char cmd[BUFFER_SIZE];
+    snprintf(cmd, BUFFER_SIZE, "dispfnames %s", dest_dir);
+    write(sockfd, cmd, strlen(cmd));
+
+    char buffer[BUFFER_SIZE * 4];
+    ssize_t n;
+    *bytes = 0;
+    while ((n = read(sockfd, buffer, sizeof(buffer))) > 0) {
+        *bytes += n;
+    }
+    close(sockfd);
+    return (n < 0) ? -1 : 0;
+}
+
+int do_downltar(struct client_state *state, unsigned long *bytes)
+{
+    const char *types[] = { ".c", ".pdf", ".txt" };
+    int sockfd = connect_to_server();
+    if (sockfd < 0) return -1;
+
+    char cmd[BUFFER_SIZE];
+    snprintf(cmd, BUFFER_SIZE, "downltar %s", types[rand_r(&state->seed) % 3]);
+    write(sockfd, cmd, strlen(cmd));
+
+    int result = drain_sized_response(sockfd, bytes);
+    close(sockfd);
+    return result;
+}
+
+void add_sample(struct latency_samples *samples, double usec, int failed, unsigned long bytes)
+{
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        double *values = realloc(samples->values, capacity * sizeof(double));
+        if (values == NULL) return;
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = usec;
+    samples->bytes += bytes;
+    if (failed) samples->errors++;
+}
+
+void *client_main(void *arg)
+{
+    struct client_state *state = arg;
+
+    for (long done = 0; !stop_requested; done++) {
+        if (requests_per_client > 0 && done >= requests_per_client) break;
+
+        int op = pick_op(state);
+        // Until this client has uploaded something a download becomes an upload (sampled as
+        // one) and a removal is skipped
+        if (state->file_count == 0 && op == OP_DOWNLF) op = OP_UPLOADF;
+        if (state->file_count == 0 && op == OP_REMOVEF) continue;
+        unsigned long bytes = 0;
+        double start = now_sec();
+        int result;
+
+        switch (op) {
+            case OP_UPLOADF: result = do_upload(state, &bytes); break;
+            case OP_DOWNLF: result = do_download(state, &bytes); break;
+            case OP_REMOVEF: result = do_remove(state); break;
+            case OP_DISPFNAMES: result = do_dispfnames(&bytes); break;
+            default: result = do_downltar(state, &bytes); break;
+        }
+
+        add_sample(&state->samples[op], (now_sec() - start) * 1e6, result < 0, bytes);
+    }
+    return NULL;
+}
+
+pid_t launch_server(const char *bin_dir, const char *name, char *const args[])
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", bin_dir, name);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+        execv(path, args);
+        perror(path);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Starts S2-S4 on port+1..port+3 and S1 on port, all sharing a scratch HOME
+void launch_cluster(const char *bin_dir, const char *work_dir, pid_t *pids)
+{
+    mkdir(work_dir, 0755);
+    setenv("HOME", work_dir, 1);
+
+    char ports[4][16];
+    for (int i = 0; i < 4; i++) {
+        snprintf(ports[i], sizeof(ports[i]), "%d", s1_port + i);
+    }
+
+    const char *names[] = { "S2", "S3", "S4" };
+    for (int i = 0; i < 3; i++) {
+        char *args[] = { (char *) names[i], ports[i + 1], NULL };
+        pids[i + 1] = launch_server(bin_dir, names[i], args);
+    }
+    usleep(200000);
+
+    char *args[] = { "S1", ports[0], ports[1], ports[2], ports[3], NULL };
+    pids[0] = launch_server(bin_dir, "S1", args);
+
+    // Wait for S1 to accept connections before starting the clock
+    for (int attempt = 0; attempt < 50; attempt++) {
+        int sockfd = connect_to_server();
+        if (sockfd >= 0) {
+            close(sockfd);
+            return;
+        }
+        usleep(100000);
+    }
+    fprintf(stderr, "Cluster did not start\n");
+    exit(1);
+}
+
+void stop_cluster(pid_t *pids)
+{
+    for (int i = 0; i < 4; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+double percentile(struct latency_samples *samples, double pct)
+{
+    if (samples->count == 0) return 0;
+    size_t idx = (size_t) (samples->count * pct / 100.0);
+    if (idx >= samples->count) idx = samples->count - 1;
+    return samples->values[idx];
+}
+
+int report(struct client_state *clients, double elapsed, const char *json_path)
+{
+    struct latency_samples merged[OP_COUNT];
+    memset(merged, 0, sizeof(merged));
+
+    unsigned long total_ops = 0, total_errors = 0, total_bytes = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (int c = 0; c < client_count; c++) {
+            struct latency_samples *s = &clients[c].samples[op];
+            for (size_t i = 0; i < s->count; i++) {
+                add_sample(&merged[op], s->values[i], 0, 0);
+            }
+            merged[op].errors += s->errors;
+            merged[op].bytes += s->bytes;
+        }
+        qsort(merged[op].values, merged[op].count, sizeof(double), compare_double);
+        total_ops += merged[op].count;
+        total_errors += merged[op].errors;
+        total_bytes += merged[op].bytes;
+    }
+
+    int status = 0;
+    printf("\n%-12s %8s %7s %10s %10s %10s %10s %10s\n",
+           "op", "count", "errors", "ops/s", "p50_ms", "p95_ms", "p99_ms", "p999_ms");
+    for (int op = 0; op < OP_COUNT; op++) {
+        struct latency_samples *s = &merged[op];
+        if (s->count == 0) continue;
+        printf("%-12s %8zu %7lu %10.1f %10.3f %10.3f %10.3f %10.3f\n", op_names[op], s->count, s->errors,
+               s->count / elapsed, percentile(s, 50) / 1000, percentile(s, 95) / 1000,
+               percentile(s, 99) / 1000, percentile(s, 99.9) / 1000);
+        if (max_p99_ms > 0 && percentile(s, 99) / 1000 > max_p99_ms) status = 2;
+    }
+    printf("\ntotal: %lu ops, %lu errors in %.2f s = %.1f ops/s, %.2f MB/s\n", total_ops, total_errors,
+           elapsed, total_ops / elapsed, total_bytes / elapsed / (1024 * 1024));
+
+    if (json_path != NULL) {
+        FILE *out = (strcmp(json_path, "-") == 0) ? stdout : fopen(json_path, "w");
+        if (out == NULL) {
+            perror("Cannot open JSON output");
+            return 1;
+        }
+        fprintf(out, "{\"clients\":%d,\"elapsed_s\":%.3f,\"total_ops\":%lu,\"total_errors\":%lu,"
+                "\"ops_per_sec\":%.2f,\"mb_per_sec\":%.3f,\"ops\":{",
+                client_count, elapsed, total_ops, total_errors, total_ops / elapsed,
+                total_bytes / elapsed / (1024 * 1024));
+        int first = 1;
+        for (int op = 0; op < OP_COUNT; op++) {
+            struct latency_samples *s = &merged[op];
+            if (s->count == 0) continue;
+            fprintf(out, "%s\"%s\":{\"count\":%zu,\"errors\":%lu,\"bytes\":%lu,\"ops_per_sec\":%.2f,"
+                    "\"p50_us\":%.1f,\"p95_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}",
+                    first ? "" : ",", op_names[op], s->count, s->errors, s->bytes, s->count / elapsed,
+                    percentile(s, 50), percentile(s, 95), percentile(s, 99), percentile(s, 99.9));
+            first = 0;
+        }
+        fprintf(out, "}}\n");
+        if (out != stdout) fclose(out);
+    }
+
+    for (int op = 0; op < OP_COUNT; op++) {
+        free(merged[op].values);
+    }
+    if (status != 0) {
+        fprintf(stderr, "p99 latency exceeded %.3f ms\n", max_p99_ms);
+    }
+    return status;
+}
+
+// Reads an S1 workload recording into replay_ops, ordered by when each request arrived
+int load_replay(const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+    char magic[sizeof(RECORD_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not a workload recording\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    size_t capacity = 0;
+    struct workload_record record;
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        if (record.command >= RC_COUNT || record.args_len >= BUFFER_SIZE) {
+            fprintf(stderr, "%s: corrupt record %zu\n", path, replay_count);
+            break;
+        }
+        if (replay_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            struct replay_op *ops = realloc(replay_ops, capacity * sizeof(struct replay_op));
+            if (ops == NULL) {
+                perror("Replay allocation failed");
+                exit(1);
+            }
+            replay_ops = ops;
+        }
+        struct replay_op *op = &replay_ops[replay_count];
+        memset(op, 0, sizeof(*op));
+        op->record = record;
+        op->args = calloc(1, record.args_len + 1);
+        if (op->args == NULL || fread(op->args, 1, record.args_len, in) != record.args_len) {
+            free(op->args);
+            break;
+        }
+        replay_count++;
+    }
+    fclose(in);
+
+    if (replay_count == 0) {
+        fprintf(stderr, "%s has no requests\n", path);
+        return -1;
+    }
+    qsort(replay_ops, replay_count, sizeof(struct replay_op), compare_replay);
+    for (size_t i = 0; i < replay_count; i++) {
+        replay_ops[i].at = (replay_ops[i].record.start_us - replay_ops[0].record.start_us) / 1e6;
+    }
+    return 0;
+}
+
+int compare_replay(const void *a, const void *b)
+{
+    unsigned long x = ((const struct replay_op *) a)->record.start_us;
+    unsigned long y = ((const struct replay_op *) b)->record.start_us;
+    return (x > y) - (x < y);
+}
+
+unsigned long fnv1a(const char *text)
+{
+    unsigned long hash = 14695981039346656037UL;
+    while (*text) {
+        hash = (hash ^ (unsigned char) *text++) * 1099511628211UL;
+    }
+    return hash ? hash : 1;
+}
+
+// Open-addressed set of path hashes; returns 1 if the path was already present
+int remember_path(unsigned long *set, size_t mask, const char *path)
+{
+    unsigned long hash = fnv1a(path);
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (set[i] == hash) return 1;
+        if (set[i] == 0) {
+            set[i] = hash;
+            return 0;
+        }
+    }
+}
+
+// The recording starts from whatever was already stored, so upload a stand-in for every path
+// the trace successfully reads, removes or copies before (or without) uploading it. Downloads
+// keep their recorded size; anything else gets REPLAY_SEED_SIZE bytes.
+void seed_replay(void)
+{
+    size_t slots = 1024;
+    while (slots < replay_count * 4) slots *= 2;
+    unsigned long *seen = calloc(slots, sizeof(unsigned long));
+    if (seen == NULL) {
+        perror("Seed allocation failed");
+        exit(1);
+    }
+
+    int seeded = 0, failed = 0;
+    for (size_t i = 0; i < replay_count; i++) {
+        struct replay_op *op = &replay_ops[i];
+        char path[BUFFER_SIZE], other[BUFFER_SIZE];
+        path[0] = other[0] = '\0';
+        sscanf(op->args, "%1023s %1023s", path, other);
+
+        if (op->record.command == RC_UPLOADF) {
+            size_t len = strlen(other);
+            while (len > 1 && other[len - 1] == '/') other[--len] = '\0';
+            char *name = strrchr(path, '/');
+            snprintf(other + len, sizeof(other) - len, "/%s", name ? name + 1 : path);
+            remember_path(seen, slots - 1, other);
+            continue;
+        }
+        if (op->record.command != RC_DOWNLF && op->record.command != RC_REMOVEF &&
+            op->record.command != RC_COPYF && op->record.command != RC_MOVEF) {
+            continue;
+        }
+        if (other[0] != '\0') remember_path(seen, slots - 1, other);
+
+        char *slash = strrchr(path, '/');
+        if (op->record.status != RECORD_OK || slash == NULL || strchr(slash, '.') == NULL || remember_path(seen, slots - 1, path)) continue;
+
+        off_t size = (op->record.command == RC_DOWNLF) ? (off_t) op->record.bytes_out : REPLAY_SEED_SIZE;
+        *slash = '\0';
+        if (upload_payload(slash + 1, path, size) == 0) {
+            seeded++;
+        } else {
+            failed++;
+        }
+    }
+    free(seen);
+    printf("dfsbench: seeded %d files the recording expected to exist", seeded);
+    if (failed > 0) printf(" (%d failed)", failed);
+    printf("\n");
+}
+
+// Re-issues one recorded request; returns 0, -1 on error or -2 if S1 answered BUSY
+int replay_request(struct replay_op *op, unsigned long *bytes)
+{
+    if (op->record.command == RC_UPLOADF) {
+        char name[BUFFER_SIZE], dir[BUFFER_SIZE];
+        if (sscanf(op->args, "%1023s %1023s", name, dir) != 2) return -1;
+        *bytes = op->record.bytes_in;
+        return upload_payload(name, dir, op->record.bytes_in);
+    }
+
+    int sockfd = connect_to_server();
+    if (sockfd < 0) return -1;
+
+    char cmd[BUFFER_SIZE];
+    int len = snprintf(cmd, BUFFER_SIZE, "%s %s", replay_names[op->record.command], op->args);
+    write(sockfd, cmd, len < BUFFER_SIZE ? len : BUFFER_SIZE - 1);
+
+    int result = 0;
+    if (op->record.command == RC_DOWNLF || op->record.command == RC_DOWNLTAR) {
+        result = drain_sized_response(sockfd, bytes);
+    } else {
+        char buffer[BUFFER_SIZE * 4];
+        ssize_t n;
+        *bytes = 0;
+        while ((n = read(sockfd, buffer, sizeof(buffer))) > 0) {
+            if (*bytes == 0 && strncmp(buffer, "BUSY", 4) == 0) result = -2;
+            if (*bytes == 0 && strncmp(buffer, "ERROR", 5) == 0) result = -1;
+            *bytes += n;
+        }
+        if (n < 0) result = -1;
+    }
+    close(sockfd);
+    return result;
+}
+
+void *replay_main(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        size_t idx = __atomic_fetch_add(&replay_next, 1, __ATOMIC_RELAXED);
+        if (idx >= replay_count) break;
+        struct replay_op *op = &replay_ops[idx];
+
+        // Batch requests and deltaf need client-side state the recording does not keep
+        if (op->record.command == RC_MDOWNLF || op->record.command == RC_MREMOVEF ||
+            op->record.command == RC_DELTAF) {
+            op->skipped = 1;
+            continue;
+        }
+
+        if (replay_speed > 0) {
+            double wait = replay_start + op->at / replay_speed - now_sec();
+            if (wait > 0) {
+                usleep((useconds_t) (wait * 1e6));
+            } else {
+                op->lag_us = -wait * 1e6;
+            }
+        }
+
+        unsigned long bytes = 0;
+        double start = now_sec();
+        int result = replay_request(op, &bytes);
+        op->latency_us = (now_sec() - start) * 1e6;
+        op->status = (result == 0) ? RECORD_OK : (result == -2) ? RECORD_BUSY : RECORD_ERROR;
+    }
+    return NULL;
+}
+
+// Recorded latencies are S1's own (command read to reply sent); replayed ones are measured here
+// and include the connection, so compare deltas between runs rather than against zero.
+int replay_report(double elapsed, const char *json_path)
+{
+    struct latency_samples recorded[RC_COUNT], replayed[RC_COUNT];
+    unsigned long mismatches[RC_COUNT] = { 0 }, skipped = 0;
+    double max_lag_us = 0;
+    memset(recorded, 0, sizeof(recorded));
+    memset(replayed, 0, sizeof(replayed));
+
+    for (size_t i = 0; i < replay_count; i++) {
+        struct replay_op *op = &replay_ops[i];
+        int cmd = op->record.command;
+        if (op->skipped) {
+            skipped++;
+            continue;
+        }
+        add_sample(&recorded[cmd], op->record.duration_us, op->record.status != RECORD_OK, op->record.bytes_out);
+        add_sample(&replayed[cmd], op->latency_us, op->status != RECORD_OK, 0);
+        if (op->status != op->record.status) mismatches[cmd]++;
+        if (op->lag_us > max_lag_us) max_lag_us = op->lag_us;
+    }
+
+    int status = 0;
+    printf("\n%-12s %7s %7s %7s %9s %9s %9s %9s %9s %9s\n", "command", "count", "errors", "differ",
+           "rec_p50", "p50_ms", "delta", "rec_p99", "p99_ms", "delta");
+    for (int cmd = 0; cmd < RC_COUNT; cmd++) {
+        if (replayed[cmd].count == 0) continue;
+        qsort(recorded[cmd].values, recorded[cmd].count, sizeof(double), compare_double);
+        qsort(replayed[cmd].values, replayed[cmd].count, sizeof(double), compare_double);
+        double rec50 = percentile(&recorded[cmd], 50) / 1000, rep50 = percentile(&replayed[cmd], 50) / 1000;
+        double rec99 = percentile(&recorded[cmd], 99) / 1000, rep99 = percentile(&replayed[cmd], 99) / 1000;
+        printf("%-12s %7zu %7lu %7lu %9.3f %9.3f %+9.3f %9.3f %9.3f %+9.3f\n", replay_names[cmd],
+               replayed[cmd].count, replayed[cmd].errors, mismatches[cmd], rec50, rep50, rep50 - rec50,
+               rec99, rep99, rep99 - rec99);
+        if (max_p99_ms > 0 && rep99 > max_p99_ms) status = 2;
+    }
+    printf("\nreplayed %zu requests in %.2f s (recorded over %.2f s), %lu skipped, max issue lag %.3f ms\n",
+           replay_count - skipped, elapsed, replay_ops[replay_count - 1].at, skipped, max_lag_us / 1000);
+
+    if (json_path != NULL) {
+        FILE *out = (strcmp(json_path, "-") == 0) ? stdout : fopen(json_path, "w");
+        if (out == NULL) {
+            perror("Cannot open JSON output");
+            return 1;
+        }
+        fprintf(out, "{\"replayed\":%zu,\"skipped\":%lu,\"speed\":%g,\"elapsed_s\":%.3f,\"max_lag_us\":%.1f,"
+                "\"commands\":{", replay_count - skipped, skipped, replay_speed, elapsed, max_lag_us);
+        int first = 1;
+        for (int cmd = 0; cmd < RC_COUNT; cmd++) {
+            if (replayed[cmd].count == 0) continue;
+            fprintf(out, "%s\"%s\":{\"count\":%zu,\"errors\":%lu,\"recorded_errors\":%lu,\"status_differs\":%lu,"
+                    "\"recorded_p50_us\":%.1f,\"p50_us\":%.1f,\"recorded_p99_us\":%.1f,\"p99_us\":%.1f}",
+                    first ? "" : ",", replay_names[cmd], replayed[cmd].count, replayed[cmd].errors,
+                    recorded[cmd].errors, mismatches[cmd], percentile(&recorded[cmd], 50),
+                    percentile(&replayed[cmd], 50), percentile(&recorded[cmd], 99), percentile(&replayed[cmd], 99));
+            first = 0;
+        }
+        fprintf(out, "}}\n");
+        if (out != stdout) fclose(out);
+    }
+
+    for (int cmd = 0; cmd < RC_COUNT; cmd++) {
+        free(recorded[cmd].values);
+        free(replayed[cmd].values);
+    }
+    if (status != 0) {
+        fprintf(stderr, "p99 latency exceeded %.3f ms\n", max_p99_ms);
+    }
+    return status;
+}
+
+void crc32c_init(void)
+{
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            unsigned int prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len)
+{
+    unsigned long c = crc;
+    while (len > 0 && ((unsigned long) p & 7) != 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        unsigned long word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    return c;
+}
+#endif
+
+// Continues a running CRC32C (Castagnoli, as in iSCSI/ext4); start from 0. Uses the SSE4.2
+// crc32 instruction when the CPU has it and slicing-by-8 tables otherwise.
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_sse42(crc, p, len);
+    }
+#endif
+    while (len >= 8) {
+        unsigned int lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24);
+        unsigned int hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int) p[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
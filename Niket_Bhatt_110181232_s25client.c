@@ -6,30 +6,158 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <sys/sendfile.h>
 #include <errno.h>
+#include <sys/xattr.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define PORT 4307
 #define BUFFER_SIZE 1024
+#define TRANSFER_BUFFER_SIZE (64 * 1024)
+#define CRC32C_POLY 0x82F63B78
+#define CRC_XATTR "user.dfs.crc32c"
+#define BUSY_SIZE ((off_t) -2)
+#define CACHED_TOKEN " cached="
+#define NOT_MODIFIED_SIZE ((off_t) -3)
+#define CACHE_DIR ".dfs_cache"
+#define ENCODING_RAW 0
+#define ENCODING_ZLIB 1
+#define COMPRESS_CHUNK_SIZE (64 * 1024)
+#define COMPRESS_SAMPLE_SIZE 4096
+#define COMPRESS_MAX_ENTROPY 7.5
+#define COMPRESS_TOKEN " compress=zlib"
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK (64 * 1024)
+#define DELTA_COPY 0
+#define DELTA_LITERAL 1
+#define TLS_RECORD_SIZE (16 * 1024)
+#define TLS_SERVER_NAME "localhost"
+
+// Header of one chunk of a zlib-encoded payload; wire_len 0 means the chunk is stored raw
+struct chunk_header {
+    unsigned int raw_len;
+    unsigned int wire_len;
+};
+
+// Signature of one full block of the server's copy, sent to the client for deltaf
+struct block_signature {
+    unsigned int weak;
+    unsigned int strong;
+};
+
+// One deltaf instruction: copy block `value` of the old copy, or take the `value` literal bytes
+// that follow the instruction
+struct delta_op {
+    unsigned int type;
+    unsigned int value;
+};
+
+unsigned int crc32c_table[8][256];
+int compress_enabled = 0;
+char cache_dir[BUFFER_SIZE];
+SSL_CTX *tls_ctx = NULL;
 
 int connect_to_server();
+void set_nodelay(int sockfd);
+SSL_CTX *tls_client_context(const char *ca_file);
+int tls_connect(int sockfd);
+int tls_relay(SSL *ssl, int sockfd);
+void tls_relay_main(SSL *ssl, int sockfd, int local_fd);
 int send_file(int sockfd, char *filename);
-int receive_file(int sockfd, char *filename);
+int send_delta(int sockfd, char *filename);
+off_t build_delta(FILE *out, const unsigned char *data, off_t size, struct block_signature *signatures,
+                  off_t block_count, unsigned int block_size);
+void write_literal(FILE *out, const unsigned char *data, off_t len);
+int receive_file(int sockfd, char *filename, const char *cache_file);
+int cache_path(const char *dfs_path, char *out, size_t len);
+long cached_crc32c(const char *cache_file);
+int copy_file(const char *src, const char *dst, long crc);
+int store_cache_entry(const char *src, const char *dst, unsigned int crc);
+int make_parent_dirs(const char *path);
+char *build_batch_list(char **args, int count, size_t *len);
+int receive_batch(int sockfd);
+int read_all(int fd, void *buf, size_t len);
+int write_all(int fd, const void *buf, size_t len);
+off_t transfer_data(int out_fd, int in_fd, off_t count);
+off_t transfer_checksummed(int out_fd, int in_fd, off_t count, unsigned int *crc);
+void crc32c_init(void);
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len);
+double sample_entropy(const unsigned char *buf, size_t len);
+int choose_encoding(int fd, const char *name);
+off_t send_payload(int out_fd, int in_fd, off_t size, int framed, const char *name, unsigned int *crc);
+off_t send_zlib_chunks(int out_fd, int in_fd, off_t size, unsigned int *crc);
+off_t receive_payload(int out_fd, int in_fd, off_t size, int framed, unsigned int *crc);
+void pack_chunk(struct chunk_header *header, const unsigned char *raw, size_t len, unsigned char *packed, int level);
+ssize_t read_chunk(int in_fd, int encoding, unsigned char *raw, unsigned char *packed, off_t remaining);
 
-int main() {
+int main(int argc, char *argv[]) {
     char input[BUFFER_SIZE];
     
+    int opt_char;
+    int use_cache = 0;
+    int use_tls = 0;
+    char *ca_file = NULL;
+    while ((opt_char = getopt(argc, argv, "zcTA:")) != -1) {
+        if (opt_char == 'z') {
+            compress_enabled = 1;
+        } else if (opt_char == 'c') {
+            use_cache = 1;
+        } else if (opt_char == 'T') {
+            use_tls = 1;
+        } else if (opt_char == 'A') {
+            use_tls = 1;
+            ca_file = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-z] [-c] [-T] [-A ca_file]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (use_tls && (tls_ctx = tls_client_context(ca_file)) == NULL) {
+        fprintf(stderr, "Cannot set up TLS\n");
+        exit(1);
+    }
+    if (use_cache && getenv("HOME") != NULL) {
+        snprintf(cache_dir, sizeof(cache_dir), "%s/%s", getenv("HOME"), CACHE_DIR);
+    }
+    
+    crc32c_init();
+    
     printf("DFS Client - Multi-File Support\n");
     printf("Commands:\n");
     printf("  uploadf <file1> [file2] [file3] <destination>\n");
+    printf("  deltaf <file1> [file2] [file3] <destination>\n");
     printf("  downlf <file1> [file2]\n");
     printf("  removef <file1> [file2]\n");
     printf("  downltar <filetype>\n");
     printf("  dispfnames <pathname>\n");
+    printf("  mdownlf <file|@listfile>...\n");
+    printf("  mremovef <file|@listfile>...\n");
+    printf("  stats\n");
+    printf("  tracedump\n");
+    printf("  nodes\n");
+    printf("  changes <filetype> [cursor] [wait_ms]\n");
+    printf("  du <pathname> [rescan]\n");
+    printf("  findf <pathname> <glob|/regex/> [size>N] [size<N] [mtime<AGE] [mtime>AGE] [limit=N]\n");
+    printf("  copyf <source> <destination>\n");
+    printf("  movef <source> <destination>\n");
+    printf("  rebalance [<filetype> <port> [rate=N] [iops=N]]\n");
     printf("  exit\n\n");
     
     while (1) {
@@ -59,10 +187,11 @@ int main() {
         
         char *command = words[0];
         
-        // UPLOADF COMMAND
-        if (strcmp(command, "uploadf") == 0) {
+        // UPLOADF / DELTAF COMMAND (deltaf sends only what the server's copy lacks)
+        if (strcmp(command, "uploadf") == 0 || strcmp(command, "deltaf") == 0) {
+            int delta = (strcmp(command, "deltaf") == 0);
             if (word_count < 3) {
-                printf("Usage: uploadf <file1> [file2] [file3] <destination>\n");
+                printf("Usage: %s <file1> [file2] [file3] <destination>\n", command);
                 goto cleanup;
             }
             
@@ -108,7 +237,12 @@ int main() {
                 
                 // Send command
                 char cmd[BUFFER_SIZE];
-                snprintf(cmd, BUFFER_SIZE, "uploadf %s %s", filename, destination);
+                if (delta) {
+                    snprintf(cmd, BUFFER_SIZE, "deltaf %s %s", filename, destination);
+                } else {
+                    snprintf(cmd, BUFFER_SIZE, "uploadf %s %s%s", filename, destination,
+                             compress_enabled ? COMPRESS_TOKEN : "");
+                }
                 write(sockfd, cmd, strlen(cmd));
                 
                 // Read response
@@ -118,7 +252,11 @@ int main() {
                 
                 if (strcmp(response, "READY") == 0) {
                     printf("Uploading file %d/%d: %s\n", i+1, file_count, filename);
-                    send_file(sockfd, filename);
+                    if (delta) {
+                        send_delta(sockfd, filename);
+                    } else {
+                        send_file(sockfd, filename);
+                    }
                     
                     bzero(response, BUFFER_SIZE);
                     read(sockfd, response, BUFFER_SIZE - 1);
@@ -154,14 +292,29 @@ int main() {
                     continue;
                 }
                 
+                // A cached copy is offered by its CRC32C and size; the server only resends the file
+                // if either differs
+                char cache_file[BUFFER_SIZE], cached_token[48] = "";
+                int cacheable = (cache_path(filename, cache_file, sizeof(cache_file)) == 0);
+                long cached_crc = cacheable ? cached_crc32c(cache_file) : -1;
+                struct stat cached_st;
+                if (cached_crc >= 0 && stat(cache_file, &cached_st) == 0) {
+                    snprintf(cached_token, sizeof(cached_token), "%s%08lx:%ld", CACHED_TOKEN, cached_crc,
+                             (long) cached_st.st_size);
+                }
+                
                 char cmd[BUFFER_SIZE];
-                snprintf(cmd, BUFFER_SIZE, "downlf %s", filename);
+                snprintf(cmd, BUFFER_SIZE, "downlf %s%s%s", filename, cached_token,
+                         compress_enabled ? COMPRESS_TOKEN : "");
                 write(sockfd, cmd, strlen(cmd));
                 
                 char *base_name = basename(filename);
                 printf("Downloading file %d/%d: %s\n", i+1, file_count, base_name);
                 
-                if (receive_file(sockfd, base_name) == 0) {
+                int status = receive_file(sockfd, base_name, cacheable ? cache_file : NULL);
+                if (status == 1) {
+                    printf("  Unchanged, copied from cache: %s\n", base_name);
+                } else if (status == 0) {
                     printf("  Successfully downloaded: %s\n", base_name);
                 } else {
                     printf("  Failed to download: %s\n", base_name);
@@ -229,7 +382,7 @@ int main() {
             }
             
             char cmd[BUFFER_SIZE];
-            snprintf(cmd, BUFFER_SIZE, "downltar %s", filetype);
+            snprintf(cmd, BUFFER_SIZE, "downltar %s%s", filetype, compress_enabled ? COMPRESS_TOKEN : "");
             write(sockfd, cmd, strlen(cmd));
             
             char output_file[50];
@@ -237,7 +390,7 @@ int main() {
             else if (strcmp(filetype, ".pdf") == 0) strcpy(output_file, "pdf.tar");
             else strcpy(output_file, "text.tar");
             
-            if (receive_file(sockfd, output_file) == 0) {
+            if (receive_file(sockfd, output_file, NULL) == 0) {
                 printf("Tar file '%s' downloaded successfully\n", output_file);
             }
             
@@ -276,6 +429,230 @@ int main() {
             close(sockfd);
         }
         
+        // MDOWNLF / MREMOVEF COMMANDS
+        else if (strcmp(command, "mdownlf") == 0 || strcmp(command, "mremovef") == 0) {
+            if (word_count < 2) {
+                printf("Usage: %s <file|@listfile>...\n", command);
+                goto cleanup;
+            }
+            
+            size_t list_len;
+            char *list = build_batch_list(words + 1, word_count - 1, &list_len);
+            if (list == NULL) {
+                printf("ERROR: No valid files to process\n");
+                goto cleanup;
+            }
+            
+            int sockfd = connect_to_server();
+            if (sockfd < 0) {
+                printf("ERROR: Cannot connect to server\n");
+                free(list);
+                goto cleanup;
+            }
+            
+            char cmd[BUFFER_SIZE];
+            snprintf(cmd, BUFFER_SIZE, "%s%s", command, compress_enabled ? COMPRESS_TOKEN : "");
+            write(sockfd, cmd, strlen(cmd));
+            
+            char response[BUFFER_SIZE];
+            bzero(response, BUFFER_SIZE);
+            read(sockfd, response, BUFFER_SIZE - 1);
+            
+            if (strcmp(response, "READY") == 0) {
+                off_t len = list_len;
+                write_all(sockfd, &len, sizeof(off_t));
+                write_all(sockfd, list, list_len);
+                
+                if (strcmp(command, "mdownlf") == 0) {
+                    receive_batch(sockfd);
+                } else {
+                    int bytes;
+                    while ((bytes = read(sockfd, response, sizeof(response))) > 0) {
+                        fwrite(response, 1, bytes, stdout);
+                    }
+                }
+            } else {
+                printf("  %s\n", response);
+            }
+            
+            free(list);
+            close(sockfd);
+        }
+        
+        // STATS / TRACEDUMP / NODES COMMANDS
+        else if (strcmp(command, "stats") == 0 || strcmp(command, "tracedump") == 0 ||
+                 strcmp(command, "nodes") == 0) {
+            int sockfd = connect_to_server();
+            if (sockfd < 0) {
+                printf("ERROR: Cannot connect to server\n");
+                goto cleanup;
+            }
+            
+            write(sockfd, command, strlen(command));
+            
+            char response[BUFFER_SIZE];
+            int bytes;
+            while ((bytes = read(sockfd, response, sizeof(response))) > 0) {
+                fwrite(response, 1, bytes, stdout);
+            }
+            
+            close(sockfd);
+        }
+        
+        // DU COMMAND (bytes and files below a directory, per type)
+        else if (strcmp(command, "du") == 0) {
+            if (word_count < 2 || word_count > 3 || (word_count == 3 && strcmp(words[2], "rescan") != 0)) {
+                printf("Usage: du <pathname> [rescan]\n");
+                goto cleanup;
+            }
+            
+            if (strncmp(words[1], "~S1", 3) != 0) {
+                printf("ERROR: Path must start with ~S1\n");
+                goto cleanup;
+            }
+            
+            int sockfd = connect_to_server();
+            if (sockfd < 0) {
+                printf("ERROR: Cannot connect to server\n");
+                goto cleanup;
+            }
+            
+            char cmd[BUFFER_SIZE];
+            snprintf(cmd, BUFFER_SIZE, "du %s%s", words[1], (word_count == 3) ? " rescan" : "");
+            write(sockfd, cmd, strlen(cmd));
+            
+            char response[BUFFER_SIZE];
+            int bytes;
+            while ((bytes = read(sockfd, response, sizeof(response))) > 0) {
+                fwrite(response, 1, bytes, stdout);
+            }
+            
+            close(sockfd);
+        }
+        
+        // CHANGES COMMAND (the feed of files created, modified or deleted since a cursor)
+        else if (strcmp(command, "changes") == 0) {
+            if (word_count < 2 || word_count > 4) {
+                printf("Usage: changes <filetype> [cursor] [wait_ms]\n");
+                goto cleanup;
+            }
+            
+            int sockfd = connect_to_server();
+            if (sockfd < 0) {
+                printf("ERROR: Cannot connect to server\n");
+                goto cleanup;
+            }
+            
+            char cmd[BUFFER_SIZE];
+            snprintf(cmd, BUFFER_SIZE, "changes %s %s %s", words[1], (word_count > 2) ? words[2] : "-",
+                     (word_count > 3) ? words[3] : "0");
+            write(sockfd, cmd, strlen(cmd));
+            
+            char response[BUFFER_SIZE];
+            int bytes;
+            while ((bytes = read(sockfd, response, sizeof(response))) > 0) {
+                fwrite(response, 1, bytes, stdout);
+            }
+            
+            close(sockfd);
+        }
+        
+        // FINDF COMMAND (files below a directory on every server, streamed as they are found)
+        else if (strcmp(command, "findf") == 0) {
+            if (word_count < 3) {
+                printf("Usage: findf <pathname> <glob|/regex/> [size>N] [size<N] [mtime<AGE] [mtime>AGE] [limit=N]\n");
+                goto cleanup;
+            }
+            
+            if (strncmp(words[1], "~S1", 3) != 0) {
+                printf("ERROR: Path must start with ~S1\n");
+                goto cleanup;
+            }
+            
+            int sockfd = connect_to_server();
+            if (sockfd < 0) {
+                printf("ERROR: Cannot connect to server\n");
+                goto cleanup;
+            }
+            
+            char cmd[BUFFER_SIZE] = "findf";
+            for (int i = 1; i < word_count; i++) {
+                strncat(cmd, " ", BUFFER_SIZE - strlen(cmd) - 1);
+                strncat(cmd, words[i], BUFFER_SIZE - strlen(cmd) - 1);
+            }
+            write(sockfd, cmd, strlen(cmd));
+            
+            char response[BUFFER_SIZE];
+            int bytes;
+            while ((bytes = read(sockfd, response, sizeof(response))) > 0) {
+                fwrite(response, 1, bytes, stdout);
+                fflush(stdout);
+            }
+            
+            close(sockfd);
+        }
+        
+        // COPYF / MOVEF COMMANDS (done by the servers, the file never comes to the client)
+        else if (strcmp(command, "copyf") == 0 || strcmp(command, "movef") == 0) {
+            if (word_count != 3) {
+                printf("Usage: %s <source> <destination>\n", command);
+                goto cleanup;
+            }
+            
+            if (strncmp(words[1], "~S1/", 4) != 0 || strncmp(words[2], "~S1", 3) != 0) {
+                printf("ERROR: Paths must start with ~S1\n");
+                goto cleanup;
+            }
+            
+            int sockfd = connect_to_server();
+            if (sockfd < 0) {
+                printf("ERROR: Cannot connect to server\n");
+                goto cleanup;
+            }
+            
+            char cmd[BUFFER_SIZE];
+            snprintf(cmd, BUFFER_SIZE, "%s %s %s", command, words[1], words[2]);
+            write(sockfd, cmd, strlen(cmd));
+            
+            char response[BUFFER_SIZE];
+            int bytes;
+            while ((bytes = read(sockfd, response, sizeof(response))) > 0) {
+                fwrite(response, 1, bytes, stdout);
+            }
+            printf("\n");
+            
+            close(sockfd);
+        }
+        
+        // REBALANCE COMMAND (move a file type to another storage node, or show progress)
+        else if (strcmp(command, "rebalance") == 0) {
+            if (word_count == 2 || word_count > 5) {
+                printf("Usage: rebalance [<filetype> <port> [rate=N] [iops=N]]\n");
+                goto cleanup;
+            }
+            
+            int sockfd = connect_to_server();
+            if (sockfd < 0) {
+                printf("ERROR: Cannot connect to server\n");
+                goto cleanup;
+            }
+            
+            char cmd[BUFFER_SIZE] = "rebalance";
+            for (int i = 1; i < word_count; i++) {
+                strncat(cmd, " ", BUFFER_SIZE - strlen(cmd) - 1);
+                strncat(cmd, words[i], BUFFER_SIZE - strlen(cmd) - 1);
+            }
+            write(sockfd, cmd, strlen(cmd));
+            
+            char response[BUFFER_SIZE];
+            int bytes;
+            while ((bytes = read(sockfd, response, sizeof(response))) > 0) {
+                fwrite(response, 1, bytes, stdout);
+            }
+            
+            close(sockfd);
+        }
+        
         else {
             printf("Unknown command: %s\n", command);
         }
@@ -311,10 +688,113 @@ int connect_to_server() {
         close(sockfd);
         return -1;
     }
+    set_nodelay(sockfd);
     
+    if (tls_ctx != NULL) return tls_connect(sockfd);
     return sockfd;
 }
 
+// Headers, payloads and trailers go out as separate writes; with Nagle the second one waits
+// for the server's delayed ACK (about 40 ms) before it is sent
+void set_nodelay(int sockfd) {
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Same parameters as the server: TLS 1.2 with AES-GCM is what the kernel can take over in
+// both directions, and without tickets or renegotiation no handshake records follow the data.
+SSL_CTX *tls_client_context(const char *ca_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == NULL) return NULL;
+    
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_TICKET |
+                        SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    int loaded = ca_file ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL) : SSL_CTX_set_default_verify_paths(ctx);
+    if (loaded != 1 || SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM") != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// Handshakes on a connected socket and returns the fd to talk to the server on: the socket
+// itself once the kernel does the record layer, else one end of a socketpair behind a relay.
+int tls_connect(int sockfd) {
+    SSL *ssl = SSL_new(tls_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, sockfd) != 1 || SSL_set_tlsext_host_name(ssl, TLS_SERVER_NAME) != 1 ||
+        SSL_set1_host(ssl, TLS_SERVER_NAME) != 1 || SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        close(sockfd);
+        return -1;
+    }
+    
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) && SSL_pending(ssl) == 0) {
+        SSL_free(ssl);
+        return sockfd;
+    }
+    return tls_relay(ssl, sockfd);
+}
+
+int tls_relay(SSL *ssl, int sockfd) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        SSL_free(ssl);
+        close(sockfd);
+        return -1;
+    }
+    
+    // Double fork so the relay is never left as a zombie of the interactive client
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pair[0]);
+        if (fork() == 0) tls_relay_main(ssl, sockfd, pair[1]);
+        _exit(0);
+    }
+    SSL_free(ssl);
+    close(sockfd);
+    close(pair[1]);
+    if (pid < 0) {
+        close(pair[0]);
+        return -1;
+    }
+    waitpid(pid, NULL, 0);
+    return pair[0];
+}
+
+void tls_relay_main(SSL *ssl, int sockfd, int local_fd) {
+    char buffer[TLS_RECORD_SIZE];
+    struct pollfd fds[2] = { { .fd = sockfd, .events = POLLIN }, { .fd = local_fd, .events = POLLIN } };
+    
+    while (1) {
+        fds[0].revents = fds[1].revents = 0;
+        if (SSL_pending(ssl) == 0 && poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (SSL_pending(ssl) > 0 || (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            int n = SSL_read(ssl, buffer, sizeof(buffer));
+            if (n <= 0 || write_all(local_fd, buffer, n) < 0) break;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(local_fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                SSL_shutdown(ssl);
+                break;
+            }
+            if (SSL_write(ssl, buffer, n) <= 0) break;
+        }
+    }
+    SSL_free(ssl);
+    close(sockfd);
+    close(local_fd);
+    _exit(0);
+}
+
 int send_file(int sockfd, char *filename) {
     int fd = open(filename, O_RDONLY);
     if (fd < 0) return -1;
@@ -323,37 +803,628 @@ int send_file(int sockfd, char *filename) {
     fstat(fd, &st);
     write(sockfd, &st.st_size, sizeof(off_t));
     
-    char buffer[BUFFER_SIZE];
-    off_t remaining = st.st_size;
-    while (remaining > 0) {
-        ssize_t n = read(fd, buffer, BUFFER_SIZE);
-        if (n <= 0) break;
-        write(sockfd, buffer, n);
-        remaining -= n;
+    // The CRC32C follows the data so S1 can verify what it received
+    unsigned int crc = 0;
+    off_t sent = send_payload(sockfd, fd, st.st_size, compress_enabled, filename, &crc);
+    write(sockfd, &crc, sizeof(crc));
+    
+    close(fd);
+    return (sent == st.st_size) ? 0 : -1;
+}
+
+// deltaf after READY: sends the new size, reads the server's block signatures (an off_t count,
+// -1 if the server refuses and a status line follows, then the block size) and answers with the
+// delta length, copy/literal instructions and the CRC32C of the whole new file
+int send_delta(int sockfd, char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    write_all(sockfd, &st.st_size, sizeof(off_t));
+    
+    off_t block_count;
+    unsigned int block_size;
+    if (read_all(sockfd, &block_count, sizeof(off_t)) < 0 || block_count < 0 ||
+        read_all(sockfd, &block_size, sizeof(block_size)) < 0 || block_size == 0 || block_size > DELTA_MAX_BLOCK) {
+        close(fd);
+        return -1;
     }
     
+    struct block_signature *signatures = malloc(block_count * sizeof(struct block_signature) + 1);
+    unsigned char *data = (st.st_size > 0) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    FILE *delta = tmpfile();
+    int result = -1;
+    if (signatures != NULL && data != MAP_FAILED && delta != NULL &&
+        read_all(sockfd, signatures, block_count * sizeof(struct block_signature)) == 0) {
+        off_t matched = build_delta(delta, data, st.st_size, signatures, block_count, block_size);
+        unsigned int crc = (st.st_size > 0) ? crc32c_update(0, data, st.st_size) : 0;
+        off_t delta_len = ftello(delta);
+        fflush(delta);
+        lseek(fileno(delta), 0, SEEK_SET);
+        
+        if (write_all(sockfd, &delta_len, sizeof(off_t)) == 0 &&
+            transfer_data(sockfd, fileno(delta), delta_len) == delta_len &&
+            write_all(sockfd, &crc, sizeof(crc)) == 0) {
+            printf("  Delta: %ld of %ld bytes matched the server's copy, sent %ld\n",
+                   (long) matched, (long) st.st_size, (long) delta_len);
+            result = 0;
+        }
+    }
+    
+    if (delta != NULL) fclose(delta);
+    if (data != NULL && data != MAP_FAILED) munmap(data, st.st_size);
+    free(signatures);
     close(fd);
-    return 0;
+    return result;
 }
 
-int receive_file(int sockfd, char *filename) {
+// Slides a window of block_size bytes over data, emitting a copy for every position whose rolling
+// checksum and CRC32C match one of the server's blocks and literals for the bytes in between.
+// Returns the number of bytes covered by copies.
+off_t build_delta(FILE *out, const unsigned char *data, off_t size, struct block_signature *signatures,
+                  off_t block_count, unsigned int block_size) {
+    size_t table_size = 1;
+    while (table_size < 2 * (size_t) block_count) table_size *= 2;
+    long *heads = malloc(table_size * sizeof(long));
+    long *next = malloc(block_count * sizeof(long) + 1);
+    if (heads == NULL || next == NULL) block_count = 0;
+    
+    // Chains are built back to front so each one lists the earliest matching block first
+    for (size_t i = 0; heads != NULL && i < table_size; i++) heads[i] = -1;
+    for (long i = block_count - 1; i >= 0; i--) {
+        size_t slot = signatures[i].weak & (table_size - 1);
+        next[i] = heads[slot];
+        heads[slot] = i;
+    }
+    
+    off_t pos = 0, literal_start = 0, matched = 0;
+    unsigned int a = 0, b = 0;
+    int window = 0;
+    while (block_count > 0 && pos + block_size <= size) {
+        if (!window) {
+            a = b = 0;
+            for (unsigned int i = 0; i < block_size; i++) {
+                a += data[pos + i];
+                b += a;
+            }
+            window = 1;
+        }
+        
+        unsigned int weak = (a & 0xffff) | (b << 16);
+        unsigned int strong = 0;
+        int have_strong = 0;
+        long match = -1;
+        for (long i = heads[weak & (table_size - 1)]; i >= 0 && match < 0; i = next[i]) {
+            if (signatures[i].weak != weak) continue;
+            if (!have_strong) {
+                strong = crc32c_update(0, data + pos, block_size);
+                have_strong = 1;
+            }
+            if (signatures[i].strong == strong) match = i;
+        }
+        
+        if (match >= 0) {
+            write_literal(out, data + literal_start, pos - literal_start);
+            struct delta_op op = { .type = DELTA_COPY, .value = match };
+            fwrite(&op, sizeof(op), 1, out);
+            pos += block_size;
+            literal_start = pos;
+            matched += block_size;
+            window = 0;
+        } else {
+            // Roll the window one byte forward
+            if (pos + block_size < size) {
+                unsigned char out_byte = data[pos], in_byte = data[pos + block_size];
+                a += in_byte - out_byte;
+                b += a - block_size * out_byte;
+            }
+            pos++;
+        }
+    }
+    write_literal(out, data + literal_start, size - literal_start);
+    
+    free(heads);
+    free(next);
+    return matched;
+}
+
+// Literal runs are split so the server never buffers more than one block's worth
+void write_literal(FILE *out, const unsigned char *data, off_t len) {
+    while (len > 0) {
+        struct delta_op op = { .type = DELTA_LITERAL, .value = (len < DELTA_MAX_BLOCK) ? len : DELTA_MAX_BLOCK };
+        fwrite(&op, sizeof(op), 1, out);
+        fwrite(data, 1, op.value, out);
+        data += op.value;
+        len -= op.value;
+    }
+}
+
+// Download header is the off_t size (-1 on error, -2 when S1 is saturated, followed by the
+// suggested retry delay, -3 when the cached copy offered with the request is current) and, for
+// valid sizes, the CRC32C of the data, which is checked as the file is written. With a
+// cache_file, a fresh download also replaces the cached copy. Returns 1 if the cache was used.
+int receive_file(int sockfd, char *filename, const char *cache_file) {
     off_t file_size;
-    if (read(sockfd, &file_size, sizeof(off_t)) != sizeof(off_t)) return -1;
-    if (file_size <= 0) return -1;
+    unsigned int expected_crc, crc = 0;
+    if (read_all(sockfd, &file_size, sizeof(off_t)) < 0) return -1;
+    if (file_size == BUSY_SIZE) {
+        unsigned int retry_after_ms = 0;
+        read_all(sockfd, &retry_after_ms, sizeof(retry_after_ms));
+        printf("  BUSY: server saturated, retry after %u ms\n", retry_after_ms);
+        return -1;
+    }
+    if (file_size == NOT_MODIFIED_SIZE && cache_file != NULL) {
+        // The copy is checked against the CRC32C it was offered with as it is read
+        if (copy_file(cache_file, filename, cached_crc32c(cache_file)) < 0) {
+            printf("  Cached copy of %s is damaged and was removed; download it again\n", filename);
+            unlink(cache_file);
+            return -1;
+        }
+        return 1;
+    }
+    if (file_size <= 0 || read_all(sockfd, &expected_crc, sizeof(expected_crc)) < 0) return -1;
     
     int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd < 0) return -1;
     
-    char buffer[BUFFER_SIZE];
-    off_t remaining = file_size;
-    while (remaining > 0) {
-        int chunk = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
-        int bytes = read(sockfd, buffer, chunk);
-        if (bytes <= 0) break;
-        write(fd, buffer, bytes);
-        remaining -= bytes;
-    }
+    off_t received = receive_payload(fd, sockfd, file_size, compress_enabled, &crc);
     
     close(fd);
+    if (received != file_size) return -1;
+    if (crc != expected_crc) {
+        printf("  Checksum mismatch for %s (expected %08x, got %08x)\n", filename, expected_crc, crc);
+        unlink(filename);
+        return -1;
+    }
+    if (cache_file != NULL && make_parent_dirs(cache_file) == 0) {
+        store_cache_entry(filename, cache_file, crc);
+    }
     return 0;
 }
+
+// Cache entries mirror the DFS tree: ~S1/a/b.txt is kept as $HOME/.dfs_cache/S1/a/b.txt.
+// Fails when caching is off (no -c) or the path could leave the cache directory.
+int cache_path(const char *dfs_path, char *out, size_t len) {
+    if (cache_dir[0] == '\0' || strstr(dfs_path, "..") != NULL) return -1;
+    int n = snprintf(out, len, "%s/%s", cache_dir, dfs_path + 1);
+    return (n > 0 && (size_t) n < len) ? 0 : -1;
+}
+
+// CRC32C recorded on a cache entry when it was stored, or -1 if there is no usable entry
+long cached_crc32c(const char *cache_file) {
+    unsigned int crc;
+    if (getxattr(cache_file, CRC_XATTR, &crc, sizeof(crc)) != sizeof(crc)) return -1;
+    return crc;
+}
+
+// Copies src to dst through a temporary file renamed into place. With a crc other than -1 the
+// data must match it, and the copy is tagged with it.
+int copy_file(const char *src, const char *dst, long crc) {
+    char tmp[BUFFER_SIZE + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", dst, getpid());
+    
+    struct stat st;
+    int in_fd = open(src, O_RDONLY);
+    int out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = -1;
+    if (in_fd >= 0 && out_fd >= 0 && fstat(in_fd, &st) == 0) {
+        unsigned int copied_crc = 0;
+        off_t copied = transfer_checksummed(out_fd, in_fd, st.st_size, &copied_crc);
+        if (copied == st.st_size && (crc < 0 || copied_crc == (unsigned int) crc)) {
+            if (crc >= 0) fsetxattr(out_fd, CRC_XATTR, &copied_crc, sizeof(copied_crc), 0);
+            result = rename(tmp, dst);
+        }
+    }
+    
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0) close(out_fd);
+    if (result < 0) unlink(tmp);
+    return result;
+}
+
+// Adds a file just downloaded (and checked against crc) to the cache. A reflink (FICLONE)
+// shares its blocks without copying; where the filesystem cannot, or the cache is on another
+// one, the data is copied.
+int store_cache_entry(const char *src, const char *dst, unsigned int crc) {
+    char tmp[BUFFER_SIZE + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", dst, getpid());
+    
+    int in_fd = open(src, O_RDONLY);
+    int out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = -1;
+    if (in_fd >= 0 && out_fd >= 0 && ioctl(out_fd, FICLONE, in_fd) == 0 &&
+        fsetxattr(out_fd, CRC_XATTR, &crc, sizeof(crc), 0) == 0) {
+        result = rename(tmp, dst);
+    }
+    
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0) close(out_fd);
+    if (result < 0) {
+        unlink(tmp);
+        result = copy_file(src, dst, crc);
+    }
+    return result;
+}
+
+int make_parent_dirs(const char *path) {
+    char dir[BUFFER_SIZE];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+        *slash = '/';
+    }
+    return 0;
+}
+
+// Joins the paths given on the command line, and the lines of any @listfile, into the
+// newline-separated list sent after READY. Returns NULL if no valid path was found.
+char *build_batch_list(char **args, int count, size_t *len) {
+    size_t capacity = BUFFER_SIZE;
+    char *list = malloc(capacity);
+    if (list == NULL) return NULL;
+    *len = 0;
+    
+    for (int i = 0; i < count; i++) {
+        FILE *listfile = NULL;
+        char line[BUFFER_SIZE];
+        
+        if (args[i][0] == '@') {
+            listfile = fopen(args[i] + 1, "r");
+            if (listfile == NULL) {
+                printf("ERROR: Cannot open list file '%s'\n", args[i] + 1);
+                continue;
+            }
+        }
+        
+        while (1) {
+            if (listfile != NULL) {
+                if (fgets(line, sizeof(line), listfile) == NULL) break;
+                line[strcspn(line, "\r\n")] = 0;
+                if (strlen(line) == 0) continue;
+            } else {
+                snprintf(line, sizeof(line), "%s", args[i]);
+            }
+            
+            if (strncmp(line, "~S1/", 4) != 0) {
+                printf("ERROR: File '%s' must start with ~S1/\n", line);
+            } else {
+                size_t line_len = strlen(line);
+                if (*len + line_len + 1 >= capacity) {
+                    capacity = (capacity + line_len + 1) * 2;
+                    char *grown = realloc(list, capacity);
+                    if (grown == NULL) break;
+                    list = grown;
+                }
+                memcpy(list + *len, line, line_len);
+                *len += line_len;
+                list[(*len)++] = '\n';
+            }
+            
+            if (listfile == NULL) break;
+        }
+        
+        if (listfile != NULL) fclose(listfile);
+    }
+    
+    if (*len == 0) {
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+// Saves each mdownlf record (off_t name length, name, off_t size, CRC32C, data) under its
+// base name, verifying the checksum as it is written
+int receive_batch(int sockfd) {
+    int downloaded = 0, failed = 0;
+    off_t name_len;
+    
+    while (read_all(sockfd, &name_len, sizeof(off_t)) == 0) {
+        char path[BUFFER_SIZE];
+        off_t file_size;
+        unsigned int expected_crc, crc = 0;
+        if (name_len <= 0 || name_len >= BUFFER_SIZE || read_all(sockfd, path, name_len) < 0 ||
+            read_all(sockfd, &file_size, sizeof(off_t)) < 0) {
+            printf("ERROR: Malformed response from server\n");
+            return -1;
+        }
+        path[name_len] = '\0';
+        
+        if (file_size < 0) {
+            printf("  Failed to download: %s\n", path);
+            failed++;
+            continue;
+        }
+        if (read_all(sockfd, &expected_crc, sizeof(expected_crc)) < 0) {
+            printf("ERROR: Malformed response from server\n");
+            return -1;
+        }
+        
+        // Keep the stream in step even if the local file cannot be created
+        char *base_name = basename(path);
+        int fd = open(base_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int out_fd = (fd >= 0) ? fd : open("/dev/null", O_WRONLY);
+        off_t received = receive_payload(out_fd, sockfd, file_size, compress_enabled, &crc);
+        close(out_fd);
+        if (fd >= 0 && received == file_size && crc != expected_crc) {
+            printf("  Checksum mismatch: %s (expected %08x, got %08x)\n", path, expected_crc, crc);
+            unlink(base_name);
+            failed++;
+        } else if (fd >= 0 && received == file_size) {
+            printf("  Successfully downloaded: %s\n", base_name);
+            downloaded++;
+        } else {
+            printf("  Failed to download: %s\n", path);
+            failed++;
+        }
+    }
+    
+    printf("%d downloaded, %d failed\n", downloaded, failed);
+    return failed ? -1 : 0;
+}
+
+int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Moves count bytes between descriptors: sendfile when the source is a regular file,
+// otherwise a TRANSFER_BUFFER_SIZE read/write loop (the fastest options in xferbench).
+// Returns the number of bytes moved, which is short of count on error or EOF.
+off_t transfer_data(int out_fd, int in_fd, off_t count) {
+    struct stat st;
+    off_t done = 0;
+
+    if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        while (done < count) {
+            ssize_t sent = sendfile(out_fd, in_fd, NULL, count - done);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) break;
+            done += sent;
+        }
+        return done;
+    }
+
+    return transfer_checksummed(out_fd, in_fd, count, NULL);
+}
+
+// Read/write loop that also folds the bytes into *crc (if not NULL), so a payload is
+// checksummed while it streams instead of in a second pass
+off_t transfer_checksummed(int out_fd, int in_fd, off_t count, unsigned int *crc) {
+    char buffer[TRANSFER_BUFFER_SIZE];
+    off_t done = 0;
+    while (done < count) {
+        size_t chunk = (count - done < TRANSFER_BUFFER_SIZE) ? (size_t) (count - done) : TRANSFER_BUFFER_SIZE;
+        ssize_t n = read(in_fd, buffer, chunk);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || write_all(out_fd, buffer, n) < 0) break;
+        if (crc != NULL) *crc = crc32c_update(*crc, buffer, n);
+        done += n;
+    }
+    return done;
+}
+
+void crc32c_init(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            unsigned int prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len) {
+    unsigned long c = crc;
+    while (len > 0 && ((unsigned long) p & 7) != 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        unsigned long word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    return c;
+}
+#endif
+
+// Continues a running CRC32C (Castagnoli, as in iSCSI/ext4); start from 0. Uses the SSE4.2
+// crc32 instruction when the CPU has it and slicing-by-8 tables otherwise.
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_sse42(crc, p, len);
+    }
+#endif
+    while (len >= 8) {
+        unsigned int lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24);
+        unsigned int hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int) p[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+// Shannon entropy of a sample in bits per byte; already-compressed data comes out close to 8
+double sample_entropy(const unsigned char *buf, size_t len) {
+    unsigned int counts[256] = {0};
+    for (size_t i = 0; i < len; i++) {
+        counts[buf[i]]++;
+    }
+    
+    double entropy = 0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] == 0) continue;
+        double p = (double) counts[i] / len;
+        entropy -= p * log2(p);
+    }
+    return entropy;
+}
+
+// Zip archives are always sent raw. Regular files are sampled at the start and the middle, since
+// formats like PDF have a plain-text header in front of compressed streams; sockets cannot be
+// sampled up front and rely on the per-chunk check in send_zlib_chunks.
+int choose_encoding(int fd, const char *name) {
+    const char *ext = strrchr(name, '.');
+    if (ext != NULL && strcmp(ext, ".zip") == 0) return ENCODING_RAW;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return ENCODING_ZLIB;
+    
+    unsigned char sample[COMPRESS_SAMPLE_SIZE];
+    off_t offsets[2] = { 0, st.st_size / 2 };
+    for (int i = 0; i < 2; i++) {
+        ssize_t n = pread(fd, sample, sizeof(sample), offsets[i]);
+        if (n > 0 && sample_entropy(sample, n) > COMPRESS_MAX_ENTROPY) return ENCODING_RAW;
+    }
+    return ENCODING_ZLIB;
+}
+
+// Sends size bytes from in_fd. Unframed sessions get the bytes as they are; framed sessions
+// (the command carried COMPRESS_TOKEN) get a one-byte encoding first, then either the raw
+// bytes or a sequence of chunks; empty payloads have no encoding byte. *crc, if not NULL, is
+// updated over the uncompressed data.
+off_t send_payload(int out_fd, int in_fd, off_t size, int framed, const char *name, unsigned int *crc) {
+    if (size == 0) return 0;
+    unsigned char encoding = framed ? choose_encoding(in_fd, name) : ENCODING_RAW;
+    if (framed && write_all(out_fd, &encoding, 1) < 0) return -1;
+    
+    if (encoding == ENCODING_ZLIB) return send_zlib_chunks(out_fd, in_fd, size, crc);
+    return (crc != NULL) ? transfer_checksummed(out_fd, in_fd, size, crc) : transfer_data(out_fd, in_fd, size);
+}
+
+// Each chunk is a chunk_header and either wire_len bytes of zlib data or, when wire_len is 0,
+// raw_len stored bytes. Chunks that look random or do not shrink are stored.
+off_t send_zlib_chunks(int out_fd, int in_fd, off_t size, unsigned int *crc) {
+    unsigned char *raw = malloc(COMPRESS_CHUNK_SIZE);
+    unsigned char *packed = malloc(compressBound(COMPRESS_CHUNK_SIZE));
+    off_t sent = 0;
+    
+    while (raw != NULL && packed != NULL && sent < size) {
+        size_t want = (size - sent < COMPRESS_CHUNK_SIZE) ? (size_t) (size - sent) : COMPRESS_CHUNK_SIZE;
+        if (read_all(in_fd, raw, want) < 0) break;
+        if (crc != NULL) *crc = crc32c_update(*crc, raw, want);
+        
+        struct chunk_header header;
+        pack_chunk(&header, raw, want, packed, Z_BEST_SPEED);
+        
+        const unsigned char *wire = header.wire_len ? packed : raw;
+        size_t wire_len = header.wire_len ? header.wire_len : want;
+        if (write_all(out_fd, &header, sizeof(header)) < 0 || write_all(out_fd, wire, wire_len) < 0) break;
+        sent += want;
+    }
+    
+    free(raw);
+    free(packed);
+    return sent;
+}
+
+// Counterpart of send_payload: writes the decoded payload to out_fd and returns its length
+off_t receive_payload(int out_fd, int in_fd, off_t size, int framed, unsigned int *crc) {
+    unsigned char encoding = ENCODING_RAW;
+    if (size == 0) return 0;
+    if (framed && read_all(in_fd, &encoding, 1) < 0) return -1;
+    if (encoding == ENCODING_RAW) return transfer_checksummed(out_fd, in_fd, size, crc);
+    if (encoding != ENCODING_ZLIB) return -1;
+    
+    unsigned char *raw = malloc(COMPRESS_CHUNK_SIZE);
+    unsigned char *packed = malloc(compressBound(COMPRESS_CHUNK_SIZE));
+    off_t received = 0;
+    
+    while (raw != NULL && packed != NULL && received < size) {
+        ssize_t n = read_chunk(in_fd, encoding, raw, packed, size - received);
+        if (n < 0) break;
+        if (crc != NULL) *crc = crc32c_update(*crc, raw, n);
+        if (write_all(out_fd, raw, n) < 0) break;
+        received += n;
+    }
+    
+    free(raw);
+    free(packed);
+    return received;
+}
+
+// Compresses one chunk into packed (compressBound(COMPRESS_CHUNK_SIZE) bytes) and fills in its
+// header; wire_len stays 0, storing the chunk raw, when the data looks random or does not shrink
+void pack_chunk(struct chunk_header *header, const unsigned char *raw, size_t len, unsigned char *packed, int level) {
+    uLongf packed_len = compressBound(COMPRESS_CHUNK_SIZE);
+    size_t sample_len = (len < COMPRESS_SAMPLE_SIZE) ? len : COMPRESS_SAMPLE_SIZE;
+    
+    header->raw_len = len;
+    header->wire_len = 0;
+    if (sample_entropy(raw, sample_len) <= COMPRESS_MAX_ENTROPY &&
+        compress2(packed, &packed_len, raw, len, level) == Z_OK && packed_len < len) {
+        header->wire_len = packed_len;
+    }
+}
+
+// Reads the next chunk (at most remaining bytes) of a payload with the given encoding into raw,
+// decoding it if needed; returns its length, or -1 on a read error or a malformed chunk
+ssize_t read_chunk(int in_fd, int encoding, unsigned char *raw, unsigned char *packed, off_t remaining) {
+    if (encoding == ENCODING_RAW) {
+        size_t want = (remaining < COMPRESS_CHUNK_SIZE) ? (size_t) remaining : COMPRESS_CHUNK_SIZE;
+        return (read_all(in_fd, raw, want) < 0) ? -1 : (ssize_t) want;
+    }
+    
+    struct chunk_header header;
+    if (read_all(in_fd, &header, sizeof(header)) < 0 || header.raw_len == 0 ||
+        header.raw_len > COMPRESS_CHUNK_SIZE || header.wire_len > compressBound(COMPRESS_CHUNK_SIZE) ||
+        header.raw_len > remaining) {
+        return -1;
+    }
+    
+    uLongf raw_len = header.raw_len;
+    if (header.wire_len == 0) {
+        if (read_all(in_fd, raw, header.raw_len) < 0) return -1;
+    } else if (read_all(in_fd, packed, header.wire_len) < 0 ||
+               uncompress(raw, &raw_len, packed, header.wire_len) != Z_OK || raw_len != header.raw_len) {
+        return -1;
+    }
+    return raw_len;
+}
@@ -0,0 +1,637 @@
+// DFS Directory Walk Microbenchmark - compares the servers' parallel tree walker with a recursive readdir
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+
+#define MAX_PATH_LEN 1024
+#define MAX_THREAD_COUNTS 16
+#define WALK_MAX_THREADS 16
+#define WALK_BUFFER_SIZE (64 * 1024)
+#define WALK_MAX_OPEN_DIRS 256
+#define WALK_SPIN_LIMIT 64
+#define WALK_IDLE_SLEEP_US 50
+#define WALK_ORDERED 1
+#define WALK_STAT 2
+#define WALK_DIRS 4
+#define WALK_COUNT_ONLY 8
+
+// Record returned by getdents64, which glibc does not declare
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// File or directory found by walk_tree; path is relative to the walk's root. size and mtime
+// are only filled in for regular files under WALK_STAT.
+struct walk_entry {
+    char *path;
+    unsigned char type;
+    off_t size;
+    time_t mtime;
+};
+
+// Directory waiting to be read, with an fd opened from its parent when one could be kept
+struct walk_item {
+    char *path;
+    int fd;
+    int depth;
+};
+
+// The directories one walker thread has queued: items[head..tail)
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_item *items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+};
+
+struct walk_worker {
+    struct walk *walk;
+    int id;
+    struct walk_deque deque;
+    struct walk_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+typedef int (*walk_match_fn)(const char *path, const char *name, const struct stat *st, void *arg);
+
+// Shared state of one walk_tree call
+struct walk {
+    int root_fd;
+    int flags;
+    int max_depth;
+    int threads;
+    walk_match_fn match;
+    void *arg;
+    long pending;
+    long open_dirs;
+    int stop;
+    struct walk_worker *workers;
+};
+
+
+struct mode {
+    const char *name;
+    int flags;
+    int list;       // collect entries rather than just count them
+};
+
+char bench_dir[512] = "/dev/shm/walkbench";
+int walk_threads = 1;
+
+double now_sec(void);
+long build_tree(const char *path, long files, int per_dir, int branching);
+int build_dir(int dir_fd, long *remaining, int per_dir, int branching);
+int remove_tree(int dir_fd);
+long readdir_count(int dir_fd, int use_stat);
+ssize_t walk_tree(int root_fd, int flags, int max_depth, walk_match_fn match, void *arg,
+                  struct walk_entry **entries);
+void walk_free(struct walk_entry *entries, ssize_t count);
+int compare_walk_entries(const void *a, const void *b);
+void *walk_worker_main(void *arg);
+void walk_read_dir(struct walk_worker *worker, struct walk_item *item, char *buffer);
+int walk_push(struct walk_deque *deque, struct walk_item item);
+int walk_pop(struct walk_deque *deque, struct walk_item *item);
+int walk_steal(struct walk_deque *deque, struct walk_item *item);
+int match_extension(const char *path, const char *name, const struct stat *st, void *arg);
+void usage(const char *prog);
+
+struct mode modes[] = {
+    { "count",          0,                       0 },
+    { "list unordered", 0,                       1 },
+    { "list ordered",   WALK_ORDERED,            1 },
+    { "list + stat",    WALK_ORDERED | WALK_STAT, 1 },
+};
+
+int main(int argc, char *argv[])
+{
+    long files = 1000000;
+    int per_dir = 64;
+    int branching = 16;
+    int reps = 3;
+    int keep = 0;
+    int thread_counts[MAX_THREAD_COUNTS];
+    int thread_count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:f:b:t:r:kh")) != -1) {
+        if (opt == 'd') {
+            snprintf(bench_dir, sizeof(bench_dir), "%s", optarg);
+        } else if (opt == 'n') {
+            files = atol(optarg);
+        } else if (opt == 'f') {
+            per_dir = atoi(optarg);
+        } else if (opt == 'b') {
+            branching = atoi(optarg);
+        } else if (opt == 't') {
+            for (char *item = strtok(optarg, ","); item != NULL && thread_count < MAX_THREAD_COUNTS;
+                 item = strtok(NULL, ",")) {
+                thread_counts[thread_count] = atoi(item);
+                if (thread_counts[thread_count] < 1 || thread_counts[thread_count] > WALK_MAX_THREADS) {
+                    usage(argv[0]);
+                }
+                thread_count++;
+            }
+        } else if (opt == 'r') {
+            reps = atoi(optarg);
+        } else if (opt == 'k') {
+            keep = 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (files < 1 || per_dir < 1 || branching < 1 || reps < 1) usage(argv[0]);
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int t = 1; t <= WALK_MAX_THREADS && thread_count < MAX_THREAD_COUNTS; t *= 2) {
+            if (t > 1 && t > cpus) break;
+            thread_counts[thread_count++] = t;
+        }
+    }
+
+    // An existing tree (from -k or a real ~/S2) is walked as it is
+    double start = now_sec();
+    long built = build_tree(bench_dir, files, per_dir, branching);
+    if (built < 0) {
+        perror("Cannot build tree");
+        exit(1);
+    }
+    if (built > 0) printf("Created %ld files in %.1f s\n", built, now_sec() - start);
+
+    int root_fd = open(bench_dir, O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0) {
+        perror("Cannot open tree");
+        exit(1);
+    }
+
+    // Warm the dentry and inode caches so every variant sees the same state
+    long expected = readdir_count(root_fd, 1);
+    printf("%s: %ld files\n\n", bench_dir, expected);
+
+    // Speedups are against the readdir recursion doing the same per-file work
+    double baseline[2];
+    for (int use_stat = 0; use_stat <= 1; use_stat++) {
+        double best = 0;
+        for (int r = 0; r < reps; r++) {
+            start = now_sec();
+            readdir_count(root_fd, use_stat);
+            double elapsed = now_sec() - start;
+            if (r == 0 || elapsed < best) best = elapsed;
+        }
+        printf("  %-28s %12.0f files/s\n", use_stat ? "recursive readdir + stat" : "recursive readdir",
+               expected / best);
+        baseline[use_stat] = best;
+    }
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        printf("\n  walk_tree %s\n", modes[m].name);
+        for (int t = 0; t < thread_count; t++) {
+            walk_threads = thread_counts[t];
+            double best = 0;
+            ssize_t found = 0;
+            for (int r = 0; r < reps; r++) {
+                struct walk_entry *entries = NULL;
+                start = now_sec();
+                found = walk_tree(root_fd, modes[m].flags, 0, NULL, NULL, modes[m].list ? &entries : NULL);
+                double elapsed = now_sec() - start;
+                if (entries != NULL) walk_free(entries, found);
+                if (r == 0 || elapsed < best) best = elapsed;
+            }
+            printf("    %2d threads %12.0f files/s  %5.2fx%s\n", walk_threads, found / best,
+                   baseline[(modes[m].flags & WALK_STAT) ? 1 : 0] / best,
+                   (found == expected) ? "" : "  (count mismatch)");
+        }
+    }
+
+    if (!keep && built > 0) {
+        remove_tree(root_fd);
+        rmdir(bench_dir);
+    }
+    close(root_fd);
+    return 0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d dir] [-n files] [-f files_per_dir] [-b branching] [-t threads[,threads...]]\n"
+                    "          [-r reps] [-k]\n"
+                    "  -d dir   tree to walk; created if missing (default /dev/shm/walkbench)\n"
+                    "  -n num   files to create (default 1000000)\n"
+                    "  -f num   files per directory (default 64)\n"
+                    "  -b num   subdirectories per directory (default 16)\n"
+                    "  -t list  walker thread counts, e.g. 1,2,4,8 (default powers of two up to the CPU count)\n"
+                    "  -r num   repetitions per variant, best is reported (default 3)\n"
+                    "  -k       keep the created tree for the next run\n", prog);
+    exit(1);
+}
+
+double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Creates the tree breadth first so it stays shallow; returns 0 when path already exists
+long build_tree(const char *path, long files, int per_dir, int branching)
+{
+    if (mkdir(path, 0755) < 0) return (errno == EEXIST) ? 0 : -1;
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) return -1;
+
+    long remaining = files;
+    int result = build_dir(dir_fd, &remaining, per_dir, branching);
+    close(dir_fd);
+    return (result < 0) ? -1 : files - remaining;
+}
+
+int build_dir(int dir_fd, long *remaining, int per_dir, int branching)
+{
+    char name[32];
+    for (int i = 0; i < per_dir && *remaining > 0; i++, (*remaining)--) {
+        snprintf(name, sizeof(name), "f%d.pdf", i);
+        int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return -1;
+        close(fd);
+    }
+
+    // Split what is left evenly between the subdirectories
+    long left = *remaining;
+    for (int i = 0; i < branching && *remaining > 0; i++) {
+        long share = left / branching + (i < left % branching ? 1 : 0);
+        if (share == 0) continue;
+        snprintf(name, sizeof(name), "d%d", i);
+        if (mkdirat(dir_fd, name, 0755) < 0) return -1;
+        int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY);
+        if (sub_fd < 0) return -1;
+        long sub_remaining = share;
+        int result = build_dir(sub_fd, &sub_remaining, per_dir, branching);
+        close(sub_fd);
+        *remaining -= share - sub_remaining;
+        if (result < 0) return -1;
+    }
+    return 0;
+}
+
+// Empties the directory behind dir_fd
+int remove_tree(int dir_fd)
+{
+    int list_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = (list_fd < 0) ? NULL : fdopendir(list_fd);
+    if (dir == NULL) return -1;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (ent->d_type == DT_DIR) {
+            int sub_fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub_fd >= 0) {
+                remove_tree(sub_fd);
+                close(sub_fd);
+            }
+            unlinkat(dirfd(dir), ent->d_name, AT_REMOVEDIR);
+        } else {
+            unlinkat(dirfd(dir), ent->d_name, 0);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// The single-threaded opendir/readdir recursion the servers used before walk_tree
+long readdir_count(int dir_fd, int use_stat)
+{
+    int list_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = (list_fd < 0) ? NULL : fdopendir(list_fd);
+    if (dir == NULL) {
+        if (list_fd >= 0) close(list_fd);
+        return 0;
+    }
+
+    long count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+
+        unsigned char type = ent->d_type;
+        struct stat st;
+        if ((type == DT_UNKNOWN || use_stat) && fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_REG) {
+            count++;
+        } else if (type == DT_DIR) {
+            int sub_fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub_fd >= 0) {
+                count += readdir_count(sub_fd, use_stat);
+                close(sub_fd);
+            }
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+// Walks the tree below root_fd with a pool of threads and returns the regular files whose
+// name match accepts (all of them when match is NULL); with WALK_DIRS directories are listed
+// too. max_depth 1 reads root_fd only, 0 means no limit. With entries NULL the matches are
+// only counted. Otherwise *entries gets an array the caller releases with walk_free, sorted by
+// path under WALK_ORDERED and in discovery order otherwise. match gets the file's lstat under
+// WALK_STAT (NULL otherwise); a match function returning a negative value ends the walk early.
+// root_fd stays open.
+ssize_t walk_tree(int root_fd, int flags, int max_depth, walk_match_fn match, void *arg,
+                  struct walk_entry **entries)
+{
+    struct walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.root_fd = root_fd;
+    walk.flags = flags | ((entries == NULL) ? WALK_COUNT_ONLY : 0);
+    walk.max_depth = max_depth;
+    walk.match = match;
+    walk.arg = arg;
+    // A single directory gains nothing from more threads
+    walk.threads = (max_depth == 1) ? 1 : walk_threads;
+    walk.workers = calloc(walk.threads, sizeof(struct walk_worker));
+    if (walk.workers == NULL) return -1;
+
+    for (int i = 0; i < walk.threads; i++) {
+        walk.workers[i].walk = &walk;
+        walk.workers[i].id = i;
+        pthread_mutex_init(&walk.workers[i].deque.lock, NULL);
+    }
+
+    struct walk_item root = { strdup(""), -1, 0 };
+    walk.pending = 1;
+    if (root.path == NULL || walk_push(&walk.workers[0].deque, root) < 0) {
+        free(root.path);
+        walk.pending = 0;
+    }
+
+    // The calling thread is worker 0; if threads cannot be started the others just do more
+    pthread_t tids[WALK_MAX_THREADS];
+    int started = 1;
+    while (started < walk.threads &&
+           pthread_create(&tids[started], NULL, walk_worker_main, &walk.workers[started]) == 0) {
+        started++;
+    }
+    walk_worker_main(&walk.workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    ssize_t total = 0;
+    for (int i = 0; i < walk.threads; i++) {
+        total += walk.workers[i].count;
+    }
+    struct walk_entry *all = NULL;
+    if (entries != NULL) {
+        all = malloc((total > 0 ? total : 1) * sizeof(struct walk_entry));
+        size_t filled = 0;
+        for (int i = 0; i < walk.threads; i++) {
+            if (all != NULL) {
+                memcpy(all + filled, walk.workers[i].entries, walk.workers[i].count * sizeof(struct walk_entry));
+            } else {
+                walk_free(walk.workers[i].entries, walk.workers[i].count);
+            }
+            filled += walk.workers[i].count;
+        }
+        if (all != NULL && (flags & WALK_ORDERED)) {
+            qsort(all, total, sizeof(struct walk_entry), compare_walk_entries);
+        }
+        *entries = all;
+    }
+    for (int i = 0; i < walk.threads; i++) {
+        free(walk.workers[i].entries);
+        free(walk.workers[i].deque.items);
+        pthread_mutex_destroy(&walk.workers[i].deque.lock);
+    }
+    free(walk.workers);
+    return (entries != NULL && all == NULL) ? -1 : total;
+}
+
+void walk_free(struct walk_entry *entries, ssize_t count)
+{
+    for (ssize_t i = 0; i < count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+int compare_walk_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct walk_entry *) a)->path, ((const struct walk_entry *) b)->path);
+}
+
+// Takes directories from its own deque first, then steals from the others. pending counts the
+// directories queued or being read, so the walk is over once it drops to zero.
+void *walk_worker_main(void *arg)
+{
+    struct walk_worker *worker = arg;
+    struct walk *walk = worker->walk;
+    char *buffer = malloc(WALK_BUFFER_SIZE);
+    if (buffer == NULL) return NULL;
+
+    int idle = 0;
+    while (1) {
+        struct walk_item item;
+        int found = (walk_pop(&worker->deque, &item) == 0);
+        for (int i = 1; !found && i < walk->threads; i++) {
+            found = (walk_steal(&walk->workers[(worker->id + i) % walk->threads].deque, &item) == 0);
+        }
+
+        if (found) {
+            walk_read_dir(worker, &item, buffer);
+            __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+            idle = 0;
+        } else if (__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else if (++idle < WALK_SPIN_LIMIT) {
+            sched_yield();
+        } else {
+            usleep(WALK_IDLE_SLEEP_US);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Reads one directory with getdents64, queueing its subdirectories on this worker's deque.
+// Subdirectories are opened relative to their parent while fewer than WALK_MAX_OPEN_DIRS are
+// held; past that they are reopened by path from the root when their turn comes.
+void walk_read_dir(struct walk_worker *worker, struct walk_item *item, char *buffer)
+{
+    struct walk *walk = worker->walk;
+    int fd = item->fd;
+    if (fd >= 0) {
+        __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+    } else if (!__atomic_load_n(&walk->stop, __ATOMIC_RELAXED)) {
+        fd = openat(walk->root_fd, item->path[0] ? item->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    if (fd < 0) {
+        free(item->path);
+        return;
+    }
+
+    long n;
+    // Once the walk is stopped the directories still queued are only closed
+    while (!__atomic_load_n(&walk->stop, __ATOMIC_RELAXED) &&
+           (n = syscall(SYS_getdents64, fd, buffer, WALK_BUFFER_SIZE)) > 0) {
+        for (long offset = 0; offset < n; ) {
+            struct linux_dirent64 *ent = (struct linux_dirent64 *) (buffer + offset);
+            offset += ent->d_reclen;
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+
+            unsigned char type = ent->d_type;
+            struct stat st;
+            int have_stat = 0;
+            if (type == DT_UNKNOWN || (type == DT_REG && (walk->flags & WALK_STAT))) {
+                if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                have_stat = 1;
+            }
+            if (type != DT_DIR && type != DT_REG) continue;
+            if (type == DT_REG && walk->match == NULL && (walk->flags & WALK_COUNT_ONLY)) {
+                // Plain counting never needs the file's path
+                worker->count++;
+                continue;
+            }
+
+            char path[MAX_PATH_LEN];
+            if (snprintf(path, sizeof(path), "%s%s%s", item->path, item->path[0] ? "/" : "",
+                         ent->d_name) >= (int) sizeof(path)) {
+                continue;
+            }
+
+            if (type == DT_DIR && (walk->max_depth == 0 || item->depth + 1 < walk->max_depth)) {
+                struct walk_item child = { strdup(path), -1, item->depth + 1 };
+                if (__atomic_add_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED) <= WALK_MAX_OPEN_DIRS) {
+                    child.fd = openat(fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                }
+                if (child.fd < 0) __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+
+                __atomic_add_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+                if (child.path == NULL || walk_push(&worker->deque, child) < 0) {
+                    // Out of memory: the subtree is left out rather than the walk failing
+                    __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+                    if (child.fd >= 0) {
+                        close(child.fd);
+                        __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+                    }
+                    free(child.path);
+                }
+            }
+
+            if (type == DT_DIR && !(walk->flags & WALK_DIRS)) continue;
+            int keep = (walk->match == NULL) ? 1 : walk->match(path, ent->d_name, have_stat ? &st : NULL, walk->arg);
+            if (keep < 0) {
+                __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (!keep) continue;
+            if (walk->flags & WALK_COUNT_ONLY) {
+                worker->count++;
+                continue;
+            }
+            if (worker->count == worker->capacity) {
+                size_t capacity = worker->capacity ? worker->capacity * 2 : 256;
+                struct walk_entry *grown = realloc(worker->entries, capacity * sizeof(struct walk_entry));
+                if (grown == NULL) continue;
+                worker->entries = grown;
+                worker->capacity = capacity;
+            }
+            struct walk_entry *entry = &worker->entries[worker->count];
+            entry->path = strdup(path);
+            entry->type = type;
+            entry->size = 0;
+            entry->mtime = 0;
+            if ((walk->flags & WALK_STAT) && type == DT_REG && have_stat) {
+                entry->size = st.st_size;
+                entry->mtime = st.st_mtime;
+            }
+            if (entry->path != NULL) worker->count++;
+        }
+    }
+
+    close(fd);
+    free(item->path);
+}
+
+int walk_push(struct walk_deque *deque, struct walk_item item)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(item));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            struct walk_item *grown = realloc(deque->items, capacity * sizeof(item));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->items = grown;
+            deque->capacity = capacity;
+        }
+    }
+    deque->items[deque->tail++] = item;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// The owner works depth first from the bottom of its deque...
+int walk_pop(struct walk_deque *deque, struct walk_item *item)
+{
+    int result = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[--deque->tail];
+        result = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return result;
+}
+
+// ... while thieves take from the top, where the directories nearest the root and so the
+// largest remaining subtrees are
+int walk_steal(struct walk_deque *deque, struct walk_item *item)
+{
+    if (__atomic_load_n(&deque->tail, __ATOMIC_RELAXED) == __atomic_load_n(&deque->head, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    int result = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        *item = deque->items[deque->head++];
+        result = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return result;
+}
+
+// walk_match_fn for files with the extension given as arg
+int match_extension(const char *path, const char *name, const struct stat *st, void *arg)
+{
+    (void) path;
+    (void) st;
+    const char *ext = strrchr(name, '.');
+    return ext != NULL && strcmp(ext, (const char *) arg) == 0;
+}
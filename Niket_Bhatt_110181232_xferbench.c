@@ -0,0 +1,706 @@
+// DFS Transfer Microbenchmark - compares byte-moving strategies on loopback TCP and tmpfs
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#define MAX_SIZES 16
+#define MIN_BENCH_SEC 0.2
+#define MIN_REPS 3
+#define URING_BUFFER_SIZE (64 * 1024)
+#define TLS_RECORD_SIZE (16 * 1024)
+#define ZEROCOPY_WAIT_MS 1000
+
+enum direction { FILE_TO_SOCKET, SOCKET_TO_FILE, SOCKET_TO_SOCKET, FILE_TO_FILE, FILE_TO_TLS, DIRECTION_COUNT };
+
+const char *direction_names[DIRECTION_COUNT] = {
+    "file->socket (download)", "socket->file (upload)", "socket->socket (proxy)", "file->file (local copy)",
+    "file->TLS socket (encrypted download)"
+};
+
+typedef off_t (*copy_fn)(int out_fd, int in_fd, off_t count, size_t bufsize);
+
+struct variant {
+    const char *name;
+    copy_fn run;
+    size_t bufsize;
+    int directions;     // bitmask of supported directions
+};
+
+struct pump_args {
+    int fd;
+    off_t count;
+    char *data;
+    SSL *ssl;           // set when the sink has to decrypt
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+char bench_dir[512] = "/dev/shm";
+char *pattern;
+size_t pattern_size = 1024 * 1024;
+SSL_CTX *tls_server_ctx;
+SSL_CTX *tls_client_ctx;
+SSL *bench_ssl;         // sending side of the FILE_TO_TLS connection being timed
+
+double now_sec(void);
+int write_all(int fd, const void *buf, size_t len);
+off_t parse_size(const char *text);
+int tcp_pair(int *sender, int *receiver);
+void *sink_thread(void *arg);
+void *feed_thread(void *arg);
+int make_source_file(const char *path, off_t size);
+off_t copy_readwrite(int out_fd, int in_fd, off_t count, size_t bufsize);
+off_t copy_sendfile(int out_fd, int in_fd, off_t count, size_t bufsize);
+off_t copy_splice(int out_fd, int in_fd, off_t count, size_t bufsize);
+off_t copy_file_range_loop(int out_fd, int in_fd, off_t count, size_t bufsize);
+off_t copy_zerocopy(int out_fd, int in_fd, off_t count, size_t bufsize);
+unsigned long reap_zerocopy(int fd, int wait_ms);
+off_t copy_uring(int out_fd, int in_fd, off_t count, size_t bufsize);
+off_t copy_tls_write(int out_fd, int in_fd, off_t count, size_t bufsize);
+off_t copy_ktls_sendfile(int out_fd, int in_fd, off_t count, size_t bufsize);
+int tls_init(void);
+void *tls_connect_thread(void *arg);
+int tls_handshake(int server_fd, int client_fd, SSL **server, SSL **client);
+int uring_init(struct uring *ring, unsigned entries);
+void uring_queue(struct uring *ring, int opcode, int fd, void *buf, unsigned len, __u64 offset, __u64 tag);
+int uring_wait(struct uring *ring, int submit, int wait, long *results);
+double run_once(struct variant *v, int dir, off_t size, const char *src_path);
+void usage(const char *prog);
+
+struct variant variants[] = {
+    { "read/write 1K",   copy_readwrite,       1024,        0xF },
+    { "read/write 4K",   copy_readwrite,       4096,        0xF },
+    { "read/write 16K",  copy_readwrite,       16384,       0xF },
+    { "read/write 64K",  copy_readwrite,       65536,       0xF },
+    { "read/write 256K", copy_readwrite,       262144,      0xF },
+    { "sendfile",        copy_sendfile,        0,           (1 << FILE_TO_SOCKET) | (1 << FILE_TO_FILE) },
+    { "splice",          copy_splice,          65536,       (1 << FILE_TO_SOCKET) | (1 << SOCKET_TO_FILE) |
+                                                            (1 << SOCKET_TO_SOCKET) },
+    { "copy_file_range", copy_file_range_loop, 0,           (1 << FILE_TO_FILE) },
+    { "MSG_ZEROCOPY",    copy_zerocopy,        0,           (1 << FILE_TO_SOCKET) },
+    { "io_uring 64K",    copy_uring,           URING_BUFFER_SIZE, 0xF },
+    { "TLS write 16K",   copy_tls_write,       TLS_RECORD_SIZE, (1 << FILE_TO_TLS) },
+    { "kTLS sendfile",   copy_ktls_sendfile,   0,           (1 << FILE_TO_TLS) },
+};
+
+int main(int argc, char *argv[])
+{
+    off_t sizes[MAX_SIZES];
+    int size_count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:h")) != -1) {
+        if (opt == 'd') {
+            snprintf(bench_dir, sizeof(bench_dir), "%s", optarg);
+        } else if (opt == 's') {
+            for (char *item = strtok(optarg, ","); item != NULL && size_count < MAX_SIZES;
+                 item = strtok(NULL, ",")) {
+                sizes[size_count] = parse_size(item);
+                if (sizes[size_count] <= 0) usage(argv[0]);
+                size_count++;
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (size_count == 0) {
+        off_t defaults[] = { 4096, 65536, 1024 * 1024, 16 * 1024 * 1024 };
+        for (size_count = 0; size_count < 4; size_count++) sizes[size_count] = defaults[size_count];
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (tls_init() < 0) {
+        fprintf(stderr, "TLS setup failed\n");
+        exit(1);
+    }
+
+    pattern = malloc(pattern_size);
+    if (pattern == NULL) {
+        perror("Pattern allocation failed");
+        exit(1);
+    }
+    unsigned int seed = 42;
+    for (size_t i = 0; i < pattern_size; i++) {
+        pattern[i] = (char) rand_r(&seed);
+    }
+
+    char src_path[600];
+    snprintf(src_path, sizeof(src_path), "%s/xferbench.src", bench_dir);
+
+    for (int s = 0; s < size_count; s++) {
+        if (make_source_file(src_path, sizes[s]) < 0) {
+            perror("Cannot create source file");
+            exit(1);
+        }
+        printf("\n== %lld bytes ==\n", (long long) sizes[s]);
+        for (int dir = 0; dir < DIRECTION_COUNT; dir++) {
+            printf("  %s\n", direction_names[dir]);
+            for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+                if (!(variants[v].directions & (1 << dir))) continue;
+
+                double total = 0;
+                int reps = 0;
+                double best = 0;
+                while (reps < MIN_REPS || total < MIN_BENCH_SEC) {
+                    double elapsed = run_once(&variants[v], dir, sizes[s], src_path);
+                    if (elapsed < 0) break;
+                    if (reps == 0 || elapsed < best) best = elapsed;
+                    total += elapsed;
+                    reps++;
+                }
+                if (reps == 0) {
+                    printf("    %-18s unavailable (%s)\n", variants[v].name, strerror(errno));
+                } else {
+                    printf("    %-18s %10.1f MB/s  (best of %d)\n", variants[v].name,
+                           sizes[s] / best / (1024 * 1024), reps);
+                }
+            }
+        }
+    }
+
+    unlink(src_path);
+    return 0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d dir] [-s size[,size...]]\n"
+                    "  -d dir   directory for test files (default /dev/shm, i.e. tmpfs)\n"
+                    "  -s list  file sizes, e.g. 4K,64K,1M,16M\n", prog);
+    exit(1);
+}
+
+double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+off_t parse_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (*end == 'K' || *end == 'k') value *= 1024;
+    else if (*end == 'M' || *end == 'm') value *= 1024 * 1024;
+    else if (*end == 'G' || *end == 'g') value *= 1024.0 * 1024 * 1024;
+    return (off_t) value;
+}
+
+int tcp_pair(int *sender, int *receiver)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) return -1;
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    bzero((char *) &addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *) &addr, &len) < 0) {
+        close(listener);
+        return -1;
+    }
+
+    *sender = socket(AF_INET, SOCK_STREAM, 0);
+    if (*sender < 0 || connect(*sender, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(listener);
+        return -1;
+    }
+    *receiver = accept(listener, NULL, NULL);
+    close(listener);
+    return (*receiver < 0) ? -1 : 0;
+}
+
+void *sink_thread(void *arg)
+{
+    struct pump_args *pump = arg;
+    char buffer[256 * 1024];
+    off_t remaining = pump->count;
+    while (remaining > 0) {
+        ssize_t n = pump->ssl ? SSL_read(pump->ssl, buffer, sizeof(buffer)) : read(pump->fd, buffer, sizeof(buffer));
+        if (n <= 0) break;
+        remaining -= n;
+    }
+    return NULL;
+}
+
+void *feed_thread(void *arg)
+{
+    struct pump_args *pump = arg;
+    off_t remaining = pump->count;
+    while (remaining > 0) {
+        size_t chunk = (remaining < (off_t) pattern_size) ? (size_t) remaining : pattern_size;
+        if (write_all(pump->fd, pattern, chunk) < 0) break;
+        remaining -= chunk;
+    }
+    shutdown(pump->fd, SHUT_WR);
+    return NULL;
+}
+
+int make_source_file(const char *path, off_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    off_t remaining = size;
+    while (remaining > 0) {
+        size_t chunk = (remaining < (off_t) pattern_size) ? (size_t) remaining : pattern_size;
+        if (write_all(fd, pattern, chunk) < 0) {
+            close(fd);
+            return -1;
+        }
+        remaining -= chunk;
+    }
+    close(fd);
+    return 0;
+}
+
+// Times one copy of size bytes in the given direction; returns seconds or -1 if unsupported
+double run_once(struct variant *v, int dir, off_t size, const char *src_path)
+{
+    int in_fd = -1, out_fd = -1;
+    int feed_send = -1, feed_recv = -1, sink_send = -1, sink_recv = -1;
+    pthread_t feeder, sink;
+    int have_feeder = 0, have_sink = 0;
+    char dst_path[600];
+    snprintf(dst_path, sizeof(dst_path), "%s/xferbench.dst", bench_dir);
+
+    if (dir == FILE_TO_SOCKET || dir == FILE_TO_FILE || dir == FILE_TO_TLS) {
+        in_fd = open(src_path, O_RDONLY);
+    } else if (tcp_pair(&feed_send, &feed_recv) == 0) {
+        in_fd = feed_recv;
+    }
+    if (dir == SOCKET_TO_FILE || dir == FILE_TO_FILE) {
+        out_fd = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else if (tcp_pair(&sink_send, &sink_recv) == 0) {
+        out_fd = sink_send;
+    }
+    SSL *server_ssl = NULL, *client_ssl = NULL;
+    if (dir == FILE_TO_TLS && out_fd >= 0 && tls_handshake(sink_send, sink_recv, &server_ssl, &client_ssl) < 0) {
+        out_fd = -1;
+    }
+    if (in_fd < 0 || out_fd < 0) {
+        fprintf(stderr, "setup failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    bench_ssl = server_ssl;
+
+    struct pump_args feed_args = { feed_send, size, NULL, NULL };
+    struct pump_args sink_args = { sink_recv, size, NULL, client_ssl };
+    if (feed_send >= 0) {
+        pthread_create(&feeder, NULL, feed_thread, &feed_args);
+        have_feeder = 1;
+    }
+    if (sink_recv >= 0) {
+        pthread_create(&sink, NULL, sink_thread, &sink_args);
+        have_sink = 1;
+    }
+
+    double start = now_sec();
+    off_t copied = v->run(out_fd, in_fd, size, v->bufsize);
+    if (sink_send >= 0) shutdown(sink_send, SHUT_WR);
+    if (have_sink) pthread_join(sink, NULL);
+    double elapsed = now_sec() - start;
+
+    if (have_feeder) {
+        if (copied != size) shutdown(feed_recv, SHUT_RDWR);
+        pthread_join(feeder, NULL);
+    }
+
+    int saved_errno = errno;
+    SSL_free(server_ssl);
+    SSL_free(client_ssl);
+    close(in_fd);
+    close(out_fd);
+    if (feed_send >= 0) close(feed_send);
+    if (sink_recv >= 0) close(sink_recv);
+    unlink(dst_path);
+    errno = saved_errno;
+
+    return (copied == size) ? elapsed : -1;
+}
+
+off_t copy_readwrite(int out_fd, int in_fd, off_t count, size_t bufsize)
+{
+    char *buffer = malloc(bufsize);
+    off_t done = 0;
+    while (buffer != NULL && done < count) {
+        size_t chunk = (count - done < (off_t) bufsize) ? (size_t) (count - done) : bufsize;
+        ssize_t n = read(in_fd, buffer, chunk);
+        if (n <= 0 || write_all(out_fd, buffer, n) < 0) break;
+        done += n;
+    }
+    free(buffer);
+    return done;
+}
+
+off_t copy_sendfile(int out_fd, int in_fd, off_t count, size_t bufsize)
+{
+    (void) bufsize;
+    off_t done = 0;
+    while (done < count) {
+        ssize_t n = sendfile(out_fd, in_fd, NULL, count - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+off_t copy_splice(int out_fd, int in_fd, off_t count, size_t bufsize)
+{
+    int pipefd[2];
+    if (pipe(pipefd) < 0) return -1;
+    fcntl(pipefd[1], F_SETPIPE_SZ, (int) bufsize);
+
+    off_t done = 0;
+    while (done < count) {
+        size_t chunk = (count - done < (off_t) bufsize) ? (size_t) (count - done) : bufsize;
+        ssize_t in = splice(in_fd, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE);
+        if (in <= 0) break;
+        ssize_t left = in;
+        while (left > 0) {
+            ssize_t out = splice(pipefd[0], NULL, out_fd, NULL, left, SPLICE_F_MOVE);
+            if (out <= 0) {
+                left = -1;
+                break;
+            }
+            left -= out;
+        }
+        if (left < 0) break;
+        done += in;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return done;
+}
+
+off_t copy_file_range_loop(int out_fd, int in_fd, off_t count, size_t bufsize)
+{
+    (void) bufsize;
+    off_t done = 0;
+    while (done < count) {
+        ssize_t n = copy_file_range(in_fd, NULL, out_fd, NULL, count - done, 0);
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+// Sends straight from a file mapping. The pages stay pinned until the kernel reports each send
+// complete, so the mapping is kept, and the clock keeps running, until every notification is in.
+off_t copy_zerocopy(int out_fd, int in_fd, off_t count, size_t bufsize)
+{
+    (void) bufsize;
+    int one = 1;
+    if (setsockopt(out_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) return -1;
+
+    char *map = mmap(NULL, count, PROT_READ, MAP_PRIVATE, in_fd, 0);
+    if (map == MAP_FAILED) return -1;
+
+    off_t done = 0;
+    unsigned long sends = 0, completed = 0;
+    while (done < count) {
+        ssize_t n = send(out_fd, map + done, count - done, MSG_ZEROCOPY);
+        if (n < 0 && errno != ENOBUFS) break;
+        if (n > 0) {
+            done += n;
+            sends++;
+        }
+        // Reap as we go so the socket's optmem budget does not run out; on ENOBUFS wait for some
+        completed += reap_zerocopy(out_fd, (n < 0) ? ZEROCOPY_WAIT_MS : 0);
+    }
+    while (completed < sends) {
+        unsigned long reaped = reap_zerocopy(out_fd, ZEROCOPY_WAIT_MS);
+        if (reaped == 0) break;
+        completed += reaped;
+    }
+    munmap(map, count);
+    return (completed == sends) ? done : -1;
+}
+
+// Drains MSG_ZEROCOPY notifications from the socket's error queue, first waiting up to wait_ms
+// for one when wait_ms > 0. Returns the number of sends they report complete.
+unsigned long reap_zerocopy(int fd, int wait_ms)
+{
+    if (wait_ms > 0) {
+        // A queued notification shows up as POLLERR, which poll always reports
+        struct pollfd pfd = { fd, 0, 0 };
+        if (poll(&pfd, 1, wait_ms) <= 0) return 0;
+    }
+
+    unsigned long completed = 0;
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    while (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0) {
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (cm != NULL) {
+            struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                completed += serr->ee_data - serr->ee_info + 1;
+            }
+        }
+        msg.msg_controllen = sizeof(control);
+    }
+    return completed;
+}
+
+int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+    }
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return -1;
+    char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return -1;
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) return -1;
+
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_queue(struct uring *ring, int opcode, int fd, void *buf, unsigned len, __u64 offset, __u64 tag)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Submits queued entries, waits for wait completions and stores each result under its tag
+int uring_wait(struct uring *ring, int submit, int wait, long *results)
+{
+    if (syscall(__NR_io_uring_enter, ring->fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        return -1;
+    }
+    unsigned head = *ring->cq_head;
+    int reaped = 0;
+    while (reaped < wait && head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        results[cqe->user_data] = cqe->res;
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// Double-buffered: the read of chunk N+1 is in flight while chunk N is written
+off_t copy_uring(int out_fd, int in_fd, off_t count, size_t bufsize)
+{
+    static struct uring ring;
+    static int ring_state = 0;
+    if (ring_state == 0) {
+        ring_state = (uring_init(&ring, 8) == 0) ? 1 : -1;
+    }
+    if (ring_state < 0) return -1;
+
+    static char buffers[2][URING_BUFFER_SIZE];
+    long results[2];
+    off_t read_offset = 0, done = 0;
+    int cur = 0;
+
+    unsigned chunk = (count < (off_t) bufsize) ? (unsigned) count : (unsigned) bufsize;
+    uring_queue(&ring, IORING_OP_READ, in_fd, buffers[cur], chunk, (__u64) -1, 1);
+    if (uring_wait(&ring, 1, 1, results) != 1 || results[1] <= 0) return done;
+    long pending = results[1];
+    read_offset += pending;
+
+    while (pending > 0) {
+        int submit = 0, wait = 0;
+        uring_queue(&ring, IORING_OP_WRITE, out_fd, buffers[cur], (unsigned) pending, (__u64) -1, 0);
+        submit++;
+        wait++;
+        if (read_offset < count) {
+            chunk = (count - read_offset < (off_t) bufsize) ? (unsigned) (count - read_offset) : (unsigned) bufsize;
+            uring_queue(&ring, IORING_OP_READ, in_fd, buffers[1 - cur], chunk, (__u64) -1, 1);
+            submit++;
+            wait++;
+        }
+        results[1] = 0;
+        for (int got = 0; got < wait; ) {
+            int n = uring_wait(&ring, submit, wait - got, results);
+            if (n < 0) return done;
+            got += n;
+            submit = 0;
+        }
+        if (results[0] < 0) return done;
+        if (results[0] < pending &&
+            write_all(out_fd, buffers[cur] + results[0], pending - results[0]) < 0) {
+            return done;
+        }
+        done += pending;
+        pending = (read_offset < count) ? results[1] : 0;
+        if (pending < 0) return done;
+        read_offset += pending;
+        cur = 1 - cur;
+    }
+    return done;
+}
+
+// User-space TLS: every byte is read into a buffer and encrypted by OpenSSL, one record per write
+off_t copy_tls_write(int out_fd, int in_fd, off_t count, size_t bufsize)
+{
+    (void) out_fd;
+    char buffer[TLS_RECORD_SIZE];
+    if (bufsize > sizeof(buffer)) bufsize = sizeof(buffer);
+    off_t done = 0;
+    while (done < count) {
+        size_t chunk = (count - done < (off_t) bufsize) ? (size_t) (count - done) : bufsize;
+        ssize_t n = read(in_fd, buffer, chunk);
+        if (n <= 0 || SSL_write(bench_ssl, buffer, n) != n) break;
+        done += n;
+    }
+    return done;
+}
+
+// Kernel TLS: the page cache goes to the socket and the kernel encrypts on the way out
+off_t copy_ktls_sendfile(int out_fd, int in_fd, off_t count, size_t bufsize)
+{
+    (void) out_fd;
+    (void) bufsize;
+    if (!BIO_get_ktls_send(SSL_get_wbio(bench_ssl))) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    off_t done = 0;
+    while (done < count) {
+        ossl_ssize_t n = SSL_sendfile(bench_ssl, in_fd, done, count - done, 0);
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+// Throwaway P-256 certificate; both ends are limited to what kernel TLS can offload
+int tls_init(void)
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    if (key == NULL || cert == NULL) return -1;
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (unsigned char *) "xferbench", -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(cert));
+    if (X509_sign(cert, key, EVP_sha256()) == 0) return -1;
+
+    tls_server_ctx = SSL_CTX_new(TLS_server_method());
+    tls_client_ctx = SSL_CTX_new(TLS_client_method());
+    if (tls_server_ctx == NULL || tls_client_ctx == NULL) return -1;
+    SSL_CTX *contexts[2] = { tls_server_ctx, tls_client_ctx };
+    for (int i = 0; i < 2; i++) {
+        SSL_CTX_set_min_proto_version(contexts[i], TLS1_2_VERSION);
+        SSL_CTX_set_max_proto_version(contexts[i], TLS1_2_VERSION);
+        SSL_CTX_set_options(contexts[i], SSL_OP_ENABLE_KTLS | SSL_OP_NO_TICKET);
+        if (SSL_CTX_set_cipher_list(contexts[i], "ECDHE-ECDSA-AES128-GCM-SHA256") != 1) return -1;
+    }
+    if (SSL_CTX_use_certificate(tls_server_ctx, cert) != 1 || SSL_CTX_use_PrivateKey(tls_server_ctx, key) != 1) {
+        return -1;
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return 0;
+}
+
+void *tls_connect_thread(void *arg)
+{
+    return (SSL_connect(arg) == 1) ? arg : NULL;
+}
+
+// Runs both halves of the handshake over a tcp_pair; the client half needs its own thread
+int tls_handshake(int server_fd, int client_fd, SSL **server, SSL **client)
+{
+    *server = SSL_new(tls_server_ctx);
+    *client = SSL_new(tls_client_ctx);
+    SSL_set_fd(*server, server_fd);
+    SSL_set_fd(*client, client_fd);
+
+    pthread_t connector;
+    void *connected = NULL;
+    pthread_create(&connector, NULL, tls_connect_thread, *client);
+    int accepted = SSL_accept(*server);
+    pthread_join(connector, &connected);
+    return (accepted == 1 && connected != NULL) ? 0 : -1;
+}
@@ -0,0 +1,18 @@
+#!/bin/bash
+# downlf -c must not serve a cached copy of a file that was edited on its node in place, even
+# when the edit keeps the size the same
+. "$(dirname "$0")/lib.sh"
+start_servers
+cd "$WORK/files"
+head -c 60000 /dev/urandom | base64 > notes.txt
+client "uploadf notes.txt ~S1/t" >/dev/null
+mkdir dl && cd dl
+
+client -c "downlf ~S1/t/notes.txt" >/dev/null
+cmp -s notes.txt ../notes.txt || fail "first download differs from the upload"
+client -c "downlf ~S1/t/notes.txt" | grep -q "Unchanged" || fail "unchanged file was not served from the cache"
+
+printf 'EDITED' | dd of="$HOME/S3/t/notes.txt" bs=1 seek=100 conv=notrunc status=none
+client -c "downlf ~S1/t/notes.txt" | grep -q "Unchanged" && fail "edited file was served from the cache"
+cmp -s notes.txt "$HOME/S3/t/notes.txt" || fail "download differs from the edited file"
+echo "PASS: cache_same_size"
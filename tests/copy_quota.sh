@@ -0,0 +1,23 @@
+#!/bin/bash
+# copyf and movef are charged against quotas like uploads: a copy into a full directory is
+# refused, whichever server it comes from, while a move within the directory still works
+. "$(dirname "$0")/lib.sh"
+printf '~S1/full 100K\n' > "$WORK/quotas.txt"
+start_servers -Q "$WORK/quotas.txt"
+cd "$WORK/files"
+head -c 60000 /dev/urandom > filler.txt
+head -c 60000 /dev/urandom > big.c
+head -c 60000 /dev/urandom > big.pdf
+client "uploadf filler.txt ~S1/full" >/dev/null
+client "uploadf big.c ~S1/src" >/dev/null
+client "uploadf big.pdf ~S1/src" >/dev/null
+
+client "copyf ~S1/src/big.c ~S1/full" | grep -q "Quota exceeded" || fail "copyf into a full directory was not refused"
+[ -e "$HOME/S1/full/big.c" ] && fail "refused copyf left a file behind"
+client "copyf ~S1/src/big.pdf ~S1/full/big.c" | grep -q "Quota exceeded" || fail "copyf from a node was not refused"
+[ -e "$HOME/S1/full/big.c" ] && fail "refused copyf from a node left a file behind"
+client "movef ~S1/src/big.pdf ~S1/full" | grep -q "Quota exceeded" || fail "movef into a full directory was not refused"
+
+client "movef ~S1/full/filler.txt ~S1/full/moved.txt" | grep -q "SUCCESS" || fail "movef within the quota was refused"
+client "copyf ~S1/src/big.c ~S1/other" | grep -q "SUCCESS" || fail "copyf outside the quota was refused"
+echo "PASS: copy_quota"
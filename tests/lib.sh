@@ -0,0 +1,44 @@
+#!/bin/bash
+# Sourced by the tests: builds every program into a scratch directory and runs S1 to S4 on the
+# default ports with HOME pointing at an empty tree. Everything is stopped and removed on exit.
+set -e
+REPO=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK=$(mktemp -d)
+export HOME=$WORK/home
+mkdir -p "$HOME" "$WORK/bin" "$WORK/files"
+for program in S1 S2 S3 S4 s25client; do
+    gcc -O2 -Wall -pthread -o "$WORK/bin/$program" "$REPO/Niket_Bhatt_110181232_$program.c" \
+        -lz -lm -lssl -lcrypto
+done
+
+start_servers()
+{
+    for node in S2 S3 S4; do
+        "$WORK/bin/$node" >"$WORK/$node.log" 2>&1 &
+    done
+    sleep 0.3
+    "$WORK/bin/S1" "$@" >"$WORK/S1.log" 2>&1 &
+    sleep 0.5
+}
+
+stop_servers()
+{
+    pkill -f "^$WORK/bin/S" || true
+    sleep 0.3
+}
+
+# Runs one client session; the commands come from the arguments, one per line
+client()
+{
+    local options=()
+    while [ "${1:0:1}" = "-" ]; do options+=("$1"); shift; done
+    printf '%s\nexit\n' "$@" | "$WORK/bin/s25client" "${options[@]}"
+}
+
+fail()
+{
+    echo "FAIL: $*"
+    exit 1
+}
+
+trap 'stop_servers; rm -rf "$WORK"' EXIT